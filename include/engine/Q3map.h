@@ -5,6 +5,9 @@
 #include "math/vector.h"
 #include "render/camera.h"
 #include "engine/map.h"
+#include "engine/arena.h"
+#include "engine/vfs.h"
+#include "engine/collision.h"
 
 
 #define Q3BSP_XYZ_SCALE		(1.0 / 64.0)
@@ -16,6 +19,24 @@
 #define Q3_MAX_SPAWN_POINTS		50
 
 
+/*
+ *	Lightmaps are stored darkened, brighten them by this many bits
+ */
+#define Q3_LIGHTMAP_OVERBRIGHT	2
+
+
+/*
+ *	Bytes of pixel data in a lightmap
+ */
+#define Q3_LIGHTMAP_BYTES		(128 * 128 * 3)
+
+
+/*
+ *	Lightmaps uploaded per frame ahead of being drawn
+ */
+#define Q3_LIGHTMAP_PREFETCH_PER_FRAME	2
+
+
 /*
  *	Lump indicies.
  */
@@ -37,6 +58,8 @@
 #define LUMP_LIGHTVOLS		15
 #define LUMP_VISDATA		16
 
+#define NUM_LUMPS			17
+
 
 /*
  *	Face types.
@@ -64,7 +87,7 @@ struct q3bsp_direntry_t {
 struct q3bsp_header_t {
 	int magic;					/* Always "IBSP" (0x50534249) [little endian] */
 	int version;
-	struct q3bsp_direntry_t direntry[17];
+	struct q3bsp_direntry_t direntry[NUM_LUMPS];
 };
 
 
@@ -184,7 +207,7 @@ struct q3bsp_face_t {
 
 #define SIZEOF_LIGHTMAP		49152
 struct q3bsp_lightmap_t {
-	byte map[128][128][3];
+	byte* map;					/* 128x128 RGB in the arena, NULL once released */
 
 	unsigned int gl_text_id;
 };
@@ -203,6 +226,124 @@ struct q3bsp_visdata_t {
 };
 
 
+/*
+ *	Plane types in the traversal tree.
+ */
+#define Q3_PLANE_X				0		/* normal along an axis, the type is the axis */
+#define Q3_PLANE_Y				1
+#define Q3_PLANE_Z				2
+#define Q3_PLANE_NON_AXIAL		3
+
+
+/**
+ *	@struct q3bsp_tree_node_t
+ *	@brief A node of the tree used to walk the map.
+ *
+ *	Built from the nodes and planes lumps with the plane stored
+ *	inline, so each step of a walk reads one 32 byte record.  Nodes
+ *	are in breadth-first order, the top levels share cache lines.
+ */
+struct q3bsp_tree_node_t {
+	float normal[3];
+	float dist;
+	int children[2];			/* tree nodes, or ~leaf for leafs */
+	int type;					/* Q3_PLANE_* */
+	int node;					/* in the nodes lump */
+};
+
+
+/**
+ *	@struct q3bsp_bounds_t
+ *	@brief Bounds of a tree node, kept apart as walks seldom need them.
+ */
+struct q3bsp_bounds_t {
+	float mins[3];
+	float maxs[3];
+};
+
+
+/*
+ *	Patch collision.  Each patch is cut into triangles no further
+ *	than the tolerance from its curve, and each triangle is a thin
+ *	facet with a plane for its surface, one behind it, one up from
+ *	each edge and six axial bevels.  Without the bevels the sharp
+ *	corners of a facet reach far out once pushed out for a sphere.
+ */
+#define Q3_PATCH_COLLISION_TOLERANCE	2.0f
+#define Q3_PATCH_MAX_SUBDIVISIONS		16		/* triangles across each 3x3 piece, each way */
+#define Q3_PATCH_FACET_THICKNESS		1.0f
+#define Q3_FACET_PLANES					11
+
+
+/**
+ *	@struct q3bsp_patch_t
+ *	@brief The collision facets of a patch face.
+ */
+struct q3bsp_patch_t {
+	float mins[3];
+	float maxs[3];
+	int facet;					/* first of its facets */
+	int num_facets;
+	int contents;				/* of the face's texture */
+	int face;
+};
+
+
+/*
+ *	Visibility kept from frame to frame.  A leaf or cluster is only
+ *	tested against the frustum again once the camera has moved or
+ *	turned enough since it was last tested that it could have
+ *	crossed a plane.
+ */
+#define Q3_VIS_INSIDE					6		/* in front of all the frustum planes */
+#define Q3_VIS_MAX_SWING				0.35f	/* turn, as the distance a point 1 unit away moves, before testing everything */
+#define Q3_VIS_MAX_MOVE					256.0f	/* move before testing everything */
+#define Q3_VIS_EPSILON					0.5f	/* kept clear of a plane for rounding */
+
+
+/**
+ *	@struct q3bsp_vis_t
+ *	@brief What a map found visible, reused while the camera stays in a cluster.
+ *
+ *	The slack of a leaf or cluster is how far its corners can move
+ *	towards or away from the planes before it could change sides,
+ *	less the motion of the camera from the origin to when it was
+ *	tested.  Motion is bounded by the distance the camera moved from
+ *	the origin plus the turn since then times the radius.
+ */
+struct q3bsp_vis_t {
+	int cluster;				/* camera cluster the candidates are for, -2 for none */
+	int num_candidates;
+	int* candidates;			/* clusters in the PVS, with any leafs */
+
+	/* camera when everything was last tested */
+	float origin[3];
+	float view[16];
+	float projection[16];
+
+	/* by cluster, and by sorted leaf */
+	byte* cluster_plane;		/* frustum plane it is behind, Q3_VIS_INSIDE if it is not behind any */
+	float* cluster_slack;
+	float* cluster_radius;		/* furthest corner from the origin */
+	byte* leaf_plane;
+	float* leaf_slack;
+	float* leaf_radius;
+
+	/* faces of the visible leafs, each once */
+	int num_faces;
+	int* faces;
+	int* face_marks;			/* rebuild each face was last added in */
+	int rebuild;
+
+	int num_full;				/* frames everything was tested */
+	int num_retests;			/* leafs and clusters tested again since */
+};
+
+
+struct trace_work_t;
+struct box_leafs_t;
+
+
 /*
  *	Callback structures for
  *	parsing the entities lump.
@@ -224,36 +365,55 @@ struct q3bsp_spawn_point_t {
 
 
 /**
- *	@class EQ3Map
- *	@brief A quake3 BSP map
+ *	@class EQ3MapData
+ *	@brief The lumps of a Quake3 BSP, shared by every EQ3Map of the file.
+ *
+ *	A file is loaded once, along with its textures, lightmaps and
+ *	vertex buffers, however many maps show it; acquire() hands out
+ *	references and the last release() frees it.  Nothing here
+ *	changes what the map is once loaded: lightmaps upload lazily
+ *	and lean data releases what OpenGL already has.
+ *
+ *	Only used from the thread that owns the GL context, unless
+ *	it is headless and never gives OpenGL anything.
  */
-class EQ3Map : public EMap {
+class EQ3MapData {
 	public:
-		EQ3Map();
-		~EQ3Map();
+		static EQ3MapData* acquire(const char* file, int lean, int headless, EArena* arena);
+		void release();
 
-		int load(char* file);
+		void upload_lightmap(int index);
+		void report_memory() const;
 
-		void render(RCamera* camera);
-		void render_face(int face_index);
+	private:
+		friend class EQ3Map;
 
-		int get_spawn_point(int index, float* angle, vector3* position);
+		EQ3MapData();
+		~EQ3MapData();
 
-	private:
+		int load(const char* file);
 		int load_header(FILE* fptr);
+		int alloc_lumps();
 		int load_lumps(FILE* fptr);
 
 		void load_textures();
 		void load_lightmaps();
-		void parse_entities();
-
-		char* get_next_token(const char* str, char* buf, int buf_size);
-
-		void load_entity_info_player_deathmatch(const char* ent);
-
-
-		int find_leaf(vector3* pos);
-		int is_cluster_visable(int current, int test);
+		void upload_geometry();
+		void release_geometry();
+		long get_lump_bytes(int lump) const;
+		int build_tree();
+		int build_leaf_table();
+		int build_brushes();
+		int build_patches();
+		void bucket_patch(int node, const float* mins, const float* maxs, int patch, int fill);
+		void build_cluster_resources();
+
+		/* every file loaded, to find it again */
+		static EQ3MapData* loaded;
+		EQ3MapData* next;
+
+		char file[VFS_MAX_PATH];
+		int refs;
 
 		int num_textures;
 		int num_planes;
@@ -290,8 +450,171 @@ class EQ3Map : public EMap {
 		struct q3bsp_lightvol_t* lightvols;
 		struct q3bsp_visdata_t visdata;
 
+		/* the nodes and planes rearranged for walking */
+		int num_tree_nodes;
+		struct q3bsp_tree_node_t* tree;
+		struct q3bsp_bounds_t* tree_bounds;
+
+		class ETextureManager* texture_manager;
+
+		/* vertexes and meshverts in OpenGL, 0 if they are drawn from memory */
+		unsigned int vertex_buffer;
+		unsigned int index_buffer;
+
+		/* every lump lives in here, render-only ones at the end */
+		EArena* arena;
+		int own_arena;					/* created by alloc_lumps(), not passed to acquire() */
+		byte* lightmap_pixels;			/* all lightmaps, page aligned */
+		byte* lightmap_uploaded;
+
+		int lean;						/* release render-only data once uploaded */
+		int headless;					/* collision and visibility only, no textures or buffers */
+		long lump_freed[NUM_LUMPS];		/* bytes released so far */
+
+		/* contents of each brush, from its texture, and of all the brushes of each leaf */
+		int* brush_contents;
+		int* leaf_contents;				/* by leafs lump index */
+
+		/* patches tessellated for collision, and the ones in each leaf */
+		int num_patches;
+		struct q3bsp_patch_t* patches;
+		int num_facets;
+		struct q3bsp_plane_t* facet_planes;	/* Q3_FACET_PLANES per facet */
+		int* leaf_patch_start;			/* num_leafs + 1 offsets into leaf_patches, by leafs lump index */
+		int* leaf_patches;
+
+		/* the leafs grouped by cluster for culling, leafs in no cluster last */
+		int* leaf_cluster;
+		float* leaf_mins;				/* 3 per leaf */
+		float* leaf_maxs;
+		int* leaf_face_start;			/* into leaffaces */
+		int* leaf_face_count;
+		int* leaf_original;				/* index in the leafs lump */
+		int* leaf_sorted;				/* where each leaf of the lump went */
+
+		int num_clusters;
+		int* cluster_leaf_start;		/* num_clusters + 2 offsets into the sorted leafs */
+		float* cluster_mins;			/* 3 per cluster, and the leafs in no cluster */
+		float* cluster_maxs;
+
+		/* textures and lightmaps used by the faces of each cluster */
+		int* cluster_texture_start;		/* num_clusters + 1 offsets into cluster_textures */
+		int* cluster_textures;
+		int* cluster_lightmap_start;	/* num_clusters + 1 offsets into cluster_lightmaps */
+		int* cluster_lightmaps;
+		float* cluster_centers;			/* 3 per cluster */
+};
+
+
+/**
+ *	@class EQ3Map
+ *	@brief A quake3 BSP map
+ *
+ *	The lumps are shared with other maps of the same file, each
+ *	map only holds what a viewer changes: spawn points, prefetch
+ *	requests and the like.
+ */
+class EQ3Map : public EMap {
+	public:
+		EQ3Map();
+		~EQ3Map();
+
+		void set_lean(int enabled);
+		void set_headless(int enabled);
+		void set_arena(EArena* arena);
+		int load(const char* file);
+
+		void report_memory() const;
+
+		void render(RCamera* camera);
+		void render_face(int face_index);
+
+		int get_spawn_point(int index, float* angle, vector3* position);
+
+		void trace_ray(struct trace_t* trace, const vector3* start, const vector3* end, int mask);
+		void trace_sphere(struct trace_t* trace, const vector3* start, const vector3* end, float radius, int mask);
+		void trace_box(struct trace_t* trace, const vector3* start, const vector3* end,
+					   const vector3* mins, const vector3* maxs, int mask);
+		void trace(struct trace_t* trace, int type, const float* start, const float* end,
+				   const float* mins, const float* maxs, float radius, int mask,
+				   struct trace_scratch_t* scratch) const;
+		void trace_batch(struct trace_batch_t* batch, EThreadPool* pool);
+
+		int point_contents(const float* point) const;
+		void point_contents_batch(const float* points, int count, int* contents, EThreadPool* pool) const;
+
+		int get_num_brushes() const;
+		int get_num_patches() const;
+		int get_bounds(float* mins, float* maxs) const;
+
+		int box_leafs(const float* mins, const float* maxs, int* leafs, int max_leafs) const;
+		int get_num_leafs() const;
+		int get_leaf_cluster(int leaf) const;
+		int get_leaf_area(int leaf) const;
+		int find_leaf(const float* p) const;
+		int is_cluster_visable(int current, int test) const;
+
+		int get_num_vis_full() const;
+		int get_num_vis_retests() const;
+
+	private:
+		void parse_entities();
+
+		void prefetch(int cluster, vector3* pos);
+
+		int init_vis();
+		void free_vis();
+		void find_visible(RCamera* camera, int cluster);
+		int test_box(const float* mins, const float* maxs, const struct vec4* frustum, int plane, float* slack) const;
+
+		char* get_next_token(const char* str, char* buf, int buf_size);
+
+		void load_entity_info_player_deathmatch(const char* ent);
+
+
+		int find_leaf(vector3* pos);
+
+		void trace_through_tree(struct trace_work_t* tw, int node, float p1f, float p2f,
+								const float* p1, const float* p2) const;
+		void trace_through_leaf(struct trace_work_t* tw, int leaf) const;
+		void trace_through_brush(struct trace_work_t* tw, int brush) const;
+		void trace_through_patch(struct trace_work_t* tw, int patch) const;
+
+		void box_leafs_r(struct box_leafs_t* bl, int node) const;
+
+		static void point_contents_range(void* arg, int begin, int end);
+
+		const int* sort_batch(const struct trace_batch_t* batch);
+		int claim_batch_scratch();
+		static void trace_batch_range(void* arg, int begin, int end);
+
+		EQ3MapData* data;
+
+		/* for traces from the thread that owns the map */
+		struct trace_scratch_t scratch;
+
+		/* for trace_batch(), one per thread that can run part of a batch */
+		struct trace_scratch_t batch_scratch[TRACE_BATCH_MAX_SCRATCH];
+		volatile int batch_scratch_busy[TRACE_BATCH_MAX_SCRATCH];
+		int num_batch_scratch;
+
+		/* batch traces in the order they are run, and their sort keys */
+		int* batch_order;
+		unsigned int* batch_keys;
+		int batch_capacity;
+
 		struct entity_loader_callbacks_t* entity_loader_callbacks;
 
+		/* given to EQ3MapData::acquire() */
+		int lean;
+		int headless;
+		EArena* arena;
+
+		int prefetch_cluster;			/* cluster the current prefetch requests are for */
+		float* lightmap_priority;		/* distance of lightmaps waiting to be uploaded, -1 if not wanted */
+
+		struct q3bsp_vis_t vis;			/* what the camera saw last frame */
+
 		struct q3bsp_spawn_point_t spawn_points[Q3_MAX_SPAWN_POINTS];
 		int num_spawn_points;
 };
@@ -0,0 +1,52 @@
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <stddef.h>
+
+#include "definitions.h"
+
+/**
+ *	@file arena.h
+ *	@brief Linear allocator for data that lives as long as a map.
+ */
+
+/* default alignment of allocations, a cache line */
+#define ARENA_ALIGN				64
+
+/* alignment of allocations that may be released on their own */
+#define ARENA_PAGE_ALIGN		4096
+
+
+/**
+ *	@class EArena
+ *	@brief One block of memory handed out front to back.
+ *
+ *	Everything is freed at once by reset(), which keeps the block
+ *	so the next map can be loaded into it without touching the
+ *	heap.  The block only grows when a map needs more than it has.
+ *
+ *	Pages of an allocation that is no longer needed can be given
+ *	back to the system with release(); the address range stays
+ *	reserved and reads as zeros if it is used again.
+ */
+class EArena {
+	public:
+		EArena();
+		~EArena();
+
+		int reserve(size_t bytes);
+		void reset();
+
+		void* alloc(size_t bytes, size_t align = ARENA_ALIGN);
+		size_t release(void* ptr, size_t bytes);
+
+		size_t get_capacity() const;
+		size_t get_used() const;
+
+	private:
+		byte* base;
+		size_t capacity;
+		size_t used;
+};
+
+#endif // ARENA_H_INCLUDED
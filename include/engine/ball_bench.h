@@ -0,0 +1,24 @@
+#ifndef BALL_BENCH_H_INCLUDED
+#define BALL_BENCH_H_INCLUDED
+
+#include "engine/Q3map.h"
+#include "engine/thread_pool.h"
+
+/**
+ *	@file ball_bench.h
+ *	@brief Timing of balls rolling around a map.
+ */
+
+/* balls run by "make bench" */
+#define BALL_BENCH_DEFAULT_COUNT		4096
+
+/* ticks for the balls to fall and settle, then ticks timed */
+#define BALL_BENCH_SETTLE_TICKS			100
+#define BALL_BENCH_TICKS				200
+
+/* a spot for a ball must have something this far below it */
+#define BALL_BENCH_MAX_DROP				2048.0f
+
+int ball_bench(EQ3Map* map, EThreadPool* pool, int count);
+
+#endif // BALL_BENCH_H_INCLUDED
@@ -0,0 +1,111 @@
+#ifndef BALLS_H_INCLUDED
+#define BALLS_H_INCLUDED
+
+#include "engine/collision.h"
+#include "engine/thread_pool.h"
+
+/**
+ *	@file balls.h
+ *	@brief Balls rolling around a map.
+ */
+
+/* units per second squared, as Quake 3 */
+#define BALL_GRAVITY				800.0f
+
+#define BALL_DEFAULT_RADIUS			8.0f
+
+/* speed kept bouncing off the map and off each other */
+#define BALL_RESTITUTION			0.4f
+#define BALL_BALL_RESTITUTION		0.6f
+
+/* slower hits than this do not bounce, so resting balls settle */
+#define BALL_REST_SPEED				(BALL_GRAVITY * 0.05f)
+
+/* fraction of speed lost per second */
+#define BALL_DRAG					0.2f
+
+/* fraction of an overlap between balls pushed apart per tick */
+#define BALL_SEPARATION				0.2f
+
+/* surfaces a ball can slide along in one tick */
+#define BALL_MAX_BUMPS				3
+
+/* balls further than this outside the map are gone */
+#define BALL_LOST_DISTANCE			1024.0f
+
+
+class EQ3Map;
+
+
+/**
+ *	@class EBallSet
+ *	@brief Spheres of the same size moved together.
+ *
+ *	Each property of the balls is kept in an array of its own, three
+ *	floats a ball, so integrating is a pass over flat memory that
+ *	can use SSE and the moves through the map go straight into a
+ *	trace batch.  Balls bounce off each other through a uniform grid
+ *	of cells a ball across, hashed so the grid covers any map.
+ *
+ *	Everything is done in ball order, so the same balls given the
+ *	same gravity always end up in the same places.
+ */
+class EBallSet {
+	public:
+		EBallSet();
+		~EBallSet();
+
+		int init(int max_balls, float radius, EQ3Map* map, EThreadPool* pool);
+
+		int add(const float* position, const float* velocity);
+		void tick(float dt, const float* gravity);
+
+		int get_count() const;
+		float get_radius() const;
+		const float* get_positions() const;
+		const float* get_prev_positions() const;
+		const float* get_velocities() const;
+
+		static void tilt_gravity(float roll, float pitch, float* gravity);
+
+	private:
+		void integrate(float dt, const float* gravity);
+		void build_grid();
+		void collide_balls(float dt);
+		void move(float dt);
+		void remove_lost();
+
+		int count;
+		int capacity;						/* a multiple of 4 */
+		float radius;
+
+		float* positions;					/* 3 floats each */
+		float* prev_positions;				/* at the start of the tick */
+		float* velocities;
+		float* targets;						/* where the balls are headed this tick */
+
+		/* hashed grid, ball indices in cell order */
+		int grid_mask;						/* hash buckets - 1 */
+		float cell_scale;					/* 1 / cell size */
+		int* cell_start;					/* grid_mask + 2 */
+		int* cell_balls;
+
+		/* the balls still moving on each bump of move() */
+		int* move_balls;
+		float* move_time;
+		float* move_starts;
+		float* move_ends;
+		float* move_fractions;
+		float* move_end_positions;
+		float* move_normals;
+		int* move_flags;
+
+		void* block;						/* all of the above */
+
+		EQ3Map* map;						/* bounced off, or NULL */
+		EThreadPool* pool;					/* for the traces, or NULL */
+		float lost_mins[3];
+		float lost_maxs[3];
+};
+
+#endif // BALLS_H_INCLUDED
@@ -0,0 +1,23 @@
+#ifndef BENCH_H_INCLUDED
+#define BENCH_H_INCLUDED
+
+#include "engine/Q3map.h"
+#include "engine/thread_pool.h"
+
+/**
+ *	@file bench.h
+ *	@brief What the benches of "make bench" share.
+ */
+
+/* rand() is seeded with this before anything random is picked, so runs can be compared */
+#define BENCH_SEED						1
+
+/**
+ *	A bench run on a loaded map.
+ *	Returns 1 on success, 0 on failure.
+ */
+typedef int (*bench_func_t)(EQ3Map* map, EThreadPool* pool, int count);
+
+double bench_time_ms();
+
+#endif // BENCH_H_INCLUDED
@@ -0,0 +1,45 @@
+#ifndef BOUNDED_QUEUE_H_INCLUDED
+#define BOUNDED_QUEUE_H_INCLUDED
+
+#include <pthread.h>
+
+/**
+ *	@file bounded_queue.h
+ *	@brief Fixed capacity queue for handing work between threads.
+ */
+
+
+/**
+ *	@class EBoundedQueue
+ *	@brief Thread safe ring buffer of pointers.
+ *
+ *	Producers block in push() while the queue is full, which keeps
+ *	the amount of finished-but-unconsumed data bounded.  The consumer
+ *	never blocks; try_pop() returns NULL when nothing is ready.
+ */
+class EBoundedQueue {
+	public:
+		EBoundedQueue(int capacity);
+		~EBoundedQueue();
+
+		int push(void* item);
+		void* try_pop();
+
+		void close();
+		int is_closed();
+
+		int get_count();
+
+	private:
+		void** items;
+		int capacity;
+		int head;
+		int count;
+
+		int closed;
+
+		pthread_mutex_t lock;
+		pthread_cond_t not_full;
+};
+
+#endif // BOUNDED_QUEUE_H_INCLUDED
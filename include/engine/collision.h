@@ -0,0 +1,131 @@
+#ifndef COLLISION_H_INCLUDED
+#define COLLISION_H_INCLUDED
+
+#include "definitions.h"
+#include "math/vector.h"
+#include "engine/thread_pool.h"
+
+/**
+ *	@file collision.h
+ *	@brief Tracing shapes through the brushes of a map.
+ */
+
+/*
+ *	Brush contents, from the contents of a brush's texture.
+ */
+#define CONTENTS_SOLID				0x00000001
+#define CONTENTS_LAVA				0x00000008
+#define CONTENTS_SLIME				0x00000010
+#define CONTENTS_WATER				0x00000020
+#define CONTENTS_FOG				0x00000040
+#define CONTENTS_PLAYERCLIP			0x00010000
+#define CONTENTS_BODY				0x02000000
+#define CONTENTS_TRIGGER			0x40000000
+
+/* what a moving ball or camera is stopped by */
+#define MASK_SOLID					(CONTENTS_SOLID | CONTENTS_PLAYERCLIP)
+
+/* what a ball can be in */
+#define MASK_LIQUID					(CONTENTS_LAVA | CONTENTS_SLIME | CONTENTS_WATER)
+
+/* distance kept from surfaces so a trace never ends inside one */
+#define SURFACE_CLIP_EPSILON		0.125f
+
+
+/*
+ *	Shapes that can be traced.
+ */
+#define TRACE_RAY					0
+#define TRACE_SPHERE				1
+#define TRACE_BOX					2
+
+
+/**
+ *	@struct trace_t
+ *	@brief What a trace hit.
+ */
+struct trace_t {
+	float fraction;				/* of the way to the end before hitting something, 1.0 if nothing */
+	vector3 end;				/* where the shape stopped */
+
+	float normal[3];			/* of the surface hit */
+	float dist;
+
+	int contents;				/* of the brush hit */
+	int brush;					/* the brush hit, -1 if none */
+	int patch;					/* the patch hit, -1 if none */
+
+	int start_solid;			/* the start was inside a brush */
+	int all_solid;				/* the whole trace was inside one, fraction is 0 */
+};
+
+
+/**
+ *	@struct trace_scratch_t
+ *	@brief Per-thread state of traces.
+ *
+ *	Each brush and patch is stamped with the number of the trace
+ *	that last tested it, so one in several leafs is only clipped
+ *	against once.  Traces running at the same time need one each.
+ */
+struct trace_scratch_t {
+	int checkcount;
+	int* brush_stamps;			/* one per brush */
+	int num_brushes;
+	int* patch_stamps;			/* one per patch */
+	int num_patches;
+};
+
+
+/*
+ *	Flags of a trace in a batch, in place of start_solid and all_solid.
+ */
+#define TRACE_START_SOLID			0x01
+#define TRACE_ALL_SOLID				0x02
+
+/* threads that can work on a batch at once, the pool's and the caller */
+#define TRACE_BATCH_MAX_SCRATCH		(THREAD_POOL_MAX_THREADS + 1)
+
+/* traces handed to a thread at a time */
+#define TRACE_BATCH_GRAIN			256
+
+/* smaller batches are run in the order given */
+#define TRACE_BATCH_SORT_MIN		1024
+
+/* points handed to a thread at a time by point_contents_batch() */
+#define POINT_CONTENTS_GRAIN		2048
+
+
+/**
+ *	@struct trace_batch_t
+ *	@brief Many traces of the same shape run together.
+ *
+ *	Inputs and results are kept in separate arrays, three floats
+ *	per trace for positions and normals.  Results that are not
+ *	wanted can be left NULL; a line of sight check only needs the
+ *	fractions.
+ */
+struct trace_batch_t {
+	int count;
+
+	int type;					/* TRACE_* */
+	int mask;					/* contents that stop the traces */
+	float radius;				/* of the spheres, TRACE_SPHERE only */
+
+	const float* starts;
+	const float* ends;
+	const float* mins;			/* box corners of each trace, TRACE_BOX only */
+	const float* maxs;
+
+	float* fractions;
+	float* end_positions;
+	float* normals;
+	int* contents;
+	int* flags;					/* TRACE_START_SOLID, TRACE_ALL_SOLID */
+};
+
+
+int trace_scratch_init(struct trace_scratch_t* scratch, int num_brushes, int num_patches);
+void trace_scratch_free(struct trace_scratch_t* scratch);
+
+#endif // COLLISION_H_INCLUDED
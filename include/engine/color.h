@@ -0,0 +1,51 @@
+#ifndef COLOR_H_INCLUDED
+#define COLOR_H_INCLUDED
+
+#include "definitions.h"
+#include "engine/thread_pool.h"
+
+/**
+ *	@file color.h
+ *	@brief Colour adjustment of 8-bit RGB and RGBA pixel data.
+ *
+ *	Each pixel's RGB channels are multiplied by a brightness factor,
+ *	brought back into range, then passed through a gamma ramp.
+ *	Alpha is never changed.
+ */
+
+/*
+ *	Flags.
+ */
+#define COLOR_SATURATE				0x01	/* scale overbright pixels down by their brightest channel, keeping the hue */
+
+/* brightness factor of an overbright shift, Q3 lightmaps use 2 bits */
+#define COLOR_OVERBRIGHT(bits)		((float)(1 << (bits)))
+
+/* buffers with fewer pixels than this are not split over threads */
+#define COLOR_PARALLEL_PIXELS		(256 * 256)
+
+
+/**
+ *	@struct color_table_t
+ *	@brief Precomputed result of one set of colour parameters.
+ *
+ *	With COLOR_SATURATE a channel's output depends on its own value
+ *	and the pixel's brightest channel only, so every result fits in
+ *	a 256 x 256 table.
+ */
+struct color_table_t {
+	float factor;
+	float gamma;
+	int flags;
+
+	byte* table;				/* [brightest channel][channel], gamma ramp included */
+};
+
+
+struct color_table_t* color_table_create(float factor, float gamma, int flags);
+void color_table_destroy(struct color_table_t* t);
+
+void color_apply(byte* data, int num_pixels, int components, float factor, float gamma, int flags, EThreadPool* pool);
+void color_apply_table(const struct color_table_t* t, byte* data, int num_pixels, int components, EThreadPool* pool);
+
+#endif // COLOR_H_INCLUDED
@@ -0,0 +1,29 @@
+#ifndef DXT_H_INCLUDED
+#define DXT_H_INCLUDED
+
+#include "engine/image.h"
+#include "engine/thread_pool.h"
+
+/**
+ *	@file dxt.h
+ *	@brief S3TC (BC1/BC3) block compression.
+ *
+ *	RGB images are encoded as BC1 (DXT1), RGBA images as BC3 (DXT5).
+ */
+
+/*
+ *	Quality presets, fastest first.
+ */
+#define DXT_QUALITY_FAST		0		/* inset bounding box endpoints */
+#define DXT_QUALITY_NORMAL		1		/* endpoints on the principal axis */
+#define DXT_QUALITY_HIGH		2		/* principal axis plus least squares refinement */
+
+/* levels with fewer blocks than this are not split over threads */
+#define DXT_PARALLEL_BLOCKS		1024
+
+
+int dxt_supported();
+
+struct image_t* dxt_compress(const struct image_t* img, int quality, EThreadPool* pool);
+
+#endif // DXT_H_INCLUDED
@@ -7,8 +7,14 @@ extern class EEngine g_engine;
 #include "engine/wiimote.h"
 #include "render/render.h"
 #include "engine/texture_manager.h"
+#include "engine/thread_pool.h"
+#include "engine/vfs.h"
 #include "engine/map.h"
+#include "engine/arena.h"
 #include "engine/mouse.h"
+#include "engine/simulation.h"
+#include "engine/entity_links.h"
+#include "engine/bench.h"
 
 /**
  *	@file engine.h
@@ -17,6 +23,30 @@ extern class EEngine g_engine;
 
 #define MOUSE_SENSITIVITY_SCALER		5.0f
 
+/* game data, loose files and every pk3 in it */
+#define ENGINE_SEARCH_PATH				"."
+
+/* block compress textures (needs S3TC), and how hard to try */
+#define ENGINE_COMPRESS_TEXTURES		0
+#define ENGINE_COMPRESS_QUALITY			DXT_QUALITY_NORMAL
+
+/* colour adjustment of textures, 1.0 and 1.0 leave them untouched */
+#define ENGINE_TEXTURE_BRIGHTNESS		1.0f
+#define ENGINE_TEXTURE_GAMMA			1.0f
+
+/* memory textures may use, 0 for no limit */
+#define ENGINE_TEXTURE_BUDGET			(128UL * 1024UL * 1024UL)
+
+/* only load textures once they are prefetched or drawn */
+#define ENGINE_DEFER_TEXTURES			1
+
+/* balls dropped around the spawn point, and room for more in stress modes */
+#define ENGINE_BALLS					27
+#define ENGINE_MAX_BALLS				8192
+
+/* free the CPU copies of map geometry and lightmaps once OpenGL has them */
+#define ENGINE_LEAN_MAPS				1
+
 /**
  *	@class EEngine
  *	@brief The game engine
@@ -26,26 +56,42 @@ class EEngine {
 		~EEngine();
 
 		int init();
-		void shutdown();
+		int init_headless();
+		void shutdown(int status = 0);
 
 		int exec();
+		int bench(bench_func_t fn, int count);
 		void check_sdl_events();
 
 		ETextureManager* get_texture_manager() const;
+		EThreadPool* get_thread_pool() const;
+		const EVFS* get_vfs() const;
 		EWiimote wiimote;
 
 	private:
+		void init_data();
 		void handle_key_press(SDL_Event* e);
+		void handle_key_release(SDL_Event* e);
+		void set_key(SDLKey key, int pressed);
+		void send_input();
+		void drop_balls(EQ3Map* q3map, const vector3* around, int count);
 		void handle_mouse_event(SDL_Event* e);
 
 		RRender* renderer;
 		RCamera* camera;						/* default camera */
 		ETextureManager* texture_manager;
+		ETextureCache* texture_cache;
+		EThreadPool* thread_pool;
+		EVFS* vfs;
 		EMouse mouse;
+		ESimulation* simulation;
+		EEntityLinks* ball_links;				/* where the balls are drawn */
+		struct sim_input_t input;				/* last given to the simulation */
 
 		int initialized;
 
 		EMap* map;
+		EArena* map_arena;						/* kept across map changes */
 };
 
 
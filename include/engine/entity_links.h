@@ -0,0 +1,100 @@
+#ifndef ENTITY_LINKS_H_INCLUDED
+#define ENTITY_LINKS_H_INCLUDED
+
+/**
+ *	@file entity_links.h
+ *	@brief Things that move, linked into the leafs of a map.
+ */
+
+/* leafs an entity can be linked into, bigger ones are in every leaf */
+#define LINK_MAX_LEAFS				16
+
+/* clusters kept for an entity, in more and it is always visible */
+#define LINK_MAX_CLUSTERS			8
+
+
+class EQ3Map;
+
+
+/**
+ *	@struct link_entity_t
+ *	@brief Where an entity is in the map.
+ */
+struct link_entity_t {
+	float mins[3];
+	float maxs[3];
+
+	int linked;
+	int num_leafs;				/* LINK_MAX_LEAFS + 1 if linked everywhere */
+	int leafs[LINK_MAX_LEAFS];
+
+	int num_clusters;			/* -1 if in too many to keep */
+	int clusters[LINK_MAX_CLUSTERS];
+
+	int area;					/* -1 if in none */
+	int area2;					/* second area, if spanning an areaportal */
+};
+
+
+/**
+ *	@struct leaf_link_t
+ *	@brief An entity in the list of a leaf.
+ */
+struct leaf_link_t {
+	int prev;					/* links, -1 at the ends */
+	int next;
+};
+
+
+/**
+ *	@class EEntityLinks
+ *	@brief Finds which leafs, clusters and areas entities are in.
+ *
+ *	Each leaf has a list of the entities in it, so finding what is
+ *	near something only looks at the leafs around it.  Each entity
+ *	keeps the clusters it is in, so it can be checked against the
+ *	PVS like the faces of the map.
+ *
+ *	Entity i has the links i * LINK_MAX_LEAFS onwards, one for each
+ *	leaf it is in, so linking never allocates.  An entity that moves
+ *	but stays in the same leafs is not relinked.
+ */
+class EEntityLinks {
+	public:
+		EEntityLinks();
+		~EEntityLinks();
+
+		int init(EQ3Map* map, int max_entities);
+
+		int link(int entity, const float* mins, const float* maxs);
+		void unlink(int entity);
+
+		const struct link_entity_t* get_entity(int entity) const;
+		int find_cluster(const float* point) const;
+		int is_visible(int entity, int cluster) const;
+
+		int entities_in_leafs(const int* leafs, int num_leafs, int* found, int max_found);
+		int entities_in_box(const float* mins, const float* maxs, int* found, int max_found);
+
+		int get_num_relinks() const;
+
+	private:
+		int add_entities(int head, const float* mins, const float* maxs, int* found, int count, int max_found);
+
+		EQ3Map* map;
+
+		struct link_entity_t* entities;
+		int max_entities;
+
+		struct leaf_link_t* links;			/* LINK_MAX_LEAFS for each entity */
+		int* leaf_heads;					/* first link of each leaf, -1 if empty */
+		int num_leafs;
+		int everywhere_head;				/* entities in too many leafs to link */
+
+		int* stamps;						/* query that last found each entity */
+		int query_count;
+
+		int num_relinks;
+};
+
+#endif // ENTITY_LINKS_H_INCLUDED
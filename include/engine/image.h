@@ -0,0 +1,62 @@
+#ifndef IMAGE_H_INCLUDED
+#define IMAGE_H_INCLUDED
+
+#include "definitions.h"
+#include "gl.h"
+
+/**
+ *	@file image.h
+ *	@brief Decoded images and their mip chains.
+ */
+
+/* enough levels for a 32768x32768 image */
+#define IMAGE_MAX_LEVELS		16
+
+/* alignment of every level in the pixel block */
+#define IMAGE_ALIGNMENT			16
+
+
+/**
+ *	@struct image_level_t
+ *	@brief One mip level of an image
+ */
+struct image_level_t {
+	int width;
+	int height;
+	int size;					/* bytes in data */
+	byte* data;
+};
+
+
+/**
+ *	@struct image_t
+ *	@brief A decoded image ready to be given to OpenGL.
+ *
+ *	Pixels are tightly packed (no row padding) in the order
+ *	given by format.  All levels share one allocation, which is
+ *	either from the heap or a read-only mapping of a cache file.
+ */
+struct image_t {
+	int width;
+	int height;
+	int components;				/* bytes per pixel - 3 or 4, before any compression */
+	GLenum format;				/* GL_RGB, GL_RGBA or an S3TC format */
+
+	int num_levels;
+	struct image_level_t levels[IMAGE_MAX_LEVELS];
+
+	byte* mem;
+	long mapped_size;			/* non-zero if mem is mmap()ed */
+};
+
+
+int image_count_levels(int width, int height);
+int image_level_size(int width, int height, GLenum format);
+int image_is_compressed(const struct image_t* img);
+
+struct image_t* image_create(int width, int height, int components, int mipmapped);
+struct image_t* image_create_format(int width, int height, int components, GLenum format, int num_levels);
+struct image_t* image_map(byte* mem, long mapped_size);
+void image_destroy(struct image_t* img);
+
+#endif // IMAGE_H_INCLUDED
@@ -0,0 +1,25 @@
+#ifndef JPEG_H_INCLUDED
+#define JPEG_H_INCLUDED
+
+#include "definitions.h"
+#include "engine/image.h"
+
+/**
+ *	@file jpeg.h
+ *	@brief Baseline JPEG decoder.
+ *
+ *	Handles sequential Huffman coded JPEGs with one (grey) or three
+ *	(YCbCr) components, any sampling factors and restart
+ *	intervals.  Progressive and arithmetic coded files are refused so
+ *	the caller can fall back to another decoder.  Pixels are written
+ *	as RGB with the top row first.
+ */
+
+/* bits looked up at once when decoding Huffman codes */
+#define JPEG_FAST_BITS			9
+
+
+int jpeg_check(const byte* data, long size);
+struct image_t* jpeg_decode(const byte* data, long size, int mipmapped);
+
+#endif // JPEG_H_INCLUDED
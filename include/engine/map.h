@@ -19,7 +19,7 @@ class EMap {
 		 *	@brief Load the given map.
 		 *	@return 1 on success, 0 on failure
 		 */
-		virtual int load(char* file) = 0;
+		virtual int load(const char* file) = 0;
 
 		/**
 		 *	@brief Render the given map at the specified camera position.
@@ -0,0 +1,40 @@
+#ifndef MIPMAP_H_INCLUDED
+#define MIPMAP_H_INCLUDED
+
+#include "engine/image.h"
+#include "engine/thread_pool.h"
+
+/**
+ *	@file mipmap.h
+ *	@brief Mip chain generation and upload.
+ *
+ *	Replaces gluBuild2DMipmaps.  Images of any size are supported,
+ *	each level is max(1, floor(previous / 2)) in both directions
+ *	so non-power-of-two images are not rescaled first.
+ */
+
+/*
+ *	Down sampling filters.
+ */
+#define MIPMAP_FILTER_BOX			0		/* area average */
+#define MIPMAP_FILTER_KAISER		1		/* Kaiser windowed sinc */
+#define MIPMAP_FILTER_LANCZOS		2		/* Lanczos-3 */
+
+/*
+ *	Flags.
+ */
+#define MIPMAP_GAMMA_CORRECT		0x01	/* average colour in linear space */
+
+/* gamma used by MIPMAP_GAMMA_CORRECT */
+#define MIPMAP_GAMMA				2.2f
+
+/* levels with fewer output pixels than this are not split over threads */
+#define MIPMAP_PARALLEL_PIXELS		(256 * 256)
+
+
+void mipmap_build(struct image_t* img, int filter, int flags, EThreadPool* pool);
+void mipmap_upload(struct image_t* img);
+void mipmap_upload_levels(struct image_t* img, int first_level);
+void mipmap_upload_unpack_buffer(struct image_t* img, int first_level);
+
+#endif // MIPMAP_H_INCLUDED
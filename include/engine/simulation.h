@@ -0,0 +1,172 @@
+#ifndef SIMULATION_H_INCLUDED
+#define SIMULATION_H_INCLUDED
+
+#include <pthread.h>
+
+#include "engine/collision.h"
+#include "engine/balls.h"
+
+/**
+ *	@file simulation.h
+ *	@brief Fixed timestep simulation.
+ */
+
+/* ticks per second, every tick advances the world by the same time */
+#define SIM_TICK_RATE				100
+#define SIM_TICK_USEC				(1000000 / SIM_TICK_RATE)
+#define SIM_TICK_SECONDS			(1.0f / SIM_TICK_RATE)
+
+/* ticks run at once to catch up before the rest is dropped */
+#define SIM_MAX_CATCHUP_TICKS		10
+
+/* units per second the camera flies at */
+#define SIM_CAMERA_SPEED			320.0f
+
+/* how fast the camera reaches the speed it is steered to, per second */
+#define SIM_CAMERA_RESPONSE			12.0f
+
+/* the camera is a sphere of this radius where it collides with the map */
+#define SIM_CAMERA_RADIUS			12.0f
+
+/* surfaces the camera can slide along in one tick */
+#define SIM_MAX_BUMPS				4
+
+/* push a little further off a surface than the velocity into it */
+#define SIM_OVERCLIP				1.001f
+
+/*
+ *	Held keys of sim_input_t.
+ */
+#define SIM_KEY_FORWARD				0x01
+#define SIM_KEY_BACK				0x02
+#define SIM_KEY_LEFT				0x04
+#define SIM_KEY_RIGHT				0x08
+
+
+class EQ3Map;
+
+
+/**
+ *	@struct sim_input_t
+ *	@brief What the player is doing, sampled once per tick.
+ */
+struct sim_input_t {
+	int keys;					/* SIM_KEY_* held down */
+	float theta;				/* camera rotations in degrees, as RCamera */
+	float psi;
+
+	float roll;					/* tilt of the level in degrees, as EWiimote */
+	float pitch;
+};
+
+
+/**
+ *	@struct sim_camera_t
+ *	@brief Camera state at the end of a tick.
+ */
+struct sim_camera_t {
+	float position[3];
+	float velocity[3];
+};
+
+
+/**
+ *	@struct sim_snapshot_t
+ *	@brief The last two ticks, for drawing between them.
+ */
+struct sim_snapshot_t {
+	unsigned int tick;
+	unsigned long usec;			/* when the tick was due, 0 if run by step() */
+
+	struct sim_camera_t prev;
+	struct sim_camera_t cur;
+
+	int num_balls;
+	float ball_radius;
+	float* prev_balls;			/* positions, 3 floats each */
+	float* cur_balls;
+};
+
+
+/*
+ *	Set in triple_buffer_t::middle while the slot has not been read.
+ */
+#define TRIPLE_BUFFER_FRESH			0x04
+
+/**
+ *	@struct triple_buffer_t
+ *	@brief Slots handed from one writer thread to one reader thread.
+ *
+ *	The writer fills its back slot and swaps it with the middle one,
+ *	the reader swaps its front slot with the middle one when that
+ *	holds something newer.  Neither ever waits for the other and
+ *	the reader always has the latest complete slot.
+ */
+struct triple_buffer_t {
+	int back;					/* slot the writer fills */
+	volatile int middle;		/* last one published */
+	int front;					/* slot the reader holds */
+};
+
+
+/**
+ *	@class ESimulation
+ *	@brief Moves the camera and balls in fixed ticks on its own thread.
+ *
+ *	Ticks are run at SIM_TICK_RATE whatever the frame rate, so a
+ *	slow frame never changes where things end up and a slow tick
+ *	never holds up a frame.  Input is passed in and state is passed
+ *	out through triple buffers, the renderer drawing in between the
+ *	last two ticks.
+ *
+ *	Without start(), step() runs ticks on the calling thread, so
+ *	the same input always gives the same result.
+ */
+class ESimulation {
+	public:
+		ESimulation();
+		~ESimulation();
+
+		int init(EQ3Map* map, EThreadPool* pool, int max_balls);
+
+		void set_camera(const float* position);
+		int add_ball(const float* position);
+		void set_input(const struct sim_input_t* input);
+
+		int start();
+		void stop();
+		void step(int ticks);
+
+		const struct sim_snapshot_t* get_snapshot(float* alpha);
+		unsigned int get_tick() const;
+
+	private:
+		static void* thread_main(void* arg);
+
+		void tick();
+		void move_camera(const struct sim_input_t* input);
+		void slide_move(float* position, float* velocity);
+		void publish(unsigned long usec);
+
+		EQ3Map* map;						/* collided with, or NULL */
+		struct trace_scratch_t scratch;		/* for traces of the simulation thread */
+
+		struct sim_input_t inputs[3];
+		struct triple_buffer_t input_buffer;
+
+		struct sim_snapshot_t snapshots[3];
+		float* snapshot_balls;				/* the ball positions of all of them */
+		struct triple_buffer_t snapshot_buffer;
+
+		/* only touched by the thread running the ticks */
+		struct sim_camera_t camera;
+		struct sim_camera_t prev_camera;
+		EBallSet* balls;					/* NULL without any */
+		unsigned int tick_count;
+		unsigned int dropped_ticks;
+
+		pthread_t thread;
+		volatile int running;
+};
+
+#endif // SIMULATION_H_INCLUDED
@@ -0,0 +1,116 @@
+#ifndef TEXTURE_CACHE_H_INCLUDED
+#define TEXTURE_CACHE_H_INCLUDED
+
+#include <pthread.h>
+
+#include "engine/image.h"
+#include "engine/vfs.h"
+
+/**
+ *	@file texture_cache.h
+ *	@brief On-disk cache of decoded, mipmapped textures.
+ */
+
+/* where cache entries are kept, relative to the working directory */
+#define TEXTURE_CACHE_DIR			"cache/textures"
+
+/* default size cap of the cache directory */
+#define TEXTURE_CACHE_MAX_BYTES		(256UL * 1024UL * 1024UL)
+
+/* trimming stops once the cache is below this percentage of the cap */
+#define TEXTURE_CACHE_TRIM_PERCENT	90
+
+#define TEXTURE_CACHE_MAGIC			0x31435854		/* "TXC1" [little endian] */
+#define TEXTURE_CACHE_VERSION		3
+#define TEXTURE_CACHE_EXT			".tex"
+
+
+/**
+ *	@struct texture_cache_key_t
+ *	@brief What a cache entry was built from.
+ *
+ *	An entry is only used if all of these still match.
+ */
+struct texture_cache_key_t {
+	unsigned long long hash;	/* FNV-1a of the fields below, names the file */
+
+	char path[256];
+	long long source_size;
+	long long source_mtime;
+	unsigned int source_crc;	/* of an archived source, 0 for loose files */
+	unsigned long long options;	/* how the levels were generated */
+};
+
+
+/**
+ *	@struct texture_cache_level_t
+ *	@brief Location of one mip level in a cache entry.
+ */
+struct texture_cache_level_t {
+	int width;
+	int height;
+	int offset;
+	int size;
+};
+
+
+/**
+ *	@struct texture_cache_header_t
+ *	@brief Start of every cache entry.  Level data follows, page aligned.
+ */
+struct texture_cache_header_t {
+	int magic;
+	int version;
+
+	struct texture_cache_key_t key;
+
+	int width;
+	int height;
+	int components;
+	unsigned int format;		/* GL pixel format of the level data */
+
+	int num_levels;
+	struct texture_cache_level_t levels[IMAGE_MAX_LEVELS];
+};
+
+
+/**
+ *	@class ETextureCache
+ *	@brief Persistent cache of GL-ready images.
+ *
+ *	Entries are keyed by source path, size and modification time
+ *	(and CRC for sources inside archives) and hold every mip level.  Hits are mmap()ed and handed back
+ *	as images that can be uploaded straight from the mapping.
+ *	The directory is kept under a size cap by deleting the least
+ *	recently used entries; a hit refreshes the entry's mtime.
+ *
+ *	lookup() and store() may be called from any thread.
+ */
+class ETextureCache {
+	public:
+		ETextureCache();
+		~ETextureCache();
+
+		int init(const char* dir, unsigned long max_bytes, const EVFS* vfs);
+
+		struct image_t* lookup(const char* file, unsigned long long options);
+		int store(const char* file, unsigned long long options, const struct image_t* img);
+
+		void trim();
+
+	private:
+		int make_key(const char* file, unsigned long long options, struct texture_cache_key_t* key);
+		void entry_path(const struct texture_cache_key_t* key, char* buf, int buf_size);
+
+		char dir[256];
+		unsigned long max_bytes;
+		unsigned long total_bytes;
+
+		int enabled;
+
+		const EVFS* vfs;			/* where sources are looked up, NULL for the real filesystem */
+
+		pthread_mutex_t lock;
+};
+
+#endif // TEXTURE_CACHE_H_INCLUDED
@@ -2,48 +2,206 @@
 #define TEXTURE_MANAGER_H_INCLUDED
 
 #include "gl.h"
+#include "engine/image.h"
+#include "engine/mipmap.h"
+#include "engine/dxt.h"
+#include "engine/color.h"
+#include "engine/texture_cache.h"
+#include "engine/vfs.h"
+#include "engine/thread_pool.h"
+#include "engine/bounded_queue.h"
+#include "engine/upload_ring.h"
 
 /**
  *	@file texture_manager.h
  *	@brief Texture manager.
  */
 
+/* decoded images waiting for the main thread to upload them */
+#define TEXTURE_UPLOAD_QUEUE_SIZE		16
+
+/* default time per frame spent uploading decoded images */
+#define TEXTURE_UPLOAD_BUDGET_USEC		4000
+
+/* default bytes of image data uploaded per frame */
+#define TEXTURE_UPLOAD_BUDGET_BYTES		(4 * 1024 * 1024)
+
+/* textures unused for this many frames are evicted before any are downgraded */
+#define TEXTURE_EVICT_FRAMES			120
+
+/* evicted or downgraded textures are only brought back while under this much of the budget */
+#define TEXTURE_RESTORE_PERCENT			90
+
+/* most textures reloaded per frame */
+#define TEXTURE_RESTORE_PER_FRAME		4
+
+/* prefetches are only started while fewer than this many loads are in flight */
+#define TEXTURE_PREFETCH_IN_FLIGHT		8
+
+/* size charged for a texture never decoded, while no texture has been (256x256 RGBA and mips) */
+#define TEXTURE_SIZE_ESTIMATE			(256 * 256 * 4 * 4 / 3)
+
+/*
+ *	Texture states.
+ */
+#define TEXTURE_PENDING			0		/* placeholder bound, image being decoded */
+#define TEXTURE_READY			1		/* image data uploaded */
+#define TEXTURE_FAILED			2		/* could not be decoded, placeholder stays */
+#define TEXTURE_EVICTED			3		/* dropped to stay in budget, placeholder bound */
+#define TEXTURE_DEFERRED		4		/* placeholder bound, image not asked for yet */
+
 
 /**
  *	@struct texture_t
  *	@brief Linked list of textures
+ *
+ *	base_level and size describe what will be resident once
+ *	any outstanding reload has been uploaded.
  */
 typedef struct _texture_t {
 	struct _texture_t* next;
 
 	char* file;
 	GLuint gl_id;
+
+	int state;
+	int loading;				/* a job for this texture is in flight */
+
+	int num_levels;				/* of the full image, 0 until first uploaded */
+	unsigned int level_size[IMAGE_MAX_LEVELS];
+
+	int base_level;				/* first image level given to OpenGL */
+	unsigned int size;			/* bytes from base_level down */
+
+	unsigned int last_used;		/* frame it was last drawn in */
+
+	int prefetch_queued;		/* in the prefetch list */
+	float prefetch_priority;	/* lower is sooner */
 } texture_t;
 
 
+/**
+ *	@struct texture_job_t
+ *	@brief A texture on its way from the decoder to OpenGL.
+ */
+struct texture_job_t {
+	class ETextureManager* tm;
+	texture_t* texture;			/* only touched on the main thread */
+
+	char* file;
+	struct image_t* image;		/* NULL if decoding failed */
+	int base_level;				/* first level to upload */
+};
+
+
 /**
  *	@class ETexture_Manager
  *	@brief Manages loaded textures
+ *
+ *	Images are decoded and mipmapped on the worker pool, or mapped
+ *	from the texture cache when a valid entry exists.  load()
+ *	returns straight away with a texture id bound to a placeholder,
+ *	and the real image replaces it when process_uploads() gets to it.
+ *	Uploads are staged through a ring of pixel buffer objects where
+ *	the driver supports them, and limited in bytes per frame.
+ *
+ *	With a memory budget set, textures drawn (see touch()) least
+ *	recently are evicted, then the top mip levels of the rest are
+ *	dropped, until the textures fit.  They are reloaded, normally
+ *	from the texture cache, once they are drawn again and there is
+ *	room for them.
+ *
+ *	With deferred loading on, load() only registers the texture.
+ *	Its image is loaded when it is first drawn or when prefetch()
+ *	asks for it ahead of time.
  */
 class ETextureManager {
 	public:
 		~ETextureManager();
 
-		void init();
+		void init(EThreadPool* pool);
+		void cancel_pending();
+
+		void set_mip_filter(int filter, int flags);
+		void set_compression(int enabled, int quality);
+		void set_color(float factor, float gamma, int flags);
+		void set_cache(ETextureCache* cache);
+		void set_vfs(const EVFS* vfs);
+		void set_budget(unsigned long bytes);
+		void set_deferred(int enabled);
+		void set_upload_budget(unsigned long bytes);
 
 		unsigned int load(char* file);
 		unsigned int try_load(char* file, char* extensions[]);
 
-		static void modify_gamma(byte* data, int width, int height, int bbp, float factor);
+		int process_uploads(unsigned int budget_usec);
+		void finish();
+
+		void upload_image(struct image_t* img, int first_level);
+		int can_upload();
+
+		void touch(unsigned int gl_id);
+		void end_frame();
+
+		void clear_prefetch();
+		void prefetch(unsigned int gl_id, float priority);
 
 		int get_num_loaded() const;
+		int get_num_pending() const;
+		unsigned long get_resident_bytes() const;
 
 	private:
 		texture_t* textures;
 
 		texture_t* cached(char* file);
 
+		static void decode_job(void* arg);
+		static struct image_t* decode(const char* file, const EVFS* vfs);
+		struct image_t* build_image(const char* file);
+		unsigned long long cache_options() const;
+
+		void upload(texture_job_t* job);
+		void submit(texture_t* texture, int base_level);
+
+		void evict(texture_t* texture);
+		void downgrade(texture_t* texture);
+		void enforce_budget(unsigned long target);
+		unsigned long restore_textures();
+		unsigned int estimate_size() const;
+		void start_prefetches();
+
+		texture_t** by_gl_id;		/* textures indexed by GL id */
+		unsigned int by_gl_id_size;
+
+		unsigned long budget;		/* 0 for no limit */
+		unsigned long resident_bytes;
+		unsigned int frame;
+
+		int deferred;
+
+		texture_t** prefetch_list;	/* textures wanted soon, not yet loading */
+		int num_prefetch;
+		int max_prefetch;
+
+		EThreadPool* pool;
+		EBoundedQueue* upload_queue;
+		EUploadRing* upload_ring;
+
+		int mip_filter;
+		int mip_flags;
+
+		int compress;
+		int compress_quality;
+
+		float color_factor;
+		float color_gamma;
+		int color_flags;
+
+		ETextureCache* cache;
+		const EVFS* vfs;
+
 		int num_loaded;
+		int num_pending;
 };
 
 
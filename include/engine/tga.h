@@ -0,0 +1,24 @@
+#ifndef TGA_H_INCLUDED
+#define TGA_H_INCLUDED
+
+#include "definitions.h"
+#include "engine/image.h"
+
+/**
+ *	@file tga.h
+ *	@brief Truevision TGA decoder.
+ *
+ *	Handles colour mapped, true colour and grey images, raw or run
+ *	length encoded, at 8, 15, 16, 24 and 32 bits per pixel.  Pixels
+ *	are written straight into an upload ready RGB or RGBA image
+ *	with the top row first.
+ */
+
+/* size of the fixed file header */
+#define TGA_HEADER_SIZE			18
+
+
+int tga_check(const byte* data, long size);
+struct image_t* tga_decode(const byte* data, long size, int mipmapped);
+
+#endif // TGA_H_INCLUDED
@@ -0,0 +1,66 @@
+#ifndef THREAD_POOL_H_INCLUDED
+#define THREAD_POOL_H_INCLUDED
+
+#include <pthread.h>
+
+/**
+ *	@file thread_pool.h
+ *	@brief Worker thread pool.
+ */
+
+/* upper limit on the number of worker threads */
+#define THREAD_POOL_MAX_THREADS			16
+
+/** Job callback, run on one of the worker threads. */
+typedef void (*job_func_t)(void* arg);
+
+/** Range callback for parallel_for(), handles items [begin, end). */
+typedef void (*range_func_t)(void* arg, int begin, int end);
+
+
+/**
+ *	@struct job_t
+ *	@brief Linked list of pending jobs
+ */
+typedef struct _job_t {
+	struct _job_t* next;
+
+	job_func_t func;
+	void* arg;
+} job_t;
+
+
+/**
+ *	@class EThreadPool
+ *	@brief Fixed set of worker threads that run queued jobs in FIFO order.
+ */
+class EThreadPool {
+	public:
+		EThreadPool();
+		~EThreadPool();
+
+		int init(int threads);
+		void shutdown();
+
+		void submit(job_func_t func, void* arg);
+		void parallel_for(range_func_t func, void* arg, int count, int grain);
+
+		int get_num_threads() const;
+
+	private:
+		static void* worker_main(void* arg);
+		static void range_job(void* arg);
+
+		pthread_t threads[THREAD_POOL_MAX_THREADS];
+		int num_threads;
+
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+
+		job_t* head;
+		job_t* tail;
+
+		int running;
+};
+
+#endif // THREAD_POOL_H_INCLUDED
@@ -0,0 +1,20 @@
+#ifndef TRACE_BENCH_H_INCLUDED
+#define TRACE_BENCH_H_INCLUDED
+
+#include "engine/Q3map.h"
+#include "engine/thread_pool.h"
+
+/**
+ *	@file trace_bench.h
+ *	@brief Timing of traces through a map.
+ */
+
+/* traces run by "make bench" */
+#define TRACE_BENCH_DEFAULT_COUNT		200000
+
+/* longest move of a random trace */
+#define TRACE_BENCH_MAX_MOVE			512.0f
+
+int trace_bench(EQ3Map* map, EThreadPool* pool, int count);
+
+#endif // TRACE_BENCH_H_INCLUDED
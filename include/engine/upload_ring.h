@@ -0,0 +1,75 @@
+#ifndef UPLOAD_RING_H_INCLUDED
+#define UPLOAD_RING_H_INCLUDED
+
+#include "gl.h"
+#include "engine/image.h"
+
+/**
+ *	@file upload_ring.h
+ *	@brief Asynchronous texture uploads through pixel buffer objects.
+ */
+
+/* default number of buffers in the ring */
+#define UPLOAD_RING_BUFFERS			4
+
+/* default size of each buffer, larger images are uploaded directly */
+#define UPLOAD_RING_BUFFER_SIZE		(4 * 1024 * 1024)
+
+
+/**
+ *	@struct upload_buffer_t
+ *	@brief One pixel buffer object of the ring.
+ */
+struct upload_buffer_t {
+	GLuint pbo;
+	GLsync fence;				/* set while OpenGL may still read the buffer, else 0 */
+};
+
+
+/**
+ *	@class EUploadRing
+ *	@brief Ring of pixel unpack buffers images are staged through.
+ *
+ *	An image is copied into a mapped buffer and the texture is
+ *	specified from it, so OpenGL can transfer the pixels without
+ *	stalling the caller.  A fence after each upload tells when the
+ *	buffer can be reused; buffers are recycled in order.
+ *
+ *	Without driver support, or for images bigger than a buffer,
+ *	uploads go straight from memory as before.
+ *
+ *	Only used from the thread that owns the GL context.
+ */
+class EUploadRing {
+	public:
+		EUploadRing();
+		~EUploadRing();
+
+		int init(int num_buffers, long buffer_size);
+
+		void upload(struct image_t* img, int first_level);
+		int available();
+
+		void set_frame_budget(unsigned long bytes);
+		void end_frame();
+		int over_budget() const;
+
+		int is_enabled() const;
+		unsigned long get_frame_bytes() const;
+
+	private:
+		struct upload_buffer_t* acquire();
+
+		struct upload_buffer_t* buffers;
+		int num_buffers;
+		int next;					/* oldest buffer, the next one to reuse */
+		long buffer_size;
+
+		unsigned long frame_budget;	/* 0 for no limit */
+		unsigned long frame_bytes;	/* uploaded since end_frame() */
+
+		int num_staged;
+		int num_direct;
+};
+
+#endif // UPLOAD_RING_H_INCLUDED
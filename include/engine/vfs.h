@@ -0,0 +1,109 @@
+#ifndef VFS_H_INCLUDED
+#define VFS_H_INCLUDED
+
+#include "definitions.h"
+
+/**
+ *	@file vfs.h
+ *	@brief Virtual filesystem over loose directories and pk3 archives.
+ */
+
+/* longest file name, relative to its search path */
+#define VFS_MAX_PATH			256
+
+/* compressed data read from an archive at a time */
+#define VFS_READ_CHUNK			(64 * 1024)
+
+/* extension of the archives add_search_path() mounts */
+#define VFS_PACK_EXT			".pk3"
+
+
+/**
+ *	@struct vfs_source_t
+ *	@brief A mounted directory or archive.
+ */
+struct vfs_source_t {
+	char path[VFS_MAX_PATH];
+	int fd;						/* open archive, -1 for directories */
+	long long mtime;			/* of the archive */
+};
+
+
+/**
+ *	@struct vfs_entry_t
+ *	@brief A file in the index.
+ */
+struct vfs_entry_t {
+	struct vfs_entry_t* next;	/* hash chain */
+	unsigned int hash;
+
+	char* name;					/* lower case, '/' separated */
+	int source;
+
+	long offset;				/* of the local header in an archive */
+	long size;					/* uncompressed */
+	long comp_size;
+	int method;					/* 0 stored, 8 deflated, -1 loose file */
+	unsigned int crc;
+	long long mtime;			/* of the loose file */
+};
+
+
+/**
+ *	@struct vfs_info_t
+ *	@brief What get_info() knows about a file.
+ */
+struct vfs_info_t {
+	long size;
+	long long mtime;			/* of the loose file or its archive */
+	unsigned int crc;			/* 0 for loose files */
+};
+
+
+/**
+ *	@class EVFS
+ *	@brief Indexed view of every mounted file.
+ *
+ *	Directories are scanned and the central directory of each
+ *	archive is read when they are mounted, so looking files up
+ *	needs no system calls.  Later mounts hide files of the same
+ *	name from earlier ones.  Names are not case sensitive.
+ *
+ *	Mount everything before other threads start using it; lookups
+ *	and reads are then safe from any thread.
+ */
+class EVFS {
+	public:
+		EVFS();
+		~EVFS();
+
+		int add_search_path(const char* dir);
+		int add_directory(const char* dir);
+		int add_pack(const char* file);
+
+		int exists(const char* name) const;
+		int get_info(const char* name, struct vfs_info_t* info) const;
+
+		long read(const char* name, void* buf, long buf_size) const;
+		byte* load(const char* name, long* size) const;
+
+		int get_num_files() const;
+
+	private:
+		const struct vfs_entry_t* find(const char* name) const;
+		void insert(struct vfs_entry_t* entry);
+		int add_source(const char* path, int fd, long long mtime);
+		int scan_directory(int source, const char* dir, const char* prefix);
+
+		long read_loose(const struct vfs_entry_t* entry, void* buf, long buf_size) const;
+		long read_packed(const struct vfs_entry_t* entry, void* buf, long buf_size) const;
+
+		struct vfs_source_t* sources;
+		int num_sources;
+
+		struct vfs_entry_t** table;
+		unsigned int table_size;	/* power of 2 */
+		int num_files;
+};
+
+#endif // VFS_H_INCLUDED
@@ -2,23 +2,50 @@
 #define MATRIX_H_INCLUDED
 
 #include "math/mat.h"
-
+#include "math/simd.h"
+
+/**
+ *	@class matrix4
+ *	@brief 4x4 matrix kept as m[column][row], as OpenGL lays it out.
+ *
+ *	Indexing and multiplying treat it as row major, so a * b is the
+ *	OpenGL product B * A, as in m_mvm * m_pm giving PM * MVM.
+ */
 class matrix4 {
 	public:
-		matrix4();
-		matrix4(float a[16]);
-		matrix4(float xx, float xy, float xz, float xd, float yx, float yy, float yz, float yd, float zx, float zy, float zz, float zd, float dx, float dy, float dz, float dd);
+		matrix4() { }
 
-		const float* operator[](int x);
+		matrix4(const float a[16]) {
+			mat4_load(&m, a);
+		}
 
-		matrix4 operator*(matrix4& b) const;
+		matrix4(float xx, float xy, float xz, float xd, float yx, float yy, float yz, float yd, float zx, float zy, float zz, float zd, float dx, float dy, float dz, float dd) {
+			m.m[0] = xx;	m.m[1] = xy;	m.m[2] = xz;	m.m[3] = xd;
+			m.m[4] = yx;	m.m[5] = yy;	m.m[6] = yz;	m.m[7] = yd;
+			m.m[8] = zx;	m.m[9] = zy;	m.m[10] = zz;	m.m[11] = zd;
+			m.m[12] = dx;	m.m[13] = dy;	m.m[14] = dz;	m.m[15] = dd;
+		}
 
-		void transpose();
+		const float* operator[](int x) const {
+			return &m.m[x * 4];
+		}
 
-	private:
-		float m[4][4];
-};
+		matrix4 operator*(const matrix4& b) const {
+			matrix4 r;
+			mat4_mul(&r.m, &b.m, &m);
+			return r;
+		}
 
+		void transpose() {
+			mat4_transpose(&m, &m);
+		}
 
+		const struct mat4* get() const {
+			return &m;
+		}
+
+	private:
+		struct mat4 m;
+};
 
 #endif // MATRIX_H_INCLUDED
@@ -0,0 +1,536 @@
+#ifndef SIMD_H_INCLUDED
+#define SIMD_H_INCLUDED
+
+/**
+ *	@file simd.h
+ *	@brief 4 wide vectors and matrices, done with SSE when there is some.
+ *
+ *	Matrices are column major like OpenGL, element (row, col) is at
+ *	m[col * 4 + row], so they come straight from glGetFloatv() and
+ *	go straight to glLoadMatrixf().
+ *
+ *	The vec3x4 and vec3x8 types hold 4 or 8 points with all the x
+ *	together, then all the y, then all the z, so a kernel does one
+ *	lane a point without any shuffling.
+ *
+ *	Defining MATH_NO_SIMD (make NO_SIMD=1) builds everything as plain
+ *	C.  Apart from mat4_inverse() it works out the same numbers, in
+ *	the same order, as the SSE code.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE__) && !defined(MATH_NO_SIMD)
+#define MATH_SIMD
+#include <xmmintrin.h>
+#if defined(__AVX__)
+#define MATH_AVX
+#include <immintrin.h>
+#endif
+#endif
+
+#define MATH_ALIGN					__attribute__((aligned(16)))
+#define MATH_ALIGN32				__attribute__((aligned(32)))
+
+
+/**
+ *	@struct vec4
+ *	@brief 4 floats, aligned for SSE.
+ */
+struct vec4 {
+	float v[4];
+} MATH_ALIGN;
+
+
+/**
+ *	@struct mat4
+ *	@brief Column major 4x4 matrix, aligned for SSE.
+ */
+struct mat4 {
+	float m[16];
+} MATH_ALIGN;
+
+
+/**
+ *	@struct vec3x4
+ *	@brief 4 points, one in each lane.
+ */
+struct vec3x4 {
+	float x[4];
+	float y[4];
+	float z[4];
+} MATH_ALIGN;
+
+
+/**
+ *	@struct vec3x8
+ *	@brief 8 points, one in each lane.
+ */
+struct vec3x8 {
+	float x[8];
+	float y[8];
+	float z[8];
+} MATH_ALIGN32;
+
+
+#ifdef MATH_SIMD
+#define MATH_SHUFFLE(a, b, x, y, z, w)	_mm_shuffle_ps((a), (b), _MM_SHUFFLE((w), (z), (y), (x)))
+#define MATH_SPLAT(a, i)				MATH_SHUFFLE((a), (a), (i), (i), (i), (i))
+#endif
+
+
+/*
+ *	vec4
+ */
+
+static inline void vec4_set(struct vec4* r, float x, float y, float z, float w) {
+	r->v[0] = x;
+	r->v[1] = y;
+	r->v[2] = z;
+	r->v[3] = w;
+}
+
+
+static inline void vec4_add(struct vec4* r, const struct vec4* a, const struct vec4* b) {
+#ifdef MATH_SIMD
+	_mm_store_ps(r->v, _mm_add_ps(_mm_load_ps(a->v), _mm_load_ps(b->v)));
+#else
+	for (int i = 0; i < 4; ++i)
+		r->v[i] = a->v[i] + b->v[i];
+#endif
+}
+
+
+static inline void vec4_sub(struct vec4* r, const struct vec4* a, const struct vec4* b) {
+#ifdef MATH_SIMD
+	_mm_store_ps(r->v, _mm_sub_ps(_mm_load_ps(a->v), _mm_load_ps(b->v)));
+#else
+	for (int i = 0; i < 4; ++i)
+		r->v[i] = a->v[i] - b->v[i];
+#endif
+}
+
+
+static inline void vec4_scale(struct vec4* r, const struct vec4* a, float s) {
+#ifdef MATH_SIMD
+	_mm_store_ps(r->v, _mm_mul_ps(_mm_load_ps(a->v), _mm_set1_ps(s)));
+#else
+	for (int i = 0; i < 4; ++i)
+		r->v[i] = a->v[i] * s;
+#endif
+}
+
+
+/**
+ *	@brief Dot product of all 4 components, added up x, y, z then w.
+ */
+static inline float vec4_dot(const struct vec4* a, const struct vec4* b) {
+#ifdef MATH_SIMD
+	__m128 m = _mm_mul_ps(_mm_load_ps(a->v), _mm_load_ps(b->v));
+	__m128 s = _mm_add_ss(m, MATH_SPLAT(m, 1));
+	s = _mm_add_ss(s, MATH_SPLAT(m, 2));
+	s = _mm_add_ss(s, MATH_SPLAT(m, 3));
+	return _mm_cvtss_f32(s);
+#else
+	return ((a->v[0] * b->v[0]) + (a->v[1] * b->v[1]) + (a->v[2] * b->v[2]) + (a->v[3] * b->v[3]));
+#endif
+}
+
+
+/**
+ *	@brief Scale a plane (a, b, c, d) so its normal is unit length.
+ *
+ *	Same as normalize_plane(), on one vec4.
+ */
+static inline void plane_normalize(struct vec4* p) {
+#ifdef MATH_SIMD
+	__m128 v = _mm_load_ps(p->v);
+	__m128 m = _mm_mul_ps(v, v);
+	__m128 s = _mm_add_ss(m, MATH_SPLAT(m, 1));
+	s = _mm_sqrt_ss(_mm_add_ss(s, MATH_SPLAT(m, 2)));
+	_mm_store_ps(p->v, _mm_div_ps(v, MATH_SPLAT(s, 0)));
+#else
+	float mag = sqrtf((p->v[0] * p->v[0]) + (p->v[1] * p->v[1]) + (p->v[2] * p->v[2]));
+
+	for (int i = 0; i < 4; ++i)
+		p->v[i] /= mag;
+#endif
+}
+
+
+/*
+ *	mat4
+ */
+
+/**
+ *	@brief Copy 16 floats in OpenGL order, which need not be aligned.
+ */
+static inline void mat4_load(struct mat4* r, const float* a) {
+	memcpy(r->m, a, sizeof(r->m));
+}
+
+
+static inline void mat4_identity(struct mat4* r) {
+	memset(r->m, 0, sizeof(r->m));
+	r->m[0] = r->m[5] = r->m[10] = r->m[15] = 1.0f;
+}
+
+
+/**
+ *	@brief r = a * b, r may be a or b.
+ *
+ *	Each column of r is the columns of a weighted by a column of b,
+ *	added up in order.
+ */
+static inline void mat4_mul(struct mat4* r, const struct mat4* a, const struct mat4* b) {
+#ifdef MATH_SIMD
+	__m128 a0 = _mm_load_ps(&a->m[0]);
+	__m128 a1 = _mm_load_ps(&a->m[4]);
+	__m128 a2 = _mm_load_ps(&a->m[8]);
+	__m128 a3 = _mm_load_ps(&a->m[12]);
+	__m128 c[4];
+
+	for (int i = 0; i < 4; ++i) {
+		__m128 bc = _mm_load_ps(&b->m[i * 4]);
+		__m128 s = _mm_mul_ps(a0, MATH_SPLAT(bc, 0));
+		s = _mm_add_ps(s, _mm_mul_ps(a1, MATH_SPLAT(bc, 1)));
+		s = _mm_add_ps(s, _mm_mul_ps(a2, MATH_SPLAT(bc, 2)));
+		c[i] = _mm_add_ps(s, _mm_mul_ps(a3, MATH_SPLAT(bc, 3)));
+	}
+
+	for (int i = 0; i < 4; ++i)
+		_mm_store_ps(&r->m[i * 4], c[i]);
+#else
+	float c[16];
+
+	for (int col = 0; col < 4; ++col) {
+		for (int row = 0; row < 4; ++row) {
+			c[col * 4 + row] = (a->m[row] * b->m[col * 4]) +
+							   (a->m[4 + row] * b->m[col * 4 + 1]) +
+							   (a->m[8 + row] * b->m[col * 4 + 2]) +
+							   (a->m[12 + row] * b->m[col * 4 + 3]);
+		}
+	}
+
+	memcpy(r->m, c, sizeof(c));
+#endif
+}
+
+
+/**
+ *	@brief r = a transposed, r may be a.
+ */
+static inline void mat4_transpose(struct mat4* r, const struct mat4* a) {
+#ifdef MATH_SIMD
+	__m128 c0 = _mm_load_ps(&a->m[0]);
+	__m128 c1 = _mm_load_ps(&a->m[4]);
+	__m128 c2 = _mm_load_ps(&a->m[8]);
+	__m128 c3 = _mm_load_ps(&a->m[12]);
+
+	_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+
+	_mm_store_ps(&r->m[0], c0);
+	_mm_store_ps(&r->m[4], c1);
+	_mm_store_ps(&r->m[8], c2);
+	_mm_store_ps(&r->m[12], c3);
+#else
+	float t[16];
+
+	for (int col = 0; col < 4; ++col) {
+		for (int row = 0; row < 4; ++row)
+			t[row * 4 + col] = a->m[col * 4 + row];
+	}
+
+	memcpy(r->m, t, sizeof(t));
+#endif
+}
+
+
+/**
+ *	@brief r = m * v.
+ */
+static inline void mat4_transform(struct vec4* r, const struct mat4* m, const struct vec4* v) {
+#ifdef MATH_SIMD
+	__m128 x = _mm_load_ps(v->v);
+	__m128 s = _mm_mul_ps(_mm_load_ps(&m->m[0]), MATH_SPLAT(x, 0));
+	s = _mm_add_ps(s, _mm_mul_ps(_mm_load_ps(&m->m[4]), MATH_SPLAT(x, 1)));
+	s = _mm_add_ps(s, _mm_mul_ps(_mm_load_ps(&m->m[8]), MATH_SPLAT(x, 2)));
+	_mm_store_ps(r->v, _mm_add_ps(s, _mm_mul_ps(_mm_load_ps(&m->m[12]), MATH_SPLAT(x, 3))));
+#else
+	float t[4];
+
+	for (int row = 0; row < 4; ++row) {
+		t[row] = (m->m[row] * v->v[0]) + (m->m[4 + row] * v->v[1]) +
+				 (m->m[8 + row] * v->v[2]) + (m->m[12 + row] * v->v[3]);
+	}
+
+	memcpy(r->v, t, sizeof(t));
+#endif
+}
+
+
+#ifdef MATH_SIMD
+/* 2x2 matrices as (m00, m01, m10, m11), a * b, adj(a) * b and a * adj(b) */
+static inline __m128 mat2_mul(__m128 a, __m128 b) {
+	return _mm_add_ps(_mm_mul_ps(a, MATH_SHUFFLE(b, b, 0, 3, 0, 3)),
+					  _mm_mul_ps(MATH_SHUFFLE(a, a, 1, 0, 3, 2), MATH_SHUFFLE(b, b, 2, 1, 2, 1)));
+}
+
+static inline __m128 mat2_adj_mul(__m128 a, __m128 b) {
+	return _mm_sub_ps(_mm_mul_ps(MATH_SHUFFLE(a, a, 3, 3, 0, 0), b),
+					  _mm_mul_ps(MATH_SHUFFLE(a, a, 1, 1, 2, 2), MATH_SHUFFLE(b, b, 2, 3, 0, 1)));
+}
+
+static inline __m128 mat2_mul_adj(__m128 a, __m128 b) {
+	return _mm_sub_ps(_mm_mul_ps(a, MATH_SHUFFLE(b, b, 3, 0, 3, 0)),
+					  _mm_mul_ps(MATH_SHUFFLE(a, a, 1, 0, 3, 2), MATH_SHUFFLE(b, b, 2, 1, 2, 1)));
+}
+#endif
+
+
+/**
+ *	@brief r = a inverted, r may be a.
+ *	@return 1 on success, 0 if a can not be inverted and r is left alone
+ *
+ *	The SSE version splits a into 2x2 blocks and inverts it from
+ *	those, the plain one expands by cofactors, so the last bits of
+ *	the two can differ.
+ */
+static inline int mat4_inverse(struct mat4* r, const struct mat4* a) {
+#ifdef MATH_SIMD
+	__m128 c0 = _mm_load_ps(&a->m[0]);
+	__m128 c1 = _mm_load_ps(&a->m[4]);
+	__m128 c2 = _mm_load_ps(&a->m[8]);
+	__m128 c3 = _mm_load_ps(&a->m[12]);
+
+	/* the blocks of the transpose, whose inverse is the transpose of the one wanted */
+	__m128 A = _mm_movelh_ps(c0, c1);
+	__m128 B = _mm_movehl_ps(c1, c0);
+	__m128 C = _mm_movelh_ps(c2, c3);
+	__m128 D = _mm_movehl_ps(c3, c2);
+
+	/* |A| |B| |C| |D| */
+	__m128 det_sub = _mm_sub_ps(_mm_mul_ps(MATH_SHUFFLE(c0, c2, 0, 2, 0, 2), MATH_SHUFFLE(c1, c3, 1, 3, 1, 3)),
+								_mm_mul_ps(MATH_SHUFFLE(c0, c2, 1, 3, 1, 3), MATH_SHUFFLE(c1, c3, 0, 2, 0, 2)));
+	__m128 det_a = MATH_SPLAT(det_sub, 0);
+	__m128 det_b = MATH_SPLAT(det_sub, 1);
+	__m128 det_c = MATH_SPLAT(det_sub, 2);
+	__m128 det_d = MATH_SPLAT(det_sub, 3);
+
+	__m128 d_c = mat2_adj_mul(D, C);
+	__m128 a_b = mat2_adj_mul(A, B);
+
+	__m128 x = _mm_sub_ps(_mm_mul_ps(det_d, A), mat2_mul(B, d_c));
+	__m128 w = _mm_sub_ps(_mm_mul_ps(det_a, D), mat2_mul(C, a_b));
+	__m128 y = _mm_sub_ps(_mm_mul_ps(det_b, C), mat2_mul_adj(D, a_b));
+	__m128 z = _mm_sub_ps(_mm_mul_ps(det_c, B), mat2_mul_adj(A, d_c));
+
+	/* |M| = |A| |D| + |B| |C| - tr(adj(A) B adj(D) C) */
+	__m128 tr = _mm_mul_ps(a_b, MATH_SHUFFLE(d_c, d_c, 0, 2, 1, 3));
+	tr = _mm_add_ps(tr, MATH_SHUFFLE(tr, tr, 2, 3, 0, 1));
+	tr = _mm_add_ps(tr, MATH_SHUFFLE(tr, tr, 1, 0, 3, 2));
+	__m128 det = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(det_a, det_d), _mm_mul_ps(det_b, det_c)), tr);
+
+	if (_mm_cvtss_f32(det) == 0.0f)
+		return 0;
+
+	__m128 rdet = _mm_div_ps(_mm_setr_ps(1.0f, -1.0f, -1.0f, 1.0f), det);
+	x = _mm_mul_ps(x, rdet);
+	y = _mm_mul_ps(y, rdet);
+	z = _mm_mul_ps(z, rdet);
+	w = _mm_mul_ps(w, rdet);
+
+	/* the adjugates of the blocks put back together */
+	_mm_store_ps(&r->m[0], MATH_SHUFFLE(x, y, 3, 1, 3, 1));
+	_mm_store_ps(&r->m[4], MATH_SHUFFLE(x, y, 2, 0, 2, 0));
+	_mm_store_ps(&r->m[8], MATH_SHUFFLE(z, w, 3, 1, 3, 1));
+	_mm_store_ps(&r->m[12], MATH_SHUFFLE(z, w, 2, 0, 2, 0));
+
+	return 1;
+#else
+	const float* m = a->m;
+	float inv[16];
+	float det;
+
+	inv[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15] + m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+	inv[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15] - m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+	inv[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15] + m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+	inv[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14] - m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+	inv[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15] - m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+	inv[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15] + m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+	inv[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15] - m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+	inv[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14] + m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+	inv[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15] + m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+	inv[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15] - m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+	inv[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15] + m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+	inv[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14] - m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+	inv[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11] - m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+	inv[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11] + m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+	inv[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11] - m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+	inv[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10] + m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+
+	det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
+	if (det == 0.0f)
+		return 0;
+
+	det = 1.0f / det;
+	for (int i = 0; i < 16; ++i)
+		r->m[i] = inv[i] * det;
+
+	return 1;
+#endif
+}
+
+
+/*
+ *	vec3x4 and vec3x8
+ *
+ *	The soa_ functions do n lanes of x, y and z laid out one after
+ *	the other, n being 4 or 8.
+ */
+
+static inline void soa_load(float* r, const float* points, int n) {
+	for (int i = 0; i < n; ++i) {
+		r[i] = points[i * 3 + 0];
+		r[n + i] = points[i * 3 + 1];
+		r[n * 2 + i] = points[i * 3 + 2];
+	}
+}
+
+
+static inline void soa_store(const float* a, float* points, int n) {
+	for (int i = 0; i < n; ++i) {
+		points[i * 3 + 0] = a[i];
+		points[i * 3 + 1] = a[n + i];
+		points[i * 3 + 2] = a[n * 2 + i];
+	}
+}
+
+
+/**
+ *	@brief r = a + b * s, for all 3 * n floats.
+ */
+static inline void soa_madd(float* r, const float* a, const float* b, float s, int n) {
+	int i = 0;
+
+#ifdef MATH_SIMD
+	__m128 s4 = _mm_set1_ps(s);
+
+	for (; i < (n * 3); i += 4)
+		_mm_store_ps(&r[i], _mm_add_ps(_mm_load_ps(&a[i]), _mm_mul_ps(_mm_load_ps(&b[i]), s4)));
+#endif
+
+	for (; i < (n * 3); ++i)
+		r[i] = a[i] + b[i] * s;
+}
+
+
+/**
+ *	@brief out = dot(a, b), one each lane.
+ */
+static inline void soa_dot(const float* a, const float* b, float* out, int n) {
+	int i = 0;
+
+#ifdef MATH_AVX
+	for (; (i + 8) <= n; i += 8) {
+		__m256 s = _mm256_mul_ps(_mm256_load_ps(&a[i]), _mm256_load_ps(&b[i]));
+		s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_load_ps(&a[n + i]), _mm256_load_ps(&b[n + i])));
+		_mm256_storeu_ps(&out[i], _mm256_add_ps(s, _mm256_mul_ps(_mm256_load_ps(&a[n * 2 + i]), _mm256_load_ps(&b[n * 2 + i]))));
+	}
+#endif
+#ifdef MATH_SIMD
+	for (; (i + 4) <= n; i += 4) {
+		__m128 s = _mm_mul_ps(_mm_load_ps(&a[i]), _mm_load_ps(&b[i]));
+		s = _mm_add_ps(s, _mm_mul_ps(_mm_load_ps(&a[n + i]), _mm_load_ps(&b[n + i])));
+		_mm_storeu_ps(&out[i], _mm_add_ps(s, _mm_mul_ps(_mm_load_ps(&a[n * 2 + i]), _mm_load_ps(&b[n * 2 + i]))));
+	}
+#endif
+
+	for (; i < n; ++i)
+		out[i] = (a[i] * b[i]) + (a[n + i] * b[n + i]) + (a[n * 2 + i] * b[n * 2 + i]);
+}
+
+
+/**
+ *	@brief Distances of n points from a plane, and a bit set for each one behind it.
+ */
+static inline int soa_plane(const float* a, const struct vec4* plane, float* out, int n) {
+	const float* p = plane->v;
+	int behind = 0;
+	int i = 0;
+
+#ifdef MATH_AVX
+	__m256 px8 = _mm256_set1_ps(p[0]), py8 = _mm256_set1_ps(p[1]);
+	__m256 pz8 = _mm256_set1_ps(p[2]), pd8 = _mm256_set1_ps(p[3]);
+
+	for (; (i + 8) <= n; i += 8) {
+		__m256 s = _mm256_mul_ps(_mm256_load_ps(&a[i]), px8);
+		s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_load_ps(&a[n + i]), py8));
+		s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_load_ps(&a[n * 2 + i]), pz8));
+		s = _mm256_add_ps(s, pd8);
+		_mm256_storeu_ps(&out[i], s);
+		behind |= (_mm256_movemask_ps(_mm256_cmp_ps(s, _mm256_setzero_ps(), _CMP_LT_OQ)) << i);
+	}
+#endif
+#ifdef MATH_SIMD
+	__m128 px = _mm_set1_ps(p[0]), py = _mm_set1_ps(p[1]);
+	__m128 pz = _mm_set1_ps(p[2]), pd = _mm_set1_ps(p[3]);
+
+	for (; (i + 4) <= n; i += 4) {
+		__m128 s = _mm_mul_ps(_mm_load_ps(&a[i]), px);
+		s = _mm_add_ps(s, _mm_mul_ps(_mm_load_ps(&a[n + i]), py));
+		s = _mm_add_ps(s, _mm_mul_ps(_mm_load_ps(&a[n * 2 + i]), pz));
+		s = _mm_add_ps(s, pd);
+		_mm_storeu_ps(&out[i], s);
+		behind |= (_mm_movemask_ps(_mm_cmplt_ps(s, _mm_setzero_ps())) << i);
+	}
+#endif
+
+	for (; i < n; ++i) {
+		out[i] = (a[i] * p[0]) + (a[n + i] * p[1]) + (a[n * 2 + i] * p[2]) + p[3];
+		if (out[i] < 0.0f)
+			behind |= (1 << i);
+	}
+
+	return behind;
+}
+
+
+/** @brief 4 points packed xyz into lanes. */
+static inline void vec3x4_load(struct vec3x4* r, const float* points) { soa_load(r->x, points, 4); }
+
+/** @brief Lanes back out to 4 packed points. */
+static inline void vec3x4_store(const struct vec3x4* a, float* points) { soa_store(a->x, points, 4); }
+
+/** @brief r = a + b * s. */
+static inline void vec3x4_madd(struct vec3x4* r, const struct vec3x4* a, const struct vec3x4* b, float s) { soa_madd(r->x, a->x, b->x, s, 4); }
+
+/** @brief Dot products of the points of a and b, into out[4]. */
+static inline void vec3x4_dot(const struct vec3x4* a, const struct vec3x4* b, float* out) { soa_dot(a->x, b->x, out, 4); }
+
+/**
+ *	@brief Distances of 4 points from a plane (a, b, c, d), into out[4].
+ *	@return Bit i set if point i is behind the plane
+ */
+static inline int vec3x4_plane(const struct vec3x4* p, const struct vec4* plane, float* out) { return soa_plane(p->x, plane, out, 4); }
+
+/** @brief 8 points packed xyz into lanes. */
+static inline void vec3x8_load(struct vec3x8* r, const float* points) { soa_load(r->x, points, 8); }
+
+/** @brief Lanes back out to 8 packed points. */
+static inline void vec3x8_store(const struct vec3x8* a, float* points) { soa_store(a->x, points, 8); }
+
+/** @brief r = a + b * s. */
+static inline void vec3x8_madd(struct vec3x8* r, const struct vec3x8* a, const struct vec3x8* b, float s) { soa_madd(r->x, a->x, b->x, s, 8); }
+
+/** @brief Dot products of the points of a and b, into out[8]. */
+static inline void vec3x8_dot(const struct vec3x8* a, const struct vec3x8* b, float* out) { soa_dot(a->x, b->x, out, 8); }
+
+/**
+ *	@brief Distances of 8 points from a plane (a, b, c, d), into out[8].
+ *	@return Bit i set if point i is behind the plane
+ */
+static inline int vec3x8_plane(const struct vec3x8* p, const struct vec4* plane, float* out) { return soa_plane(p->x, plane, out, 8); }
+
+#endif // SIMD_H_INCLUDED
@@ -1,27 +1,45 @@
 #ifndef VECTOR_H_INCLUDED
 #define VECTOR_H_INCLUDED
 
+#include <math.h>
+
 class vector3 {
 	public:
-		vector3();
-		vector3(float x, float y, float z);
+		vector3() : x(0), y(0), z(0) { }
+		vector3(float x, float y, float z) : x(x), y(y), z(z) { }
+
+		void set(float x, float y, float z) {
+			this->x = x;
+			this->y = y;
+			this->z = z;
+		}
+
+		void normalize() {
+			float s = sqrtf(x*x + y*y + z*z);
+			x /= s;
+			y /= s;
+			z /= s;
+		}
 
-		void set(float x, float y, float z);
+		float dot(const vector3* b) const {
+			return ((x * b->x) + (y * b->y) + (z * b->z));
+		}
 
-		void normalize();
-		float dot(vector3* b);
-		vector3 cross(vector3* b);
+		vector3 cross(const vector3* b) const {
+			return vector3(((y * b->z) - (b->y * z)),
+						   ((-x * b->z) + (z * b->x)),
+						   ((x * b->y) - (y * b->x)));
+		}
 
-		vector3 operator+(vector3& b);
-		vector3 operator-(vector3& b);
-		vector3 operator*(vector3& b);
-		vector3 operator/(vector3& b);
+		vector3 operator+(const vector3& b) const	{ return vector3(x+b.x, y+b.y, z+b.z); }
+		vector3 operator-(const vector3& b) const	{ return vector3(x-b.x, y-b.y, z-b.z); }
+		vector3 operator*(const vector3& b) const	{ return vector3(x*b.x, y*b.y, z*b.z); }
+		vector3 operator/(const vector3& b) const	{ return vector3(x/b.x, y/b.y, z/b.z); }
 
-		void operator=(vector3& b);
-		void operator+=(vector3& b);
-		void operator-=(vector3& b);
-		void operator*=(vector3& b);
-		void operator/=(vector3& b);
+		void operator+=(const vector3& b)	{ x += b.x; y += b.y; z += b.z; }
+		void operator-=(const vector3& b)	{ x -= b.x; y -= b.y; z -= b.z; }
+		void operator*=(const vector3& b)	{ x *= b.x; y *= b.y; z *= b.z; }
+		void operator/=(const vector3& b)	{ x /= b.x; y /= b.y; z /= b.z; }
 
 		float x, y, z;
 };
@@ -3,10 +3,12 @@
 
 #include "math/mat.h"
 #include "math/vector.h"
+#include "math/simd.h"
 
 #define R_CAMERA_DEFAULT_FOV			50.0f
 #define R_CAMERA_DEFAULT_ZNEAR			0.1f
 #define R_CAMERA_DEFAULT_ZFAR			1500.0f
+#define R_CAMERA_DEFAULT_ASPECT			(4.0f / 3.0f)
 
 class RCamera {
 	friend class RRender;
@@ -16,6 +18,7 @@ class RCamera {
 		~RCamera();
 
 		void set_viewable_area(float Fov, float zNear, float zFar);
+		void set_aspect(float aspect);
 
 		void toggle_third_person(int enabled, float radius = 1);
 
@@ -24,6 +27,7 @@ class RCamera {
 
 		void get_position(vector3* vec);
 		void get_direction(vector3* vec);
+		void get_rotation(float* theta, float* psi);
 
 		void move(float x, float y, float z, float factor);
 		void move_forward(float factor);
@@ -37,17 +41,24 @@ class RCamera {
 		void rotate_hor_abs(float angle);
 
 		void update();
+		void update_view();
 
-		int is_point_visable(float x, float y, float z);
-		int is_box_visable(float x1, float y1, float z1, float x2, float y2, float z2);
+		const float* get_projection() const;
+		const float* get_view() const;
+		const struct vec4* get_frustum() const;
+
+		int is_point_visable(float x, float y, float z) const;
+		int is_box_visable(float x1, float y1, float z1, float x2, float y2, float z2) const;
 
 	private:
 		void update_direction();
+		void update_projection();
 		void update_frustum();
 
 		float fov;				/* field of view	*/
 		float znear;			/* near clipping	*/
 		float zfar;				/* far clipping		*/
+		float aspect;			/* width / height	*/
 
 		int third_person;
 		float third_person_radius;
@@ -59,7 +70,9 @@ class RCamera {
 		float psi_rot;			/* up/down			*/
 		float theta_rot;		/* left/right		*/
 
-		float frustum[6][4];	/* frustum clipping planes */
+		struct mat4 projection;
+		struct mat4 view;
+		struct vec4 frustum[6];	/* frustum clipping planes, inside is positive */
 };
 
 #endif // CAMERA_H_INCLUDED
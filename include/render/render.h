@@ -4,8 +4,11 @@
 #include <SDL/SDL.h>
 
 #include "definitions.h"
+#include "gl.h"
 #include "render/camera.h"
 #include "engine/map.h"
+#include "engine/simulation.h"
+#include "engine/entity_links.h"
 
 /**
  *	@file render.h
@@ -14,6 +17,10 @@
 
 #define DEFAULT_MAX_FPS			100
 
+/* detail of the spheres balls are drawn with */
+#define R_BALL_SLICES			12
+#define R_BALL_STACKS			8
+
 /**
  *	@class RRender
  *	@brief Rendering class.
@@ -27,6 +34,8 @@ class RRender {
 		int init(RCamera* cam);
 		void set_camera(RCamera* cam);
 		void set_map(EMap* m);
+		void set_simulation(ESimulation* sim);
+		void set_ball_links(EEntityLinks* links);
 		void set_max_fps(unsigned int max);
 
 		void resize_window(int new_width, int new_height);
@@ -34,11 +43,17 @@ class RRender {
 		void render();
 
 	private:
+		void render_balls(const struct sim_snapshot_t* snap, float alpha);
+
 		inline float calculate_framerate();
 		inline int fps_can_render();
 
 		RCamera* camera;
 		EMap* map;
+		ESimulation* simulation;			/* moves the camera, or NULL */
+		GLuint ball_list;					/* display list of a ball, 0 until drawn */
+		EEntityLinks* ball_links;			/* where the balls are drawn, or NULL to draw them all */
+		int num_linked_balls;
 
 		int width;
 		int height;
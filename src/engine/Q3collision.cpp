@@ -0,0 +1,1510 @@
+/**
+ *	@file Q3collision.cpp
+ *	@brief Trace rays, spheres and boxes through a Quake3 BSP map.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "definitions.h"
+#include "math/mat.h"
+#include "engine/collision.h"
+#include "engine/Q3map.h"
+
+
+/**
+ *	@struct trace_work_t
+ *	@brief A trace in progress.
+ */
+struct trace_work_t {
+	int type;					/* TRACE_* */
+	int mask;					/* contents that stop the trace */
+
+	float start[3];				/* box traces are moved so the box is centred on them */
+	float end[3];
+
+	float radius;				/* of a sphere */
+	float extents[3];			/* half size of a box */
+	float offsets[8][3];		/* box corner nearest each plane, by sign bits of the normal */
+
+	float mins[3];				/* around everything the shape passes through */
+	float maxs[3];
+
+	struct trace_t* trace;
+	struct trace_scratch_t* scratch;
+};
+
+
+/**
+ *	@struct clip_t
+ *	@brief Where a trace crosses a convex set of planes.
+ */
+struct clip_t {
+	float enter_frac;
+	float leave_frac;
+	const struct q3bsp_plane_t* plane;	/* the trace enters through, NULL if it starts inside */
+	int start_out;
+	int get_out;
+};
+
+
+/**
+ *	@brief Prepare per-thread trace state.
+ *	@param scratch		The state
+ *	@param num_brushes	Brushes in the map it will be used with
+ *	@param num_patches	Patches in the map
+ *	@return 1 on success, 0 if out of memory
+ */
+int trace_scratch_init(struct trace_scratch_t* scratch, int num_brushes, int num_patches) {
+	scratch->checkcount = 0;
+	scratch->num_brushes = num_brushes;
+	scratch->num_patches = num_patches;
+	scratch->brush_stamps = (int*)calloc(num_brushes + 1, sizeof(int));
+	scratch->patch_stamps = (int*)calloc(num_patches + 1, sizeof(int));
+
+	if (!scratch->brush_stamps || !scratch->patch_stamps) {
+		ERROR("Collision: Out of memory for %i brushes and %i patches.", num_brushes, num_patches);
+		trace_scratch_free(scratch);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+void trace_scratch_free(struct trace_scratch_t* scratch) {
+	free(scratch->brush_stamps);
+	free(scratch->patch_stamps);
+	scratch->brush_stamps = NULL;
+	scratch->patch_stamps = NULL;
+	scratch->num_brushes = 0;
+	scratch->num_patches = 0;
+}
+
+
+/**
+ *	@brief Check the brushes and work out their contents.
+ *	@return 1 on success, 0 if a brush or leaf refers to something that is not there
+ *
+ *	Traces index straight through leafs, brushes and sides, so
+ *	everything they follow is checked once here.  The contents of
+ *	each leaf's brushes are gathered for point_contents().
+ */
+int EQ3MapData::build_brushes() {
+	int i, j;
+
+	for (i = 0; i < num_leafs; ++i) {
+		const struct q3bsp_leaf_t* leaf = &leafs[i];
+
+		if ((leaf->leafbrush < 0) || (leaf->num_leafbrushes < 0) ||
+			(leaf->leafbrush + leaf->num_leafbrushes > num_leafbrushes)) {
+			ERROR("Q3Map: Leaf %i has brushes past the end of the leafbrushes lump.", i);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < num_leafbrushes; ++i) {
+		if ((leafbrushes[i].brush < 0) || (leafbrushes[i].brush >= num_brushes)) {
+			ERROR("Q3Map: Leaf brush %i has a bad brush.", i);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < num_brushes; ++i) {
+		const struct q3bsp_brush_t* brush = &brushes[i];
+
+		if ((brush->brushside < 0) || (brush->num_brushsides < 0) ||
+			(brush->brushside + brush->num_brushsides > num_brushsides) ||
+			(brush->texture < 0) || (brush->texture >= num_textures)) {
+			ERROR("Q3Map: Brush %i has bad sides or a bad texture.", i);
+			return 0;
+		}
+
+		for (j = 0; j < brush->num_brushsides; ++j) {
+			int plane = brushsides[brush->brushside + j].plane;
+
+			if ((plane < 0) || (plane >= num_planes)) {
+				ERROR("Q3Map: Brush %i has a bad plane.", i);
+				return 0;
+			}
+		}
+
+		brush_contents[i] = textures[brush->texture].contents;
+	}
+
+	/* what a point in each leaf could be in, most leafs are empty */
+	for (i = 0; i < num_leafs; ++i) {
+		const struct q3bsp_leaf_t* leaf = &leafs[i];
+
+		leaf_contents[i] = 0;
+		for (j = 0; j < leaf->num_leafbrushes; ++j)
+			leaf_contents[i] |= brush_contents[leafbrushes[leaf->leafbrush + j].brush];
+	}
+
+	return 1;
+}
+
+
+/**
+ *	@brief Rows or columns of facets to cut each piece of a patch into.
+ *	@param cp		Control points of the patch
+ *	@param width	Control points across
+ *	@param height	Control points down
+ *	@param across	1 for across, 0 for down
+ *
+ *	A quadratic curve strays at most a quarter of |a - 2b + c| from
+ *	the line between its ends, and cutting it into n straight pieces
+ *	brings that down by n squared.  The piece that strays most sets
+ *	the number for the whole patch.
+ */
+static int patch_subdivisions(const struct q3bsp_vertex_t* cp, int width, int height, int across) {
+	float worst = 0.0f;
+	int rows = (across ? height : width);
+	int pieces = ((across ? width : height) - 1) / 2;
+	int r, i, k, n;
+
+	for (r = 0; r < rows; ++r) {
+		for (i = 0; i < pieces; ++i) {
+			const float *a, *b, *c;
+			float dev = 0.0f;
+
+			if (across) {
+				a = cp[r * width + i * 2].position;
+				b = cp[r * width + i * 2 + 1].position;
+				c = cp[r * width + i * 2 + 2].position;
+			} else {
+				a = cp[(i * 2) * width + r].position;
+				b = cp[(i * 2 + 1) * width + r].position;
+				c = cp[(i * 2 + 2) * width + r].position;
+			}
+
+			for (k = 0; k < 3; ++k) {
+				float d = a[k] - 2.0f * b[k] + c[k];
+				dev += d * d;
+			}
+
+			dev = sqrtf(dev) * 0.25f;
+			if (dev > worst)
+				worst = dev;
+		}
+	}
+
+	n = (int)ceilf(sqrtf(worst / Q3_PATCH_COLLISION_TOLERANCE));
+	RANGE_BOUND(n, 1, Q3_PATCH_MAX_SUBDIVISIONS);
+	return n;
+}
+
+
+/**
+ *	@brief Point on a patch.
+ *	@param u	Facet column, 0 to pieces across * sub_u
+ *	@param v	Facet row
+ */
+static void patch_point(const struct q3bsp_vertex_t* cp, int width, int height, int sub_u, int sub_v,
+						int u, int v, float* out) {
+	int pu = u / sub_u, pv = v / sub_v;
+	float s, t, wu[3], wv[3];
+	int i, j, k;
+
+	/* the last row and column end the last piece rather than start another */
+	if (pu == (width - 1) / 2)
+		--pu;
+	if (pv == (height - 1) / 2)
+		--pv;
+
+	s = (u - pu * sub_u) / (float)sub_u;
+	t = (v - pv * sub_v) / (float)sub_v;
+
+	wu[0] = (1.0f - s) * (1.0f - s);
+	wu[1] = 2.0f * s * (1.0f - s);
+	wu[2] = s * s;
+	wv[0] = (1.0f - t) * (1.0f - t);
+	wv[1] = 2.0f * t * (1.0f - t);
+	wv[2] = t * t;
+
+	out[0] = out[1] = out[2] = 0.0f;
+	for (j = 0; j < 3; ++j) {
+		for (i = 0; i < 3; ++i) {
+			const float* p = cp[(pv * 2 + j) * width + pu * 2 + i].position;
+			float w = wu[i] * wv[j];
+
+			for (k = 0; k < 3; ++k)
+				out[k] += p[k] * w;
+		}
+	}
+}
+
+
+/**
+ *	@brief Normal of a triangle, turned to agree with the way a patch faces.
+ *	@return Twice the triangle's area
+ */
+static float facet_normal(const float* a, const float* b, const float* c, const float* facing, float* n) {
+	float e1[3], e2[3], len;
+	int k;
+
+	for (k = 0; k < 3; ++k) {
+		e1[k] = b[k] - a[k];
+		e2[k] = c[k] - a[k];
+	}
+
+	n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+
+	len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+	if (len < 0.01f)
+		return 0.0f;
+
+	if (n[0] * facing[0] + n[1] * facing[1] + n[2] * facing[2] < 0.0f)
+		len = -len;
+
+	for (k = 0; k < 3; ++k)
+		n[k] /= len;
+
+	return fabsf(len);
+}
+
+
+/**
+ *	@brief Make the planes of a facet from a triangle.
+ *	@param planes	Q3_FACET_PLANES planes to fill in
+ *	@param corners	The triangle
+ *	@param normals	Normal of the patch at each corner
+ *	@param facing	The way the patch faces, the surface plane is turned to agree
+ *	@return 1 on success, 0 if the triangle has no area
+ *
+ *	Edge planes lean with the patch's normals at the ends of the
+ *	edge rather than stand up from the facet, so the facets either
+ *	side of an edge share the plane and leave no gap at a crease.
+ */
+static int make_facet(struct q3bsp_plane_t* planes, const float* const* corners, const float* const* normals,
+					  const float* facing) {
+	const float* a = corners[0];
+	float n[3], len;
+	int i, k;
+
+	if (!facet_normal(corners[0], corners[1], corners[2], facing, n))
+		return 0;
+
+	/* the surface, and a plane a little behind it facing back */
+	for (k = 0; k < 3; ++k) {
+		planes[0].normal[k] = n[k];
+		planes[1].normal[k] = -n[k];
+	}
+	planes[0].dist = n[0] * a[0] + n[1] * a[1] + n[2] * a[2];
+	planes[1].dist = Q3_PATCH_FACET_THICKNESS - planes[0].dist;
+
+	/* one up from each edge, facing away from the corner across from it */
+	for (i = 0; i < 3; ++i) {
+		const float* p = corners[i];
+		const float* q = corners[(i + 1) % 3];
+		const float* r = corners[(i + 2) % 3];
+		struct q3bsp_plane_t* plane = &planes[2 + i];
+		float e[3], en[3], m[3];
+
+		for (k = 0; k < 3; ++k) {
+			e[k] = q[k] - p[k];
+			m[k] = normals[i][k] + normals[(i + 1) % 3][k];
+		}
+
+		en[0] = e[1] * m[2] - e[2] * m[1];
+		en[1] = e[2] * m[0] - e[0] * m[2];
+		en[2] = e[0] * m[1] - e[1] * m[0];
+
+		len = sqrtf(en[0] * en[0] + en[1] * en[1] + en[2] * en[2]);
+		if (len < 0.001f)
+			return 0;
+
+		if (en[0] * (r[0] - p[0]) + en[1] * (r[1] - p[1]) + en[2] * (r[2] - p[2]) > 0.0f)
+			len = -len;
+
+		for (k = 0; k < 3; ++k)
+			plane->normal[k] = en[k] / len;
+		plane->dist = plane->normal[0] * p[0] + plane->normal[1] * p[1] + plane->normal[2] * p[2];
+	}
+
+	/* the box around the triangle and the slab behind it */
+	for (k = 0; k < 3; ++k) {
+		struct q3bsp_plane_t* pos = &planes[5 + k * 2];
+		struct q3bsp_plane_t* neg = &planes[6 + k * 2];
+		float lo = a[k], hi = a[k];
+
+		for (i = 1; i < 3; ++i) {
+			if (corners[i][k] < lo)
+				lo = corners[i][k];
+			if (corners[i][k] > hi)
+				hi = corners[i][k];
+		}
+
+		/* the back plane reaches out along the normal */
+		if (n[k] > 0.0f)
+			lo -= n[k] * Q3_PATCH_FACET_THICKNESS;
+		else
+			hi -= n[k] * Q3_PATCH_FACET_THICKNESS;
+
+		pos->normal[0] = pos->normal[1] = pos->normal[2] = 0.0f;
+		neg->normal[0] = neg->normal[1] = neg->normal[2] = 0.0f;
+		pos->normal[k] = 1.0f;
+		neg->normal[k] = -1.0f;
+		pos->dist = hi;
+		neg->dist = -lo;
+	}
+
+	return 1;
+}
+
+
+/**
+ *	@brief Check a patch face's control points are all there.
+ */
+static int is_patch_valid(const struct q3bsp_face_t* face, int num_vertexes, int num_textures) {
+	int w = face->size[0], h = face->size[1];
+
+	/* a grid of 3x3 pieces that share their edges */
+	if ((w < 3) || (h < 3) || !(w & 1) || !(h & 1) || (face->num_vertexes != w * h))
+		return 0;
+
+	return ((face->vertex >= 0) && (face->vertex + face->num_vertexes <= num_vertexes) &&
+			(face->texture >= 0) && (face->texture < num_textures));
+}
+
+
+/**
+ *	@brief Tessellate the patches into facets for collision.
+ *	@return 1 on success, 0 if out of memory
+ *
+ *	Runs before lean maps release their vertexes.  Each patch is
+ *	cut finely enough to stay within Q3_PATCH_COLLISION_TOLERANCE
+ *	of its curve and put in every leaf its bounds reach, so traces
+ *	find patches the same way they find brushes.  Patches with bad
+ *	control points are left out.
+ */
+int EQ3MapData::build_patches() {
+	float* grid = NULL;
+	int max_facets = 0, max_points = 0;
+	int i, j, t, u, v, k, total;
+
+	memset(leaf_patch_start, 0, sizeof(int) * (num_leafs + 1));
+
+	/* size everything first, the patches are in the arena already */
+	for (i = 0; i < num_faces; ++i) {
+		const struct q3bsp_face_t* face = &faces[i];
+		int w = face->size[0], h = face->size[1];
+		int sub_u, sub_v, points;
+
+		if (face->type != Q3_FACETYPE_PATCH)
+			continue;
+
+		if (!is_patch_valid(face, num_vertexes, num_textures)) {
+			WARNING("Q3Map: Patch %i has bad control points, it will not collide.", i);
+			continue;
+		}
+
+		sub_u = patch_subdivisions(&vertexes[face->vertex], w, h, 1);
+		sub_v = patch_subdivisions(&vertexes[face->vertex], w, h, 0);
+
+		points = (((w - 1) / 2) * sub_u + 1) * (((h - 1) / 2) * sub_v + 1);
+		if (points > max_points)
+			max_points = points;
+
+		max_facets += ((w - 1) / 2) * sub_u * ((h - 1) / 2) * sub_v * 2;
+		++num_patches;
+	}
+
+	if (!num_patches)
+		return 1;
+
+	facet_planes = (struct q3bsp_plane_t*)malloc(sizeof(struct q3bsp_plane_t) * Q3_FACET_PLANES * max_facets);
+	grid = (float*)malloc(sizeof(float) * 6 * max_points);
+
+	if (!facet_planes || !grid) {
+		ERROR("Q3Map: Out of memory for %i patch facets.", max_facets);
+		free(grid);
+		return 0;
+	}
+
+	num_patches = 0;
+	for (i = 0; i < num_faces; ++i) {
+		const struct q3bsp_face_t* face = &faces[i];
+		const struct q3bsp_vertex_t* cp = &vertexes[face->vertex];
+		struct q3bsp_patch_t* patch = &patches[num_patches];
+		float* normals = grid + max_points * 3;
+		int w = face->size[0], h = face->size[1];
+		int sub_u, sub_v, grid_w, grid_h;
+		float facing[3] = { 0.0f, 0.0f, 0.0f };
+
+		if (face->type != Q3_FACETYPE_PATCH)
+			continue;
+
+		if (!is_patch_valid(face, num_vertexes, num_textures))
+			continue;
+
+		sub_u = patch_subdivisions(cp, w, h, 1);
+		sub_v = patch_subdivisions(cp, w, h, 0);
+		grid_w = ((w - 1) / 2) * sub_u + 1;
+		grid_h = ((h - 1) / 2) * sub_v + 1;
+
+		for (v = 0; v < grid_h; ++v) {
+			for (u = 0; u < grid_w; ++u)
+				patch_point(cp, w, h, sub_u, sub_v, u, v, &grid[(v * grid_w + u) * 3]);
+		}
+
+		/* the way the patch is lit from is its front */
+		for (k = 0; k < w * h; ++k) {
+			facing[0] += cp[k].normal[0];
+			facing[1] += cp[k].normal[1];
+			facing[2] += cp[k].normal[2];
+		}
+
+		/* a normal at each point from the facets around it, weighted by their size */
+		memset(normals, 0, sizeof(float) * 3 * grid_w * grid_h);
+		for (v = 0; v < grid_h - 1; ++v) {
+			for (u = 0; u < grid_w - 1; ++u) {
+				int cell[2][3] = {
+					{ v * grid_w + u, v * grid_w + u + 1, (v + 1) * grid_w + u + 1 },
+					{ v * grid_w + u, (v + 1) * grid_w + u + 1, (v + 1) * grid_w + u }
+				};
+
+				for (t = 0; t < 2; ++t) {
+					float n[3], area;
+
+					area = facet_normal(&grid[cell[t][0] * 3], &grid[cell[t][1] * 3], &grid[cell[t][2] * 3], facing, n);
+					for (j = 0; j < 3; ++j) {
+						for (k = 0; k < 3; ++k)
+							normals[cell[t][j] * 3 + k] += n[k] * area;
+					}
+				}
+			}
+		}
+
+		for (j = 0; j < grid_w * grid_h; ++j) {
+			float* n = &normals[j * 3];
+			float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+			for (k = 0; k < 3; ++k)
+				n[k] = ((len > 0.0f) ? n[k] / len : 0.0f);
+		}
+
+		patch->facet = num_facets;
+		patch->num_facets = 0;
+		patch->contents = textures[face->texture].contents;
+		patch->face = i;
+
+		for (k = 0; k < 3; ++k) {
+			patch->mins[k] = grid[k];
+			patch->maxs[k] = grid[k];
+		}
+
+		for (v = 0; v < grid_h; ++v) {
+			for (u = 0; u < grid_w; ++u) {
+				const float* p = &grid[(v * grid_w + u) * 3];
+
+				for (k = 0; k < 3; ++k) {
+					if (p[k] < patch->mins[k])
+						patch->mins[k] = p[k];
+					if (p[k] > patch->maxs[k])
+						patch->maxs[k] = p[k];
+				}
+			}
+		}
+
+		/* two triangles a cell */
+		for (v = 0; v < grid_h - 1; ++v) {
+			for (u = 0; u < grid_w - 1; ++u) {
+				int p00 = v * grid_w + u, p10 = p00 + 1, p01 = p00 + grid_w, p11 = p01 + 1;
+				const float* tri[2][3] = {
+					{ &grid[p00 * 3], &grid[p10 * 3], &grid[p11 * 3] },
+					{ &grid[p00 * 3], &grid[p11 * 3], &grid[p01 * 3] }
+				};
+				const float* tri_normals[2][3] = {
+					{ &normals[p00 * 3], &normals[p10 * 3], &normals[p11 * 3] },
+					{ &normals[p00 * 3], &normals[p11 * 3], &normals[p01 * 3] }
+				};
+
+				for (t = 0; t < 2; ++t) {
+					if (make_facet(&facet_planes[num_facets * Q3_FACET_PLANES], tri[t], tri_normals[t], facing))
+						++num_facets;
+				}
+			}
+		}
+
+		/* the facets are as thick as the slab behind them */
+		for (k = 0; k < 3; ++k) {
+			patch->mins[k] -= Q3_PATCH_FACET_THICKNESS;
+			patch->maxs[k] += Q3_PATCH_FACET_THICKNESS;
+		}
+
+		patch->num_facets = num_facets - patch->facet;
+		++num_patches;
+	}
+
+	free(grid);
+
+	if (!num_tree_nodes)
+		return 1;
+
+	/* count the patches of each leaf, then fill them in */
+	for (i = 0; i < num_patches; ++i)
+		bucket_patch(0, patches[i].mins, patches[i].maxs, i, 0);
+
+	for (i = 0, total = 0; i <= num_leafs; ++i) {
+		int n = leaf_patch_start[i];
+		leaf_patch_start[i] = total;
+		total += n;
+	}
+
+	leaf_patches = (int*)malloc(sizeof(int) * (total + 1));
+	if (!leaf_patches) {
+		ERROR("Q3Map: Out of memory for leaf patches.");
+		return 0;
+	}
+
+	/* each leaf's start moves up to the next leaf's while filling */
+	for (i = 0; i < num_patches; ++i)
+		bucket_patch(0, patches[i].mins, patches[i].maxs, i, 1);
+
+	for (i = num_leafs; i > 0; --i)
+		leaf_patch_start[i] = leaf_patch_start[i - 1];
+	leaf_patch_start[0] = 0;
+
+	INFO("Q3Map: %i patches cut into %i collision facets in %i leaf slots (%lu KB).", num_patches, num_facets, total,
+		 (unsigned long)((sizeof(struct q3bsp_plane_t) * Q3_FACET_PLANES * max_facets +
+						  sizeof(struct q3bsp_patch_t) * num_patches + sizeof(int) * (total + num_leafs + 2)) / 1024));
+
+	return 1;
+}
+
+
+/**
+ *	@brief Put a patch in each leaf its bounds reach.
+ *	@param node		Tree node, or ~leaf
+ *	@param fill		0 to count the patches of each leaf, 1 to store them
+ */
+void EQ3MapData::bucket_patch(int node, const float* mins, const float* maxs, int patch, int fill) {
+	while (node >= 0) {
+		const struct q3bsp_tree_node_t* n = &tree[node];
+		float front = -n->dist, back = -n->dist;
+		int k;
+
+		/* the corners of the box furthest in front of and behind the plane */
+		for (k = 0; k < 3; ++k) {
+			if (n->normal[k] >= 0.0f) {
+				front += n->normal[k] * maxs[k];
+				back += n->normal[k] * mins[k];
+			} else {
+				front += n->normal[k] * mins[k];
+				back += n->normal[k] * maxs[k];
+			}
+		}
+
+		if (back >= 0.0f) {
+			node = n->children[0];
+		} else if (front < 0.0f) {
+			node = n->children[1];
+		} else {
+			bucket_patch(n->children[0], mins, maxs, patch, fill);
+			node = n->children[1];
+		}
+	}
+
+	if (fill)
+		leaf_patches[leaf_patch_start[~node]++] = patch;
+	else
+		++leaf_patch_start[~node];
+}
+
+
+/**
+ *	@brief Trace a shape through the map.
+ *	@param trace	Where to put the result
+ *	@param type		TRACE_RAY, TRACE_SPHERE or TRACE_BOX
+ *	@param start	Where the shape starts, 3 floats
+ *	@param end		Where it moves to
+ *	@param mins		Box corners relative to start and end, TRACE_BOX only
+ *	@param maxs
+ *	@param radius	Of the sphere, TRACE_SPHERE only
+ *	@param mask		Contents that stop the shape, CONTENTS_* or MASK_*
+ *	@param scratch	Trace state of the calling thread
+ *
+ *	The shape moves until it touches a brush with any of the mask
+ *	contents, stopping SURFACE_CLIP_EPSILON short.  Traces only read
+ *	the map, so any number can run at once with a scratch each.
+ */
+void EQ3Map::trace(struct trace_t* trace, int type, const float* start, const float* end,
+				   const float* mins, const float* maxs, float radius, int mask,
+				   struct trace_scratch_t* scratch) const {
+	struct trace_work_t tw;
+	int i, j;
+
+	trace->fraction = 1.0f;
+	trace->normal[0] = trace->normal[1] = trace->normal[2] = 0.0f;
+	trace->dist = 0.0f;
+	trace->contents = 0;
+	trace->brush = -1;
+	trace->patch = -1;
+	trace->start_solid = 0;
+	trace->all_solid = 0;
+
+	tw.type = type;
+	tw.mask = mask;
+	tw.radius = ((type == TRACE_SPHERE) ? radius : 0.0f);
+	tw.trace = trace;
+	tw.scratch = scratch;
+
+	/* a box is traced from its centre, so it is the same size each side */
+	for (i = 0; i < 3; ++i) {
+		float centre = ((type == TRACE_BOX) ? (mins[i] + maxs[i]) * 0.5f : 0.0f);
+
+		tw.start[i] = start[i] + centre;
+		tw.end[i] = end[i] + centre;
+		tw.extents[i] = ((type == TRACE_BOX) ? (maxs[i] - mins[i]) * 0.5f : 0.0f);
+
+		tw.mins[i] = ((tw.start[i] < tw.end[i]) ? tw.start[i] : tw.end[i]) - tw.extents[i] - tw.radius - 1.0f;
+		tw.maxs[i] = ((tw.start[i] > tw.end[i]) ? tw.start[i] : tw.end[i]) + tw.extents[i] + tw.radius + 1.0f;
+	}
+
+	/* planes with a negative normal component meet the box's far side on that axis */
+	for (i = 0; i < 8; ++i) {
+		for (j = 0; j < 3; ++j)
+			tw.offsets[i][j] = ((i & (1 << j)) ? tw.extents[j] : -tw.extents[j]);
+	}
+
+	if (data && data->num_tree_nodes) {
+		/* a new number means no brush has been tested by this trace */
+		if (++scratch->checkcount <= 0) {
+			memset(scratch->brush_stamps, 0, sizeof(int) * scratch->num_brushes);
+			memset(scratch->patch_stamps, 0, sizeof(int) * scratch->num_patches);
+			scratch->checkcount = 1;
+		}
+
+		trace_through_tree(&tw, 0, 0.0f, 1.0f, tw.start, tw.end);
+	}
+
+	trace->end.x = start[0] + trace->fraction * (end[0] - start[0]);
+	trace->end.y = start[1] + trace->fraction * (end[1] - start[1]);
+	trace->end.z = start[2] + trace->fraction * (end[2] - start[2]);
+}
+
+
+/**
+ *	@brief Trace a point.
+ */
+void EQ3Map::trace_ray(struct trace_t* trace, const vector3* start, const vector3* end, int mask) {
+	float s[3] = { start->x, start->y, start->z };
+	float e[3] = { end->x, end->y, end->z };
+
+	this->trace(trace, TRACE_RAY, s, e, NULL, NULL, 0.0f, mask, &scratch);
+}
+
+
+/**
+ *	@brief Trace a sphere.
+ *
+ *	Brushes are grown by the radius, so the sphere is treated as
+ *	slightly bigger along their edges.
+ */
+void EQ3Map::trace_sphere(struct trace_t* trace, const vector3* start, const vector3* end, float radius, int mask) {
+	float s[3] = { start->x, start->y, start->z };
+	float e[3] = { end->x, end->y, end->z };
+
+	this->trace(trace, TRACE_SPHERE, s, e, NULL, NULL, radius, mask, &scratch);
+}
+
+
+/**
+ *	@brief Trace a box that does not rotate.
+ *	@param mins	Lowest corner relative to the position
+ *	@param maxs	Highest corner
+ */
+void EQ3Map::trace_box(struct trace_t* trace, const vector3* start, const vector3* end,
+					   const vector3* mins, const vector3* maxs, int mask) {
+	float s[3] = { start->x, start->y, start->z };
+	float e[3] = { end->x, end->y, end->z };
+	float mn[3] = { mins->x, mins->y, mins->z };
+	float mx[3] = { maxs->x, maxs->y, maxs->z };
+
+	this->trace(trace, TRACE_BOX, s, e, mn, mx, 0.0f, mask, &scratch);
+}
+
+
+/**
+ *	@brief Brushes in the map, for sizing trace scratch.
+ */
+int EQ3Map::get_num_brushes() const {
+	return (data ? data->num_brushes : 0);
+}
+
+
+/**
+ *	@brief Patches in the map, for sizing trace scratch.
+ */
+int EQ3Map::get_num_patches() const {
+	return (data ? data->num_patches : 0);
+}
+
+
+/**
+ *	@brief Box around everything in the map.
+ *	@return 1 on success, 0 if no map is loaded
+ */
+int EQ3Map::get_bounds(float* mins, float* maxs) const {
+	if (!data || !data->num_tree_nodes)
+		return 0;
+
+	for (int i = 0; i < 3; ++i) {
+		mins[i] = data->tree_bounds[0].mins[i];
+		maxs[i] = data->tree_bounds[0].maxs[i];
+	}
+
+	return 1;
+}
+
+
+/**
+ *	@struct box_leafs_t
+ *	@brief State of a box_leafs() walk.
+ */
+struct box_leafs_t {
+	const float* mins;
+	const float* maxs;
+	int* leafs;
+	int max_leafs;
+	int count;					/* may pass max_leafs, only that many are stored */
+};
+
+
+/**
+ *	@brief Find the leafs a box is in.
+ *	@param mins			Lowest corner of the box
+ *	@param maxs			Highest corner
+ *	@param leafs		Where to put the leafs lump indices
+ *	@param max_leafs	Room in leafs
+ *	@return Number of leafs, more than max_leafs if they did not all fit
+ *
+ *	Leafs outside every cluster, inside walls and outside the map,
+ *	are left out.  The leafs come in the same order every time for
+ *	the same box.
+ */
+int EQ3Map::box_leafs(const float* mins, const float* maxs, int* leafs, int max_leafs) const {
+	struct box_leafs_t bl;
+
+	if (!data || !data->num_tree_nodes)
+		return 0;
+
+	bl.mins = mins;
+	bl.maxs = maxs;
+	bl.leafs = leafs;
+	bl.max_leafs = max_leafs;
+	bl.count = 0;
+
+	box_leafs_r(&bl, 0);
+
+	return bl.count;
+}
+
+
+/**
+ *	@brief Walk down both sides of the planes a box crosses.
+ */
+void EQ3Map::box_leafs_r(struct box_leafs_t* bl, int node) const {
+	while (node >= 0) {
+		const struct q3bsp_tree_node_t* n = &data->tree[node];
+		float near_dist, far_dist;
+
+		if (n->type < Q3_PLANE_NON_AXIAL) {
+			near_dist = (bl->mins[n->type] - n->dist);
+			far_dist = (bl->maxs[n->type] - n->dist);
+		} else {
+			/* the corners nearest and furthest along the normal */
+			near_dist = far_dist = -n->dist;
+			for (int i = 0; i < 3; ++i) {
+				if (n->normal[i] >= 0.0f) {
+					near_dist += (n->normal[i] * bl->mins[i]);
+					far_dist += (n->normal[i] * bl->maxs[i]);
+				} else {
+					near_dist += (n->normal[i] * bl->maxs[i]);
+					far_dist += (n->normal[i] * bl->mins[i]);
+				}
+			}
+		}
+
+		if (near_dist >= 0.0f) {
+			node = n->children[0];
+		} else if (far_dist < 0.0f) {
+			node = n->children[1];
+		} else {
+			box_leafs_r(bl, n->children[0]);
+			node = n->children[1];
+		}
+	}
+
+	if (data->leafs[~node].cluster < 0)
+		return;
+
+	if (bl->count < bl->max_leafs)
+		bl->leafs[bl->count] = ~node;
+	++bl->count;
+}
+
+
+/**
+ *	@brief Leafs in the map, for sizing per leaf tables.
+ */
+int EQ3Map::get_num_leafs() const {
+	return (data ? data->num_leafs : 0);
+}
+
+
+/**
+ *	@brief Visibility cluster of a leaf, -1 if it is in none.
+ */
+int EQ3Map::get_leaf_cluster(int leaf) const {
+	return data->leafs[leaf].cluster;
+}
+
+
+/**
+ *	@brief Area of a leaf, -1 if it is in none.
+ *
+ *	Areas are the parts of a map areaportals, doors, divide it into.
+ */
+int EQ3Map::get_leaf_area(int leaf) const {
+	return data->leafs[leaf].area;
+}
+
+
+/**
+ *	@brief Follow the part of a trace from p1 to p2 down the tree.
+ *	@param node	Tree node, or ~leaf
+ *	@param p1f	Fraction of the whole trace at p1
+ *	@param p2f	Fraction at p2
+ *
+ *	Both sides of a node are visited when the shape straddles its
+ *	plane, the side p1 is on first.
+ */
+void EQ3Map::trace_through_tree(struct trace_work_t* tw, int node, float p1f, float p2f,
+								const float* p1, const float* p2) const {
+	const struct q3bsp_tree_node_t* n;
+	float t1, t2, offset;
+	float frac, frac2, idist;
+	float mid[3], midf;
+	int side, i;
+
+	/* something nearer has been hit already */
+	if (tw->trace->fraction <= p1f)
+		return;
+
+	if (node < 0) {
+		trace_through_leaf(tw, ~node);
+		return;
+	}
+
+	n = &data->tree[node];
+
+	/* distance of both ends from the plane, and how far the shape reaches across it */
+	if (n->type < Q3_PLANE_NON_AXIAL) {
+		t1 = n->normal[n->type] * p1[n->type] - n->dist;
+		t2 = n->normal[n->type] * p2[n->type] - n->dist;
+		offset = tw->extents[n->type];
+	} else {
+		t1 = n->normal[0] * p1[0] + n->normal[1] * p1[1] + n->normal[2] * p1[2] - n->dist;
+		t2 = n->normal[0] * p2[0] + n->normal[1] * p2[1] + n->normal[2] * p2[2] - n->dist;
+		offset = (fabsf(tw->extents[0] * n->normal[0]) +
+				  fabsf(tw->extents[1] * n->normal[1]) +
+				  fabsf(tw->extents[2] * n->normal[2]));
+	}
+	offset += tw->radius;
+
+	/* all on one side */
+	if ((t1 >= offset + 1.0f) && (t2 >= offset + 1.0f)) {
+		trace_through_tree(tw, n->children[0], p1f, p2f, p1, p2);
+		return;
+	}
+	if ((t1 < -offset - 1.0f) && (t2 < -offset - 1.0f)) {
+		trace_through_tree(tw, n->children[1], p1f, p2f, p1, p2);
+		return;
+	}
+
+	/* split where the shape leaves p1's side, and where it enters the other */
+	if (t1 < t2) {
+		idist = 1.0f / (t1 - t2);
+		side = 1;
+		frac2 = (t1 + offset + SURFACE_CLIP_EPSILON) * idist;
+		frac = (t1 - offset + SURFACE_CLIP_EPSILON) * idist;
+	} else if (t1 > t2) {
+		idist = 1.0f / (t1 - t2);
+		side = 0;
+		frac2 = (t1 - offset - SURFACE_CLIP_EPSILON) * idist;
+		frac = (t1 + offset + SURFACE_CLIP_EPSILON) * idist;
+	} else {
+		side = 0;
+		frac = 1.0f;
+		frac2 = 0.0f;
+	}
+
+	RANGE_BOUND(frac, 0.0f, 1.0f);
+	RANGE_BOUND(frac2, 0.0f, 1.0f);
+
+	midf = p1f + (p2f - p1f) * frac;
+	for (i = 0; i < 3; ++i)
+		mid[i] = p1[i] + frac * (p2[i] - p1[i]);
+
+	trace_through_tree(tw, n->children[side], p1f, midf, p1, mid);
+
+	midf = p1f + (p2f - p1f) * frac2;
+	for (i = 0; i < 3; ++i)
+		mid[i] = p1[i] + frac2 * (p2[i] - p1[i]);
+
+	trace_through_tree(tw, n->children[side ^ 1], midf, p2f, mid, p2);
+}
+
+
+/**
+ *	@brief Clip a trace against the brushes of a leaf it passes through.
+ */
+void EQ3Map::trace_through_leaf(struct trace_work_t* tw, int leaf) const {
+	const struct q3bsp_leaf_t* l = &data->leafs[leaf];
+	const struct q3bsp_leafbrush_t* lb = &data->leafbrushes[l->leafbrush];
+	struct trace_scratch_t* scratch = tw->scratch;
+	int i;
+
+	for (i = 0; i < l->num_leafbrushes; ++i) {
+		int brush = lb[i].brush;
+
+		/* already tested from another leaf */
+		if (scratch->brush_stamps[brush] == scratch->checkcount)
+			continue;
+		scratch->brush_stamps[brush] = scratch->checkcount;
+
+		if (!(data->brush_contents[brush] & tw->mask))
+			continue;
+
+		trace_through_brush(tw, brush);
+
+		if (!tw->trace->fraction)
+			return;
+	}
+
+	if (!data->leaf_patch_start)
+		return;
+
+	for (i = data->leaf_patch_start[leaf]; i < data->leaf_patch_start[leaf + 1]; ++i) {
+		int patch = data->leaf_patches[i];
+
+		if (scratch->patch_stamps[patch] == scratch->checkcount)
+			continue;
+		scratch->patch_stamps[patch] = scratch->checkcount;
+
+		if (!(data->patches[patch].contents & tw->mask))
+			continue;
+
+		trace_through_patch(tw, patch);
+
+		if (!tw->trace->fraction)
+			return;
+	}
+}
+
+
+/**
+ *	@brief Find where a trace crosses a convex set of planes.
+ *	@param planes	The planes, or the planes the sides index into
+ *	@param sides	Brush sides, NULL if the planes follow one another
+ *	@param num		Number of planes
+ *	@param clip		Where to put what was found
+ *	@return 0 if the trace stays in front of one of the planes the whole way
+ *
+ *	The shape enters the set at the latest of the planes it crosses
+ *	going in and leaves at the earliest going out.
+ */
+static int clip_to_planes(const struct trace_work_t* tw, const struct q3bsp_plane_t* planes,
+						  const struct q3bsp_brushside_t* sides, int num, struct clip_t* clip) {
+	int i;
+
+	clip->enter_frac = -1.0f;
+	clip->leave_frac = 1.0f;
+	clip->plane = NULL;
+	clip->start_out = 0;
+	clip->get_out = 0;
+
+	for (i = 0; i < num; ++i) {
+		const struct q3bsp_plane_t* plane = (sides ? &planes[sides[i].plane] : &planes[i]);
+		const float* n = plane->normal;
+		float dist, d1, d2, f;
+
+		/* move the plane out to where the shape touches it */
+		if (tw->type == TRACE_BOX) {
+			const float* o = tw->offsets[(n[0] < 0.0f) | ((n[1] < 0.0f) << 1) | ((n[2] < 0.0f) << 2)];
+			dist = plane->dist - (o[0] * n[0] + o[1] * n[1] + o[2] * n[2]);
+		} else {
+			dist = plane->dist + tw->radius;
+		}
+
+		d1 = n[0] * tw->start[0] + n[1] * tw->start[1] + n[2] * tw->start[2] - dist;
+		d2 = n[0] * tw->end[0] + n[1] * tw->end[1] + n[2] * tw->end[2] - dist;
+
+		if (d2 > 0.0f)
+			clip->get_out = 1;
+		if (d1 > 0.0f)
+			clip->start_out = 1;
+
+		/* in front of this plane the whole way */
+		if ((d1 > 0.0f) && ((d2 >= SURFACE_CLIP_EPSILON) || (d2 >= d1)))
+			return 0;
+
+		/* behind it the whole way */
+		if ((d1 <= 0.0f) && (d2 <= 0.0f))
+			continue;
+
+		if (d1 > d2) {
+			/* going in */
+			f = (d1 - SURFACE_CLIP_EPSILON) / (d1 - d2);
+			if (f < 0.0f)
+				f = 0.0f;
+			if (f > clip->enter_frac) {
+				clip->enter_frac = f;
+				clip->plane = plane;
+			}
+		} else {
+			/* coming out */
+			f = (d1 + SURFACE_CLIP_EPSILON) / (d1 - d2);
+			if (f > 1.0f)
+				f = 1.0f;
+			if (f < clip->leave_frac)
+				clip->leave_frac = f;
+		}
+	}
+
+	return 1;
+}
+
+
+/**
+ *	@brief Shorten a trace to where it enters a clipped set of planes.
+ *	@param contents	Of what the planes bound
+ *	@param brush	The brush they bound, or -1
+ *	@param patch	The patch, or -1
+ */
+static void apply_clip(struct trace_work_t* tw, const struct clip_t* clip, int contents, int brush, int patch) {
+	struct trace_t* trace = tw->trace;
+
+	/* started behind every plane */
+	if (!clip->start_out) {
+		trace->start_solid = 1;
+
+		if (!clip->get_out) {
+			trace->all_solid = 1;
+			trace->fraction = 0.0f;
+			trace->contents = contents;
+			trace->brush = brush;
+			trace->patch = patch;
+		}
+
+		return;
+	}
+
+	if ((clip->enter_frac < clip->leave_frac) && (clip->enter_frac > -1.0f) &&
+		(clip->enter_frac < trace->fraction) && clip->plane) {
+		trace->fraction = clip->enter_frac;
+		trace->normal[0] = clip->plane->normal[0];
+		trace->normal[1] = clip->plane->normal[1];
+		trace->normal[2] = clip->plane->normal[2];
+		trace->dist = clip->plane->dist;
+		trace->contents = contents;
+		trace->brush = brush;
+		trace->patch = patch;
+	}
+}
+
+
+/**
+ *	@brief Clip a trace against a brush.
+ */
+void EQ3Map::trace_through_brush(struct trace_work_t* tw, int brush) const {
+	const struct q3bsp_brush_t* b = &data->brushes[brush];
+	struct clip_t clip;
+
+	if (!b->num_brushsides)
+		return;
+
+	if (clip_to_planes(tw, data->planes, &data->brushsides[b->brushside], b->num_brushsides, &clip))
+		apply_clip(tw, &clip, data->brush_contents[brush], brush, -1);
+}
+
+
+/**
+ *	@brief Clip a trace against the facets of a patch.
+ *
+ *	Facets are tested one by one once the trace is known to come
+ *	near the patch.  Nothing is tessellated here; the facets are
+ *	made when the map is loaded.
+ */
+void EQ3Map::trace_through_patch(struct trace_work_t* tw, int patch) const {
+	const struct q3bsp_patch_t* p = &data->patches[patch];
+	const struct q3bsp_plane_t* planes;
+	struct clip_t clip;
+	int i;
+
+	for (i = 0; i < 3; ++i) {
+		if ((tw->mins[i] > p->maxs[i]) || (tw->maxs[i] < p->mins[i]))
+			return;
+	}
+
+	planes = &data->facet_planes[p->facet * Q3_FACET_PLANES];
+
+	for (i = 0; i < p->num_facets; ++i, planes += Q3_FACET_PLANES) {
+		if (clip_to_planes(tw, planes, NULL, Q3_FACET_PLANES, &clip))
+			apply_clip(tw, &clip, p->contents, -1, patch);
+
+		if (!tw->trace->fraction)
+			return;
+	}
+}
+
+
+/**
+ *	@brief Find what a point is in.
+ *	@param point	3 floats
+ *	@return CONTENTS_* of every brush the point is inside, 0 if none
+ *
+ *	Only the brushes of the point's leaf are tested, and none at all
+ *	if the leaf has no brushes or its brushes add nothing to what
+ *	has been found already.  Patches have no inside and are not
+ *	counted.
+ */
+int EQ3Map::point_contents(const float* point) const {
+	const struct q3bsp_leaf_t* l;
+	const struct q3bsp_leafbrush_t* lb;
+	int leaf, all, contents = 0;
+	int i, j;
+
+	if (!data || !data->num_tree_nodes)
+		return 0;
+
+	leaf = find_leaf(point);
+	all = data->leaf_contents[leaf];
+	if (!all)
+		return 0;
+
+	l = &data->leafs[leaf];
+	lb = &data->leafbrushes[l->leafbrush];
+
+	for (i = 0; i < l->num_leafbrushes; ++i) {
+		int brush = lb[i].brush;
+		const struct q3bsp_brush_t* b = &data->brushes[brush];
+		const struct q3bsp_brushside_t* sides = &data->brushsides[b->brushside];
+
+		/* nothing new to find in this one */
+		if (!(data->brush_contents[brush] & ~contents))
+			continue;
+
+		for (j = 0; j < b->num_brushsides; ++j) {
+			const struct q3bsp_plane_t* plane = &data->planes[sides[j].plane];
+
+			if (plane->normal[0] * point[0] + plane->normal[1] * point[1] + plane->normal[2] * point[2] > plane->dist)
+				break;
+		}
+
+		/* behind every side */
+		if ((j == b->num_brushsides) && j) {
+			contents |= data->brush_contents[brush];
+			if (contents == all)
+				break;
+		}
+	}
+
+	return contents;
+}
+
+
+/**
+ *	@struct point_contents_job_t
+ *	@brief Points being split over the thread pool.
+ */
+struct point_contents_job_t {
+	const EQ3Map* map;
+	const float* points;
+	int* contents;
+};
+
+
+/**
+ *	@brief Find what many points are in.
+ *	@param points	3 floats a point
+ *	@param count	Number of points
+ *	@param contents	Where to put the contents of each point
+ *	@param pool		Threads to spread the points over, or NULL
+ *
+ *	For particles and swarms of balls.  The map is only read, so
+ *	unlike trace_batch() any thread may call this at any time.
+ */
+void EQ3Map::point_contents_batch(const float* points, int count, int* contents, EThreadPool* pool) const {
+	struct point_contents_job_t job;
+
+	job.map = this;
+	job.points = points;
+	job.contents = contents;
+
+	if (pool)
+		pool->parallel_for(point_contents_range, &job, count, POINT_CONTENTS_GRAIN);
+	else
+		point_contents_range(&job, 0, count);
+}
+
+
+/**
+ *	@brief [Static] Find what points [begin, end) of a batch are in, called by parallel_for().
+ */
+void EQ3Map::point_contents_range(void* arg, int begin, int end) {
+	struct point_contents_job_t* job = (struct point_contents_job_t*)arg;
+
+	for (int i = begin; i < end; ++i)
+		job->contents[i] = job->map->point_contents(&job->points[i * 3]);
+}
+
+
+/**
+ *	@struct trace_batch_job_t
+ *	@brief A batch being split over the thread pool.
+ */
+struct trace_batch_job_t {
+	EQ3Map* map;
+	struct trace_batch_t* batch;
+	const int* order;			/* batch index of each trace to run, NULL for as given */
+};
+
+
+/**
+ *	@brief Spread the low 10 bits of x out to every third bit.
+ */
+static TB_INLINE unsigned int morton_spread(unsigned int x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+
+/**
+ *	@brief Run traces [begin, end) of a batch and store their results.
+ */
+static void trace_batch_run(const struct trace_batch_job_t* job, int begin, int end,
+							struct trace_scratch_t* scratch) {
+	struct trace_batch_t* batch = job->batch;
+	struct trace_t tr;
+	int n, i;
+
+	for (n = begin; n < end; ++n) {
+		i = (job->order ? job->order[n] : n);
+
+		job->map->trace(&tr, batch->type, &batch->starts[i * 3], &batch->ends[i * 3],
+						(batch->mins ? &batch->mins[i * 3] : NULL), (batch->maxs ? &batch->maxs[i * 3] : NULL),
+						batch->radius, batch->mask, scratch);
+
+		if (batch->fractions)
+			batch->fractions[i] = tr.fraction;
+
+		if (batch->end_positions) {
+			batch->end_positions[i * 3 + 0] = tr.end.x;
+			batch->end_positions[i * 3 + 1] = tr.end.y;
+			batch->end_positions[i * 3 + 2] = tr.end.z;
+		}
+
+		if (batch->normals) {
+			batch->normals[i * 3 + 0] = tr.normal[0];
+			batch->normals[i * 3 + 1] = tr.normal[1];
+			batch->normals[i * 3 + 2] = tr.normal[2];
+		}
+
+		if (batch->contents)
+			batch->contents[i] = tr.contents;
+
+		if (batch->flags)
+			batch->flags[i] = ((tr.start_solid ? TRACE_START_SOLID : 0) | (tr.all_solid ? TRACE_ALL_SOLID : 0));
+	}
+}
+
+
+/**
+ *	@brief Run many traces, spread over a thread pool.
+ *	@param batch	The traces and where to put the results
+ *	@param pool		Threads to run them on, or NULL to run them all on the calling thread
+ *
+ *	Large batches are run in order of where the traces are so that
+ *	traces through the same part of the map share the cache.  Each
+ *	thread that takes part uses a scratch of its own, kept between
+ *	batches.  Call from one thread at a time.
+ */
+void EQ3Map::trace_batch(struct trace_batch_t* batch, EThreadPool* pool) {
+	struct trace_batch_job_t job;
+	int threads, brushes, patches;
+
+	if (batch->count <= 0)
+		return;
+
+	if ((batch->type == TRACE_BOX) && (!batch->mins || !batch->maxs)) {
+		ERROR("Collision: Box trace batch without box corners.");
+		return;
+	}
+
+	threads = (pool ? pool->get_num_threads() : 0) + 1;
+	if (threads > TRACE_BATCH_MAX_SCRATCH)
+		threads = TRACE_BATCH_MAX_SCRATCH;
+
+	/* scratch made for a map with other brushes or patches is remade */
+	brushes = get_num_brushes();
+	patches = get_num_patches();
+	if (num_batch_scratch && ((batch_scratch[0].num_brushes != brushes) || (batch_scratch[0].num_patches != patches))) {
+		for (int i = 0; i < num_batch_scratch; ++i)
+			trace_scratch_free(&batch_scratch[i]);
+		num_batch_scratch = 0;
+	}
+
+	while (num_batch_scratch < threads) {
+		if (!trace_scratch_init(&batch_scratch[num_batch_scratch], brushes, patches))
+			break;
+		++num_batch_scratch;
+	}
+
+	job.map = this;
+	job.batch = batch;
+	job.order = ((batch->count >= TRACE_BATCH_SORT_MIN) ? sort_batch(batch) : NULL);
+
+	if (!num_batch_scratch) {
+		/* out of memory for more, the map's own scratch will do on this thread */
+		trace_batch_run(&job, 0, batch->count, &scratch);
+		return;
+	}
+
+	/* every thread that can take part needs a scratch */
+	if (!pool || (num_batch_scratch < threads))
+		trace_batch_range(&job, 0, batch->count);
+	else
+		pool->parallel_for(trace_batch_range, &job, batch->count, TRACE_BATCH_GRAIN);
+}
+
+
+/**
+ *	@brief Order a batch along a curve through the map.
+ *	@return The batch index of each trace in the order to run them, NULL if out of memory
+ *
+ *	Traces are keyed on the Morton code of their middle within the
+ *	map's bounds, 10 bits an axis, and radix sorted on the keys.
+ */
+const int* EQ3Map::sort_batch(const struct trace_batch_t* batch) {
+	const struct q3bsp_bounds_t* bounds;
+	unsigned int* keys[2];
+	int* order[2];
+	float scale[3];
+	int count = batch->count;
+	int i, k, pass;
+
+	if (!data || !data->num_tree_nodes)
+		return NULL;
+
+	if (count > batch_capacity) {
+		int* new_order = (int*)realloc(batch_order, sizeof(int) * count * 2);
+		unsigned int* new_keys;
+
+		if (!new_order)
+			return NULL;
+		batch_order = new_order;
+
+		new_keys = (unsigned int*)realloc(batch_keys, sizeof(unsigned int) * count * 2);
+		if (!new_keys)
+			return NULL;
+		batch_keys = new_keys;
+
+		batch_capacity = count;
+	}
+
+	keys[0] = batch_keys;
+	keys[1] = batch_keys + count;
+	order[0] = batch_order;
+	order[1] = batch_order + count;
+
+	/* the root's bounds take in the whole map */
+	bounds = &data->tree_bounds[0];
+	for (k = 0; k < 3; ++k) {
+		float size = bounds->maxs[k] - bounds->mins[k];
+		scale[k] = ((size > 0.0f) ? 1023.0f / size : 0.0f);
+	}
+
+	for (i = 0; i < count; ++i) {
+		const float* s = &batch->starts[i * 3];
+		const float* e = &batch->ends[i * 3];
+		unsigned int q[3];
+
+		for (k = 0; k < 3; ++k) {
+			float c = ((s[k] + e[k]) * 0.5f - bounds->mins[k]) * scale[k];
+
+			/* traces outside the map are put at its edge */
+			RANGE_BOUND(c, 0.0f, 1023.0f);
+			q[k] = (unsigned int)c;
+		}
+
+		keys[0][i] = morton_spread(q[0]) | (morton_spread(q[1]) << 1) | (morton_spread(q[2]) << 2);
+		order[0][i] = i;
+	}
+
+	/* three passes over 10 bits each, stable so equal keys keep the given order */
+	for (pass = 0; pass < 3; ++pass) {
+		int shift = pass * 10;
+		int src = pass & 1;
+		int offsets[1024];
+
+		memset(offsets, 0, sizeof(offsets));
+		for (i = 0; i < count; ++i)
+			++offsets[(keys[src][i] >> shift) & 0x3ff];
+
+		for (i = 0, k = 0; i < 1024; ++i) {
+			int n = offsets[i];
+			offsets[i] = k;
+			k += n;
+		}
+
+		for (i = 0; i < count; ++i) {
+			int to = offsets[(keys[src][i] >> shift) & 0x3ff]++;
+			keys[src ^ 1][to] = keys[src][i];
+			order[src ^ 1][to] = order[src][i];
+		}
+	}
+
+	return order[1];
+}
+
+
+/**
+ *	@brief Take a batch scratch no other thread is using.
+ *	@return Index of the scratch
+ *
+ *	There is one for every thread that can take part in a batch,
+ *	so one is always free.
+ */
+int EQ3Map::claim_batch_scratch() {
+	while (1) {
+		for (int i = 0; i < num_batch_scratch; ++i) {
+			if (!__sync_lock_test_and_set(&batch_scratch_busy[i], 1))
+				return i;
+		}
+	}
+}
+
+
+/**
+ *	@brief [Static] Run traces [begin, end) of a batch, called by parallel_for().
+ */
+void EQ3Map::trace_batch_range(void* arg, int begin, int end) {
+	struct trace_batch_job_t* job = (struct trace_batch_job_t*)arg;
+	EQ3Map* map = job->map;
+	int slot = map->claim_batch_scratch();
+
+	trace_batch_run(job, begin, end, &map->batch_scratch[slot]);
+
+	__sync_lock_release(&map->batch_scratch_busy[slot]);
+}
@@ -4,6 +4,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
 #include <assert.h>
@@ -12,94 +13,260 @@
 #include "math/mat.h"
 #include "str.h"
 #include "engine/engine.h"
+#include "engine/mipmap.h"
+#include "engine/color.h"
 #include "engine/Q3map.h"
 
 
-EQ3Map::EQ3Map() {
-	static struct entity_loader_callbacks_t _entity_loader_callbacks[] = {
-		{	"info_player_deathmatch",		&EQ3Map::load_entity_info_player_deathmatch	},
-		{	NULL,							NULL										}
-	};
+/* lump names for the memory report */
+static const char* lump_names[NUM_LUMPS] = {
+	"entities", "textures", "planes", "nodes", "leafs", "leaffaces",
+	"leafbrushes", "models", "brushes", "brushsides", "vertexes",
+	"meshverts", "effects", "faces", "lightmaps", "lightvols", "visdata"
+};
+
+
+EQ3MapData* EQ3MapData::loaded = NULL;
+
+
+EQ3MapData::EQ3MapData() {
+	next = NULL;
+	file[0] = '\0';
+	refs = 0;
+
+	/* nothing is allocated until load() */
+	entities.ents = NULL;
+	textures = NULL;
+	planes = NULL;
+	nodes = NULL;
+	leafs = NULL;
+	leaffaces = NULL;
+	leafbrushes = NULL;
+	models = NULL;
+	brushes = NULL;
+	brushsides = NULL;
+	vertexes = NULL;
+	meshverts = NULL;
+	effects = NULL;
+	faces = NULL;
+	lightmaps = NULL;
+	lightvols = NULL;
+	visdata.vecs = NULL;
+	num_lightmaps = 0;
+
+	num_tree_nodes = 0;
+	tree = NULL;
+	tree_bounds = NULL;
+
+	brush_contents = NULL;
+	leaf_contents = NULL;
+
+	num_patches = 0;
+	patches = NULL;
+	num_facets = 0;
+	facet_planes = NULL;
+	leaf_patch_start = NULL;
+	leaf_patches = NULL;
+
+	leaf_cluster = NULL;
+	leaf_mins = NULL;
+	leaf_maxs = NULL;
+	leaf_face_start = NULL;
+	leaf_face_count = NULL;
+	leaf_original = NULL;
+	leaf_sorted = NULL;
+
+	texture_manager = NULL;
+
+	vertex_buffer = 0;
+	index_buffer = 0;
+
+	arena = NULL;
+	own_arena = 0;
+	lightmap_pixels = NULL;
+	lightmap_uploaded = NULL;
+
+	lean = 0;
+	headless = 0;
+	memset(lump_freed, 0, sizeof(lump_freed));
+
+	num_clusters = 0;
+	cluster_leaf_start = NULL;
+	cluster_mins = NULL;
+	cluster_maxs = NULL;
+	cluster_texture_start = NULL;
+	cluster_textures = NULL;
+	cluster_lightmap_start = NULL;
+	cluster_lightmaps = NULL;
+	cluster_centers = NULL;
+}
 
-	entity_loader_callbacks = _entity_loader_callbacks;
 
-	memset(spawn_points, 0, sizeof(struct q3bsp_spawn_point_t) * Q3_MAX_SPAWN_POINTS);
-	num_spawn_points = 0;
+EQ3MapData::~EQ3MapData() {
+	INFO("Unloading Quake3 map \"%s\"...", file);
+
+	/* every lump goes at once */
+	if (own_arena)
+		delete arena;
+	else if (arena)
+		arena->reset();
+
+	if (vertex_buffer)
+		glDeleteBuffers(1, &vertex_buffer);
+	if (index_buffer)
+		glDeleteBuffers(1, &index_buffer);
+
+	/* sized by the facets made and the leafs they reach, which alloc_lumps() can not know */
+	free(facet_planes);
+	free(leaf_patches);
+
+	free(cluster_texture_start);
+	free(cluster_textures);
+	free(cluster_lightmap_start);
+	free(cluster_lightmaps);
+	free(cluster_centers);
+	free(lightmap_uploaded);
 }
 
 
-EQ3Map::~EQ3Map() {
-	INFO("Unloading Quake3 map...");
-
-	free(entities.ents);
-	free(textures);
-	free(planes);
-	free(nodes);
-	free(leafs);
-	free(leaffaces);
-	free(leafbrushes);
-	free(models);
-	free(brushes);
-	free(brushsides);
-	free(vertexes);
-	free(meshverts);
-	free(effects);
-	free(faces);
-	free(lightmaps);
-	free(lightvols);
-	free(visdata.vecs);
+/**
+ *	@brief Get the data of a map file, loading it if nothing has it yet.
+ *	@param file		The BSP file
+ *	@param lean		1 to release render-only data once uploaded
+ *	@param headless	1 to load only what collision and visibility need, without OpenGL
+ *	@param arena	Where to put the lumps, NULL or an arena in use for one of their own
+ *	@return A reference to the data, or NULL if the file failed to load
+ *
+ *	Lean, headless and full copies of a file are kept apart, as
+ *	the first two have nothing to give a map that needs all of it.
+ */
+EQ3MapData* EQ3MapData::acquire(const char* file, int lean, int headless, EArena* arena) {
+	EQ3MapData* data = loaded;
+
+	for (; data; data = data->next) {
+		if (!strcmp(data->file, file) && (data->lean == lean) && (data->headless == headless)) {
+			++data->refs;
+			INFO("Q3Map: \"%s\" is already loaded (%i users).", file, data->refs);
+			return data;
+		}
+	}
+
+	data = new EQ3MapData();
+	data->lean = lean;
+	data->headless = headless;
+
+	/* only one map's lumps fit in an arena at a time */
+	if (arena && !arena->get_used())
+		data->arena = arena;
+
+	if (!data->load(file)) {
+		delete data;
+		return NULL;
+	}
+
+	data->refs = 1;
+	data->next = loaded;
+	loaded = data;
+
+	return data;
 }
 
 
 /**
- *	@brief Load the specified Quake3 map.
+ *	@brief Give up a reference, the last one frees the data.
+ */
+void EQ3MapData::release() {
+	EQ3MapData** d = &loaded;
+
+	if (--refs > 0)
+		return;
+
+	for (; *d; d = &(*d)->next) {
+		if (*d == this) {
+			*d = next;
+			break;
+		}
+	}
+
+	delete this;
+}
+
+
+/**
+ *	@brief Load a Quake3 map file.
+ *
+ *	The map is read through the engine's virtual filesystem,
+ *	so it may come from inside a pk3.
  */
-int EQ3Map::load(char* file) {
-	FILE* fptr = fopen(file, "rb");
+int EQ3MapData::load(const char* file) {
+	const EVFS* vfs = g_engine.get_vfs();
+	byte* data = NULL;
+	FILE* fptr = NULL;
+	long size;
 
 	INFO("Q3Map: Loading Quake3 map \"%s\"...", file);
 
+	strncpy(this->file, file, VFS_MAX_PATH - 1);
+	this->file[VFS_MAX_PATH - 1] = '\0';
+
+	if (vfs) {
+		/* read it in one go and parse it from memory */
+		data = vfs->load(file, &size);
+		if (data)
+			fptr = fmemopen(data, size, "rb");
+	} else {
+		fptr = fopen(file, "rb");
+	}
+
 	if (!fptr) {
 		ERROR("Q3Map: Failed to load map.");
+		free(data);
 		return 0;
 	}
 
 	/* Read the header */
 	if (!load_header(fptr)) {
 		fclose(fptr);
+		free(data);
 		return 0;
 	}
 
 	/* Load the lumps */
-	if (!load_lumps(fptr)) {
+	if (!alloc_lumps() || !load_lumps(fptr)) {
 		fclose(fptr);
+		free(data);
 		return 0;
 	}
 
 	fclose(fptr);
+	free(data);
+
+	/* Lay the nodes out for walking, and the leafs for culling */
+	if (!build_tree() || !build_leaf_table())
+		return 0;
 
-	/* Load the textures */
-	load_textures();
+	/* Check the brushes over for collision, and cut the patches up for it */
+	if (!build_brushes() || !build_patches())
+		return 0;
 
-	/* Load the light maps */
-	load_lightmaps();
+	if (!headless) {
+		/* Load the textures */
+		load_textures();
 
-	/* Parse the entities */
-	parse_entities();
+		/* Load the light maps */
+		load_lightmaps();
 
+		/* Find what each cluster needs for prefetching */
+		build_cluster_resources();
 
-	/* display the spawn points */
-	int i = 0;
-	for (; i < num_spawn_points; ++i) {
-		INFO("Spawn Point %i: Angle = %f\t\tOrigin = (%f, %f, %f)",
-			i,
-			spawn_points[i].angle,
-			spawn_points[i].origin.x,
-			spawn_points[i].origin.y,
-			spawn_points[i].origin.z
-		);
+		/* Give the geometry to OpenGL */
+		upload_geometry();
+
+		if (lean)
+			release_geometry();
 	}
 
+	report_memory();
 
 	INFO("Q3Map: Successfully loaded Quake3 map \"%s\".", file);
 	return 1;
@@ -109,7 +276,7 @@ int EQ3Map::load(char* file) {
 /**
  *	@brief Load the Quake3 map header.
  */
-int EQ3Map::load_header(FILE* fptr) {
+int EQ3MapData::load_header(FILE* fptr) {
 	/* load magic number */
 	fread((void*)&header.magic, 4, 1, fptr);
 	if (header.magic != 0x50534249) {
@@ -124,25 +291,134 @@ int EQ3Map::load_header(FILE* fptr) {
 
 	/* load direntry array */
 	int entry = 0;
-	for (; entry < 17; ++entry)
+	for (; entry < NUM_LUMPS; ++entry)
 		fread((header.direntry + entry), 4, 2, fptr);
 
 	return 1;
 }
 
 
+/**
+ *	@brief Count the entries of each lump and give them all one allocation.
+ *	@return 1 on success, 0 if the header is damaged or out of memory
+ *
+ *	Every lump is cache line aligned in the arena.  Collision and
+ *	visibility data comes first; vertexes, meshverts and lightmap
+ *	pixels, which only the renderer needs, are page aligned at the
+ *	end so lean maps can give them back to the system.  Tables built
+ *	from the lumps go in with them when the counts bound their size.
+ */
+int EQ3MapData::alloc_lumps() {
+	int i;
+
+	for (i = 0; i < NUM_LUMPS; ++i) {
+		if ((LUMP_OFFSET(i) < 0) || (LUMP_LENGTH(i) < 0)) {
+			ERROR("Q3Map: Lump %s has a negative offset or length.", lump_names[i]);
+			return 0;
+		}
+	}
+
+	/*
+	 *	Number of entries = (lump length) / sizeof(struct)
+	 */
+	num_textures = (LUMP_LENGTH(LUMP_TEXTURES) / SIZEOF_TEXTURE);
+	num_planes = (LUMP_LENGTH(LUMP_PLANES) / SIZEOF_PLANE);
+	num_nodes = (LUMP_LENGTH(LUMP_NODES) / SIZEOF_NODE);
+	num_leafs = (LUMP_LENGTH(LUMP_LEAFS) / SIZEOF_LEAF);
+	num_leaffaces = (LUMP_LENGTH(LUMP_LEAFFACES) / SIZEOF_LEAFFACE);
+	num_leafbrushes = (LUMP_LENGTH(LUMP_LEAFBRUSHES) / SIZEOF_LEAFBRUSH);
+	num_models = (LUMP_LENGTH(LUMP_MODELS) / SIZEOF_MODEL);
+	num_brushes = (LUMP_LENGTH(LUMP_BRUSHES) / SIZEOF_BRUSH);
+	num_brushsides = (LUMP_LENGTH(LUMP_BRUSHSIDES) / SIZEOF_BRUSHSIDE);
+	num_vertexes = (LUMP_LENGTH(LUMP_VERTEXES) / SIZEOF_VERTEX);
+	num_meshverts = (LUMP_LENGTH(LUMP_MESHVERTS) / SIZEOF_MESHVERT);
+	num_effects = (LUMP_LENGTH(LUMP_EFFECTS) / SIZEOF_EFFECT);
+	num_faces = (LUMP_LENGTH(LUMP_FACES) / SIZEOF_FACE);
+	num_lightmaps = (LUMP_LENGTH(LUMP_LIGHTMAPS) / SIZEOF_LIGHTMAP);
+	num_lightvols = (LUMP_LENGTH(LUMP_LIGHTVOLS) / SIZEOF_LIGHTVOL);
+
+	struct lump_alloc_t {
+		void** ptr;
+		size_t bytes;
+		size_t align;
+	} allocs[] = {
+		{ (void**)&entities.ents,	(size_t)LUMP_LENGTH(LUMP_ENTITIES) + 1,							ARENA_ALIGN },
+		{ (void**)&planes,			sizeof(struct q3bsp_plane_t) * num_planes,						ARENA_ALIGN },
+		{ (void**)&nodes,			sizeof(struct q3bsp_node_t) * num_nodes,						ARENA_ALIGN },
+		{ (void**)&tree,			sizeof(struct q3bsp_tree_node_t) * num_nodes,					ARENA_ALIGN },
+		{ (void**)&tree_bounds,		sizeof(struct q3bsp_bounds_t) * num_nodes,						ARENA_ALIGN },
+		{ (void**)&leafs,			sizeof(struct q3bsp_leaf_t) * num_leafs,						ARENA_ALIGN },
+		{ (void**)&leaf_cluster,	sizeof(int) * num_leafs,										ARENA_ALIGN },
+		{ (void**)&leaf_mins,		sizeof(float) * 3 * num_leafs,									ARENA_ALIGN },
+		{ (void**)&leaf_maxs,		sizeof(float) * 3 * num_leafs,									ARENA_ALIGN },
+		{ (void**)&leaf_face_start,	sizeof(int) * num_leafs,										ARENA_ALIGN },
+		{ (void**)&leaf_face_count,	sizeof(int) * num_leafs,										ARENA_ALIGN },
+		{ (void**)&leaf_original,	sizeof(int) * num_leafs,										ARENA_ALIGN },
+		{ (void**)&leaf_sorted,		sizeof(int) * num_leafs,										ARENA_ALIGN },
+		{ (void**)&leaffaces,		sizeof(struct q3bsp_leafface_t) * num_leaffaces,				ARENA_ALIGN },
+		{ (void**)&leafbrushes,		sizeof(struct q3bsp_leafbrush_t) * num_leafbrushes,				ARENA_ALIGN },
+		{ (void**)&brushes,			sizeof(struct q3bsp_brush_t) * num_brushes,						ARENA_ALIGN },
+		{ (void**)&brushsides,		sizeof(struct q3bsp_brushside_t) * num_brushsides,				ARENA_ALIGN },
+		{ (void**)&brush_contents,	sizeof(int) * num_brushes,										ARENA_ALIGN },
+		{ (void**)&leaf_contents,	sizeof(int) * num_leafs,										ARENA_ALIGN },
+		{ (void**)&models,			sizeof(struct q3bsp_model_t) * num_models,						ARENA_ALIGN },
+		{ (void**)&faces,			sizeof(struct q3bsp_face_t) * num_faces,						ARENA_ALIGN },
+		{ (void**)&textures,		sizeof(struct q3bsp_texture_t) * num_textures,					ARENA_ALIGN },
+		{ (void**)&effects,			sizeof(struct q3bsp_effect_t) * num_effects,					ARENA_ALIGN },
+		{ (void**)&lightmaps,		sizeof(struct q3bsp_lightmap_t) * (num_lightmaps + 1),			ARENA_ALIGN },
+		{ (void**)&lightvols,		sizeof(struct q3bsp_lightvol_t) * num_lightvols,				ARENA_ALIGN },
+		{ (void**)&visdata.vecs,	(size_t)((LUMP_LENGTH(LUMP_VISDATA) > 8) ? LUMP_LENGTH(LUMP_VISDATA) - 8 : 0),	ARENA_ALIGN },
+
+		/* built once the lumps are loaded, as big as they can get: a cluster a leaf, a patch a face */
+		{ (void**)&cluster_leaf_start,	sizeof(int) * (num_leafs + 2),								ARENA_ALIGN },
+		{ (void**)&cluster_mins,	sizeof(float) * 3 * (num_leafs + 1),							ARENA_ALIGN },
+		{ (void**)&cluster_maxs,	sizeof(float) * 3 * (num_leafs + 1),							ARENA_ALIGN },
+		{ (void**)&patches,			sizeof(struct q3bsp_patch_t) * num_faces,						ARENA_ALIGN },
+		{ (void**)&leaf_patch_start,	sizeof(int) * (num_leafs + 1),								ARENA_ALIGN },
+
+		/* render-only, the lightmaps also mark the page the meshverts end on */
+		{ (void**)&vertexes,		sizeof(struct q3bsp_vertex_t) * num_vertexes,					ARENA_PAGE_ALIGN },
+		{ (void**)&meshverts,		sizeof(struct q3bsp_meshvert_t) * num_meshverts,				ARENA_ALIGN },
+		{ (void**)&lightmap_pixels,	(size_t)Q3_LIGHTMAP_BYTES * num_lightmaps,						ARENA_PAGE_ALIGN }
+	};
+	int num_allocs = sizeof(allocs) / sizeof(allocs[0]);
+	size_t total = 0;
+
+	for (i = 0; i < num_allocs; ++i)
+		total += allocs[i].bytes + allocs[i].align - 1;
+
+	if (!arena) {
+		arena = new EArena();
+		own_arena = 1;
+	}
+
+	if (!arena->reserve(total)) {
+		ERROR("Q3Map: Out of memory for the lumps.");
+		return 0;
+	}
+
+	for (i = 0; i < num_allocs; ++i)
+		*allocs[i].ptr = arena->alloc(allocs[i].bytes, allocs[i].align);
+
+	INFO("Q3Map: Lumps use %lu KB of a %lu KB arena.", (unsigned long)(arena->get_used() / 1024),
+		 (unsigned long)(arena->get_capacity() / 1024));
+
+	return 1;
+}
+
+
 /**
  *	@brief Load the Quake3 map lumps.
  */
-int EQ3Map::load_lumps(FILE* fptr) {
+int EQ3MapData::load_lumps(FILE* fptr) {
 	int i;
 
 	/*
 	 *	Lump 0 - Entities
 	 */
 	SEEK_LUMP(LUMP_ENTITIES);
-	entities.ents = (char*)malloc(sizeof(char) * LUMP_LENGTH(LUMP_ENTITIES));
 	fread(entities.ents, LUMP_LENGTH(LUMP_ENTITIES), 1, fptr);
+	entities.ents[LUMP_LENGTH(LUMP_ENTITIES)] = '\0';
 
 	/*
 	 *	Lump 1 - Textures
@@ -150,8 +426,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_TEXTURES);
-	num_textures = (LUMP_LENGTH(LUMP_TEXTURES) / SIZEOF_TEXTURE);
-	textures = (struct q3bsp_texture_t*)malloc(sizeof(struct q3bsp_texture_t) * num_textures);
 	for (i = 0; i < num_textures; ++i) {
 		fread(textures[i].name, 64, 1, fptr);
 		fread(&textures[i].flags, 4, 1, fptr);
@@ -164,8 +438,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_PLANES);
-	num_planes = (LUMP_LENGTH(LUMP_PLANES) / SIZEOF_PLANE);
-	planes = (struct q3bsp_plane_t*)malloc(sizeof(struct q3bsp_plane_t) * num_planes);
 	for (i = 0; i < num_planes; ++i) {
 		fread(planes[i].normal, 4, 3, fptr);
 		fread(&planes[i].dist, 4, 1, fptr);
@@ -179,8 +451,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_NODES);
-	num_nodes = (LUMP_LENGTH(LUMP_NODES) / SIZEOF_NODE);
-	nodes = (struct q3bsp_node_t*)malloc(sizeof(struct q3bsp_node_t) * num_nodes);
 	for (i = 0; i < num_nodes; ++i) {
 		fread(&nodes[i].plane, 4, 1, fptr);
 		fread(nodes[i].children, 4, 2, fptr);
@@ -197,8 +467,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_LEAFS);
-	num_leafs = (LUMP_LENGTH(LUMP_LEAFS) / SIZEOF_LEAF);
-	leafs = (struct q3bsp_leaf_t*)malloc(sizeof(struct q3bsp_leaf_t) * num_leafs);
 	for (i = 0; i < num_leafs; ++i) {
 		fread(&leafs[i].cluster, 4, 1, fptr);
 		fread(&leafs[i].area, 4, 1, fptr);
@@ -219,8 +487,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_LEAFFACES);
-	num_leaffaces = (LUMP_LENGTH(LUMP_LEAFS) / SIZEOF_LEAFFACE);
-	leaffaces = (struct q3bsp_leafface_t*)malloc(sizeof(struct q3bsp_leafface_t) * num_leaffaces);
 	for (i = 0; i < num_leaffaces; ++i) {
 		fread(&leaffaces[i].face, 4, 1, fptr);
 	}
@@ -231,8 +497,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_LEAFBRUSHES);
-	num_leafbrushes = (LUMP_LENGTH(LUMP_LEAFBRUSHES) / SIZEOF_LEAFBRUSH);
-	leafbrushes = (struct q3bsp_leafbrush_t*)malloc(sizeof(struct q3bsp_leafbrush_t) * num_leafbrushes);
 	for (i = 0; i < num_leafbrushes; ++i) {
 		fread(&leafbrushes[i].brush, 4, 1, fptr);
 	}
@@ -243,8 +507,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_MODELS);
-	num_models = (LUMP_LENGTH(LUMP_MODELS) / SIZEOF_MODEL);
-	models = (struct q3bsp_model_t*)malloc(sizeof(struct q3bsp_model_t) * num_models);
 	for (i = 0; i < num_models; ++i) {
 		fread(models[i].mins, 4, 3, fptr);
 		fread(models[i].maxs, 4, 3, fptr);
@@ -263,8 +525,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_BRUSHES);
-	num_brushes = (LUMP_LENGTH(LUMP_BRUSHES) / SIZEOF_BRUSH);
-	brushes = (struct q3bsp_brush_t*)malloc(sizeof(struct q3bsp_brush_t) * num_brushes);
 	for (i = 0; i < num_brushes; ++i) {
 		fread(&brushes[i].brushside, 4, 1, fptr);
 		fread(&brushes[i].num_brushsides, 4, 1, fptr);
@@ -277,8 +537,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_BRUSHSIDES);
-	num_brushsides = (LUMP_LENGTH(LUMP_BRUSHSIDES) / SIZEOF_BRUSHSIDE);
-	brushsides = (struct q3bsp_brushside_t*)malloc(sizeof(struct q3bsp_brushside_t) * num_brushsides);
 	for (i = 0; i < num_brushsides; ++i) {
 		fread(&brushsides[i].plane, 4, 1, fptr);
 		fread(&brushsides[i].texture, 4, 1, fptr);
@@ -290,8 +548,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_VERTEXES);
-	num_vertexes = (LUMP_LENGTH(LUMP_VERTEXES) / SIZEOF_VERTEX);
-	vertexes = (struct q3bsp_vertex_t*)malloc(sizeof(struct q3bsp_vertex_t) * num_vertexes);
 	for (i = 0; i < num_vertexes; ++i) {
 		fread(vertexes[i].position, 4, 3, fptr);
 		fread(vertexes[i].texcoord, 4, 4, fptr);
@@ -308,8 +564,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_MESHVERTS);
-	num_meshverts = (LUMP_LENGTH(LUMP_MESHVERTS) / SIZEOF_MESHVERT);
-	meshverts = (struct q3bsp_meshvert_t*)malloc(sizeof(struct q3bsp_meshvert_t) * num_meshverts);
 	for (i = 0; i < num_meshverts; ++i) {
 		fread(&meshverts[i].offset, 1, 4, fptr);
 	}
@@ -320,8 +574,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_EFFECTS);
-	num_effects = (LUMP_LENGTH(LUMP_EFFECTS) / SIZEOF_EFFECT);
-	effects = (struct q3bsp_effect_t*)malloc(sizeof(struct q3bsp_effect_t) * num_effects);
 	for (i = 0; i < num_effects; ++i) {
 		fread(effects[i].name, 64, 1, fptr);
 		fread(&effects[i].brush, 4, 1, fptr);
@@ -334,8 +586,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_FACES);
-	num_faces = (LUMP_LENGTH(LUMP_FACES) / SIZEOF_FACE);
-	faces = (struct q3bsp_face_t*)malloc(sizeof(struct q3bsp_face_t) * num_faces);
 	for (i = 0; i < num_faces; ++i) {
 		fread(&faces[i].texture, 4, 1, fptr);
 		fread(&faces[i].effect, 4, 1, fptr);
@@ -362,10 +612,12 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_LIGHTMAPS);
-	num_lightmaps = (LUMP_LENGTH(LUMP_LIGHTMAPS) / SIZEOF_LIGHTMAP);
-	lightmaps = (struct q3bsp_lightmap_t*)malloc(sizeof(struct q3bsp_lightmap_t) * num_lightmaps);
 	for (i = 0; i < num_lightmaps; ++i) {
-		fread(&lightmaps[i].map, 128*128*3, 1, fptr);
+		/* each starts on a page so it can be released once uploaded */
+		lightmaps[i].map = lightmap_pixels + i * Q3_LIGHTMAP_BYTES;
+		lightmaps[i].gl_text_id = 0;
+
+		fread(lightmaps[i].map, Q3_LIGHTMAP_BYTES, 1, fptr);
 	}
 
 	/*
@@ -374,8 +626,6 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	 *	Number of entries = (lump length) / sizeof(struct)
 	 */
 	SEEK_LUMP(LUMP_LIGHTVOLS);
-	num_lightvols = (LUMP_LENGTH(LUMP_LIGHTVOLS) / SIZEOF_LIGHTVOL);
-	lightvols = (struct q3bsp_lightvol_t*)malloc(sizeof(struct q3bsp_lightvol_t) * num_lightvols);
 	for (i = 0; i < num_lightvols; ++i) {
 		fread(&lightvols[i].ambient, 3, 1, fptr);
 		fread(&lightvols[i].directional, 3, 1, fptr);
@@ -388,7 +638,14 @@ int EQ3Map::load_lumps(FILE* fptr) {
 	SEEK_LUMP(LUMP_VISDATA);
 	fread(&visdata.num_vecs, 4, 1, fptr);
 	fread(&visdata.sz_vecs, 4, 1, fptr);
-	visdata.vecs = (byte*)malloc(sizeof(byte) * visdata.num_vecs * visdata.sz_vecs);
+
+	/* the vectors were sized from the lump length, don't trust the counts over it */
+	if ((visdata.num_vecs < 0) || (visdata.sz_vecs < 0) ||
+		((long)visdata.num_vecs * visdata.sz_vecs > LUMP_LENGTH(LUMP_VISDATA) - 8)) {
+		ERROR("Q3Map: Visibility data is bigger than its lump.");
+		return 0;
+	}
+
 	fread(visdata.vecs, (visdata.num_vecs * visdata.sz_vecs), 1, fptr);
 
 	return 1;
@@ -398,11 +655,14 @@ int EQ3Map::load_lumps(FILE* fptr) {
 /**
  *	@brief Load the textures from the texture lump into the texture manager.
  */
-void EQ3Map::load_textures() {
+void EQ3MapData::load_textures() {
 	int i;
 	ETextureManager* tm = g_engine.get_texture_manager();
 	assert(tm);
 
+	/* render_face() tells it which textures are in use */
+	texture_manager = tm;
+
 	char* img_ext[] = {
 		".jpg",
 		".tga",
@@ -417,29 +677,625 @@ void EQ3Map::load_textures() {
 
 
 /**
- *	@brief Load the lightmap textures from the lightmaps lump.
+ *	@brief Prepare the lightmap textures from the lightmaps lump.
+ *
+ *	Texture ids are created here, but each lightmap is only
+ *	uploaded when it is prefetched or first drawn.
  */
-void EQ3Map::load_lightmaps() {
+void EQ3MapData::load_lightmaps() {
 	int i = 0;
 
+	lightmap_uploaded = (byte*)malloc(num_lightmaps + 1);
+
+	struct color_table_t* color = color_table_create(COLOR_OVERBRIGHT(Q3_LIGHTMAP_OVERBRIGHT), 1.0f, COLOR_SATURATE);
+	if (!lightmap_uploaded || !color) {
+		ERROR("Q3Map: Out of memory for lightmaps.");
+		color_table_destroy(color);
+		num_lightmaps = 0;
+		return;
+	}
+
 	for (; i < num_lightmaps; ++i) {
-		unsigned int* text_id = &(lightmaps[i].gl_text_id);
+		glGenTextures(1, &(lightmaps[i].gl_text_id));
+
+		color_apply_table(color, lightmaps[i].map, 128 * 128, 3, NULL);
+
+		lightmap_uploaded[i] = 0;
+	}
+
+	color_table_destroy(color);
+}
+
+
+/**
+ *	@brief Give a lightmap to OpenGL.
+ *	@param index	The lightmap
+ */
+void EQ3MapData::upload_lightmap(int index) {
+	struct image_t* img = image_create(128, 128, 3, 1);
+	if (!img) {
+		ERROR("Q3Map: Out of memory for lightmaps.");
+		return;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, lightmaps[index].gl_text_id);
+
+	memcpy(img->levels[0].data, lightmaps[index].map, img->levels[0].size);
+	mipmap_build(img, MIPMAP_FILTER_BOX, 0, NULL);
+	texture_manager->upload_image(img, 0);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+
+	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+
+	image_destroy(img);
+
+	lightmap_uploaded[index] = 1;
+
+	if (lean) {
+		arena->release(lightmaps[index].map, Q3_LIGHTMAP_BYTES);
+		lightmaps[index].map = NULL;
+		lump_freed[LUMP_LIGHTMAPS] += Q3_LIGHTMAP_BYTES;
+	}
+}
+
+
+/**
+ *	@brief Put the vertexes and meshverts in OpenGL buffers.
+ *
+ *	If the buffers can not be created the faces are drawn from
+ *	memory as before.
+ */
+void EQ3MapData::upload_geometry() {
+	if (!num_vertexes || !num_meshverts)
+		return;
+
+	glGenBuffers(1, &vertex_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(struct q3bsp_vertex_t) * num_vertexes, vertexes, GL_STATIC_DRAW);
+
+	glGenBuffers(1, &index_buffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(struct q3bsp_meshvert_t) * num_meshverts, meshverts, GL_STATIC_DRAW);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	if (glGetError() != GL_NO_ERROR) {
+		WARNING("Q3Map: Could not create vertex buffers, drawing from memory.");
+
+		glDeleteBuffers(1, &vertex_buffer);
+		glDeleteBuffers(1, &index_buffer);
+		vertex_buffer = 0;
+		index_buffer = 0;
+	}
+}
+
+
+/**
+ *	@brief Free the vertexes and meshverts if OpenGL holds them.
+ */
+void EQ3MapData::release_geometry() {
+	if (!vertex_buffer || !index_buffer)
+		return;
+
+	lump_freed[LUMP_VERTEXES] += get_lump_bytes(LUMP_VERTEXES);
+	lump_freed[LUMP_MESHVERTS] += get_lump_bytes(LUMP_MESHVERTS);
+
+	/* both run up to the page the lightmaps start on */
+	arena->release(vertexes, lightmap_pixels - (byte*)vertexes);
+	vertexes = NULL;
+	meshverts = NULL;
+}
+
+
+/**
+ *	@brief Get the heap memory a lump currently uses.
+ *	@param lump	LUMP_*
+ */
+long EQ3MapData::get_lump_bytes(int lump) const {
+	long bytes = 0;
+	int i;
+
+	switch (lump) {
+		case LUMP_ENTITIES:		return (entities.ents ? LUMP_LENGTH(LUMP_ENTITIES) : 0);
+		case LUMP_TEXTURES:		return sizeof(struct q3bsp_texture_t) * num_textures;
+		case LUMP_PLANES:		return sizeof(struct q3bsp_plane_t) * num_planes;
+		case LUMP_NODES:		return sizeof(struct q3bsp_node_t) * num_nodes;
+		case LUMP_LEAFS:		return sizeof(struct q3bsp_leaf_t) * num_leafs;
+		case LUMP_LEAFFACES:	return sizeof(struct q3bsp_leafface_t) * num_leaffaces;
+		case LUMP_LEAFBRUSHES:	return sizeof(struct q3bsp_leafbrush_t) * num_leafbrushes;
+		case LUMP_MODELS:		return sizeof(struct q3bsp_model_t) * num_models;
+		case LUMP_BRUSHES:		return sizeof(struct q3bsp_brush_t) * num_brushes;
+		case LUMP_BRUSHSIDES:	return sizeof(struct q3bsp_brushside_t) * num_brushsides;
+		case LUMP_VERTEXES:		return (vertexes ? sizeof(struct q3bsp_vertex_t) * num_vertexes : 0);
+		case LUMP_MESHVERTS:	return (meshverts ? sizeof(struct q3bsp_meshvert_t) * num_meshverts : 0);
+		case LUMP_EFFECTS:		return sizeof(struct q3bsp_effect_t) * num_effects;
+		case LUMP_FACES:		return sizeof(struct q3bsp_face_t) * num_faces;
+		case LUMP_LIGHTVOLS:	return sizeof(struct q3bsp_lightvol_t) * num_lightvols;
+		case LUMP_VISDATA:		return ((long)visdata.num_vecs * visdata.sz_vecs);
+
+		case LUMP_LIGHTMAPS:
+			bytes = sizeof(struct q3bsp_lightmap_t) * num_lightmaps;
+			for (i = 0; i < num_lightmaps; ++i) {
+				if (lightmaps[i].map)
+					bytes += Q3_LIGHTMAP_BYTES;
+			}
+			return bytes;
+	}
+
+	return 0;
+}
+
+
+/**
+ *	@brief Print the memory each lump uses and how much has been released.
+ */
+void EQ3MapData::report_memory() const {
+	long total = 0, total_freed = 0;
+
+	INFO("Q3Map: Lump memory (resident / freed, KB):");
+
+	for (int i = 0; i < NUM_LUMPS; ++i) {
+		long bytes = get_lump_bytes(i);
+
+		INFO("Q3Map:   %-12s %8.1f / %8.1f", lump_names[i], bytes / 1024.0f, lump_freed[i] / 1024.0f);
+
+		total += bytes;
+		total_freed += lump_freed[i];
+	}
+
+	INFO("Q3Map:   %-12s %8.1f / %8.1f", "total", total / 1024.0f, total_freed / 1024.0f);
+}
+
+
+/**
+ *	@brief Build the traversal tree from the nodes and planes.
+ *	@return 1 on success, 0 if a node refers to something that is not there
+ *
+ *	Nodes are numbered breadth-first from the root, so the first
+ *	steps of every walk stay in the same few cache lines.  Nodes
+ *	the root can not reach are left out.
+ */
+int EQ3MapData::build_tree() {
+	int* order = NULL;			/* lump index of each tree node */
+	int* index = NULL;			/* tree index of each lump node, -1 until reached */
+	int i, j, k;
+
+	num_tree_nodes = 0;
+
+	if (!num_nodes)
+		return 1;
+
+	order = (int*)malloc(sizeof(int) * num_nodes);
+	index = (int*)malloc(sizeof(int) * num_nodes);
+	if (!order || !index) {
+		ERROR("Q3Map: Out of memory for the node tree.");
+		free(order);
+		free(index);
+		return 0;
+	}
+
+	for (i = 0; i < num_nodes; ++i)
+		index[i] = -1;
+
+	/* the list of nodes to visit is the tree order itself */
+	order[num_tree_nodes++] = 0;
+	index[0] = 0;
+
+	for (i = 0; i < num_tree_nodes; ++i) {
+		const struct q3bsp_node_t* node = &nodes[order[i]];
+		struct q3bsp_tree_node_t* t = &tree[i];
+		struct q3bsp_bounds_t* b = &tree_bounds[i];
+
+		if ((node->plane < 0) || (node->plane >= num_planes)) {
+			ERROR("Q3Map: Node %i has a bad plane.", order[i]);
+			goto fail;
+		}
+
+		const struct q3bsp_plane_t* plane = &planes[node->plane];
+
+		t->normal[0] = plane->normal[0];
+		t->normal[1] = plane->normal[1];
+		t->normal[2] = plane->normal[2];
+		t->dist = plane->dist;
+		t->node = order[i];
+
+		/* +-1 along an axis only needs that coordinate, and gives the same distance */
+		t->type = Q3_PLANE_NON_AXIAL;
+		for (k = 0; k < 3; ++k) {
+			if (((plane->normal[k] == 1.0f) || (plane->normal[k] == -1.0f)) &&
+				(plane->normal[(k + 1) % 3] == 0.0f) && (plane->normal[(k + 2) % 3] == 0.0f))
+				t->type = k;
+		}
+
+		for (k = 0; k < 3; ++k) {
+			b->mins[k] = node->mins[k];
+			b->maxs[k] = node->maxs[k];
+		}
+
+		for (j = 0; j < 2; ++j) {
+			int child = node->children[j];
+
+			if (child < 0) {
+				if (~child >= num_leafs) {
+					ERROR("Q3Map: Node %i has a bad leaf.", order[i]);
+					goto fail;
+				}
+
+				t->children[j] = child;
+				continue;
+			}
+
+			if (child >= num_nodes) {
+				ERROR("Q3Map: Node %i has a bad child.", order[i]);
+				goto fail;
+			}
+
+			if (index[child] < 0) {
+				index[child] = num_tree_nodes;
+				order[num_tree_nodes++] = child;
+			}
+
+			t->children[j] = index[child];
+		}
+	}
+
+	free(order);
+	free(index);
+	return 1;
+
+fail:
+	free(order);
+	free(index);
+	num_tree_nodes = 0;
+	return 0;
+}
+
+
+/**
+ *	@brief Build the leaf table culling walks through.
+ *	@return 1 on success, 0 if a leaf is in a cluster there is no room for
+ *
+ *	The leafs are sorted by cluster so each cluster's are next to
+ *	each other, with their bounds as floats and the bounds of every
+ *	cluster worked out.  Face ranges that run off the leaffaces lump
+ *	are emptied.
+ */
+int EQ3MapData::build_leaf_table() {
+	int i, j, c;
+
+	/* alloc_lumps() made room for a cluster a leaf */
+	num_clusters = 0;
+	for (i = 0; i < num_leafs; ++i) {
+		if (leafs[i].cluster >= num_leafs) {
+			ERROR("Q3Map: Leaf %i is in cluster %i, but there are only %i leafs.", i, leafs[i].cluster, num_leafs);
+			return 0;
+		}
+
+		if (leafs[i].cluster >= num_clusters)
+			num_clusters = leafs[i].cluster + 1;
+	}
+
+	/* the last group is the leafs in no cluster */
+	memset(cluster_leaf_start, 0, sizeof(int) * (num_clusters + 2));
+
+	/* count the leafs of each cluster, then place them */
+	for (i = 0; i < num_leafs; ++i) {
+		c = leafs[i].cluster;
+		++cluster_leaf_start[((c < 0) ? num_clusters : c) + 1];
+	}
+	for (c = 0; c <= num_clusters; ++c)
+		cluster_leaf_start[c + 1] += cluster_leaf_start[c];
+
+	for (i = 0; i < num_leafs; ++i) {
+		const struct q3bsp_leaf_t* leaf = &leafs[i];
+		c = ((leaf->cluster < 0) ? num_clusters : leaf->cluster);
+		int s = cluster_leaf_start[c]++;
+
+		leaf_cluster[s] = leaf->cluster;
+		leaf_original[s] = i;
+		leaf_sorted[i] = s;
+
+		for (j = 0; j < 3; ++j) {
+			leaf_mins[s * 3 + j] = leaf->mins[j];
+			leaf_maxs[s * 3 + j] = leaf->maxs[j];
+		}
+
+		if ((leaf->leafface < 0) || (leaf->num_leaffaces < 0) ||
+			(leaf->leafface + leaf->num_leaffaces > num_leaffaces)) {
+			WARNING("Q3Map: Leaf %i has faces past the end of the leaffaces lump.", i);
+			leaf_face_start[s] = 0;
+			leaf_face_count[s] = 0;
+		} else {
+			leaf_face_start[s] = leaf->leafface;
+			leaf_face_count[s] = leaf->num_leaffaces;
+		}
+	}
+
+	/* placing them moved every start to the next group's */
+	for (c = num_clusters; c > 0; --c)
+		cluster_leaf_start[c] = cluster_leaf_start[c - 1];
+	cluster_leaf_start[0] = 0;
+
+	for (c = 0; c <= num_clusters; ++c) {
+		float* mn = &cluster_mins[c * 3];
+		float* mx = &cluster_maxs[c * 3];
+
+		mn[0] = mn[1] = mn[2] = 0.0f;
+		mx[0] = mx[1] = mx[2] = 0.0f;
+
+		for (i = cluster_leaf_start[c]; i < cluster_leaf_start[c + 1]; ++i) {
+			for (j = 0; j < 3; ++j) {
+				if ((i == cluster_leaf_start[c]) || (leaf_mins[i * 3 + j] < mn[j]))
+					mn[j] = leaf_mins[i * 3 + j];
+				if ((i == cluster_leaf_start[c]) || (leaf_maxs[i * 3 + j] > mx[j]))
+					mx[j] = leaf_maxs[i * 3 + j];
+			}
+		}
+	}
+
+	return 1;
+}
+
+
+/**
+ *	@brief Find the textures and lightmaps used by the faces of each cluster.
+ *
+ *	Also finds the middle of each cluster, prefetch requests are
+ *	prioritized by the distance to it.
+ */
+void EQ3MapData::build_cluster_resources() {
+	int* texture_mark = NULL;
+	int* lightmap_mark = NULL;
+	int i, j, c, pass;
+
+	if (!num_clusters)
+		return;
+
+	texture_mark = (int*)malloc(sizeof(int) * (num_textures + 1));
+	lightmap_mark = (int*)malloc(sizeof(int) * (num_lightmaps + 1));
+	cluster_texture_start = (int*)calloc(num_clusters + 1, sizeof(int));
+	cluster_lightmap_start = (int*)calloc(num_clusters + 1, sizeof(int));
+	cluster_centers = (float*)malloc(sizeof(float) * 3 * num_clusters);
+
+	if (!texture_mark || !lightmap_mark || !cluster_texture_start || !cluster_lightmap_start || !cluster_centers) {
+		ERROR("Q3Map: Out of memory for cluster resources.");
+		goto fail;
+	}
+
+	/* count the unique textures and lightmaps of each cluster, then fill them in */
+	for (pass = 0; pass < 2; ++pass) {
+		int num_t = 0, num_l = 0;
+
+		for (i = 0; i < num_textures; ++i)
+			texture_mark[i] = -1;
+		for (i = 0; i < num_lightmaps; ++i)
+			lightmap_mark[i] = -1;
+
+		for (c = 0; c < num_clusters; ++c) {
+			cluster_texture_start[c] = num_t;
+			cluster_lightmap_start[c] = num_l;
+
+			for (i = cluster_leaf_start[c]; i < cluster_leaf_start[c + 1]; ++i) {
+				for (j = 0; j < leaf_face_count[i]; ++j) {
+					struct q3bsp_face_t* face = &faces[leaffaces[leaf_face_start[i] + j].face];
+
+					if ((face->texture >= 0) && (face->texture < num_textures) && (texture_mark[face->texture] != c)) {
+						texture_mark[face->texture] = c;
+						if (pass)
+							cluster_textures[num_t] = face->texture;
+						++num_t;
+					}
+
+					if ((face->lm_index >= 0) && (face->lm_index < num_lightmaps) && (lightmap_mark[face->lm_index] != c)) {
+						lightmap_mark[face->lm_index] = c;
+						if (pass)
+							cluster_lightmaps[num_l] = face->lm_index;
+						++num_l;
+					}
+				}
+			}
+		}
+
+		cluster_texture_start[num_clusters] = num_t;
+		cluster_lightmap_start[num_clusters] = num_l;
+
+		if (!pass) {
+			cluster_textures = (int*)malloc(sizeof(int) * (num_t + 1));
+			cluster_lightmaps = (int*)malloc(sizeof(int) * (num_l + 1));
+
+			if (!cluster_textures || !cluster_lightmaps) {
+				ERROR("Q3Map: Out of memory for cluster resources.");
+				goto fail;
+			}
+		}
+	}
+
+	/* middle of the bounds of each cluster's leafs */
+	for (c = 0; c < num_clusters; ++c) {
+		for (j = 0; j < 3; ++j)
+			cluster_centers[c * 3 + j] = (cluster_mins[c * 3 + j] + cluster_maxs[c * 3 + j]) * 0.5f;
+	}
+
+	INFO("Q3Map: %i clusters reference %i textures and %i lightmaps.", num_clusters,
+		 cluster_texture_start[num_clusters], cluster_lightmap_start[num_clusters]);
+
+	free(texture_mark);
+	free(lightmap_mark);
+	return;
+
+fail:
+	/* the map still draws, it just won't prefetch */
+	free(texture_mark);
+	free(lightmap_mark);
+	free(cluster_texture_start);
+	free(cluster_textures);
+	free(cluster_lightmap_start);
+	free(cluster_lightmaps);
+	free(cluster_centers);
+	cluster_texture_start = NULL;
+	cluster_textures = NULL;
+	cluster_lightmap_start = NULL;
+	cluster_lightmaps = NULL;
+	cluster_centers = NULL;
+}
+
+
+EQ3Map::EQ3Map() {
+	static struct entity_loader_callbacks_t _entity_loader_callbacks[] = {
+		{	"info_player_deathmatch",		&EQ3Map::load_entity_info_player_deathmatch	},
+		{	NULL,							NULL										}
+	};
+
+	entity_loader_callbacks = _entity_loader_callbacks;
+
+	memset(spawn_points, 0, sizeof(struct q3bsp_spawn_point_t) * Q3_MAX_SPAWN_POINTS);
+	num_spawn_points = 0;
+
+	data = NULL;
+
+	scratch.checkcount = 0;
+	scratch.brush_stamps = NULL;
+	scratch.num_brushes = 0;
+	scratch.patch_stamps = NULL;
+	scratch.num_patches = 0;
+
+	memset(batch_scratch, 0, sizeof(batch_scratch));
+	memset((void*)batch_scratch_busy, 0, sizeof(batch_scratch_busy));
+	num_batch_scratch = 0;
+
+	batch_order = NULL;
+	batch_keys = NULL;
+	batch_capacity = 0;
+
+	lean = 0;
+	headless = 0;
+	arena = NULL;
+
+	prefetch_cluster = -2;
+	lightmap_priority = NULL;
+
+	memset(&vis, 0, sizeof(vis));
+	vis.cluster = -2;
+}
+
+
+EQ3Map::~EQ3Map() {
+	if (data)
+		data->release();
+
+	free(lightmap_priority);
+	free_vis();
+	trace_scratch_free(&scratch);
+
+	for (int i = 0; i < num_batch_scratch; ++i)
+		trace_scratch_free(&batch_scratch[i]);
+
+	free(batch_order);
+	free(batch_keys);
+}
+
+
+/**
+ *	@brief Choose whether to keep render-only data after uploading it.
+ *	@param enabled	1 to free vertexes, meshverts and lightmap pixels once OpenGL has them
+ *
+ *	Collision and visibility data is always kept.  Call before load().
+ */
+void EQ3Map::set_lean(int enabled) {
+	lean = enabled;
+}
 
-		glGenTextures(1, text_id);
 
-		glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+/**
+ *	@brief Choose whether to load the map without OpenGL.
+ *	@param enabled	1 to load only what collision and visibility need
+ *
+ *	No textures, lightmaps or vertex buffers are made, so the map
+ *	can be loaded for the simulation without a GL context, but not
+ *	drawn.  Call before load().
+ */
+void EQ3Map::set_headless(int enabled) {
+	headless = enabled;
+}
+
+
+/**
+ *	@brief Load the lumps into an arena that outlives the map.
+ *	@param arena	The arena, emptied by load() and when the lumps are freed
+ *
+ *	Reusing one arena for each map that is loaded saves going back
+ *	to the heap, which fragments it over many map changes.  Only one
+ *	file's lumps fit in an arena at a time; if it is in use when
+ *	the map is loaded, or none is given, the lumps get their own.
+ *	Call before load().
+ */
+void EQ3Map::set_arena(EArena* arena) {
+	this->arena = arena;
+}
+
 
-		glBindTexture(GL_TEXTURE_2D, *text_id);
+/**
+ *	@brief Load the specified Quake3 map.
+ *
+ *	If another map already has the file loaded its data is shared.
+ */
+int EQ3Map::load(const char* file) {
+	data = EQ3MapData::acquire(file, lean, headless, arena);
+	if (!data)
+		return 0;
+
+	lightmap_priority = (float*)malloc(sizeof(float) * (data->num_lightmaps + 1));
+	if (!lightmap_priority) {
+		ERROR("Q3Map: Out of memory for lightmaps.");
+		data->release();
+		data = NULL;
+		return 0;
+	}
+
+	for (int i = 0; i < data->num_lightmaps; ++i)
+		lightmap_priority[i] = -1.0f;
+
+	if (!init_vis()) {
+		data->release();
+		data = NULL;
+		return 0;
+	}
 
-		ETextureManager::modify_gamma((byte*)lightmaps[i].map, 128, 128, 3, 4.0f);
+	if (!trace_scratch_init(&scratch, data->num_brushes, data->num_patches)) {
+		data->release();
+		data = NULL;
+		return 0;
+	}
 
-		gluBuild2DMipmaps(GL_TEXTURE_2D, 3, 128, 128, GL_RGB, GL_UNSIGNED_BYTE, lightmaps[i].map);
+	/* Parse the entities */
+	parse_entities();
 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
 
-		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	/* display the spawn points */
+	int i = 0;
+	for (; i < num_spawn_points; ++i) {
+		INFO("Spawn Point %i: Angle = %f\t\tOrigin = (%f, %f, %f)",
+			i,
+			spawn_points[i].angle,
+			spawn_points[i].origin.x,
+			spawn_points[i].origin.y,
+			spawn_points[i].origin.z
+		);
 	}
+
+	return 1;
+}
+
+
+/**
+ *	@brief Print the memory each lump uses and how much has been released.
+ */
+void EQ3Map::report_memory() const {
+	if (data)
+		data->report_memory();
 }
 
 
@@ -447,7 +1303,7 @@ void EQ3Map::load_lightmaps() {
  *	@brief Parse the entities lump
  */
 void EQ3Map::parse_entities() {
-	const char* s = entities.ents;
+	const char* s = data->entities.ents;
 	const char* b = NULL;
 
 	char key[256];
@@ -545,7 +1401,7 @@ void EQ3Map::load_entity_info_player_deathmatch(const char* ent) {
 	 */
 
 	/* if we are beyond the limit of spawn points then ignore this one */
-	if (num_spawn_points > Q3_MAX_SPAWN_POINTS)
+	if (num_spawn_points >= Q3_MAX_SPAWN_POINTS)
 		return;
 
 	++ent;
@@ -583,7 +1439,7 @@ void EQ3Map::load_entity_info_player_deathmatch(const char* ent) {
 int EQ3Map::get_spawn_point(int index, float* angle, vector3* position) {
 	assert(angle && position);
 
-	if ((index < 0) || (index > num_spawn_points))
+	if ((index < 0) || (index >= num_spawn_points))
 		return 0;
 
 	*angle = spawn_points[index].angle;
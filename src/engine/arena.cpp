@@ -0,0 +1,128 @@
+/**
+ *	@file arena.cpp
+ *	@brief Linear allocator for data that lives as long as a map.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "definitions.h"
+#include "engine/arena.h"
+
+
+#define ALIGN_UP(x, a)			(((x) + ((a) - 1)) & ~((size_t)(a) - 1))
+#define ALIGN_DOWN(x, a)		((x) & ~((size_t)(a) - 1))
+
+
+EArena::EArena() {
+	base = NULL;
+	capacity = 0;
+	used = 0;
+}
+
+
+EArena::~EArena() {
+	if (base)
+		munmap(base, capacity);
+}
+
+
+/**
+ *	@brief Make room for at least bytes and empty the arena.
+ *	@param bytes	Total of the coming allocations, with their alignment
+ *	@return 1 on success, 0 if the memory could not be mapped
+ *
+ *	The block is reused if it is big enough, otherwise it is
+ *	replaced by a bigger one.  Pointers handed out before are
+ *	no longer valid either way.
+ */
+int EArena::reserve(size_t bytes) {
+	used = 0;
+
+	if (bytes <= capacity)
+		return 1;
+
+	if (base)
+		munmap(base, capacity);
+
+	capacity = ALIGN_UP(bytes, ARENA_PAGE_ALIGN);
+	base = (byte*)mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (base == MAP_FAILED) {
+		ERROR("Arena: Out of memory for %lu KB.", (unsigned long)(capacity / 1024));
+		base = NULL;
+		capacity = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/**
+ *	@brief Free everything allocated from the arena.
+ *
+ *	The block itself is kept for the next reserve().
+ */
+void EArena::reset() {
+	used = 0;
+}
+
+
+/**
+ *	@brief Allocate from the arena.
+ *	@param bytes	Size of the allocation
+ *	@param align	Power of two the address is a multiple of
+ *	@return The memory, or NULL if the arena is full
+ *
+ *	The memory is not cleared; it is zero the first time the
+ *	block is used but holds the previous map after a reset().
+ */
+void* EArena::alloc(size_t bytes, size_t align) {
+	size_t start = ALIGN_UP(used, align);
+
+	if (!base || (start + bytes > capacity)) {
+		ERROR("Arena: Out of space for %lu bytes (%lu of %lu used).", (unsigned long)bytes,
+			  (unsigned long)used, (unsigned long)capacity);
+		return NULL;
+	}
+
+	used = start + bytes;
+	return (base + start);
+}
+
+
+/**
+ *	@brief Give the pages of an allocation back to the system.
+ *	@param ptr		Start of the memory
+ *	@param bytes	Size of the memory
+ *	@return Bytes released
+ *
+ *	Only pages entirely inside the range are released, so
+ *	allocations that are to be released should be made with
+ *	ARENA_PAGE_ALIGN and followed by another page aligned one.
+ */
+size_t EArena::release(void* ptr, size_t bytes) {
+	size_t start = ALIGN_UP((size_t)ptr, ARENA_PAGE_ALIGN);
+	size_t end = ALIGN_DOWN((size_t)ptr + bytes, ARENA_PAGE_ALIGN);
+
+	if (!ptr || (end <= start))
+		return 0;
+
+	if (madvise((void*)start, end - start, MADV_DONTNEED))
+		return 0;
+
+	return (end - start);
+}
+
+
+size_t EArena::get_capacity() const {
+	return capacity;
+}
+
+
+size_t EArena::get_used() const {
+	return used;
+}
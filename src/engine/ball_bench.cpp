@@ -0,0 +1,122 @@
+/**
+ *	@file ball_bench.cpp
+ *	@brief Timing of balls rolling around a map.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "definitions.h"
+#include "engine/balls.h"
+#include "engine/simulation.h"
+#include "engine/bench.h"
+#include "engine/ball_bench.h"
+
+
+/**
+ *	@brief Scatter balls over the floors of a map.
+ *	@return Balls placed
+ *
+ *	Spots are picked at random in the map's bounds and kept if a
+ *	ball fits there and there is something under it, so balls are
+ *	not left falling through the void around the map.
+ */
+static int bench_place(EQ3Map* map, EBallSet* balls, int count) {
+	float mins[3], maxs[3];
+	float p[3], below[3];
+	struct trace_scratch_t scratch;
+	struct trace_t tr;
+	int placed = 0;
+
+	if (!map->get_bounds(mins, maxs) ||
+		!trace_scratch_init(&scratch, map->get_num_brushes(), map->get_num_patches()))
+		return 0;
+
+	srand(BENCH_SEED);
+	for (int tries = 0; (tries < count * 100) && (placed < count); ++tries) {
+		for (int k = 0; k < 3; ++k)
+			p[k] = mins[k] + (maxs[k] - mins[k]) * (rand() / (float)RAND_MAX);
+
+		map->trace(&tr, TRACE_SPHERE, p, p, NULL, NULL, balls->get_radius(), MASK_SOLID, &scratch);
+		if (tr.start_solid)
+			continue;
+
+		below[0] = p[0];
+		below[1] = p[1] - BALL_BENCH_MAX_DROP;
+		below[2] = p[2];
+		map->trace(&tr, TRACE_RAY, p, below, NULL, NULL, 0.0f, MASK_SOLID, &scratch);
+		if (tr.fraction >= 1.0f)
+			continue;
+
+		placed += balls->add(p, NULL);
+	}
+
+	trace_scratch_free(&scratch);
+	return placed;
+}
+
+
+/**
+ *	@brief Time a run of ticks.
+ */
+static void bench_run(EBallSet* balls, const char* how) {
+	float gravity[3];
+	double t;
+
+	EBallSet::tilt_gravity(0.0f, 0.0f, gravity);
+
+	for (int i = 0; i < BALL_BENCH_SETTLE_TICKS; ++i)
+		balls->tick(SIM_TICK_SECONDS, gravity);
+
+	/* tip the level so the balls keep rolling while timed */
+	EBallSet::tilt_gravity(10.0f, 5.0f, gravity);
+
+	t = bench_time_ms();
+	for (int i = 0; i < BALL_BENCH_TICKS; ++i)
+		balls->tick(SIM_TICK_SECONDS, gravity);
+	t = (bench_time_ms() - t);
+
+	INFO("BallBench: %-22s %5i balls  %7.3f ms/tick  %6.3f us/ball  %5.1f%% of a tick",
+		 how, balls->get_count(), t / BALL_BENCH_TICKS, (t * 1000.0) / ((double)BALL_BENCH_TICKS * balls->get_count()),
+		 (t * 100000.0) / ((double)BALL_BENCH_TICKS * SIM_TICK_USEC));
+}
+
+
+/**
+ *	@brief Time balls falling and rolling around a loaded map.
+ *	@param map		The map
+ *	@param pool		Threads for the traces
+ *	@param count	Balls
+ *	@return 1 on success, 0 on failure
+ *
+ *	The balls are scattered, left to settle and then timed rolling
+ *	on a tilted level, on this thread and with their traces over
+ *	the pool.
+ */
+int ball_bench(EQ3Map* map, EThreadPool* pool, int count) {
+	EBallSet balls;
+	int placed;
+
+	if (count <= 0)
+		return 0;
+
+	INFO("BallBench: %i balls, %i ticks, %i worker threads.", count, BALL_BENCH_TICKS, (pool ? pool->get_num_threads() : 0));
+
+	for (int run = 0; run < 2; ++run) {
+		EThreadPool* p = (run ? pool : NULL);
+
+		if (!balls.init(count, BALL_DEFAULT_RADIUS, map, p))
+			return 0;
+
+		placed = bench_place(map, &balls, count);
+		if (!placed) {
+			ERROR("BallBench: No room for balls in the map.");
+			return 0;
+		}
+
+		bench_run(&balls, (p ? "traces on the pool" : "one thread"));
+	}
+
+	return 1;
+}
@@ -0,0 +1,509 @@
+/**
+ *	@file balls.cpp
+ *	@brief Balls rolling around a map.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "definitions.h"
+#include "math/mat.h"
+#include "math/simd.h"
+#include "engine/Q3map.h"
+#include "engine/balls.h"
+
+
+/**
+ *	@brief Bucket of the grid cell x, y, z.
+ */
+static inline int cell_hash(int x, int y, int z, int mask) {
+	return ((((unsigned int)x * 73856093u) ^ ((unsigned int)y * 19349663u) ^ ((unsigned int)z * 83492791u)) & mask);
+}
+
+
+/**
+ *	@brief Grid cell of a coordinate.
+ *
+ *	Far away coordinates are clamped to keep within an int.
+ */
+static inline int cell_coord(float f, float scale) {
+	f *= scale;
+	RANGE_BOUND(f, -1000000.0f, 1000000.0f);
+	return (int)floorf(f);
+}
+
+
+EBallSet::EBallSet() {
+	count = 0;
+	capacity = 0;
+	radius = BALL_DEFAULT_RADIUS;
+
+	positions = NULL;
+	prev_positions = NULL;
+	velocities = NULL;
+	targets = NULL;
+
+	grid_mask = 0;
+	cell_scale = 0.0f;
+	cell_start = NULL;
+	cell_balls = NULL;
+
+	move_balls = NULL;
+	move_time = NULL;
+	move_starts = NULL;
+	move_ends = NULL;
+	move_fractions = NULL;
+	move_end_positions = NULL;
+	move_normals = NULL;
+	move_flags = NULL;
+
+	block = NULL;
+
+	map = NULL;
+	pool = NULL;
+}
+
+
+EBallSet::~EBallSet() {
+	free(block);
+}
+
+
+/**
+ *	@brief Make room for the balls.
+ *	@param max_balls	Most balls there can be
+ *	@param radius		Of every ball
+ *	@param map			What the balls bounce off, or NULL
+ *	@param pool			Threads to trace the moves on, or NULL
+ *	@return 1 on success, 0 if out of memory
+ */
+int EBallSet::init(int max_balls, float radius, EQ3Map* map, EThreadPool* pool) {
+	float mins[3], maxs[3];
+	int buckets;
+	float* p;
+
+	free(block);
+	block = NULL;
+	count = 0;
+
+	/* whole groups of 4 for SSE, the extra balls are never used */
+	capacity = ((max_balls + 3) & ~3);
+	this->radius = radius;
+	this->map = map;
+	this->pool = pool;
+
+	buckets = 64;
+	while (buckets < capacity * 2)
+		buckets <<= 1;
+	grid_mask = (buckets - 1);
+	cell_scale = (1.0f / (radius * 2.0f));
+
+	/* 8 arrays of 3 floats, 2 floats and 3 ints a ball, then the bucket starts */
+	block = calloc(1, sizeof(float) * capacity * 26 + sizeof(int) * capacity * 3 + sizeof(int) * (buckets + 1));
+	if (!block) {
+		ERROR("Balls: Out of memory for %i balls.", max_balls);
+		capacity = 0;
+		return 0;
+	}
+
+	p = (float*)block;
+	positions = p;				p += capacity * 3;
+	prev_positions = p;			p += capacity * 3;
+	velocities = p;				p += capacity * 3;
+	targets = p;				p += capacity * 3;
+	move_starts = p;			p += capacity * 3;
+	move_ends = p;				p += capacity * 3;
+	move_end_positions = p;		p += capacity * 3;
+	move_normals = p;			p += capacity * 3;
+	move_fractions = p;			p += capacity;
+	move_time = p;				p += capacity;
+	move_balls = (int*)p;
+	move_flags = move_balls + capacity;
+	cell_balls = move_flags + capacity;
+	cell_start = cell_balls + capacity;
+
+	if (map && map->get_bounds(mins, maxs)) {
+		for (int i = 0; i < 3; ++i) {
+			lost_mins[i] = (mins[i] - BALL_LOST_DISTANCE);
+			lost_maxs[i] = (maxs[i] + BALL_LOST_DISTANCE);
+		}
+	} else {
+		for (int i = 0; i < 3; ++i) {
+			lost_mins[i] = -1000000.0f;
+			lost_maxs[i] = 1000000.0f;
+		}
+	}
+
+	return 1;
+}
+
+
+/**
+ *	@brief Add a ball.
+ *	@param position	3 floats
+ *	@param velocity	3 floats, or NULL for at rest
+ *	@return 1 on success, 0 if there are as many balls as there can be
+ */
+int EBallSet::add(const float* position, const float* velocity) {
+	if (count >= capacity)
+		return 0;
+
+	for (int i = 0; i < 3; ++i) {
+		positions[count * 3 + i] = position[i];
+		prev_positions[count * 3 + i] = position[i];
+		velocities[count * 3 + i] = (velocity ? velocity[i] : 0.0f);
+	}
+
+	++count;
+	return 1;
+}
+
+
+/**
+ *	@brief Move the balls along.
+ *	@param dt		Seconds
+ *	@param gravity	Acceleration, 3 floats
+ *
+ *	Balls first push off the ones they touch, then fall and move
+ *	through the map as far as it lets them.
+ */
+void EBallSet::tick(float dt, const float* gravity) {
+	if (!count)
+		return;
+
+	memcpy(prev_positions, positions, sizeof(float) * count * 3);
+
+	build_grid();
+	collide_balls(dt);
+	integrate(dt, gravity);
+	move(dt);
+	remove_lost();
+}
+
+
+/**
+ *	@brief Speed up the balls and work out where they are headed.
+ *
+ *	Runs over the position and velocity arrays as flat floats, 4
+ *	balls at a time.  Three registers hold gravity repeating so that
+ *	each lines up with its 4 floats of x, y and z.
+ */
+void EBallSet::integrate(float dt, const float* gravity) {
+	float drag = (1.0f - (BALL_DRAG * dt));
+	int n = (((count + 3) & ~3) * 3);
+	int i = 0;
+
+#ifdef MATH_SIMD
+	__m128 g0 = _mm_setr_ps(gravity[0] * dt, gravity[1] * dt, gravity[2] * dt, gravity[0] * dt);
+	__m128 g1 = _mm_setr_ps(gravity[1] * dt, gravity[2] * dt, gravity[0] * dt, gravity[1] * dt);
+	__m128 g2 = _mm_setr_ps(gravity[2] * dt, gravity[0] * dt, gravity[1] * dt, gravity[2] * dt);
+	__m128 d = _mm_set1_ps(drag);
+	__m128 t = _mm_set1_ps(dt);
+
+	for (; i < n; i += 12) {
+		__m128 v0 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&velocities[i + 0]), d), g0);
+		__m128 v1 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&velocities[i + 4]), d), g1);
+		__m128 v2 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&velocities[i + 8]), d), g2);
+
+		_mm_storeu_ps(&velocities[i + 0], v0);
+		_mm_storeu_ps(&velocities[i + 4], v1);
+		_mm_storeu_ps(&velocities[i + 8], v2);
+
+		_mm_storeu_ps(&targets[i + 0], _mm_add_ps(_mm_loadu_ps(&positions[i + 0]), _mm_mul_ps(v0, t)));
+		_mm_storeu_ps(&targets[i + 4], _mm_add_ps(_mm_loadu_ps(&positions[i + 4]), _mm_mul_ps(v1, t)));
+		_mm_storeu_ps(&targets[i + 8], _mm_add_ps(_mm_loadu_ps(&positions[i + 8]), _mm_mul_ps(v2, t)));
+	}
+#endif
+
+	for (; i < n; ++i) {
+		velocities[i] = ((velocities[i] * drag) + (gravity[i % 3] * dt));
+		targets[i] = (positions[i] + (velocities[i] * dt));
+	}
+}
+
+
+/**
+ *	@brief Sort the balls into the buckets of the cells they are in.
+ */
+void EBallSet::build_grid() {
+	int buckets = (grid_mask + 1);
+	int* hashes = move_balls;
+	int i, h;
+
+	memset(cell_start, 0, sizeof(int) * (buckets + 1));
+
+	for (i = 0; i < count; ++i) {
+		const float* p = &positions[i * 3];
+
+		hashes[i] = cell_hash(cell_coord(p[0], cell_scale), cell_coord(p[1], cell_scale),
+							  cell_coord(p[2], cell_scale), grid_mask);
+		++cell_start[hashes[i] + 1];
+	}
+
+	for (h = 0; h < buckets; ++h)
+		cell_start[h + 1] += cell_start[h];
+
+	/* fill each bucket moving its start up to the next one's, then move them back */
+	for (i = 0; i < count; ++i)
+		cell_balls[cell_start[hashes[i]]++] = i;
+
+	for (h = buckets; h > 0; --h)
+		cell_start[h] = cell_start[h - 1];
+	cell_start[0] = 0;
+}
+
+
+/**
+ *	@brief Bounce apart balls that touch.
+ *
+ *	Each ball looks through the 27 cells around it for balls after
+ *	it, so each pair is seen once.  Cells that hash to the same
+ *	bucket are only looked through once.  Overlapping balls are
+ *	given speed apart rather than moved, so they never get pushed
+ *	through the map.
+ */
+void EBallSet::collide_balls(float dt) {
+	float diameter = (radius * 2.0f);
+	int buckets[27];
+	int i, j, k, b;
+
+	for (i = 0; i < count; ++i) {
+		const float* pi = &positions[i * 3];
+		float* vi = &velocities[i * 3];
+		int cx = cell_coord(pi[0], cell_scale);
+		int cy = cell_coord(pi[1], cell_scale);
+		int cz = cell_coord(pi[2], cell_scale);
+		int num_buckets = 0;
+
+		for (int dx = -1; dx <= 1; ++dx) {
+			for (int dy = -1; dy <= 1; ++dy) {
+				for (int dz = -1; dz <= 1; ++dz) {
+					int h = cell_hash(cx + dx, cy + dy, cz + dz, grid_mask);
+
+					for (b = 0; b < num_buckets; ++b) {
+						if (buckets[b] == h)
+							break;
+					}
+					if (b < num_buckets)
+						continue;
+					buckets[num_buckets++] = h;
+
+					for (k = cell_start[h]; k < cell_start[h + 1]; ++k) {
+						j = cell_balls[k];
+						if (j <= i)
+							continue;
+
+						const float* pj = &positions[j * 3];
+						float* vj = &velocities[j * 3];
+						float d[3] = { pj[0] - pi[0], pj[1] - pi[1], pj[2] - pi[2] };
+						float dist = ((d[0] * d[0]) + (d[1] * d[1]) + (d[2] * d[2]));
+
+						if ((dist >= (diameter * diameter)) || (dist <= 0.0f))
+							continue;
+
+						dist = sqrtf(dist);
+						d[0] /= dist;
+						d[1] /= dist;
+						d[2] /= dist;
+
+						/* speed apart along the line between them, negative if closing */
+						float apart = (((vj[0] - vi[0]) * d[0]) + ((vj[1] - vi[1]) * d[1]) + ((vj[2] - vi[2]) * d[2]));
+						float want = (((diameter - dist) * BALL_SEPARATION) / dt);
+
+						if (apart < 0.0f) {
+							float bounce = (-apart * BALL_BALL_RESTITUTION);
+							if (bounce > want)
+								want = bounce;
+						}
+
+						if (apart >= want)
+							continue;
+
+						/* the same mass, so each takes half */
+						float push = ((want - apart) * 0.5f);
+						vi[0] -= (d[0] * push);
+						vi[1] -= (d[1] * push);
+						vi[2] -= (d[2] * push);
+						vj[0] += (d[0] * push);
+						vj[1] += (d[1] * push);
+						vj[2] += (d[2] * push);
+					}
+				}
+			}
+		}
+	}
+}
+
+
+/**
+ *	@brief Move the balls to their targets through the map.
+ *
+ *	All the balls are traced as one batch.  Those that hit
+ *	something bounce, or slide if hitting slowly, and are traced
+ *	again for the rest of the tick, up to BALL_MAX_BUMPS times.
+ */
+void EBallSet::move(float dt) {
+	struct trace_batch_t batch;
+	int num_moving = count;
+	int i, k;
+
+	if (!map) {
+		memcpy(positions, targets, sizeof(float) * count * 3);
+		return;
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	batch.type = TRACE_SPHERE;
+	batch.mask = MASK_SOLID;
+	batch.radius = radius;
+	batch.fractions = move_fractions;
+	batch.end_positions = move_end_positions;
+	batch.normals = move_normals;
+	batch.flags = move_flags;
+
+	/* the first bump traces every ball straight from the arrays */
+	batch.starts = positions;
+	batch.ends = targets;
+	for (i = 0; i < count; ++i) {
+		move_balls[i] = i;
+		move_time[i] = dt;
+	}
+
+	for (int bump = 0; (bump < BALL_MAX_BUMPS) && num_moving; ++bump) {
+		batch.count = num_moving;
+		map->trace_batch(&batch, pool);
+
+		int still_moving = 0;
+		for (k = 0; k < num_moving; ++k) {
+			int ball = move_balls[k];
+			float* p = &positions[ball * 3];
+			float* v = &velocities[ball * 3];
+			const float* n = &move_normals[k * 3];
+
+			/* stuck inside a brush, let it out */
+			if (move_flags[k] & TRACE_ALL_SOLID) {
+				p[0] = batch.ends[k * 3 + 0];
+				p[1] = batch.ends[k * 3 + 1];
+				p[2] = batch.ends[k * 3 + 2];
+				continue;
+			}
+
+			p[0] = move_end_positions[k * 3 + 0];
+			p[1] = move_end_positions[k * 3 + 1];
+			p[2] = move_end_positions[k * 3 + 2];
+
+			if (move_fractions[k] >= 1.0f)
+				continue;
+
+			float into = ((v[0] * n[0]) + (v[1] * n[1]) + (v[2] * n[2]));
+			if (into < 0.0f) {
+				into *= ((-into > BALL_REST_SPEED) ? (1.0f + BALL_RESTITUTION) : 1.0f);
+				v[0] -= (n[0] * into);
+				v[1] -= (n[1] * into);
+				v[2] -= (n[2] * into);
+			}
+
+			float time_left = (move_time[ball] * (1.0f - move_fractions[k]));
+			if (time_left <= 0.0f)
+				continue;
+
+			/* k only grows faster than still_moving, so nothing unread is overwritten */
+			move_time[ball] = time_left;
+			move_balls[still_moving] = ball;
+			for (i = 0; i < 3; ++i) {
+				move_starts[still_moving * 3 + i] = p[i];
+				move_ends[still_moving * 3 + i] = (p[i] + (v[i] * time_left));
+			}
+			++still_moving;
+		}
+
+		batch.starts = move_starts;
+		batch.ends = move_ends;
+		num_moving = still_moving;
+	}
+}
+
+
+/**
+ *	@brief Take out balls that have left the map.
+ *
+ *	The last ball takes the place of each one taken out.
+ */
+void EBallSet::remove_lost() {
+	for (int i = 0; i < count; ++i) {
+		const float* p = &positions[i * 3];
+
+		if ((p[0] >= lost_mins[0]) && (p[0] <= lost_maxs[0]) &&
+			(p[1] >= lost_mins[1]) && (p[1] <= lost_maxs[1]) &&
+			(p[2] >= lost_mins[2]) && (p[2] <= lost_maxs[2]))
+			continue;
+
+		--count;
+		memcpy(&positions[i * 3], &positions[count * 3], sizeof(float) * 3);
+		memcpy(&prev_positions[i * 3], &prev_positions[count * 3], sizeof(float) * 3);
+		memcpy(&velocities[i * 3], &velocities[count * 3], sizeof(float) * 3);
+		--i;
+	}
+}
+
+
+/**
+ *	@brief Number of balls.
+ */
+int EBallSet::get_count() const {
+	return count;
+}
+
+
+/**
+ *	@brief Radius of every ball.
+ */
+float EBallSet::get_radius() const {
+	return radius;
+}
+
+
+/**
+ *	@brief Where the balls are, 3 floats each.
+ */
+const float* EBallSet::get_positions() const {
+	return positions;
+}
+
+
+/**
+ *	@brief Where the balls were before the last tick, 3 floats each.
+ */
+const float* EBallSet::get_prev_positions() const {
+	return prev_positions;
+}
+
+
+/**
+ *	@brief How fast the balls are going, 3 floats each.
+ */
+const float* EBallSet::get_velocities() const {
+	return velocities;
+}
+
+
+/**
+ *	@brief [Static] Which way is down with the level tilted.
+ *	@param roll		Degrees, as the wiimote
+ *	@param pitch	Degrees, as the wiimote
+ *	@param gravity	Set to 3 floats
+ *
+ *	The renderer turns the map by roll about z and then pitch about
+ *	x, so gravity straight down the screen is turned back by the
+ *	opposite rotations to get it in map coordinates.
+ */
+void EBallSet::tilt_gravity(float roll, float pitch, float* gravity) {
+	float r = RADIAN(roll);
+	float p = RADIAN(pitch);
+
+	gravity[0] = (-BALL_GRAVITY * sinf(r));
+	gravity[1] = (-BALL_GRAVITY * cosf(r) * cosf(p));
+	gravity[2] = (BALL_GRAVITY * cosf(r) * sinf(p));
+}
@@ -0,0 +1,21 @@
+/**
+ *	@file bench.cpp
+ *	@brief What the benches of "make bench" share.
+ */
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "definitions.h"
+#include "engine/bench.h"
+
+
+/**
+ *	@brief Milliseconds since some point in the past.
+ */
+double bench_time_ms() {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0);
+}
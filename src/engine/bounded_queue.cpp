@@ -0,0 +1,120 @@
+/**
+ *	@file bounded_queue.cpp
+ *	@brief Fixed capacity queue for handing work between threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "definitions.h"
+#include "engine/bounded_queue.h"
+
+
+EBoundedQueue::EBoundedQueue(int capacity) {
+	if (capacity < 1)
+		capacity = 1;
+
+	this->capacity = capacity;
+	items = (void**)malloc(sizeof(void*) * capacity);
+	head = 0;
+	count = 0;
+	closed = 0;
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&not_full, NULL);
+}
+
+
+EBoundedQueue::~EBoundedQueue() {
+	free(items);
+
+	pthread_cond_destroy(&not_full);
+	pthread_mutex_destroy(&lock);
+}
+
+
+/**
+ *	@brief Add an item, waiting for room if the queue is full.
+ *	@param item	The item to add
+ *	@return 1 if the item was queued, 0 if the queue has been closed
+ *
+ *	If 0 is returned the caller still owns the item.
+ */
+int EBoundedQueue::push(void* item) {
+	pthread_mutex_lock(&lock);
+
+	while ((count == capacity) && !closed)
+		pthread_cond_wait(&not_full, &lock);
+
+	if (closed) {
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+
+	items[(head + count) % capacity] = item;
+	++count;
+
+	pthread_mutex_unlock(&lock);
+	return 1;
+}
+
+
+/**
+ *	@brief Remove the oldest item without waiting.
+ *	@return The item, or NULL if the queue is empty
+ */
+void* EBoundedQueue::try_pop() {
+	void* item = NULL;
+
+	pthread_mutex_lock(&lock);
+
+	if (count) {
+		item = items[head];
+		head = (head + 1) % capacity;
+		--count;
+
+		pthread_cond_signal(&not_full);
+	}
+
+	pthread_mutex_unlock(&lock);
+	return item;
+}
+
+
+/**
+ *	@brief Refuse any further items and wake up blocked producers.
+ */
+void EBoundedQueue::close() {
+	pthread_mutex_lock(&lock);
+	closed = 1;
+	pthread_cond_broadcast(&not_full);
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ *	@brief Return 1 if the queue has been closed, 0 if not.
+ */
+int EBoundedQueue::is_closed() {
+	int c;
+
+	pthread_mutex_lock(&lock);
+	c = closed;
+	pthread_mutex_unlock(&lock);
+
+	return c;
+}
+
+
+/**
+ *	@brief Get the number of queued items.
+ */
+int EBoundedQueue::get_count() {
+	int c;
+
+	pthread_mutex_lock(&lock);
+	c = count;
+	pthread_mutex_unlock(&lock);
+
+	return c;
+}
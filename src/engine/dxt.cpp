@@ -0,0 +1,538 @@
+/**
+ *	@file dxt.cpp
+ *	@brief S3TC (BC1/BC3) block compression.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#include "definitions.h"
+#include "gl.h"
+#include "math/mat.h"
+#include "engine/dxt.h"
+
+
+/* least squares passes done by DXT_QUALITY_HIGH */
+#define DXT_REFINE_ITERATIONS		2
+
+/* power iterations used to find the principal axis */
+#define DXT_POWER_ITERATIONS		8
+
+
+/**
+ *	@struct dxt_job_t
+ *	@brief One level being compressed, shared by the threads.
+ */
+struct dxt_job_t {
+	const struct image_level_t* src;
+	struct image_level_t* dst;
+	int bpp;
+	int alpha;					/* 1 for BC3, 0 for BC1 */
+	int quality;
+	int blocks_x;
+};
+
+
+/**
+ *	@brief Pack an RGB colour into 5:6:5.
+ */
+static TB_INLINE unsigned short pack_565(const float* c) {
+	int r = (int)(c[0] * (31.0f / 255.0f) + 0.5f);
+	int g = (int)(c[1] * (63.0f / 255.0f) + 0.5f);
+	int b = (int)(c[2] * (31.0f / 255.0f) + 0.5f);
+
+	RANGE_BOUND(r, 0, 31);
+	RANGE_BOUND(g, 0, 63);
+	RANGE_BOUND(b, 0, 31);
+
+	return (unsigned short)((r << 11) | (g << 5) | b);
+}
+
+
+/**
+ *	@brief Expand a 5:6:5 colour to 8 bits per channel.
+ */
+static TB_INLINE void unpack_565(unsigned short c, int* rgb) {
+	int r = (c >> 11) & 31;
+	int g = (c >> 5) & 63;
+	int b = c & 31;
+
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+
+/**
+ *	@brief Copy a 4x4 block out of a level as RGBA, clamping at the edges.
+ */
+static void load_block(const struct image_level_t* src, int bpp, int bx, int by, byte* block) {
+	int x, y;
+
+	for (y = 0; y < 4; ++y) {
+		int sy = (by << 2) + y;
+		if (sy >= src->height)
+			sy = src->height - 1;
+
+		for (x = 0; x < 4; ++x, block += 4) {
+			int sx = (bx << 2) + x;
+			if (sx >= src->width)
+				sx = src->width - 1;
+
+			const byte* p = src->data + ((sy * src->width + sx) * bpp);
+			block[0] = p[0];
+			block[1] = p[1];
+			block[2] = p[2];
+			block[3] = (bpp == 4 ? p[3] : 255);
+		}
+	}
+}
+
+
+/**
+ *	@brief Per channel minimum and maximum of a block.
+ */
+static void block_bounds(const byte* block, int* mn, int* mx) {
+	int c;
+
+#ifdef __SSE2__
+	__m128i p0 = _mm_loadu_si128((const __m128i*)(block + 0));
+	__m128i p1 = _mm_loadu_si128((const __m128i*)(block + 16));
+	__m128i p2 = _mm_loadu_si128((const __m128i*)(block + 32));
+	__m128i p3 = _mm_loadu_si128((const __m128i*)(block + 48));
+
+	__m128i lo = _mm_min_epu8(_mm_min_epu8(p0, p1), _mm_min_epu8(p2, p3));
+	__m128i hi = _mm_max_epu8(_mm_max_epu8(p0, p1), _mm_max_epu8(p2, p3));
+
+	/* fold the four pixels down to one */
+	lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 8));
+	hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 8));
+	lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 4));
+	hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 4));
+
+	int l = _mm_cvtsi128_si32(lo);
+	int h = _mm_cvtsi128_si32(hi);
+
+	for (c = 0; c < 4; ++c) {
+		mn[c] = (l >> (c * 8)) & 0xff;
+		mx[c] = (h >> (c * 8)) & 0xff;
+	}
+#else
+	int i;
+
+	for (c = 0; c < 4; ++c) {
+		mn[c] = 255;
+		mx[c] = 0;
+	}
+
+	for (i = 0; i < 16; ++i) {
+		for (c = 0; c < 4; ++c) {
+			if (block[i * 4 + c] < mn[c])	mn[c] = block[i * 4 + c];
+			if (block[i * 4 + c] > mx[c])	mx[c] = block[i * 4 + c];
+		}
+	}
+#endif
+}
+
+
+#ifdef __SSE2__
+/**
+ *	@brief Squared RGB distance of 4 pixels to one colour.
+ *	@param px	4 RGBA pixels with alpha cleared
+ *	@param col	The colour as 16 bit lanes, twice
+ */
+static TB_INLINE __m128i distance4(__m128i px, __m128i col) {
+	const __m128i zero = _mm_setzero_si128();
+
+	__m128i dl = _mm_sub_epi16(_mm_unpacklo_epi8(px, zero), col);
+	__m128i dh = _mm_sub_epi16(_mm_unpackhi_epi8(px, zero), col);
+
+	/* (r^2 + g^2), (b^2 + 0) per pixel */
+	__m128 ml = _mm_castsi128_ps(_mm_madd_epi16(dl, dl));
+	__m128 mh = _mm_castsi128_ps(_mm_madd_epi16(dh, dh));
+
+	__m128i a = _mm_castps_si128(_mm_shuffle_ps(ml, mh, _MM_SHUFFLE(2, 0, 2, 0)));
+	__m128i b = _mm_castps_si128(_mm_shuffle_ps(ml, mh, _MM_SHUFFLE(3, 1, 3, 1)));
+
+	return _mm_add_epi32(a, b);
+}
+#endif
+
+
+/**
+ *	@brief Choose the nearest palette entry for every pixel.
+ *	@param block	16 RGBA pixels
+ *	@param c0		First endpoint
+ *	@param c1		Second endpoint
+ *	@param error	Set to the total squared error
+ *	@return The 32 bits of 2 bit indices
+ */
+static unsigned int pick_indices(const byte* block, unsigned short c0, unsigned short c1, int* error) {
+	int pal[4][3];
+	unsigned int indices = 0;
+	int i, k;
+
+	unpack_565(c0, pal[0]);
+	unpack_565(c1, pal[1]);
+	for (k = 0; k < 3; ++k) {
+		pal[2][k] = (2 * pal[0][k] + pal[1][k]) / 3;
+		pal[3][k] = (pal[0][k] + 2 * pal[1][k]) / 3;
+	}
+
+	*error = 0;
+
+#ifdef __SSE2__
+	const __m128i rgb_mask = _mm_set1_epi32(0x00ffffff);
+	__m128i col[4];
+
+	for (k = 0; k < 4; ++k)
+		col[k] = _mm_setr_epi16(pal[k][0], pal[k][1], pal[k][2], 0, pal[k][0], pal[k][1], pal[k][2], 0);
+
+	for (i = 0; i < 4; ++i) {
+		__m128i px = _mm_and_si128(_mm_loadu_si128((const __m128i*)(block + i * 16)), rgb_mask);
+		__m128i best = distance4(px, col[0]);
+		__m128i best_idx = _mm_setzero_si128();
+
+		for (k = 1; k < 4; ++k) {
+			__m128i d = distance4(px, col[k]);
+			__m128i closer = _mm_cmplt_epi32(d, best);
+
+			best = _mm_or_si128(_mm_and_si128(closer, d), _mm_andnot_si128(closer, best));
+			best_idx = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(k)), _mm_andnot_si128(closer, best_idx));
+		}
+
+		int idx[4], err[4];
+		_mm_storeu_si128((__m128i*)idx, best_idx);
+		_mm_storeu_si128((__m128i*)err, best);
+
+		for (k = 0; k < 4; ++k) {
+			indices |= (idx[k] << ((i * 4 + k) * 2));
+			*error += err[k];
+		}
+	}
+#else
+	for (i = 0; i < 16; ++i) {
+		const byte* p = block + (i * 4);
+		int best = 0x7fffffff, best_idx = 0;
+
+		for (k = 0; k < 4; ++k) {
+			int dr = p[0] - pal[k][0];
+			int dg = p[1] - pal[k][1];
+			int db = p[2] - pal[k][2];
+			int d = dr * dr + dg * dg + db * db;
+
+			if (d < best) {
+				best = d;
+				best_idx = k;
+			}
+		}
+
+		indices |= (best_idx << (i * 2));
+		*error += best;
+	}
+#endif
+
+	return indices;
+}
+
+
+/**
+ *	@brief Find endpoints on the principal axis of the block colours.
+ */
+static void principal_endpoints(const byte* block, float* e0, float* e1) {
+	float mean[3] = { 0.0f, 0.0f, 0.0f };
+	float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+	float axis[3] = { 1.0f, 1.0f, 1.0f };
+	float lo = 1e9f, hi = -1e9f;
+	int i, k;
+
+	for (i = 0; i < 16; ++i)
+		for (k = 0; k < 3; ++k)
+			mean[k] += block[i * 4 + k];
+	for (k = 0; k < 3; ++k)
+		mean[k] /= 16.0f;
+
+	for (i = 0; i < 16; ++i) {
+		float r = block[i * 4 + 0] - mean[0];
+		float g = block[i * 4 + 1] - mean[1];
+		float b = block[i * 4 + 2] - mean[2];
+
+		cov[0] += r * r;	cov[1] += r * g;	cov[2] += r * b;
+		cov[3] += g * g;	cov[4] += g * b;	cov[5] += b * b;
+	}
+
+	for (i = 0; i < DXT_POWER_ITERATIONS; ++i) {
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float m = fabsf(x);
+
+		if (fabsf(y) > m)	m = fabsf(y);
+		if (fabsf(z) > m)	m = fabsf(z);
+
+		/* flat block, any axis will do */
+		if (m < 1e-6f)
+			break;
+
+		axis[0] = x / m;
+		axis[1] = y / m;
+		axis[2] = z / m;
+	}
+
+	float len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+	for (i = 0; i < 16; ++i) {
+		float t = ((block[i * 4 + 0] - mean[0]) * axis[0] +
+				   (block[i * 4 + 1] - mean[1]) * axis[1] +
+				   (block[i * 4 + 2] - mean[2]) * axis[2]) / len2;
+
+		if (t < lo)	lo = t;
+		if (t > hi)	hi = t;
+	}
+
+	for (k = 0; k < 3; ++k) {
+		e0[k] = mean[k] + axis[k] * hi;
+		e1[k] = mean[k] + axis[k] * lo;
+		RANGE_BOUND(e0[k], 0.0f, 255.0f);
+		RANGE_BOUND(e1[k], 0.0f, 255.0f);
+	}
+}
+
+
+/**
+ *	@brief Solve for the endpoints that best fit a set of indices.
+ *	@return 1 if new endpoints were found, 0 if the system is singular
+ */
+static int refine_endpoints(const byte* block, unsigned int indices, float* e0, float* e1) {
+	static const float weight[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+	float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+	float ax[3] = { 0.0f, 0.0f, 0.0f };
+	float bx[3] = { 0.0f, 0.0f, 0.0f };
+	int i, k;
+
+	for (i = 0; i < 16; ++i) {
+		float a = weight[(indices >> (i * 2)) & 3];
+		float b = 1.0f - a;
+
+		aa += a * a;
+		ab += a * b;
+		bb += b * b;
+
+		for (k = 0; k < 3; ++k) {
+			ax[k] += a * block[i * 4 + k];
+			bx[k] += b * block[i * 4 + k];
+		}
+	}
+
+	float det = aa * bb - ab * ab;
+	if (fabsf(det) < 1e-6f)
+		return 0;
+
+	for (k = 0; k < 3; ++k) {
+		e0[k] = (ax[k] * bb - bx[k] * ab) / det;
+		e1[k] = (bx[k] * aa - ax[k] * ab) / det;
+		RANGE_BOUND(e0[k], 0.0f, 255.0f);
+		RANGE_BOUND(e1[k], 0.0f, 255.0f);
+	}
+
+	return 1;
+}
+
+
+/**
+ *	@brief Encode the colour half of a block (a whole BC1 block).
+ */
+static void encode_colour(const byte* block, byte* out, int quality) {
+	float e0[3], e1[3];
+	int mn[4], mx[4];
+	unsigned short c0, c1;
+	unsigned int indices;
+	int error, k, i;
+
+	if (quality == DXT_QUALITY_FAST) {
+		block_bounds(block, mn, mx);
+
+		/* pull the endpoints in a little, the extremes are rarely hit */
+		for (k = 0; k < 3; ++k) {
+			int inset = (mx[k] - mn[k]) >> 4;
+			e0[k] = (float)(mx[k] - inset);
+			e1[k] = (float)(mn[k] + inset);
+		}
+	} else {
+		principal_endpoints(block, e0, e1);
+	}
+
+	c0 = pack_565(e0);
+	c1 = pack_565(e1);
+	indices = pick_indices(block, c0, c1, &error);
+
+	if (quality == DXT_QUALITY_HIGH) {
+		for (i = 0; (i < DXT_REFINE_ITERATIONS) && error; ++i) {
+			int new_error;
+
+			if (!refine_endpoints(block, indices, e0, e1))
+				break;
+
+			unsigned short n0 = pack_565(e0);
+			unsigned short n1 = pack_565(e1);
+			unsigned int new_indices = pick_indices(block, n0, n1, &new_error);
+
+			if (new_error >= error)
+				break;
+
+			c0 = n0;
+			c1 = n1;
+			indices = new_indices;
+			error = new_error;
+		}
+	}
+
+	/* c0 > c1 selects the 4 colour mode */
+	if (c0 < c1) {
+		SWAP(unsigned short, c0, c1);
+		indices ^= 0x55555555;
+	} else if (c0 == c1) {
+		indices = 0;
+	}
+
+	out[0] = (byte)c0;
+	out[1] = (byte)(c0 >> 8);
+	out[2] = (byte)c1;
+	out[3] = (byte)(c1 >> 8);
+	out[4] = (byte)indices;
+	out[5] = (byte)(indices >> 8);
+	out[6] = (byte)(indices >> 16);
+	out[7] = (byte)(indices >> 24);
+}
+
+
+/**
+ *	@brief Encode the alpha half of a BC3 block.
+ */
+static void encode_alpha(const byte* block, byte* out) {
+	int a0 = 0, a1 = 255;
+	int pal[8];
+	unsigned long long bits = 0;
+	int i, k;
+
+	for (i = 0; i < 16; ++i) {
+		if (block[i * 4 + 3] > a0)	a0 = block[i * 4 + 3];
+		if (block[i * 4 + 3] < a1)	a1 = block[i * 4 + 3];
+	}
+
+	out[0] = (byte)a0;
+	out[1] = (byte)a1;
+
+	if (a0 != a1) {
+		/* a0 > a1 selects the 8 value mode */
+		pal[0] = a0;
+		pal[1] = a1;
+		for (k = 2; k < 8; ++k)
+			pal[k] = ((8 - k) * a0 + (k - 1) * a1) / 7;
+
+		for (i = 0; i < 16; ++i) {
+			int a = block[i * 4 + 3];
+			int best = 256, best_idx = 0;
+
+			for (k = 0; k < 8; ++k) {
+				int d = abs(a - pal[k]);
+				if (d < best) {
+					best = d;
+					best_idx = k;
+				}
+			}
+
+			bits |= ((unsigned long long)best_idx << (i * 3));
+		}
+	}
+
+	for (i = 0; i < 6; ++i)
+		out[2 + i] = (byte)(bits >> (i * 8));
+}
+
+
+/**
+ *	@brief Compress block rows [begin, end) of a level.
+ */
+static void compress_rows(void* arg, int begin, int end) {
+	struct dxt_job_t* job = (struct dxt_job_t*)arg;
+	int block_size = (job->alpha ? 16 : 8);
+	byte block[64];
+	int bx, by;
+
+	for (by = begin; by < end; ++by) {
+		byte* out = job->dst->data + (by * job->blocks_x * block_size);
+
+		for (bx = 0; bx < job->blocks_x; ++bx, out += block_size) {
+			load_block(job->src, job->bpp, bx, by, block);
+
+			if (job->alpha) {
+				encode_alpha(block, out);
+				encode_colour(block, out + 8, job->quality);
+			} else {
+				encode_colour(block, out, job->quality);
+			}
+		}
+	}
+}
+
+
+/**
+ *	@brief Check if the driver accepts S3TC textures
+ *	@return 1 if supported, 0 if not
+ *
+ *	Needs a current GL context.
+ */
+int dxt_supported() {
+	const char* ext = (const char*)glGetString(GL_EXTENSIONS);
+
+	return (ext && strstr(ext, "GL_EXT_texture_compression_s3tc") ? 1 : 0);
+}
+
+
+/**
+ *	@brief Block compress every level of an image
+ *	@param img		An uncompressed RGB or RGBA image
+ *	@param quality	DXT_QUALITY_*
+ *	@param pool		Worker threads for large levels, can be NULL
+ *	@return A new BC1 (RGB) or BC3 (RGBA) image, or NULL on failure
+ */
+struct image_t* dxt_compress(const struct image_t* img, int quality, EThreadPool* pool) {
+	struct dxt_job_t job;
+	int i;
+
+	if (image_is_compressed(img))
+		return NULL;
+
+	int alpha = (img->components == 4);
+	GLenum format = (alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT);
+
+	struct image_t* out = image_create_format(img->width, img->height, img->components, format, img->num_levels);
+	if (!out)
+		return NULL;
+
+	job.bpp = img->components;
+	job.alpha = alpha;
+	job.quality = quality;
+
+	for (i = 0; i < img->num_levels; ++i) {
+		int blocks_y = (img->levels[i].height + 3) >> 2;
+
+		job.src = &img->levels[i];
+		job.dst = &out->levels[i];
+		job.blocks_x = (img->levels[i].width + 3) >> 2;
+
+		if (pool && (job.blocks_x * blocks_y >= DXT_PARALLEL_BLOCKS))
+			pool->parallel_for(compress_rows, &job, blocks_y, 1 + (DXT_PARALLEL_BLOCKS / 4) / job.blocks_x);
+		else
+			compress_rows(&job, 0, blocks_y);
+	}
+
+	return out;
+}
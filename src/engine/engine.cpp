@@ -4,6 +4,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "definitions.h"
@@ -11,6 +12,7 @@
 #include "engine/wiiuse.h"
 #include "engine/Q3map.h"
 #include "engine/engine.h"
+#include "engine/bench.h"
 
 /** Global Engine Instance */
 EEngine g_engine;
@@ -42,12 +44,27 @@ int EEngine::init() {
 		return 0;
 	}
 
+	init_data();
+
+	/* decoded textures from previous runs */
+	texture_cache = new ETextureCache();
+	texture_cache->init(TEXTURE_CACHE_DIR, TEXTURE_CACHE_MAX_BYTES, vfs);
+
 	/* initialize the texture manager */
 	texture_manager = new ETextureManager();
-	texture_manager->init();
+	texture_manager->init(thread_pool);
+	texture_manager->set_cache(texture_cache);
+	texture_manager->set_vfs(vfs);
+	texture_manager->set_compression(ENGINE_COMPRESS_TEXTURES, ENGINE_COMPRESS_QUALITY);
+	texture_manager->set_color(ENGINE_TEXTURE_BRIGHTNESS, ENGINE_TEXTURE_GAMMA, COLOR_SATURATE);
+	texture_manager->set_budget(ENGINE_TEXTURE_BUDGET);
+	texture_manager->set_deferred(ENGINE_DEFER_TEXTURES);
 
 	/**** temp stuff ****/
-		map = new EQ3Map();
+		EQ3Map* q3map = new EQ3Map();
+		q3map->set_lean(ENGINE_LEAN_MAPS);
+		q3map->set_arena(map_arena);
+		map = q3map;
 		if (!map->load("data/q3dm1.bsp")) {
 		//if (!map->load("data/q3dm17.bsp")) {
 			shutdown();
@@ -60,10 +77,25 @@ int EEngine::init() {
 		map->get_spawn_point(1, &angle, &pos);
 		camera->set_position(pos.x, pos.y, pos.z);
 		camera->rotate_hor(angle);
-	/**** temp stuff ****/
 
-	/* tell SDL to make key presses repeating */
-	SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY/10, SDL_DEFAULT_REPEAT_INTERVAL);
+		/* the camera is moved by the simulation from here on */
+		float spawn[3] = { pos.x, pos.y, pos.z };
+		simulation = new ESimulation();
+		if (!simulation->init(q3map, thread_pool, ENGINE_MAX_BALLS)) {
+			ERROR("Engine: Failed to set up the simulation.");
+			shutdown();
+			return 0;
+		}
+		simulation->set_camera(spawn);
+		drop_balls(q3map, &pos, ENGINE_BALLS);
+		send_input();
+		renderer->set_simulation(simulation);
+
+		/* so balls out of sight are not drawn */
+		ball_links = new EEntityLinks();
+		if (ball_links->init(q3map, ENGINE_MAX_BALLS))
+			renderer->set_ball_links(ball_links);
+	/**** temp stuff ****/
 
 	/* connect to a wiimote */
 	if (!wiimote.init())
@@ -73,38 +105,110 @@ int EEngine::init() {
 }
 
 
+/**
+ *	@brief Initialize only what runs without a window.
+ *	@return 1 on success, 0 on failure
+ *
+ *	There is no renderer, texture manager or wiimote, so maps
+ *	must be loaded headless.  Used by the benches.
+ */
+int EEngine::init_headless() {
+	INFO("Initializing game engine without a window...");
+	initialized = 1;
+
+	init_data();
+
+	return 1;
+}
+
+
+/**
+ *	@brief Index the game data, start the worker threads and make the map arena.
+ */
+void EEngine::init_data() {
+	/* index the game data */
+	vfs = new EVFS();
+	if (!vfs->add_search_path(ENGINE_SEARCH_PATH))
+		WARNING("Engine: Can not read search path \"%s\".", ENGINE_SEARCH_PATH);
+
+	/* start the worker threads */
+	thread_pool = new EThreadPool();
+	thread_pool->init(0);
+
+	/* every map is loaded into the same block of memory */
+	map_arena = new EArena();
+}
+
+
 /**
  *	@brief Shutdown the engine.
+ *	@param status	Exit status of the program
  */
-void EEngine::shutdown() {
+void EEngine::shutdown(int status) {
 	if (!initialized)
 		return;
 
 	INFO("Shutting down game engine...");
 
+	/* the simulation traces through the map */
+	if (simulation) {
+		delete simulation;
+		simulation = NULL;
+	}
+
+	if (ball_links) {
+		delete ball_links;
+		ball_links = NULL;
+	}
+
 	if (map) {
 		delete map;
 		map = NULL;
 	}
 
+	if (map_arena) {
+		delete map_arena;
+		map_arena = NULL;
+	}
+
 	if (camera) {
 		delete camera;
 		camera = NULL;
 	}
 
-	if (renderer) {
-		delete renderer;
-		renderer = NULL;
+	/* release any workers waiting on the texture manager before joining them */
+	if (texture_manager)
+		texture_manager->cancel_pending();
+
+	if (thread_pool) {
+		delete thread_pool;
+		thread_pool = NULL;
 	}
 
+	/* textures must go before the renderer takes the GL context down */
 	if (texture_manager) {
 		delete texture_manager;
 		texture_manager = NULL;
 	}
 
+	if (texture_cache) {
+		delete texture_cache;
+		texture_cache = NULL;
+	}
+
+	if (vfs) {
+		delete vfs;
+		vfs = NULL;
+	}
+
+	if (renderer) {
+		delete renderer;
+		renderer = NULL;
+	}
+
 	initialized = 0;
 
-	exit(0);
+	exit(status);
 }
 
 
@@ -121,6 +225,9 @@ int EEngine::exec() {
 
 	INFO("Entering main engine loop...");
 
+	/* physics run on their own from now on */
+	simulation->start();
+
 	while (1) {
 		/* check if there are any pending events from SDL */
 		check_sdl_events();
@@ -128,9 +235,22 @@ int EEngine::exec() {
 		/* check for anything from the wiimote */
 		wiimote.poll();
 
+		/* tilt the level with it */
+		if (wiimote.is_connected() && ((wiimote.get_roll() != input.roll) || (wiimote.get_pitch() != input.pitch))) {
+			input.roll = wiimote.get_roll();
+			input.pitch = wiimote.get_pitch();
+			send_input();
+		}
+
+		/* give OpenGL any textures that finished decoding */
+		texture_manager->process_uploads(TEXTURE_UPLOAD_BUDGET_USEC);
+
 		/* render the frame */
 		renderer->render();
 
+		/* evict or reload textures based on what was drawn */
+		texture_manager->end_frame();
+
 		/*
 		 *	Just sleep enough to get the schedulers attention
 		 *	that we don't want to hog resources
@@ -140,6 +260,32 @@ int EEngine::exec() {
 }
 
 
+/**
+ *	@brief Run a bench on the map instead of running the game.
+ *	@param fn		The bench
+ *	@param count	Passed to it
+ *	@return 1 on success, 0 on failure
+ *
+ *	Only needs init_headless().
+ */
+int EEngine::bench(bench_func_t fn, int count) {
+	EQ3Map* q3map;
+	int ret;
+
+	if (!initialized)
+		return 0;
+
+	q3map = new EQ3Map();
+	q3map->set_headless(1);
+	q3map->set_arena(map_arena);
+
+	ret = (q3map->load("data/q3dm1.bsp") && fn(q3map, thread_pool, count));
+
+	delete q3map;
+	return ret;
+}
+
+
 /**
  *	@brief Check for events from SDL
  */
@@ -163,6 +309,7 @@ void EEngine::check_sdl_events() {
 			case SDL_KEYUP:
 			{
 				/* key release */
+				handle_key_release(&event);
 				break;
 			}
 			case SDL_MOUSEBUTTONDOWN:
@@ -196,21 +343,111 @@ ETextureManager* EEngine::get_texture_manager() const {
 }
 
 
+/**
+ *	@brief Worker thread pool accesser.
+ */
+EThreadPool* EEngine::get_thread_pool() const {
+	return thread_pool;
+}
+
+
+/**
+ *	@brief Virtual filesystem accesser.
+ */
+const EVFS* EEngine::get_vfs() const {
+	return vfs;
+}
+
+
 /**
  *	@brief Handle a key press event.
  *	@param e	The SDL event
  */
 inline void EEngine::handle_key_press(SDL_Event* e) {
-	if (e->key.keysym.sym == SDLK_w)
-		camera->move_forward(10);
-	else if (e->key.keysym.sym == SDLK_s)
-		camera->move_backward(10);
-	else if (e->key.keysym.sym == SDLK_a)
-		camera->move_left(10);
-	else if (e->key.keysym.sym == SDLK_d)
-		camera->move_right(10);
-	else if (e->key.keysym.sym == SDLK_ESCAPE)
+	if (e->key.keysym.sym == SDLK_ESCAPE)
 		shutdown();
+	else
+		set_key(e->key.keysym.sym, 1);
+}
+
+
+/**
+ *	@brief Handle a key release event.
+ *	@param e	The SDL event
+ */
+inline void EEngine::handle_key_release(SDL_Event* e) {
+	set_key(e->key.keysym.sym, 0);
+}
+
+
+/**
+ *	@brief Track which movement keys are held down.
+ *	@param key		The key
+ *	@param pressed	1 if pressed, 0 if released
+ *
+ *	The camera moves for as long as a key is held, at the speed
+ *	of the simulation rather than of key repeats.
+ */
+void EEngine::set_key(SDLKey key, int pressed) {
+	int bit;
+
+	switch (key) {
+		case SDLK_w:	bit = SIM_KEY_FORWARD;	break;
+		case SDLK_s:	bit = SIM_KEY_BACK;		break;
+		case SDLK_a:	bit = SIM_KEY_LEFT;		break;
+		case SDLK_d:	bit = SIM_KEY_RIGHT;	break;
+		default:		return;
+	}
+
+	if (pressed)
+		input.keys |= bit;
+	else
+		input.keys &= ~bit;
+
+	send_input();
+}
+
+
+/**
+ *	@brief Put balls in a cube above a point, where there is room.
+ *	@param q3map	The map they are in
+ *	@param around	Middle of the bottom of the cube
+ *	@param count	Balls to try to fit
+ */
+void EEngine::drop_balls(EQ3Map* q3map, const vector3* around, int count) {
+	struct trace_t tr;
+	float spacing = (BALL_DEFAULT_RADIUS * 2.5f);
+	int side = 1;
+	int dropped = 0;
+
+	while (side * side * side < count)
+		++side;
+
+	for (int i = 0; i < count; ++i) {
+		vector3 p(around->x + ((i % side) - (side - 1) * 0.5f) * spacing,
+				  around->y + ((i / (side * side)) + 1) * spacing,
+				  around->z + (((i / side) % side) - (side - 1) * 0.5f) * spacing);
+
+		q3map->trace_sphere(&tr, &p, &p, BALL_DEFAULT_RADIUS, MASK_SOLID);
+		if (tr.start_solid)
+			continue;
+
+		float f[3] = { p.x, p.y, p.z };
+		dropped += simulation->add_ball(f);
+	}
+
+	INFO("Engine: Dropped %i of %i balls.", dropped, count);
+}
+
+
+/**
+ *	@brief Give the simulation the held keys and where the camera looks.
+ */
+void EEngine::send_input() {
+	camera->get_rotation(&input.theta, &input.psi);
+
+	if (simulation)
+		simulation->set_input(&input);
 }
 
 
@@ -285,6 +522,7 @@ void EEngine::handle_mouse_event(SDL_Event* e) {
 
 				camera->rotate_hor((float)-(e->motion.x - mouse.x) / MOUSE_SENSITIVITY_SCALER);
 				camera->rotate_vert((float)(e->motion.y - mouse.y) / MOUSE_SENSITIVITY_SCALER);
+				send_input();
 
 			}
 
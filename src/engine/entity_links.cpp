@@ -0,0 +1,334 @@
+/**
+ *	@file entity_links.cpp
+ *	@brief Things that move, linked into the leafs of a map.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "definitions.h"
+#include "engine/Q3map.h"
+#include "engine/entity_links.h"
+
+/* leafs entities_in_box() looks through before checking every entity instead */
+#define LINK_QUERY_MAX_LEAFS		256
+
+
+EEntityLinks::EEntityLinks() {
+	map = NULL;
+
+	entities = NULL;
+	max_entities = 0;
+
+	links = NULL;
+	leaf_heads = NULL;
+	num_leafs = 0;
+	everywhere_head = -1;
+
+	stamps = NULL;
+	query_count = 0;
+
+	num_relinks = 0;
+}
+
+
+EEntityLinks::~EEntityLinks() {
+	free(entities);
+	free(links);
+	free(leaf_heads);
+	free(stamps);
+}
+
+
+/**
+ *	@brief Make room for the entities of a map.
+ *	@param map				The map they move in
+ *	@param max_entities		Entities 0 to max_entities - 1 can be linked
+ *	@return 1 on success, 0 if out of memory
+ */
+int EEntityLinks::init(EQ3Map* map, int max_entities) {
+	this->map = map;
+	this->max_entities = max_entities;
+	num_leafs = map->get_num_leafs();
+
+	entities = (struct link_entity_t*)calloc(max_entities, sizeof(struct link_entity_t));
+	links = (struct leaf_link_t*)malloc(sizeof(struct leaf_link_t) * max_entities * LINK_MAX_LEAFS);
+	leaf_heads = (int*)malloc(sizeof(int) * (num_leafs + 1));
+	stamps = (int*)calloc(max_entities, sizeof(int));
+
+	if (!entities || !links || !leaf_heads || !stamps) {
+		ERROR("EntityLinks: Out of memory for %i entities.", max_entities);
+		return 0;
+	}
+
+	for (int i = 0; i < num_leafs; ++i)
+		leaf_heads[i] = -1;
+	everywhere_head = -1;
+
+	return 1;
+}
+
+
+/**
+ *	@brief Put a link at the front of a list.
+ */
+static inline void link_insert(struct leaf_link_t* links, int* head, int l) {
+	links[l].prev = -1;
+	links[l].next = *head;
+	if (*head >= 0)
+		links[*head].prev = l;
+	*head = l;
+}
+
+
+/**
+ *	@brief Take a link out of a list.
+ */
+static inline void link_remove(struct leaf_link_t* links, int* head, int l) {
+	if (links[l].prev >= 0)
+		links[links[l].prev].next = links[l].next;
+	else
+		*head = links[l].next;
+
+	if (links[l].next >= 0)
+		links[links[l].next].prev = links[l].prev;
+}
+
+
+/**
+ *	@brief Link an entity where its bounds are, after it moved.
+ *	@param entity	Index of the entity
+ *	@param mins		Lowest corner of its bounds
+ *	@param maxs		Highest corner
+ *	@return 1 if it was relinked, 0 if it is still in the same leafs
+ */
+int EEntityLinks::link(int entity, const float* mins, const float* maxs) {
+	struct link_entity_t* e = &entities[entity];
+	int leafs[LINK_MAX_LEAFS];
+	int count, i, j;
+
+	count = map->box_leafs(mins, maxs, leafs, LINK_MAX_LEAFS);
+	if (count > LINK_MAX_LEAFS)
+		count = (LINK_MAX_LEAFS + 1);
+
+	for (i = 0; i < 3; ++i) {
+		e->mins[i] = mins[i];
+		e->maxs[i] = maxs[i];
+	}
+
+	/* the leafs of a box come in the same order, so the same leafs compare equal */
+	if (e->linked && (count == e->num_leafs) &&
+		((count > LINK_MAX_LEAFS) || !memcmp(leafs, e->leafs, sizeof(int) * count)))
+		return 0;
+
+	unlink(entity);
+
+	e->linked = 1;
+	e->num_leafs = count;
+	e->num_clusters = 0;
+	e->area = -1;
+	e->area2 = -1;
+	++num_relinks;
+
+	if (count > LINK_MAX_LEAFS) {
+		/* too big to list, found by every query and always visible */
+		link_insert(links, &everywhere_head, entity * LINK_MAX_LEAFS);
+		e->num_clusters = -1;
+		return 1;
+	}
+
+	for (i = 0; i < count; ++i) {
+		int leaf = leafs[i];
+		int cluster = map->get_leaf_cluster(leaf);
+		int area = map->get_leaf_area(leaf);
+
+		e->leafs[i] = leaf;
+		link_insert(links, &leaf_heads[leaf], entity * LINK_MAX_LEAFS + i);
+
+		if (e->num_clusters >= 0) {
+			for (j = 0; j < e->num_clusters; ++j) {
+				if (e->clusters[j] == cluster)
+					break;
+			}
+
+			if (j == e->num_clusters) {
+				if (e->num_clusters < LINK_MAX_CLUSTERS)
+					e->clusters[e->num_clusters++] = cluster;
+				else
+					e->num_clusters = -1;
+			}
+		}
+
+		if (area >= 0) {
+			if (e->area < 0)
+				e->area = area;
+			else if ((area != e->area) && (e->area2 < 0))
+				e->area2 = area;
+		}
+	}
+
+	return 1;
+}
+
+
+/**
+ *	@brief Take an entity out of the map.
+ *	@param entity	Index of the entity
+ */
+void EEntityLinks::unlink(int entity) {
+	struct link_entity_t* e = &entities[entity];
+
+	if (!e->linked)
+		return;
+
+	if (e->num_leafs > LINK_MAX_LEAFS) {
+		link_remove(links, &everywhere_head, entity * LINK_MAX_LEAFS);
+	} else {
+		for (int i = 0; i < e->num_leafs; ++i)
+			link_remove(links, &leaf_heads[e->leafs[i]], entity * LINK_MAX_LEAFS + i);
+	}
+
+	e->linked = 0;
+	e->num_leafs = 0;
+}
+
+
+/**
+ *	@brief Where an entity is linked.
+ */
+const struct link_entity_t* EEntityLinks::get_entity(int entity) const {
+	return &entities[entity];
+}
+
+
+/**
+ *	@brief Cluster of a point, as given to is_visible().
+ *	@param point	3 floats
+ */
+int EEntityLinks::find_cluster(const float* point) const {
+	return map->get_leaf_cluster(map->find_leaf(point));
+}
+
+
+/**
+ *	@brief Check if an entity can be seen from a cluster.
+ *	@param entity	Index of the entity
+ *	@param cluster	Cluster of the viewer, -1 outside the map sees everything
+ *	@return 1 if any of its clusters is in the PVS of the cluster, 0 if not
+ */
+int EEntityLinks::is_visible(int entity, int cluster) const {
+	const struct link_entity_t* e = &entities[entity];
+
+	if (!e->linked)
+		return 0;
+
+	if ((cluster < 0) || (e->num_clusters < 0))
+		return 1;
+
+	for (int i = 0; i < e->num_clusters; ++i) {
+		if (map->is_cluster_visable(cluster, e->clusters[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/**
+ *	@brief Add the entities of a list not found yet by this query.
+ *	@param head		First link of the list
+ *	@param mins		Bounds the entities must touch, or NULL for all of them
+ *	@param maxs
+ *	@return The new count
+ */
+int EEntityLinks::add_entities(int head, const float* mins, const float* maxs, int* found, int count, int max_found) {
+	for (int l = head; (l >= 0) && (count < max_found); l = links[l].next) {
+		int entity = (l / LINK_MAX_LEAFS);
+		const struct link_entity_t* e = &entities[entity];
+
+		if (stamps[entity] == query_count)
+			continue;
+		stamps[entity] = query_count;
+
+		if (mins && ((e->mins[0] > maxs[0]) || (e->maxs[0] < mins[0]) ||
+					 (e->mins[1] > maxs[1]) || (e->maxs[1] < mins[1]) ||
+					 (e->mins[2] > maxs[2]) || (e->maxs[2] < mins[2])))
+			continue;
+
+		found[count++] = entity;
+	}
+
+	return count;
+}
+
+
+/**
+ *	@brief Find the entities linked into any of some leafs.
+ *	@param leafs		Leafs lump indices
+ *	@param num_leafs	Number of leafs
+ *	@param found		Where to put the entity indices
+ *	@param max_found	Room in found
+ *	@return Entities found, each once
+ *
+ *	Entities too big to link into leafs are always found.
+ */
+int EEntityLinks::entities_in_leafs(const int* leafs, int num_leafs, int* found, int max_found) {
+	int count = 0;
+
+	++query_count;
+
+	for (int i = 0; i < num_leafs; ++i)
+		count = add_entities(leaf_heads[leafs[i]], NULL, NULL, found, count, max_found);
+
+	return add_entities(everywhere_head, NULL, NULL, found, count, max_found);
+}
+
+
+/**
+ *	@brief Find the entities whose bounds touch a box.
+ *	@param mins			Lowest corner of the box
+ *	@param maxs			Highest corner
+ *	@param found		Where to put the entity indices
+ *	@param max_found	Room in found
+ *	@return Entities found, each once
+ *
+ *	Only the entities in the leafs of the box are checked, the broad
+ *	phase of collisions between things that move.
+ */
+int EEntityLinks::entities_in_box(const float* mins, const float* maxs, int* found, int max_found) {
+	int leafs[LINK_QUERY_MAX_LEAFS];
+	int num, count = 0;
+
+	++query_count;
+
+	num = map->box_leafs(mins, maxs, leafs, LINK_QUERY_MAX_LEAFS);
+	if (num > LINK_QUERY_MAX_LEAFS) {
+		/* a box this big may as well check them all */
+		for (int i = 0; (i < max_entities) && (count < max_found); ++i) {
+			const struct link_entity_t* e = &entities[i];
+
+			if (!e->linked || (e->mins[0] > maxs[0]) || (e->maxs[0] < mins[0]) ||
+				(e->mins[1] > maxs[1]) || (e->maxs[1] < mins[1]) ||
+				(e->mins[2] > maxs[2]) || (e->maxs[2] < mins[2]))
+				continue;
+
+			found[count++] = i;
+		}
+
+		return count;
+	}
+
+	for (int i = 0; i < num; ++i)
+		count = add_entities(leaf_heads[leafs[i]], mins, maxs, found, count, max_found);
+
+	return add_entities(everywhere_head, mins, maxs, found, count, max_found);
+}
+
+
+/**
+ *	@brief Times entities were relinked, rather than left in the same leafs.
+ */
+int EEntityLinks::get_num_relinks() const {
+	return num_relinks;
+}
@@ -0,0 +1,178 @@
+/**
+ *	@file image.cpp
+ *	@brief Decoded images and their mip chains.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "definitions.h"
+#include "engine/image.h"
+
+
+#define ALIGN_UP(x, a)			(((x) + ((a) - 1)) & ~((a) - 1))
+
+
+/**
+ *	@brief Get the number of levels in a full mip chain
+ *	@param width	Width of the base level
+ *	@param height	Height of the base level
+ *	@return Number of levels, down to and including 1x1
+ */
+int image_count_levels(int width, int height) {
+	int levels = 1;
+
+	while (((width > 1) || (height > 1)) && (levels < IMAGE_MAX_LEVELS)) {
+		width = (width > 1 ? (width >> 1) : 1);
+		height = (height > 1 ? (height >> 1) : 1);
+		++levels;
+	}
+
+	return levels;
+}
+
+
+/**
+ *	@brief Get the size in bytes of one level
+ *	@param width	Width of the level
+ *	@param height	Height of the level
+ *	@param format	GL_RGB, GL_RGBA or one of the S3TC formats
+ */
+int image_level_size(int width, int height, GLenum format) {
+	int blocks = ((width + 3) >> 2) * ((height + 3) >> 2);
+
+	switch (format) {
+		case GL_RGB:								return (width * height * 3);
+		case GL_RGBA:								return (width * height * 4);
+		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:		return (blocks * 8);
+		case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:		return (blocks * 16);
+	}
+
+	return 0;
+}
+
+
+/**
+ *	@brief Check if an image holds block compressed data
+ */
+int image_is_compressed(const struct image_t* img) {
+	return ((img->format != GL_RGB) && (img->format != GL_RGBA));
+}
+
+
+/**
+ *	@brief Allocate an image in any format
+ *	@param width		Width of the base level
+ *	@param height		Height of the base level
+ *	@param components	Bytes per pixel of the uncompressed data, 3 (RGB) or 4 (RGBA)
+ *	@param format		GL_RGB, GL_RGBA or one of the S3TC formats
+ *	@param num_levels	Number of mip levels to make room for
+ *	@return The new image, or NULL on failure
+ *
+ *	Only the level sizes are filled in, the pixel data is uninitialized.
+ */
+struct image_t* image_create_format(int width, int height, int components, GLenum format, int num_levels) {
+	struct image_t* img;
+	int offset[IMAGE_MAX_LEVELS];
+	int i, w, h;
+	int total = 0;
+
+	if ((width <= 0) || (height <= 0) || ((components != 3) && (components != 4)) ||
+		(num_levels < 1) || (num_levels > IMAGE_MAX_LEVELS) || !image_level_size(1, 1, format))
+		return NULL;
+
+	img = (struct image_t*)malloc(sizeof(struct image_t));
+	if (!img)
+		return NULL;
+
+	memset(img, 0, sizeof(struct image_t));
+
+	img->width = width;
+	img->height = height;
+	img->components = components;
+	img->format = format;
+	img->num_levels = num_levels;
+
+	/* work out where each level goes */
+	for (i = 0, w = width, h = height; i < img->num_levels; ++i) {
+		img->levels[i].width = w;
+		img->levels[i].height = h;
+		img->levels[i].size = image_level_size(w, h, format);
+
+		total = ALIGN_UP(total, IMAGE_ALIGNMENT);
+		offset[i] = total;
+		total += img->levels[i].size;
+
+		w = (w > 1 ? (w >> 1) : 1);
+		h = (h > 1 ? (h >> 1) : 1);
+	}
+
+	if (posix_memalign((void**)&img->mem, IMAGE_ALIGNMENT, total)) {
+		free(img);
+		return NULL;
+	}
+
+	for (i = 0; i < img->num_levels; ++i)
+		img->levels[i].data = img->mem + offset[i];
+
+	return img;
+}
+
+
+/**
+ *	@brief Allocate an image
+ *	@param width		Width of the base level
+ *	@param height		Height of the base level
+ *	@param components	Bytes per pixel, 3 (RGB) or 4 (RGBA)
+ *	@param mipmapped	If 1 room for the full mip chain is allocated
+ *	@return The new image, or NULL on failure
+ *
+ *	Only the level sizes are filled in, the pixel data is uninitialized.
+ */
+struct image_t* image_create(int width, int height, int components, int mipmapped) {
+	return image_create_format(width, height, components,
+								(components == 4 ? GL_RGBA : GL_RGB),
+								(mipmapped ? image_count_levels(width, height) : 1));
+}
+
+
+/**
+ *	@brief Wrap a mapped file as an image
+ *	@param mem			Start of the mapping
+ *	@param mapped_size	Length of the mapping
+ *	@return The new image, or NULL on failure
+ *
+ *	The caller fills in the dimensions and points the levels into
+ *	mem.  The mapping is unmapped when the image is destroyed.
+ */
+struct image_t* image_map(byte* mem, long mapped_size) {
+	struct image_t* img = (struct image_t*)malloc(sizeof(struct image_t));
+	if (!img)
+		return NULL;
+
+	memset(img, 0, sizeof(struct image_t));
+	img->mem = mem;
+	img->mapped_size = mapped_size;
+
+	return img;
+}
+
+
+/**
+ *	@brief Free an image and all of its levels
+ */
+void image_destroy(struct image_t* img) {
+	if (!img)
+		return;
+
+	if (img->mapped_size)
+		munmap(img->mem, img->mapped_size);
+	else
+		free(img->mem);
+	free(img);
+}
+
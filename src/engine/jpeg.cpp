@@ -0,0 +1,979 @@
+/**
+ *	@file jpeg.cpp
+ *	@brief Baseline JPEG decoder.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#include "definitions.h"
+#include "math/mat.h"
+#include "engine/jpeg.h"
+
+
+/*
+ *	Markers, without their 0xff prefix.
+ */
+#define JPEG_SOF0				0xc0	/* baseline */
+#define JPEG_SOF1				0xc1	/* extended sequential, Huffman */
+#define JPEG_SOF15				0xcf
+#define JPEG_DHT				0xc4
+#define JPEG_DAC				0xcc
+#define JPEG_RST0				0xd0
+#define JPEG_RST7				0xd7
+#define JPEG_SOI				0xd8
+#define JPEG_EOI				0xd9
+#define JPEG_SOS				0xda
+#define JPEG_DQT				0xdb
+#define JPEG_DRI				0xdd
+
+/* most components in a supported frame */
+#define JPEG_MAX_COMPONENTS		3
+
+/* largest sampling factor allowed by the standard */
+#define JPEG_MAX_SAMPLING		4
+
+/* fixed point fraction bits of the colour conversion */
+#define JPEG_YCC_SHIFT			14
+
+/*
+ *	YCbCr to RGB coefficients, scaled by 1 << JPEG_YCC_SHIFT.
+ */
+#define JPEG_CR_R				22970	/* 1.402 */
+#define JPEG_CB_G				-5638	/* -0.344136 */
+#define JPEG_CR_G				-11700	/* -0.714136 */
+#define JPEG_CB_B				29032	/* 1.772 */
+#define JPEG_YCC_ROUND			(1 << (JPEG_YCC_SHIFT - 1))
+
+
+/* cos(k * pi / 16) * sqrt(2) for k > 0, the input scaling the factored IDCT needs */
+static const float aan_scale[8] = {
+	1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+	1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+};
+
+
+/* position in the block of each coefficient in zig-zag order */
+static const byte zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63
+};
+
+
+/**
+ *	@struct jpeg_huffman_t
+ *	@brief A Huffman table ready for decoding.
+ *
+ *	Codes of up to JPEG_FAST_BITS bits are found with one lookup,
+ *	longer ones by comparing against the largest code of each length.
+ */
+struct jpeg_huffman_t {
+	unsigned short fast[1 << JPEG_FAST_BITS];	/* (length << 8) | symbol, 0 for longer codes */
+
+	int maxcode[18];			/* largest code of each length, -1 if none */
+	int mincode[17];
+	int valptr[17];				/* index in symbols of the first code of each length */
+	byte symbols[256];
+};
+
+
+/**
+ *	@struct jpeg_component_t
+ *	@brief One colour component of the frame.
+ */
+struct jpeg_component_t {
+	int id;
+	int h, v;					/* sampling factors */
+	int tq;						/* quantization table */
+	int td, ta;					/* DC and AC Huffman tables of the current scan */
+	int pred;					/* DC prediction */
+
+	int blocks_x, blocks_y;		/* blocks in the plane, a whole number of MCUs */
+	int width, height;			/* samples actually in the image */
+	byte* plane;				/* blocks_x * 8 bytes per row */
+};
+
+
+/**
+ *	@struct jpeg_decoder_t
+ *	@brief State of one decode.
+ */
+struct jpeg_decoder_t {
+	const byte* pos;
+	const byte* end;
+
+	unsigned int bit_buf;		/* next bits, most significant first */
+	int num_bits;
+	int marker;					/* hit a marker, only zeros are fed from now on */
+
+	float qt[4][64];			/* in zig-zag order, with the IDCT scaling folded in */
+	int qt_valid[4];
+
+	struct jpeg_huffman_t dc[4];
+	struct jpeg_huffman_t ac[4];
+	int dc_valid[4];
+	int ac_valid[4];
+
+	struct jpeg_component_t comp[JPEG_MAX_COMPONENTS];
+	int num_comp;
+
+	int width, height;
+	int hmax, vmax;
+	int mcus_x, mcus_y;
+	int restart_interval;
+
+	byte* planes;
+};
+
+
+static TB_INLINE int read_be16(const byte* p) {
+	return ((p[0] << 8) | p[1]);
+}
+
+
+/**
+ *	@brief Build a decoding table from the counts and symbols of a DHT segment.
+ *	@return 1 on success, 0 if the counts are not a valid code
+ */
+static int build_huffman(struct jpeg_huffman_t* t, const byte* counts, const byte* symbols, int num_symbols) {
+	int code = 0, k = 0;
+	int len, i;
+
+	memcpy(t->symbols, symbols, num_symbols);
+	memset(t->fast, 0, sizeof(t->fast));
+
+	for (len = 1; len <= 16; ++len) {
+		int n = counts[len - 1];
+
+		t->valptr[len] = k;
+		t->mincode[len] = code;
+		t->maxcode[len] = (n ? (code + n - 1) : -1);
+
+		/* short codes fill every fast entry they are a prefix of */
+		if (len <= JPEG_FAST_BITS) {
+			for (i = 0; i < n; ++i) {
+				int first = (code + i) << (JPEG_FAST_BITS - len);
+				int last = first + (1 << (JPEG_FAST_BITS - len));
+
+				for (int f = first; f < last; ++f)
+					t->fast[f] = (unsigned short)((len << 8) | symbols[k + i]);
+			}
+		}
+
+		code += n;
+		k += n;
+
+		if (code > (1 << len))
+			return 0;
+		code <<= 1;
+	}
+
+	t->maxcode[17] = 0x7fffffff;
+
+	return 1;
+}
+
+
+/**
+ *	@brief Top up the bit buffer to more than 24 bits.
+ *
+ *	Stuffed zero bytes are dropped.  Once a marker is reached it is
+ *	left unread and zeros are fed instead.
+ */
+static TB_INLINE void fill_bits(struct jpeg_decoder_t* j) {
+	while (j->num_bits <= 24) {
+		unsigned int c = 0;
+
+		if (!j->marker && (j->pos < j->end)) {
+			c = *j->pos;
+
+			if (c != 0xff) {
+				++j->pos;
+			} else if (((j->pos + 1) < j->end) && (j->pos[1] == 0)) {
+				j->pos += 2;
+			} else {
+				j->marker = 1;
+				c = 0;
+			}
+		}
+
+		j->bit_buf |= c << (24 - j->num_bits);
+		j->num_bits += 8;
+	}
+}
+
+
+static TB_INLINE int get_bits(struct jpeg_decoder_t* j, int n) {
+	if (j->num_bits < n)
+		fill_bits(j);
+
+	int v = (int)(j->bit_buf >> (32 - n));
+	j->bit_buf <<= n;
+	j->num_bits -= n;
+
+	return v;
+}
+
+
+/**
+ *	@brief Read an n bit magnitude and sign extend it.
+ */
+static TB_INLINE int receive_extend(struct jpeg_decoder_t* j, int n) {
+	int v = get_bits(j, n);
+
+	return ((v < (1 << (n - 1))) ? (v - (1 << n) + 1) : v);
+}
+
+
+/**
+ *	@brief Decode one Huffman coded symbol.
+ *	@return The symbol, or -1 if the bits are not a valid code
+ */
+static TB_INLINE int decode_huffman(struct jpeg_decoder_t* j, const struct jpeg_huffman_t* t) {
+	if (j->num_bits < 16)
+		fill_bits(j);
+
+	int f = t->fast[j->bit_buf >> (32 - JPEG_FAST_BITS)];
+	if (f) {
+		j->bit_buf <<= (f >> 8);
+		j->num_bits -= (f >> 8);
+		return (f & 0xff);
+	}
+
+	for (int len = JPEG_FAST_BITS + 1; len <= 16; ++len) {
+		int code = (int)(j->bit_buf >> (32 - len));
+
+		if (code <= t->maxcode[len]) {
+			j->bit_buf <<= len;
+			j->num_bits -= len;
+			return t->symbols[t->valptr[len] + code - t->mincode[len]];
+		}
+	}
+
+	return -1;
+}
+
+
+/**
+ *	@brief Decode and dequantize one 8x8 block.
+ *	@param coef	Receives the coefficients in natural order, must be zeroed
+ *	@return 1 if there are AC coefficients, 0 if only DC, or -1 on damaged data
+ */
+static int decode_block(struct jpeg_decoder_t* j, struct jpeg_component_t* c, float* coef) {
+	const float* q = j->qt[c->tq];
+	int t, k, has_ac = 0;
+
+	t = decode_huffman(j, &j->dc[c->td]);
+	if ((t < 0) || (t > 11))
+		return -1;
+
+	c->pred += (t ? receive_extend(j, t) : 0);
+	coef[0] = c->pred * q[0];
+
+	const struct jpeg_huffman_t* ac = &j->ac[c->ta];
+
+	for (k = 1; k < 64; ++k) {
+		int rs = decode_huffman(j, ac);
+		if (rs < 0)
+			return -1;
+
+		int r = rs >> 4, s = rs & 15;
+
+		if (!s) {
+			if (r != 15)
+				break;			/* end of block */
+			k += 15;
+			continue;
+		}
+
+		k += r;
+		if (k > 63)
+			return -1;
+
+		coef[zigzag[k]] = receive_extend(j, s) * q[k];
+		has_ac = 1;
+	}
+
+	return has_ac;
+}
+
+
+/*
+ *	One dimensional 8 point IDCT, the Arai-Agui-Nakajima factorization.
+ *	ADD, SUB and MUL work on either floats or SSE vectors, and
+ *	CONST makes a constant of the same type.
+ */
+#define JPEG_IDCT_1D(in0, in1, in2, in3, in4, in5, in6, in7, out0, out1, out2, out3, out4, out5, out6, out7)	\
+	do {																					\
+		/* even part */																		\
+		T e10 = ADD(in0, in4), e11 = SUB(in0, in4);											\
+		T e13 = ADD(in2, in6);																\
+		T e12 = SUB(MUL(SUB(in2, in6), CONST(1.414213562f)), e13);							\
+		T e0 = ADD(e10, e13), e3 = SUB(e10, e13);											\
+		T e1 = ADD(e11, e12), e2 = SUB(e11, e12);											\
+																							\
+		/* odd part */																		\
+		T z13 = ADD(in5, in3), z10 = SUB(in5, in3);											\
+		T z11 = ADD(in1, in7), z12 = SUB(in1, in7);											\
+		T o7 = ADD(z11, z13);																\
+		T o11 = MUL(SUB(z11, z13), CONST(1.414213562f));									\
+		T z5 = MUL(ADD(z10, z12), CONST(1.847759065f));										\
+		T o10 = SUB(MUL(z12, CONST(1.082392200f)), z5);										\
+		T o12 = ADD(MUL(z10, CONST(-2.613125930f)), z5);									\
+		T o6 = SUB(o12, o7);																\
+		T o5 = SUB(o11, o6);																\
+		T o4 = ADD(o10, o5);																\
+																							\
+		out0 = ADD(e0, o7); out7 = SUB(e0, o7);												\
+		out1 = ADD(e1, o6); out6 = SUB(e1, o6);												\
+		out2 = ADD(e2, o5); out5 = SUB(e2, o5);												\
+		out4 = ADD(e3, o4); out3 = SUB(e3, o4);												\
+	} while (0)
+
+
+/**
+ *	@brief Inverse DCT a block of coefficients into 8x8 samples.
+ *	@param coef	Dequantized with the IDCT scaling, in natural order
+ *	@param ac	From decode_block(); without AC terms the block is flat
+ */
+static void idct_block(float* coef, int ac, byte* out, int stride) {
+	int y;
+
+	if (!ac) {
+		int value = (int)(coef[0] + 128.5f);
+		RANGE_BOUND(value, 0, 255);
+
+		for (y = 0; y < 8; ++y)
+			memset(out + y * stride, value, 8);
+		return;
+	}
+
+#ifdef __SSE2__
+	#define T		__m128
+	#define ADD		_mm_add_ps
+	#define SUB		_mm_sub_ps
+	#define MUL		_mm_mul_ps
+	#define CONST	_mm_set1_ps
+
+	/* v[row * 2 + half] holds four columns of a row */
+	__m128 v[16];
+	int h;
+
+	for (y = 0; y < 16; ++y)
+		v[y] = _mm_loadu_ps(coef + y * 4);
+
+	/* columns, four at a time */
+	for (h = 0; h < 2; ++h)
+		JPEG_IDCT_1D(v[h], v[2 + h], v[4 + h], v[6 + h], v[8 + h], v[10 + h], v[12 + h], v[14 + h],
+					 v[h], v[2 + h], v[4 + h], v[6 + h], v[8 + h], v[10 + h], v[12 + h], v[14 + h]);
+
+	/* transpose so each vector holds four rows of a column */
+	_MM_TRANSPOSE4_PS(v[0], v[2], v[4], v[6]);
+	_MM_TRANSPOSE4_PS(v[9], v[11], v[13], v[15]);
+	_MM_TRANSPOSE4_PS(v[1], v[3], v[5], v[7]);
+	_MM_TRANSPOSE4_PS(v[8], v[10], v[12], v[14]);
+	SWAP(__m128, v[1], v[8]);
+	SWAP(__m128, v[3], v[10]);
+	SWAP(__m128, v[5], v[12]);
+	SWAP(__m128, v[7], v[14]);
+
+	/* rows, four at a time */
+	for (h = 0; h < 2; ++h)
+		JPEG_IDCT_1D(v[h], v[2 + h], v[4 + h], v[6 + h], v[8 + h], v[10 + h], v[12 + h], v[14 + h],
+					 v[h], v[2 + h], v[4 + h], v[6 + h], v[8 + h], v[10 + h], v[12 + h], v[14 + h]);
+
+	/* and back to rows */
+	_MM_TRANSPOSE4_PS(v[0], v[2], v[4], v[6]);
+	_MM_TRANSPOSE4_PS(v[9], v[11], v[13], v[15]);
+	_MM_TRANSPOSE4_PS(v[1], v[3], v[5], v[7]);
+	_MM_TRANSPOSE4_PS(v[8], v[10], v[12], v[14]);
+	SWAP(__m128, v[1], v[8]);
+	SWAP(__m128, v[3], v[10]);
+	SWAP(__m128, v[5], v[12]);
+	SWAP(__m128, v[7], v[14]);
+
+	__m128 bias = _mm_set1_ps(128.0f);
+
+	for (y = 0; y < 8; ++y) {
+		__m128i lo = _mm_cvtps_epi32(_mm_add_ps(v[y * 2], bias));
+		__m128i hi = _mm_cvtps_epi32(_mm_add_ps(v[y * 2 + 1], bias));
+		__m128i words = _mm_packs_epi32(lo, hi);
+
+		_mm_storel_epi64((__m128i*)(out + y * stride), _mm_packus_epi16(words, words));
+	}
+#else
+	#define T		float
+	#define ADD(a, b)	((a) + (b))
+	#define SUB(a, b)	((a) - (b))
+	#define MUL(a, b)	((a) * (b))
+	#define CONST(a)	(a)
+
+	float* c;
+	int x;
+
+	for (x = 0; x < 8; ++x) {
+		c = coef + x;
+		JPEG_IDCT_1D(c[0], c[8], c[16], c[24], c[32], c[40], c[48], c[56],
+					 c[0], c[8], c[16], c[24], c[32], c[40], c[48], c[56]);
+	}
+
+	for (y = 0; y < 8; ++y) {
+		c = coef + y * 8;
+		JPEG_IDCT_1D(c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7],
+					 c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7]);
+
+		for (x = 0; x < 8; ++x) {
+			int value = (int)floorf(c[x] + 128.5f);
+			RANGE_BOUND(value, 0, 255);
+			out[y * stride + x] = (byte)value;
+		}
+	}
+#endif
+
+	#undef T
+	#undef ADD
+	#undef SUB
+	#undef MUL
+	#undef CONST
+}
+
+
+/**
+ *	@brief Convert a row of YCbCr samples to RGB.
+ */
+static void ycc_to_rgb(const byte* ys, const byte* cbs, const byte* crs, byte* out, int n) {
+	int i = 0;
+
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i center = _mm_set1_epi16(128);
+	__m128i one = _mm_set1_epi16(1);
+	__m128i k_r = _mm_set1_epi32((JPEG_YCC_ROUND << 16) | JPEG_CR_R);
+	__m128i k_g = _mm_set1_epi32(((JPEG_CR_G & 0xffff) << 16) | (JPEG_CB_G & 0xffff));
+	__m128i k_b = _mm_set1_epi32((JPEG_YCC_ROUND << 16) | JPEG_CB_B);
+	__m128i round = _mm_set1_epi32(JPEG_YCC_ROUND);
+	byte r[16], g[16], b[16];
+
+	/* pairs of 16 bit terms are multiplied and summed to 32 bits, the rounding rides along as a term times 1 */
+	for (; i + 8 <= n; i += 8) {
+		__m128i y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(ys + i)), zero);
+		__m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(cbs + i)), zero), center);
+		__m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(crs + i)), zero), center);
+
+		__m128i r_lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cr, one), k_r), JPEG_YCC_SHIFT);
+		__m128i r_hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cr, one), k_r), JPEG_YCC_SHIFT);
+		__m128i g_lo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cb, cr), k_g), round), JPEG_YCC_SHIFT);
+		__m128i g_hi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cb, cr), k_g), round), JPEG_YCC_SHIFT);
+		__m128i b_lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cb, one), k_b), JPEG_YCC_SHIFT);
+		__m128i b_hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cb, one), k_b), JPEG_YCC_SHIFT);
+
+		__m128i rw = _mm_add_epi16(y, _mm_packs_epi32(r_lo, r_hi));
+		__m128i gw = _mm_add_epi16(y, _mm_packs_epi32(g_lo, g_hi));
+		__m128i bw = _mm_add_epi16(y, _mm_packs_epi32(b_lo, b_hi));
+
+		_mm_storeu_si128((__m128i*)r, _mm_packus_epi16(rw, rw));
+		_mm_storeu_si128((__m128i*)g, _mm_packus_epi16(gw, gw));
+		_mm_storeu_si128((__m128i*)b, _mm_packus_epi16(bw, bw));
+
+		for (int k = 0; k < 8; ++k, out += 3) {
+			out[0] = r[k];
+			out[1] = g[k];
+			out[2] = b[k];
+		}
+	}
+#endif
+
+	for (; i < n; ++i, out += 3) {
+		int y = ys[i], cb = cbs[i] - 128, cr = crs[i] - 128;
+		int rv = y + ((JPEG_CR_R * cr + JPEG_YCC_ROUND) >> JPEG_YCC_SHIFT);
+		int gv = y + ((JPEG_CB_G * cb + JPEG_CR_G * cr + JPEG_YCC_ROUND) >> JPEG_YCC_SHIFT);
+		int bv = y + ((JPEG_CB_B * cb + JPEG_YCC_ROUND) >> JPEG_YCC_SHIFT);
+
+		RANGE_BOUND(rv, 0, 255);
+		RANGE_BOUND(gv, 0, 255);
+		RANGE_BOUND(bv, 0, 255);
+
+		out[0] = (byte)rv;
+		out[1] = (byte)gv;
+		out[2] = (byte)bv;
+	}
+}
+
+
+/**
+ *	@brief Find the next marker.
+ *	@return The marker without its 0xff prefix, or -1 at the end of the data
+ *
+ *	Anything before it, such as the padding at the end of a scan,
+ *	is skipped.  The read position is left after the marker.
+ */
+static int next_marker(struct jpeg_decoder_t* j) {
+	while (j->pos + 1 < j->end) {
+		if ((j->pos[0] == 0xff) && (j->pos[1] != 0) && (j->pos[1] != 0xff)) {
+			int m = j->pos[1];
+			j->pos += 2;
+			return m;
+		}
+		++j->pos;
+	}
+
+	return -1;
+}
+
+
+/**
+ *	@brief Get the length of the segment at the read position.
+ *	@return The bytes after the length field, or -1 if the segment is truncated
+ */
+static int segment_length(struct jpeg_decoder_t* j) {
+	if (j->end - j->pos < 2)
+		return -1;
+
+	int len = read_be16(j->pos) - 2;
+	if ((len < 0) || (j->end - j->pos - 2 < len))
+		return -1;
+
+	j->pos += 2;
+	return len;
+}
+
+
+static int parse_dqt(struct jpeg_decoder_t* j, const byte* p, int len) {
+	while (len > 0) {
+		int precision = p[0] >> 4, id = p[0] & 15;
+		int bytes = 1 + 64 * (precision ? 2 : 1);
+
+		if ((id > 3) || (precision > 1) || (len < bytes))
+			return 0;
+
+		/* the factored IDCT wants its inputs scaled, and the 2D transform divides by 8 */
+		for (int k = 0; k < 64; ++k) {
+			int q = (precision ? read_be16(p + 1 + k * 2) : p[1 + k]);
+			j->qt[id][k] = q * aan_scale[zigzag[k] >> 3] * aan_scale[zigzag[k] & 7] * 0.125f;
+		}
+		j->qt_valid[id] = 1;
+
+		p += bytes;
+		len -= bytes;
+	}
+
+	return 1;
+}
+
+
+static int parse_dht(struct jpeg_decoder_t* j, const byte* p, int len) {
+	while (len > 17) {
+		int cls = p[0] >> 4, id = p[0] & 15;
+		int num_symbols = 0;
+
+		for (int i = 0; i < 16; ++i)
+			num_symbols += p[1 + i];
+
+		if ((cls > 1) || (id > 3) || (num_symbols > 256) || (len < 17 + num_symbols))
+			return 0;
+
+		struct jpeg_huffman_t* t = (cls ? &j->ac[id] : &j->dc[id]);
+		if (!build_huffman(t, p + 1, p + 17, num_symbols))
+			return 0;
+
+		if (cls)
+			j->ac_valid[id] = 1;
+		else
+			j->dc_valid[id] = 1;
+
+		p += 17 + num_symbols;
+		len -= 17 + num_symbols;
+	}
+
+	return (len == 0);
+}
+
+
+static int parse_sof(struct jpeg_decoder_t* j, const byte* p, int len) {
+	int i;
+
+	if ((len < 6) || (p[0] != 8) || j->planes)
+		return 0;
+
+	j->height = read_be16(p + 1);
+	j->width = read_be16(p + 3);
+	j->num_comp = p[5];
+
+	if (!j->width || !j->height || ((j->num_comp != 1) && (j->num_comp != 3)) || (len < 6 + j->num_comp * 3))
+		return 0;
+
+	j->hmax = j->vmax = 1;
+	for (i = 0; i < j->num_comp; ++i) {
+		struct jpeg_component_t* c = &j->comp[i];
+
+		c->id = p[6 + i * 3];
+		c->h = p[7 + i * 3] >> 4;
+		c->v = p[7 + i * 3] & 15;
+		c->tq = p[8 + i * 3];
+
+		if (!c->h || !c->v || (c->h > JPEG_MAX_SAMPLING) || (c->v > JPEG_MAX_SAMPLING) || (c->tq > 3))
+			return 0;
+
+		if (c->h > j->hmax)
+			j->hmax = c->h;
+		if (c->v > j->vmax)
+			j->vmax = c->v;
+	}
+
+	/* a lone component is never interleaved, so its MCU is one block whatever it says */
+	if (j->num_comp == 1)
+		j->comp[0].h = j->comp[0].v = j->hmax = j->vmax = 1;
+
+	j->mcus_x = (j->width + j->hmax * 8 - 1) / (j->hmax * 8);
+	j->mcus_y = (j->height + j->vmax * 8 - 1) / (j->vmax * 8);
+
+	long total = 0;
+	for (i = 0; i < j->num_comp; ++i) {
+		struct jpeg_component_t* c = &j->comp[i];
+
+		c->blocks_x = j->mcus_x * c->h;
+		c->blocks_y = j->mcus_y * c->v;
+		c->width = (j->width * c->h + j->hmax - 1) / j->hmax;
+		c->height = (j->height * c->v + j->vmax - 1) / j->vmax;
+		total += (long)c->blocks_x * c->blocks_y * 64;
+	}
+
+	j->planes = (byte*)malloc(total);
+	if (!j->planes)
+		return 0;
+
+	/* blocks a damaged scan never reaches stay mid grey */
+	memset(j->planes, 128, total);
+
+	byte* plane = j->planes;
+	for (i = 0; i < j->num_comp; ++i) {
+		j->comp[i].plane = plane;
+		plane += (long)j->comp[i].blocks_x * j->comp[i].blocks_y * 64;
+	}
+
+
+	return 1;
+}
+
+
+/**
+ *	@brief Resynchronise at a restart marker.
+ */
+static void restart(struct jpeg_decoder_t* j) {
+	j->bit_buf = 0;
+	j->num_bits = 0;
+	j->marker = 0;
+
+	const byte* start = j->pos;
+	int m = next_marker(j);
+
+	if ((m < JPEG_RST0) || (m > JPEG_RST7)) {
+		/* not a restart; leave the marker for the segment loop */
+		j->pos = ((m < 0) ? start : (j->pos - 2));
+		j->marker = 1;
+	}
+
+	for (int i = 0; i < j->num_comp; ++i)
+		j->comp[i].pred = 0;
+}
+
+
+/**
+ *	@brief Decode the entropy coded data of one scan into the component planes.
+ *	@param scan		Components in the scan
+ *	@param num_scan	Length of scan
+ *	@return 1 on success, 0 on damaged data
+ */
+static int decode_scan(struct jpeg_decoder_t* j, struct jpeg_component_t** scan, int num_scan) {
+	float coef[64];
+	int mcus_x, mcus_y, mx, my, i, bx, by;
+	int mcu = 0;
+
+	j->bit_buf = 0;
+	j->num_bits = 0;
+	j->marker = 0;
+
+	for (i = 0; i < num_scan; ++i)
+		scan[i]->pred = 0;
+
+	/* a single component scan has one block per MCU, covering only the component's samples */
+	if (num_scan == 1) {
+		mcus_x = (scan[0]->width + 7) / 8;
+		mcus_y = (scan[0]->height + 7) / 8;
+	} else {
+		mcus_x = j->mcus_x;
+		mcus_y = j->mcus_y;
+	}
+
+	for (my = 0; my < mcus_y; ++my) {
+		for (mx = 0; mx < mcus_x; ++mx, ++mcu) {
+			if (j->restart_interval && mcu && !(mcu % j->restart_interval))
+				restart(j);
+
+			for (i = 0; i < num_scan; ++i) {
+				struct jpeg_component_t* c = scan[i];
+				int stride = c->blocks_x * 8;
+				int bh = ((num_scan == 1) ? 1 : c->h);
+				int bv = ((num_scan == 1) ? 1 : c->v);
+
+				for (by = 0; by < bv; ++by) {
+					for (bx = 0; bx < bh; ++bx) {
+						memset(coef, 0, sizeof(coef));
+
+						int n = decode_block(j, c, coef);
+						if (n < 0)
+							return 0;
+
+						int row = (my * bv + by) * 8, col = (mx * bh + bx) * 8;
+						idct_block(coef, n, c->plane + (long)row * stride + col, stride);
+					}
+				}
+			}
+		}
+	}
+
+	return 1;
+}
+
+
+static int parse_sos(struct jpeg_decoder_t* j, const byte* p, int len) {
+	struct jpeg_component_t* scan[JPEG_MAX_COMPONENTS];
+	int num_scan = p[0];
+	int i, k;
+
+	if (!j->planes || !num_scan || (num_scan > j->num_comp) || (len != 4 + num_scan * 2))
+		return 0;
+
+	for (i = 0; i < num_scan; ++i) {
+		int id = p[1 + i * 2], tables = p[2 + i * 2];
+
+		for (k = 0; k < j->num_comp; ++k)
+			if (j->comp[k].id == id)
+				break;
+		if (k == j->num_comp)
+			return 0;
+
+		struct jpeg_component_t* c = &j->comp[k];
+		c->td = tables >> 4;
+		c->ta = tables & 15;
+
+		if ((c->td > 3) || (c->ta > 3) || !j->dc_valid[c->td] || !j->ac_valid[c->ta] || !j->qt_valid[c->tq])
+			return 0;
+
+		scan[i] = c;
+	}
+
+	/* spectral selection and successive approximation are always the full range in sequential mode */
+	const byte* s = p + 1 + num_scan * 2;
+	if ((s[0] != 0) || (s[1] != 63) || (s[2] != 0))
+		return 0;
+
+	j->pos = p + len;
+
+	return decode_scan(j, scan, num_scan);
+}
+
+
+/**
+ *	@brief Expand a row of a subsampled component to the full image width.
+ */
+static const byte* upsample_row(const struct jpeg_decoder_t* j, const struct jpeg_component_t* c, int y, byte* tmp) {
+	const byte* row = c->plane + (long)((y * c->v) / j->vmax) * c->blocks_x * 8;
+
+	if (c->h == j->hmax)
+		return row;
+
+	if (c->h * 2 == j->hmax) {
+		for (int x = 0; x < j->width; ++x)
+			tmp[x] = row[x >> 1];
+	} else {
+		for (int x = 0; x < j->width; ++x)
+			tmp[x] = row[(x * c->h) / j->hmax];
+	}
+
+	return tmp;
+}
+
+
+/**
+ *	@brief Convert the decoded planes into the final image.
+ */
+static void convert(const struct jpeg_decoder_t* j, byte* out, byte* tmp) {
+	int x, y;
+
+	for (y = 0; y < j->height; ++y, out += j->width * 3) {
+		const byte* ys = upsample_row(j, &j->comp[0], y, tmp);
+
+		if (j->num_comp == 1) {
+			for (x = 0; x < j->width; ++x) {
+				out[x * 3] = ys[x];
+				out[x * 3 + 1] = ys[x];
+				out[x * 3 + 2] = ys[x];
+			}
+			continue;
+		}
+
+		const byte* cbs = upsample_row(j, &j->comp[1], y, tmp + j->width);
+		const byte* crs = upsample_row(j, &j->comp[2], y, tmp + j->width * 2);
+
+		ycc_to_rgb(ys, cbs, crs, out, j->width);
+	}
+}
+
+
+/**
+ *	@brief Check that data is a JPEG the decoder handles.
+ *	@return 1 if it is, 0 if not
+ *
+ *	Walks the segments up to the frame header, so progressive and
+ *	arithmetic coded files can be handed to another decoder.
+ */
+int jpeg_check(const byte* data, long size) {
+	struct jpeg_decoder_t j;
+
+	if ((size < 4) || (data[0] != 0xff) || (data[1] != JPEG_SOI))
+		return 0;
+
+	j.pos = data + 2;
+	j.end = data + size;
+
+	for (;;) {
+		int m = next_marker(&j);
+		if ((m < 0) || (m == JPEG_EOI) || (m == JPEG_SOS))
+			return 0;
+
+		if ((m >= JPEG_RST0) && (m <= JPEG_RST7))
+			continue;
+
+		int len = segment_length(&j);
+		if (len < 0)
+			return 0;
+
+		if ((m == JPEG_SOF0) || (m == JPEG_SOF1))
+			return ((len >= 6) && (j.pos[0] == 8) && ((j.pos[5] == 1) || (j.pos[5] == 3)));
+
+		if ((m > JPEG_SOF1) && (m <= JPEG_SOF15) && (m != JPEG_DHT) && (m != JPEG_DAC))
+			return 0;
+
+		j.pos += len;
+	}
+}
+
+
+/**
+ *	@brief Decode a JPEG file.
+ *	@param data			The whole file
+ *	@param size			Bytes in data
+ *	@param mipmapped	Leave room for a mip chain after the image
+ *	@return An RGB image, or NULL if the file is damaged or not supported
+ *
+ *	Subsampled chroma is replicated up to full size.  A file cut
+ *	short after its first scan still decodes, with grey in place of
+ *	the missing blocks.
+ */
+struct image_t* jpeg_decode(const byte* data, long size, int mipmapped) {
+	struct image_t* img = NULL;
+	int scans = 0;
+
+	if (!jpeg_check(data, size)) {
+		ERROR("JPEG: Not a baseline JPEG.");
+		return NULL;
+	}
+
+	struct jpeg_decoder_t* j = (struct jpeg_decoder_t*)calloc(1, sizeof(struct jpeg_decoder_t));
+	if (!j) {
+		ERROR("JPEG: Out of memory for the decoder.");
+		return NULL;
+	}
+
+	j->pos = data + 2;
+	j->end = data + size;
+
+	for (;;) {
+		int m = next_marker(j);
+
+		if ((m < 0) || (m == JPEG_EOI))
+			break;
+		if ((m >= JPEG_RST0) && (m <= JPEG_RST7))
+			continue;
+
+		int len = segment_length(j);
+		if (len < 0)
+			break;
+
+		const byte* p = j->pos;
+		int ok = 1;
+
+		j->pos += len;
+
+		switch (m) {
+			case JPEG_SOF0:
+			case JPEG_SOF1:
+				ok = parse_sof(j, p, len);
+				break;
+
+			case JPEG_DHT:
+				ok = parse_dht(j, p, len);
+				break;
+
+			case JPEG_DQT:
+				ok = parse_dqt(j, p, len);
+				break;
+
+			case JPEG_DRI:
+				ok = ((len >= 2) ? (j->restart_interval = read_be16(p), 1) : 0);
+				break;
+
+			case JPEG_SOS:
+				ok = parse_sos(j, p, len);
+				scans += ok;
+				break;
+
+			default:
+				/* application data and comments */
+				break;
+		}
+
+		if (!ok) {
+			ERROR("JPEG: Damaged or unsupported segment 0x%02x.", m);
+			break;
+		}
+	}
+
+	if (!scans) {
+		ERROR("JPEG: No image data decoded.");
+		free(j->planes);
+		free(j);
+		return NULL;
+	}
+
+	img = image_create(j->width, j->height, 3, mipmapped);
+	byte* tmp = (byte*)malloc(j->width * 3);
+
+	if (img && tmp) {
+		convert(j, img->levels[0].data, tmp);
+	} else {
+		ERROR("JPEG: Out of memory for a %ix%i image.", j->width, j->height);
+		if (img)
+			image_destroy(img);
+		img = NULL;
+	}
+
+	free(tmp);
+	free(j->planes);
+	free(j);
+
+	return img;
+}
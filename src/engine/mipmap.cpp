@@ -0,0 +1,537 @@
+/**
+ *	@file mipmap.cpp
+ *	@brief Mip chain generation and upload.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#include "definitions.h"
+#include "math/mat.h"
+#include "engine/mipmap.h"
+
+
+/* radius of the windowed sinc filters, in destination pixels */
+#define KERNEL_RADIUS			3.0f
+
+/* Kaiser window shape */
+#define KAISER_BETA				4.0f
+
+/* entries in the linear to gamma table */
+#define LINEAR_TABLE_SIZE		4096
+
+
+/*
+ *	Gamma tables, built once.
+ */
+static pthread_once_t gamma_once = PTHREAD_ONCE_INIT;
+static float to_linear[256];
+static byte from_linear[LINEAR_TABLE_SIZE];
+
+
+/**
+ *	@struct filter_axis_t
+ *	@brief Precomputed filter taps for one direction of a level.
+ */
+struct filter_axis_t {
+	int dst_size;
+	int taps;
+
+	int* index;					/* [dst_size * taps] source pixel */
+	float* weight;				/* [dst_size * taps] normalized weight */
+};
+
+
+/**
+ *	@struct mip_job_t
+ *	@brief Everything needed to build one level, shared by the threads.
+ */
+struct mip_job_t {
+	struct image_level_t* src;
+	struct image_level_t* dst;
+	int bpp;
+	int flags;
+
+	struct filter_axis_t hor;
+	struct filter_axis_t vert;
+
+	float* tmp;					/* [dst width * src height * bpp] horizontally filtered */
+};
+
+
+static void build_gamma_tables() {
+	int i;
+
+	for (i = 0; i < 256; ++i)
+		to_linear[i] = powf(i / 255.0f, MIPMAP_GAMMA);
+
+	for (i = 0; i < LINEAR_TABLE_SIZE; ++i)
+		from_linear[i] = (byte)(powf(i / (float)(LINEAR_TABLE_SIZE - 1), 1.0f / MIPMAP_GAMMA) * 255.0f + 0.5f);
+}
+
+
+/**
+ *	@brief Convert a filtered value in [0, 1] back to a byte.
+ */
+static TB_INLINE byte quantize(float v, int gamma) {
+	if (v <= 0.0f)
+		return 0;
+	if (v >= 1.0f)
+		return 255;
+
+	if (gamma)
+		return from_linear[(int)(v * (LINEAR_TABLE_SIZE - 1) + 0.5f)];
+	return (byte)(v * 255.0f + 0.5f);
+}
+
+
+static float sinc(float x) {
+	if (fabsf(x) < 1e-6f)
+		return 1.0f;
+
+	x *= (float)PI;
+	return sinf(x) / x;
+}
+
+
+/**
+ *	@brief Modified Bessel function of the first kind, order 0.
+ */
+static float bessel_i0(float x) {
+	float sum = 1.0f;
+	float term = 1.0f;
+	int k;
+
+	for (k = 1; k < 32; ++k) {
+		term *= (x / (2.0f * k)) * (x / (2.0f * k));
+		sum += term;
+		if (term < sum * 1e-7f)
+			break;
+	}
+
+	return sum;
+}
+
+
+static float kernel(int filter, float t) {
+	t = fabsf(t);
+	if (t >= KERNEL_RADIUS)
+		return 0.0f;
+
+	if (filter == MIPMAP_FILTER_LANCZOS)
+		return sinc(t) * sinc(t / KERNEL_RADIUS);
+
+	/* kaiser */
+	float r = t / KERNEL_RADIUS;
+	return sinc(t) * bessel_i0(KAISER_BETA * sqrtf(1.0f - r * r)) / bessel_i0(KAISER_BETA);
+}
+
+
+/**
+ *	@brief Work out the filter taps for one axis.
+ *	@param a		The axis to fill in
+ *	@param src		Source size in pixels
+ *	@param dst		Destination size in pixels
+ *	@param filter	MIPMAP_FILTER_*
+ *	@return 1 on success, 0 if out of memory
+ */
+static int axis_init(struct filter_axis_t* a, int src, int dst, int filter) {
+	float scale = (float)src / (float)dst;
+	int x, i, t;
+
+	a->dst_size = dst;
+
+	if (src == dst)
+		a->taps = 1;
+	else if (filter == MIPMAP_FILTER_BOX)
+		a->taps = (int)ceilf(scale) + 1;
+	else
+		a->taps = (int)ceilf(2.0f * KERNEL_RADIUS * scale) + 2;
+
+	a->index = (int*)malloc(sizeof(int) * dst * a->taps);
+	a->weight = (float*)malloc(sizeof(float) * dst * a->taps);
+	if (!a->index || !a->weight)
+		return 0;
+
+	memset(a->index, 0, sizeof(int) * dst * a->taps);
+	memset(a->weight, 0, sizeof(float) * dst * a->taps);
+
+	for (x = 0; x < dst; ++x) {
+		int* idx = a->index + (x * a->taps);
+		float* w = a->weight + (x * a->taps);
+		float total = 0.0f;
+
+		if (src == dst) {
+			idx[0] = x;
+			w[0] = 1.0f;
+			continue;
+		}
+
+		if (filter == MIPMAP_FILTER_BOX) {
+			/* weight by how much of each source pixel the destination covers */
+			float lo = x * scale;
+			float hi = lo + scale;
+
+			for (t = 0, i = (int)floorf(lo); (i < hi) && (t < a->taps); ++i) {
+				float cover = (hi < i + 1 ? hi : i + 1) - (lo > i ? lo : i);
+				if (cover <= 0.0f)
+					continue;
+
+				idx[t] = (i < src ? i : src - 1);
+				w[t] = cover;
+				total += cover;
+				++t;
+			}
+		} else {
+			float center = (x + 0.5f) * scale;
+			float support = KERNEL_RADIUS * scale;
+
+			for (t = 0, i = (int)floorf(center - support); (i <= (int)ceilf(center + support)) && (t < a->taps); ++i) {
+				float k = kernel(filter, ((i + 0.5f) - center) / scale);
+				if (k == 0.0f)
+					continue;
+
+				/* clamp to the edge */
+				idx[t] = (i < 0 ? 0 : (i >= src ? src - 1 : i));
+				w[t] = k;
+				total += k;
+				++t;
+			}
+		}
+
+		for (t = 0; t < a->taps; ++t)
+			w[t] /= total;
+	}
+
+	return 1;
+}
+
+
+static void axis_free(struct filter_axis_t* a) {
+	free(a->index);
+	free(a->weight);
+}
+
+
+/**
+ *	@brief 2x2 box filter of destination rows [begin, end).
+ *
+ *	Only used when both source dimensions are even.
+ */
+static void box_rows(void* arg, int begin, int end) {
+	struct mip_job_t* job = (struct mip_job_t*)arg;
+	int bpp = job->bpp;
+	int src_pitch = job->src->width * bpp;
+	int w = job->dst->width;
+	int x, y, c;
+
+	for (y = begin; y < end; ++y) {
+		const byte* r0 = job->src->data + (2 * y * src_pitch);
+		const byte* r1 = r0 + src_pitch;
+		byte* out = job->dst->data + (y * w * bpp);
+
+		x = 0;
+
+#ifdef __SSE2__
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i two = _mm_set1_epi16(2);
+
+		if (bpp == 4) {
+			/* 4 source pixels -> 2 destination pixels */
+			for (; x + 2 <= w; x += 2, r0 += 16, r1 += 16, out += 8) {
+				__m128i a = _mm_loadu_si128((const __m128i*)r0);
+				__m128i b = _mm_loadu_si128((const __m128i*)r1);
+
+				__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+				__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+				lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+				hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+
+				__m128i sum = _mm_unpacklo_epi64(lo, hi);
+				sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+
+				_mm_storel_epi64((__m128i*)out, _mm_packus_epi16(sum, zero));
+			}
+		} else {
+			/*
+			 *	2 source pixels -> 1 destination pixel.  The 8 byte load
+			 *	reads 2 bytes past the pair so the last one is done below.
+			 */
+			for (; x + 1 < w; ++x, r0 += 6, r1 += 6, out += 3) {
+				__m128i a = _mm_loadl_epi64((const __m128i*)r0);
+				__m128i b = _mm_loadl_epi64((const __m128i*)r1);
+
+				__m128i s = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+				s = _mm_add_epi16(s, _mm_srli_si128(s, 6));
+				s = _mm_srli_epi16(_mm_add_epi16(s, two), 2);
+
+				int v = _mm_cvtsi128_si32(_mm_packus_epi16(s, zero));
+				out[0] = (byte)v;
+				out[1] = (byte)(v >> 8);
+				out[2] = (byte)(v >> 16);
+			}
+		}
+#endif
+
+		for (; x < w; ++x, r0 += 2 * bpp, r1 += 2 * bpp) {
+			for (c = 0; c < bpp; ++c)
+				*out++ = (byte)((r0[c] + r0[c + bpp] + r1[c] + r1[c + bpp] + 2) >> 2);
+		}
+	}
+}
+
+
+/**
+ *	@brief Horizontal pass of source rows [begin, end) into job->tmp.
+ */
+static void filter_rows_hor(void* arg, int begin, int end) {
+	struct mip_job_t* job = (struct mip_job_t*)arg;
+	struct filter_axis_t* a = &job->hor;
+	int bpp = job->bpp;
+	int src_w = job->src->width;
+	int gamma = (job->flags & MIPMAP_GAMMA_CORRECT);
+	int x, y, t, c, i;
+
+	float* row = (float*)malloc(sizeof(float) * src_w * bpp);
+	if (!row)
+		return;
+
+	for (y = begin; y < end; ++y) {
+		const byte* in = job->src->data + (y * src_w * bpp);
+		float* out = job->tmp + (y * a->dst_size * bpp);
+
+		/* widen the row, alpha is never gamma corrected */
+		for (i = 0; i < src_w * bpp; ++i) {
+			if (gamma && (((i % bpp) != 3)))
+				row[i] = to_linear[in[i]];
+			else
+				row[i] = in[i] * (1.0f / 255.0f);
+		}
+
+		for (x = 0; x < a->dst_size; ++x, out += bpp) {
+			const int* idx = a->index + (x * a->taps);
+			const float* w = a->weight + (x * a->taps);
+
+#ifdef __SSE2__
+			if (bpp == 4) {
+				__m128 acc = _mm_setzero_ps();
+
+				for (t = 0; t < a->taps; ++t)
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[t]), _mm_loadu_ps(row + (idx[t] << 2))));
+
+				_mm_storeu_ps(out, acc);
+				continue;
+			}
+#endif
+
+			for (c = 0; c < bpp; ++c)
+				out[c] = 0.0f;
+
+			for (t = 0; t < a->taps; ++t) {
+				const float* p = row + (idx[t] * bpp);
+				for (c = 0; c < bpp; ++c)
+					out[c] += w[t] * p[c];
+			}
+		}
+	}
+
+	free(row);
+}
+
+
+/**
+ *	@brief Vertical pass of destination rows [begin, end) from job->tmp.
+ */
+static void filter_rows_vert(void* arg, int begin, int end) {
+	struct mip_job_t* job = (struct mip_job_t*)arg;
+	struct filter_axis_t* a = &job->vert;
+	int bpp = job->bpp;
+	int n = job->dst->width * bpp;
+	int gamma = (job->flags & MIPMAP_GAMMA_CORRECT);
+	int y, t, i;
+
+	float* acc = (float*)malloc(sizeof(float) * n);
+	if (!acc)
+		return;
+
+	for (y = begin; y < end; ++y) {
+		const int* idx = a->index + (y * a->taps);
+		const float* w = a->weight + (y * a->taps);
+		byte* out = job->dst->data + (y * n);
+
+		memset(acc, 0, sizeof(float) * n);
+
+		/* the rows are contiguous so colour layout does not matter here */
+		for (t = 0; t < a->taps; ++t) {
+			const float* in = job->tmp + (idx[t] * n);
+			i = 0;
+
+#ifdef __SSE2__
+			__m128 wt = _mm_set1_ps(w[t]);
+			for (; i + 4 <= n; i += 4)
+				_mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(wt, _mm_loadu_ps(in + i))));
+#endif
+
+			for (; i < n; ++i)
+				acc[i] += w[t] * in[i];
+		}
+
+		for (i = 0; i < n; ++i)
+			out[i] = quantize(acc[i], gamma && ((i % bpp) != 3));
+	}
+
+	free(acc);
+}
+
+
+/**
+ *	@brief Run a row function, over the pool if the level is big enough.
+ */
+static void run_rows(EThreadPool* pool, range_func_t func, struct mip_job_t* job, int rows, int row_pixels) {
+	if (!pool || (rows * row_pixels < MIPMAP_PARALLEL_PIXELS)) {
+		func(job, 0, rows);
+		return;
+	}
+
+	int grain = (MIPMAP_PARALLEL_PIXELS / 4) / row_pixels;
+	pool->parallel_for(func, job, rows, (grain < 1 ? 1 : grain));
+}
+
+
+/**
+ *	@brief Build one level from the one above it.
+ *	@return 1 on success, 0 if out of memory
+ */
+static int build_level(struct image_level_t* src, struct image_level_t* dst, int bpp, int filter, int flags, EThreadPool* pool) {
+	struct mip_job_t job;
+
+	job.src = src;
+	job.dst = dst;
+	job.bpp = bpp;
+	job.flags = flags;
+
+	/* plain 2x2 average */
+	if ((filter == MIPMAP_FILTER_BOX) && !(flags & MIPMAP_GAMMA_CORRECT) &&
+		(src->width == 2 * dst->width) && (src->height == 2 * dst->height))
+	{
+		run_rows(pool, box_rows, &job, dst->height, dst->width);
+		return 1;
+	}
+
+	/* separable filter through a float buffer */
+	memset(&job.hor, 0, sizeof(job.hor));
+	memset(&job.vert, 0, sizeof(job.vert));
+	job.tmp = (float*)malloc(sizeof(float) * dst->width * src->height * bpp);
+
+	if (!job.tmp || !axis_init(&job.hor, src->width, dst->width, filter) ||
+		!axis_init(&job.vert, src->height, dst->height, filter))
+	{
+		free(job.tmp);
+		axis_free(&job.hor);
+		axis_free(&job.vert);
+		return 0;
+	}
+
+	run_rows(pool, filter_rows_hor, &job, src->height, dst->width);
+	run_rows(pool, filter_rows_vert, &job, dst->height, dst->width);
+
+	free(job.tmp);
+	axis_free(&job.hor);
+	axis_free(&job.vert);
+
+	return 1;
+}
+
+
+/**
+ *	@brief Fill in levels 1..n from the base level
+ *	@param img		The image, allocated with mipmapped set
+ *	@param filter	MIPMAP_FILTER_*
+ *	@param flags	MIPMAP_* flags
+ *	@param pool		Worker threads for large levels, can be NULL
+ */
+void mipmap_build(struct image_t* img, int filter, int flags, EThreadPool* pool) {
+	int i;
+
+	if (flags & MIPMAP_GAMMA_CORRECT)
+		pthread_once(&gamma_once, build_gamma_tables);
+
+	for (i = 1; i < img->num_levels; ++i) {
+		if (!build_level(&img->levels[i - 1], &img->levels[i], img->components, filter, flags, pool)) {
+			ERROR("Mipmap: Out of memory building level %i, chain truncated.", i);
+			img->num_levels = i;
+			return;
+		}
+	}
+}
+
+
+/**
+ *	@brief Upload every level of an image to the bound GL_TEXTURE_2D.
+ *
+ *	Block compressed images go through glCompressedTexImage2D.
+ */
+void mipmap_upload(struct image_t* img) {
+	mipmap_upload_levels(img, 0);
+}
+
+
+/**
+ *	@brief Upload levels of an image from memory or from an unpack buffer.
+ *	@param base		If not NULL, level data is passed to OpenGL as an offset from here
+ */
+static void upload_levels(struct image_t* img, int first_level, const byte* base) {
+	int i;
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	for (i = first_level; i < img->num_levels; ++i) {
+		const void* data = img->levels[i].data;
+		if (base)
+			data = (const void*)(img->levels[i].data - base);
+
+		if (image_is_compressed(img)) {
+			glCompressedTexImage2D(GL_TEXTURE_2D, i - first_level, img->format,
+						img->levels[i].width, img->levels[i].height, 0,
+						img->levels[i].size, data);
+		} else {
+			glTexImage2D(GL_TEXTURE_2D, i - first_level, img->components,
+						img->levels[i].width, img->levels[i].height, 0,
+						img->format, GL_UNSIGNED_BYTE, data);
+		}
+	}
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, img->num_levels - 1 - first_level);
+}
+
+
+/**
+ *	@brief Upload an image without its largest levels.
+ *	@param img			The image
+ *	@param first_level	Image level that becomes GL level 0
+ */
+void mipmap_upload_levels(struct image_t* img, int first_level) {
+	upload_levels(img, first_level, NULL);
+}
+
+
+/**
+ *	@brief Upload an image that has been copied into the bound GL_PIXEL_UNPACK_BUFFER.
+ *	@param img			The image
+ *	@param first_level	Image level that becomes GL level 0
+ *
+ *	The buffer must hold the image's pixel block starting at
+ *	first_level, with the same layout as in memory.
+ */
+void mipmap_upload_unpack_buffer(struct image_t* img, int first_level) {
+	upload_levels(img, first_level, img->levels[first_level].data);
+}
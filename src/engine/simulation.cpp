@@ -0,0 +1,452 @@
+/**
+ *	@file simulation.cpp
+ *	@brief Fixed timestep simulation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "definitions.h"
+#include "math/mat.h"
+#include "engine/Q3map.h"
+#include "engine/simulation.h"
+
+
+static unsigned long now_usec() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	return ((tv.tv_sec * 1000000) + tv.tv_usec);
+}
+
+
+static void triple_buffer_init(struct triple_buffer_t* tb) {
+	tb->back = 0;
+	tb->middle = 1;
+	tb->front = 2;
+}
+
+
+/**
+ *	@brief Hand the back slot to the reader.
+ *	@return The slot to fill next
+ */
+static int triple_buffer_publish(struct triple_buffer_t* tb) {
+	/* the slot must be written out before the reader can take it */
+	__sync_synchronize();
+	tb->back = (__sync_lock_test_and_set(&tb->middle, tb->back | TRIPLE_BUFFER_FRESH) & ~TRIPLE_BUFFER_FRESH);
+
+	return tb->back;
+}
+
+
+/**
+ *	@brief Take the newest slot if there is one.
+ *	@return The slot to read
+ */
+static int triple_buffer_acquire(struct triple_buffer_t* tb) {
+	if (tb->middle & TRIPLE_BUFFER_FRESH)
+		tb->front = (__sync_lock_test_and_set(&tb->middle, tb->front) & ~TRIPLE_BUFFER_FRESH);
+
+	return tb->front;
+}
+
+
+ESimulation::ESimulation() {
+	map = NULL;
+	memset(&scratch, 0, sizeof(scratch));
+
+	memset(inputs, 0, sizeof(inputs));
+	triple_buffer_init(&input_buffer);
+
+	memset(snapshots, 0, sizeof(snapshots));
+	snapshot_balls = NULL;
+	triple_buffer_init(&snapshot_buffer);
+
+	memset(&camera, 0, sizeof(camera));
+	memset(&prev_camera, 0, sizeof(prev_camera));
+	balls = NULL;
+	tick_count = 0;
+	dropped_ticks = 0;
+
+	running = 0;
+}
+
+
+ESimulation::~ESimulation() {
+	stop();
+	trace_scratch_free(&scratch);
+
+	if (balls)
+		delete balls;
+	free(snapshot_balls);
+}
+
+
+/**
+ *	@brief Set up the simulation.
+ *	@param map			What the camera and balls collide with, NULL to fly through everything
+ *	@param pool			Threads to move the balls on, or NULL
+ *	@param max_balls	Most balls there can be
+ *	@return 1 on success, 0 on failure
+ *
+ *	The map must outlive the simulation.
+ */
+int ESimulation::init(EQ3Map* map, EThreadPool* pool, int max_balls) {
+	this->map = map;
+
+	if (map && !trace_scratch_init(&scratch, map->get_num_brushes(), map->get_num_patches())) {
+		this->map = NULL;
+		return 0;
+	}
+
+	if (max_balls <= 0)
+		return 1;
+
+	balls = new EBallSet();
+	if (!balls->init(max_balls, BALL_DEFAULT_RADIUS, map, pool)) {
+		delete balls;
+		balls = NULL;
+		return 0;
+	}
+
+	/* each snapshot has the balls as they were and as they are */
+	snapshot_balls = (float*)malloc(sizeof(float) * max_balls * 3 * 6);
+	if (!snapshot_balls) {
+		ERROR("Simulation: Out of memory for %i balls.", max_balls);
+		delete balls;
+		balls = NULL;
+		return 0;
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		snapshots[i].ball_radius = balls->get_radius();
+		snapshots[i].prev_balls = &snapshot_balls[max_balls * 3 * (i * 2)];
+		snapshots[i].cur_balls = &snapshot_balls[max_balls * 3 * (i * 2 + 1)];
+	}
+
+	return 1;
+}
+
+
+/**
+ *	@brief Move the camera without it passing through the space in between.
+ *	@param position	3 floats
+ *
+ *	Only while the thread is not running.
+ */
+void ESimulation::set_camera(const float* position) {
+	memset(&camera, 0, sizeof(camera));
+	camera.position[0] = position[0];
+	camera.position[1] = position[1];
+	camera.position[2] = position[2];
+	prev_camera = camera;
+
+	publish(0);
+}
+
+
+/**
+ *	@brief Put a ball at rest.
+ *	@param position	3 floats
+ *	@return 1 on success, 0 if there can be no more
+ *
+ *	Only while the thread is not running.
+ */
+int ESimulation::add_ball(const float* position) {
+	if (!balls || !balls->add(position, NULL))
+		return 0;
+
+	publish(0);
+	return 1;
+}
+
+
+/**
+ *	@brief Give the input for the ticks from now on.
+ *	@param input	Copied
+ *
+ *	Should only be called from one thread.
+ */
+void ESimulation::set_input(const struct sim_input_t* input) {
+	inputs[input_buffer.back] = *input;
+	triple_buffer_publish(&input_buffer);
+}
+
+
+/**
+ *	@brief Start running ticks in real time.
+ *	@return 1 on success, 0 on failure
+ */
+int ESimulation::start() {
+	if (running)
+		return 1;
+
+	running = 1;
+	if (pthread_create(&thread, NULL, thread_main, this)) {
+		ERROR("Simulation: Failed to create the simulation thread.");
+		running = 0;
+		return 0;
+	}
+
+	INFO("Simulation: Running at %i ticks per second.", SIM_TICK_RATE);
+
+	return 1;
+}
+
+
+/**
+ *	@brief Stop the thread after the tick it is on.
+ */
+void ESimulation::stop() {
+	if (!running)
+		return;
+
+	running = 0;
+	pthread_join(thread, NULL);
+
+	if (dropped_ticks)
+		INFO("Simulation: Fell behind and dropped %u of %u ticks.", dropped_ticks, tick_count + dropped_ticks);
+}
+
+
+/**
+ *	@brief Run ticks now on the calling thread.
+ *	@param ticks	How many
+ *
+ *	Only while the thread is not running.  The renderer is given the
+ *	last tick as it is, without drawing in between ticks.
+ */
+void ESimulation::step(int ticks) {
+	for (int i = 0; i < ticks; ++i) {
+		tick();
+		publish(0);
+	}
+}
+
+
+/**
+ *	@brief [Static] Run the ticks when they are due.
+ *	@param arg	The simulation
+ *
+ *	Ticks that are late are run back to back.  When too far behind
+ *	to catch up the time is dropped, which slows the world down
+ *	rather than the frames.
+ */
+void* ESimulation::thread_main(void* arg) {
+	ESimulation* sim = (ESimulation*)arg;
+	unsigned long next_usec = now_usec();
+
+	while (sim->running) {
+		unsigned long now = now_usec();
+		int ticks = 0;
+
+		while ((now >= next_usec) && (ticks < SIM_MAX_CATCHUP_TICKS)) {
+			sim->tick();
+			sim->publish(next_usec);
+			next_usec += SIM_TICK_USEC;
+			++ticks;
+		}
+
+		if (now >= next_usec) {
+			sim->dropped_ticks += (unsigned int)((now - next_usec) / SIM_TICK_USEC + 1);
+			next_usec = now + SIM_TICK_USEC;
+		}
+
+		now = now_usec();
+		if (next_usec > now)
+			usleep(next_usec - now);
+	}
+
+	return NULL;
+}
+
+
+/**
+ *	@brief Advance the world by one tick.
+ */
+void ESimulation::tick() {
+	const struct sim_input_t* input = &inputs[triple_buffer_acquire(&input_buffer)];
+
+	prev_camera = camera;
+	move_camera(input);
+
+	if (balls) {
+		float gravity[3];
+
+		EBallSet::tilt_gravity(input->roll, input->pitch, gravity);
+		balls->tick(SIM_TICK_SECONDS, gravity);
+	}
+
+	++tick_count;
+}
+
+
+/**
+ *	@brief Steer the camera by the keys held and fly it along.
+ *	@param input	Of this tick
+ *
+ *	The velocity eases towards the speed the keys ask for, so moving
+ *	is the same however often key presses repeat.
+ */
+void ESimulation::move_camera(const struct sim_input_t* input) {
+	float forward[3], right[3], wish[3];
+	float len;
+	float k = (SIM_CAMERA_RESPONSE * SIM_TICK_SECONDS);
+	int i;
+
+	spherical_coords_deg(input->theta, input->psi, 1.0f, &forward[0], &forward[1], &forward[2]);
+
+	/* forward x up */
+	right[0] = -forward[2];
+	right[1] = 0.0f;
+	right[2] = forward[0];
+	len = sqrtf((right[0] * right[0]) + (right[2] * right[2]));
+	if (len > 0.0001f) {
+		right[0] /= len;
+		right[2] /= len;
+	}
+
+	for (i = 0; i < 3; ++i)
+		wish[i] = 0.0f;
+	for (i = 0; i < 3; ++i) {
+		if (input->keys & SIM_KEY_FORWARD)
+			wish[i] += forward[i];
+		if (input->keys & SIM_KEY_BACK)
+			wish[i] -= forward[i];
+		if (input->keys & SIM_KEY_RIGHT)
+			wish[i] += right[i];
+		if (input->keys & SIM_KEY_LEFT)
+			wish[i] -= right[i];
+	}
+
+	len = sqrtf((wish[0] * wish[0]) + (wish[1] * wish[1]) + (wish[2] * wish[2]));
+	if (len > 0.0001f)
+		len = (SIM_CAMERA_SPEED / len);
+
+	for (i = 0; i < 3; ++i)
+		camera.velocity[i] += (((wish[i] * len) - camera.velocity[i]) * k);
+
+	/* come to a stop instead of creeping */
+	if (((camera.velocity[0] * camera.velocity[0]) + (camera.velocity[1] * camera.velocity[1]) +
+		 (camera.velocity[2] * camera.velocity[2])) < 0.01f) {
+		camera.velocity[0] = camera.velocity[1] = camera.velocity[2] = 0.0f;
+		return;
+	}
+
+	slide_move(camera.position, camera.velocity);
+}
+
+
+/**
+ *	@brief Move a sphere for one tick, sliding along what it hits.
+ *	@param position	Moved
+ *	@param velocity	Loses what goes into the surfaces hit
+ *
+ *	If the sphere is stuck inside a brush it moves freely until it is
+ *	out, so a bad spawn point can not trap the camera.
+ */
+void ESimulation::slide_move(float* position, float* velocity) {
+	struct trace_t tr;
+	float end[3];
+	float time_left = SIM_TICK_SECONDS;
+	int i;
+
+	for (int bump = 0; bump < SIM_MAX_BUMPS; ++bump) {
+		for (i = 0; i < 3; ++i)
+			end[i] = (position[i] + (velocity[i] * time_left));
+
+		if (!map) {
+			position[0] = end[0];
+			position[1] = end[1];
+			position[2] = end[2];
+			return;
+		}
+
+		map->trace(&tr, TRACE_SPHERE, position, end, NULL, NULL, SIM_CAMERA_RADIUS, MASK_SOLID, &scratch);
+
+		if (tr.all_solid) {
+			position[0] = end[0];
+			position[1] = end[1];
+			position[2] = end[2];
+			return;
+		}
+
+		position[0] = tr.end.x;
+		position[1] = tr.end.y;
+		position[2] = tr.end.z;
+
+		if (tr.fraction >= 1.0f)
+			return;
+
+		time_left *= (1.0f - tr.fraction);
+
+		/* take out the part going into the surface */
+		float into = ((velocity[0] * tr.normal[0]) + (velocity[1] * tr.normal[1]) + (velocity[2] * tr.normal[2]));
+		if (into < 0.0f) {
+			into *= SIM_OVERCLIP;
+			for (i = 0; i < 3; ++i)
+				velocity[i] -= (tr.normal[i] * into);
+		}
+	}
+}
+
+
+/**
+ *	@brief Give the renderer the last two ticks.
+ *	@param usec	When the last tick was due, 0 to have it drawn as it is
+ */
+void ESimulation::publish(unsigned long usec) {
+	struct sim_snapshot_t* snap = &snapshots[snapshot_buffer.back];
+
+	snap->tick = tick_count;
+	snap->usec = usec;
+	snap->prev = prev_camera;
+	snap->cur = camera;
+
+	snap->num_balls = 0;
+	if (balls) {
+		snap->num_balls = balls->get_count();
+		memcpy(snap->prev_balls, balls->get_prev_positions(), sizeof(float) * snap->num_balls * 3);
+		memcpy(snap->cur_balls, balls->get_positions(), sizeof(float) * snap->num_balls * 3);
+	}
+
+	triple_buffer_publish(&snapshot_buffer);
+}
+
+
+/**
+ *	@brief The last two ticks and how far to draw between them.
+ *	@param alpha	Set to 0 to draw the earlier tick, 1 for the last
+ *	@return The snapshot, kept until the next call
+ *
+ *	Things are drawn between the last two ticks by how far the time
+ *	is into the next one, always a tick behind but moving smoothly
+ *	at any frame rate.  Should only be called from one thread.
+ */
+const struct sim_snapshot_t* ESimulation::get_snapshot(float* alpha) {
+	const struct sim_snapshot_t* snap = &snapshots[triple_buffer_acquire(&snapshot_buffer)];
+
+	*alpha = 1.0f;
+	if (snap->usec) {
+		unsigned long now = now_usec();
+		*alpha = ((now > snap->usec) ? ((float)(now - snap->usec) / SIM_TICK_USEC) : 0.0f);
+		RANGE_BOUND(*alpha, 0.0f, 1.0f);
+	}
+
+	return snap;
+}
+
+
+/**
+ *	@brief Ticks run so far.
+ *
+ *	Only while the thread is not running.
+ */
+unsigned int ESimulation::get_tick() const {
+	return tick_count;
+}
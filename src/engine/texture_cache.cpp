@@ -0,0 +1,420 @@
+/**
+ *	@file texture_cache.cpp
+ *	@brief On-disk cache of decoded, mipmapped textures.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "definitions.h"
+#include "engine/texture_cache.h"
+
+
+#define ALIGN_UP(x, a)			(((x) + ((a) - 1)) & ~((a) - 1))
+
+/* level data starts on a page boundary */
+#define CACHE_DATA_ALIGN		4096
+
+
+/**
+ *	@struct cache_entry_t
+ *	@brief A file found while trimming the cache.
+ */
+struct cache_entry_t {
+	char name[64];
+	long size;
+	struct timespec mtime;
+};
+
+
+/**
+ *	@brief FNV-1a hash of a block of memory.
+ */
+static unsigned long long fnv1a(const void* data, int len, unsigned long long h) {
+	const byte* p = (const byte*)data;
+
+	for (; len > 0; --len, ++p) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+
+/**
+ *	@brief Create a directory and any missing parents.
+ *	@return 1 on success, 0 on failure
+ */
+static int make_dirs(const char* path) {
+	char buf[256];
+	char* p;
+
+	strncpy(buf, path, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+
+	for (p = buf + 1; *p; ++p) {
+		if (*p != '/')
+			continue;
+
+		*p = 0;
+		if (mkdir(buf, 0755) && (errno != EEXIST))
+			return 0;
+		*p = '/';
+	}
+
+	if (mkdir(buf, 0755) && (errno != EEXIST))
+		return 0;
+
+	return 1;
+}
+
+
+/**
+ *	@brief Oldest first.
+ */
+static int compare_entry_age(const void* a, const void* b) {
+	const struct cache_entry_t* ea = (const struct cache_entry_t*)a;
+	const struct cache_entry_t* eb = (const struct cache_entry_t*)b;
+
+	if (ea->mtime.tv_sec != eb->mtime.tv_sec)
+		return (ea->mtime.tv_sec < eb->mtime.tv_sec ? -1 : 1);
+	if (ea->mtime.tv_nsec != eb->mtime.tv_nsec)
+		return (ea->mtime.tv_nsec < eb->mtime.tv_nsec ? -1 : 1);
+	return 0;
+}
+
+
+ETextureCache::ETextureCache() {
+	dir[0] = 0;
+	max_bytes = TEXTURE_CACHE_MAX_BYTES;
+	total_bytes = 0;
+	enabled = 0;
+	vfs = NULL;
+
+	pthread_mutex_init(&lock, NULL);
+}
+
+
+ETextureCache::~ETextureCache() {
+	pthread_mutex_destroy(&lock);
+}
+
+
+/**
+ *	@brief Set up the cache directory.
+ *	@param dir			Directory to keep the entries in, created if needed
+ *	@param max_bytes	Size cap of the directory
+ *	@param vfs			Where source files are found, NULL for the real filesystem
+ *	@return 1 on success, 0 if the cache is unusable (it is then disabled)
+ */
+int ETextureCache::init(const char* dir, unsigned long max_bytes, const EVFS* vfs) {
+	INFO("Initializing texture cache...");
+
+	this->vfs = vfs;
+
+	strncpy(this->dir, dir, sizeof(this->dir) - 1);
+	this->dir[sizeof(this->dir) - 1] = 0;
+	this->max_bytes = max_bytes;
+
+	if (!make_dirs(this->dir)) {
+		ERROR("TextureCache: Can not create cache directory \"%s\".", this->dir);
+		enabled = 0;
+		return 0;
+	}
+
+	enabled = 1;
+
+	/* find out how big it is and get it under the cap */
+	trim();
+
+	INFO("TextureCache: Using \"%s\" (%lu KB of %lu KB).", this->dir, total_bytes / 1024, max_bytes / 1024);
+	return 1;
+}
+
+
+/**
+ *	@brief Build the key of a source file.
+ *	@return 1 on success, 0 if the source can not be found
+ */
+int ETextureCache::make_key(const char* file, unsigned long long options, struct texture_cache_key_t* key) {
+	struct vfs_info_t info;
+	struct stat st;
+
+	if (vfs) {
+		if (!vfs->get_info(file, &info))
+			return 0;
+	} else {
+		if (stat(file, &st))
+			return 0;
+
+		info.size = st.st_size;
+		info.mtime = st.st_mtime;
+		info.crc = 0;
+	}
+
+	memset(key, 0, sizeof(struct texture_cache_key_t));
+	strncpy(key->path, file, sizeof(key->path) - 1);
+	key->source_size = info.size;
+	key->source_mtime = info.mtime;
+	key->source_crc = info.crc;
+	key->options = options;
+
+	key->hash = fnv1a(key->path, strlen(key->path), 0xcbf29ce484222325ULL);
+	key->hash = fnv1a(&key->source_size, sizeof(key->source_size), key->hash);
+	key->hash = fnv1a(&key->source_mtime, sizeof(key->source_mtime), key->hash);
+	key->hash = fnv1a(&key->source_crc, sizeof(key->source_crc), key->hash);
+	key->hash = fnv1a(&key->options, sizeof(key->options), key->hash);
+
+	return 1;
+}
+
+
+/**
+ *	@brief Get the path of the entry for a key.
+ */
+void ETextureCache::entry_path(const struct texture_cache_key_t* key, char* buf, int buf_size) {
+	snprintf(buf, buf_size, "%s/%016llx" TEXTURE_CACHE_EXT, dir, key->hash);
+}
+
+
+/**
+ *	@brief Look for a cached copy of a texture.
+ *	@param file		The source image file
+ *	@param options	Must match what the entry was stored with
+ *	@return The image, mapped read-only from the cache, or NULL on a miss
+ */
+struct image_t* ETextureCache::lookup(const char* file, unsigned long long options) {
+	struct texture_cache_key_t key;
+	struct texture_cache_header_t* hdr;
+	struct stat st;
+	char path[512];
+	int fd, i;
+
+	if (!enabled || !make_key(file, options, &key))
+		return NULL;
+
+	entry_path(&key, path, sizeof(path));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || (st.st_size < (long)sizeof(struct texture_cache_header_t))) {
+		close(fd);
+		return NULL;
+	}
+
+	byte* mem = (byte*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	hdr = (struct texture_cache_header_t*)mem;
+
+	/* make sure it really is this texture, and intact */
+	int valid = ((hdr->magic == TEXTURE_CACHE_MAGIC) &&
+				 (hdr->version == TEXTURE_CACHE_VERSION) &&
+				 !memcmp(&hdr->key, &key, sizeof(key)) &&
+				 (hdr->num_levels > 0) && (hdr->num_levels <= IMAGE_MAX_LEVELS));
+
+	for (i = 0; valid && (i < hdr->num_levels); ++i) {
+		if ((hdr->levels[i].offset < (int)sizeof(struct texture_cache_header_t)) ||
+			(hdr->levels[i].size < 0) ||
+			((long)hdr->levels[i].offset + hdr->levels[i].size > st.st_size))
+			valid = 0;
+	}
+
+	if (!valid) {
+		WARNING("TextureCache: Discarding stale entry for \"%s\".", file);
+		munmap(mem, st.st_size);
+		unlink(path);
+		return NULL;
+	}
+
+	struct image_t* img = image_map(mem, st.st_size);
+	if (!img) {
+		munmap(mem, st.st_size);
+		return NULL;
+	}
+
+	img->width = hdr->width;
+	img->height = hdr->height;
+	img->components = hdr->components;
+	img->format = hdr->format;
+	img->num_levels = hdr->num_levels;
+
+	for (i = 0; i < hdr->num_levels; ++i) {
+		img->levels[i].width = hdr->levels[i].width;
+		img->levels[i].height = hdr->levels[i].height;
+		img->levels[i].size = hdr->levels[i].size;
+		img->levels[i].data = mem + hdr->levels[i].offset;
+	}
+
+	/* mark it as recently used */
+	utimes(path, NULL);
+
+	return img;
+}
+
+
+/**
+ *	@brief Add a texture to the cache.
+ *	@param file		The source image file
+ *	@param options	How the levels were generated
+ *	@param img		The final image, with every level filled in
+ *	@return 1 on success, 0 on failure
+ *
+ *	The entry is written under a temporary name and renamed into
+ *	place so other readers never see a partial file.
+ */
+int ETextureCache::store(const char* file, unsigned long long options, const struct image_t* img) {
+	struct texture_cache_header_t hdr;
+	char path[512];
+	char tmp_path[576];
+	int fd, i;
+	long offset;
+
+	if (!enabled || !make_key(file, options, &hdr.key))
+		return 0;
+
+	hdr.magic = TEXTURE_CACHE_MAGIC;
+	hdr.version = TEXTURE_CACHE_VERSION;
+	hdr.width = img->width;
+	hdr.height = img->height;
+	hdr.components = img->components;
+	hdr.format = img->format;
+	hdr.num_levels = img->num_levels;
+
+	memset(hdr.levels, 0, sizeof(hdr.levels));
+
+	offset = ALIGN_UP((long)sizeof(hdr), CACHE_DATA_ALIGN);
+	for (i = 0; i < img->num_levels; ++i) {
+		hdr.levels[i].width = img->levels[i].width;
+		hdr.levels[i].height = img->levels[i].height;
+		hdr.levels[i].size = img->levels[i].size;
+		hdr.levels[i].offset = offset;
+
+		offset = ALIGN_UP(offset + img->levels[i].size, IMAGE_ALIGNMENT);
+	}
+
+	entry_path(&hdr.key, path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%i.%lx", path, (int)getpid(), (unsigned long)pthread_self());
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		WARNING("TextureCache: Can not write \"%s\".", tmp_path);
+		return 0;
+	}
+
+	/* header, then each level at its offset */
+	int ok = (pwrite(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr));
+
+	for (i = 0; ok && (i < img->num_levels); ++i)
+		ok = (pwrite(fd, img->levels[i].data, img->levels[i].size, hdr.levels[i].offset) == img->levels[i].size);
+
+	if (ok)
+		ok = !ftruncate(fd, offset);
+
+	close(fd);
+
+	if (!ok || rename(tmp_path, path)) {
+		WARNING("TextureCache: Failed to store \"%s\".", file);
+		unlink(tmp_path);
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	total_bytes += offset;
+	int over = (total_bytes > max_bytes);
+	pthread_mutex_unlock(&lock);
+
+	if (over)
+		trim();
+
+	return 1;
+}
+
+
+/**
+ *	@brief Delete least recently used entries until the cache fits its cap.
+ *
+ *	Also recounts the size of the cache directory.
+ */
+void ETextureCache::trim() {
+	struct cache_entry_t* entries = NULL;
+	int num_entries = 0, max_entries = 0;
+	unsigned long total = 0;
+	struct dirent* de;
+	struct stat st;
+	char path[512];
+	int i;
+
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	DIR* d = opendir(dir);
+	if (!d) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	while ((de = readdir(d))) {
+		int len = strlen(de->d_name);
+		int ext_len = strlen(TEXTURE_CACHE_EXT);
+
+		if ((len <= ext_len) || (len >= (int)sizeof(entries[0].name)) ||
+			strcmp(de->d_name + len - ext_len, TEXTURE_CACHE_EXT))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (stat(path, &st))
+			continue;
+
+		if (num_entries == max_entries) {
+			max_entries = (max_entries ? max_entries * 2 : 64);
+			entries = (struct cache_entry_t*)realloc(entries, sizeof(struct cache_entry_t) * max_entries);
+		}
+
+		strcpy(entries[num_entries].name, de->d_name);
+		entries[num_entries].size = st.st_size;
+		entries[num_entries].mtime = st.st_mtim;
+		++num_entries;
+
+		total += st.st_size;
+	}
+
+	closedir(d);
+
+	if (total > max_bytes) {
+		unsigned long target = (max_bytes / 100) * TEXTURE_CACHE_TRIM_PERCENT;
+
+		qsort(entries, num_entries, sizeof(struct cache_entry_t), compare_entry_age);
+
+		for (i = 0; (i < num_entries) && (total > target); ++i) {
+			snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+			if (!unlink(path))
+				total -= entries[i].size;
+		}
+
+		INFO("TextureCache: Trimmed %i entries, %lu KB left.", i, total / 1024);
+	}
+
+	total_bytes = total;
+
+	pthread_mutex_unlock(&lock);
+
+	free(entries);
+}
@@ -1,14 +1,92 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include "definitions.h"
 #include "gl.h"
 #include "str.h"
+#include "math/mat.h"
 #include <SDL/SDL_image.h>
 #include "engine/texture_manager.h"
+#include "engine/tga.h"
+#include "engine/jpeg.h"
+
+
+/**
+ *	@brief Give the bound texture a 1x1 white image.
+ */
+static void upload_placeholder() {
+	static const byte white[3] = { 255, 255, 255 };
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, white);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+}
+
+
+/**
+ *	@brief Get the size of a texture's levels from base_level down.
+ */
+static unsigned int levels_size(const texture_t* texture, int base_level) {
+	unsigned int size = 0;
+	int i;
+
+	for (i = base_level; i < texture->num_levels; ++i)
+		size += texture->level_size[i];
+
+	return size;
+}
+
+
+/**
+ *	@brief Least recently used first, then largest first.
+ */
+static int compare_texture_use(const void* a, const void* b) {
+	const texture_t* ta = *(const texture_t**)a;
+	const texture_t* tb = *(const texture_t**)b;
+
+	if (ta->last_used != tb->last_used)
+		return (ta->last_used < tb->last_used ? -1 : 1);
+	if (ta->size != tb->size)
+		return (ta->size > tb->size ? -1 : 1);
+	return 0;
+}
+
+
+/**
+ *	@brief Sooner first.
+ */
+static int compare_prefetch_priority(const void* a, const void* b) {
+	const texture_t* ta = *(const texture_t**)a;
+	const texture_t* tb = *(const texture_t**)b;
+
+	if (ta->prefetch_priority != tb->prefetch_priority)
+		return (ta->prefetch_priority < tb->prefetch_priority ? -1 : 1);
+	return 0;
+}
+
 
 ETextureManager::~ETextureManager() {
 	INFO("Shutting down texture manager...");
 
+	cancel_pending();
+
+	/* anything decoded but never uploaded */
+	texture_job_t* job;
+	while ((job = (texture_job_t*)upload_queue->try_pop())) {
+		image_destroy(job->image);
+		free(job->file);
+		delete job;
+	}
+	delete upload_queue;
+	delete upload_ring;
+
 	/* delete all the textures */
 	texture_t* nptr = NULL;
 	while (textures) {
@@ -24,17 +102,160 @@ ETextureManager::~ETextureManager() {
 
 		textures = nptr;
 	}
+
+	free(by_gl_id);
+	free(prefetch_list);
 }
 
 
 /**
  *	@brief Initialize the texture manager
+ *	@param pool	Worker threads to decode images on, can be NULL to decode on the calling thread
  */
-void ETextureManager::init() {
+void ETextureManager::init(EThreadPool* pool) {
 	INFO("Initializing texture manager...");
 
 	textures = NULL;
 	num_loaded = 0;
+	num_pending = 0;
+
+	this->pool = pool;
+	upload_queue = new EBoundedQueue(TEXTURE_UPLOAD_QUEUE_SIZE);
+
+	upload_ring = new EUploadRing();
+	upload_ring->init(UPLOAD_RING_BUFFERS, UPLOAD_RING_BUFFER_SIZE);
+	upload_ring->set_frame_budget(TEXTURE_UPLOAD_BUDGET_BYTES);
+
+	mip_filter = MIPMAP_FILTER_BOX;
+	mip_flags = 0;
+
+	compress = 0;
+	compress_quality = DXT_QUALITY_NORMAL;
+
+	color_factor = 1.0f;
+	color_gamma = 1.0f;
+	color_flags = 0;
+
+	cache = NULL;
+	vfs = NULL;
+
+	by_gl_id = NULL;
+	by_gl_id_size = 0;
+
+	budget = 0;
+	resident_bytes = 0;
+	frame = 0;
+
+	deferred = 0;
+
+	prefetch_list = NULL;
+	num_prefetch = 0;
+	max_prefetch = 0;
+}
+
+
+/**
+ *	@brief Store textures loaded from now on block compressed
+ *	@param enabled	1 to compress, 0 to keep textures uncompressed
+ *	@param quality	DXT_QUALITY_*
+ *
+ *	If the driver has no S3TC support textures stay uncompressed.
+ */
+void ETextureManager::set_compression(int enabled, int quality) {
+	if (enabled && !dxt_supported()) {
+		WARNING("TextureManager: S3TC not supported by the driver, textures will not be compressed.");
+		enabled = 0;
+	}
+
+	compress = enabled;
+	compress_quality = quality;
+}
+
+
+/**
+ *	@brief Adjust the colour of textures loaded from now on
+ *	@param factor	Brightness factor, see COLOR_OVERBRIGHT()
+ *	@param gamma	Gamma, 1.0 leaves textures as they are
+ *	@param flags	COLOR_* flags
+ *
+ *	Both values are rounded to 1/256 so they can be part of the cache key.
+ */
+void ETextureManager::set_color(float factor, float gamma, int flags) {
+	RANGE_BOUND(factor, 0.0f, 255.0f);
+	RANGE_BOUND(gamma, 1.0f / 256.0f, 255.0f);
+
+	color_factor = (int)(factor * 256.0f + 0.5f) / 256.0f;
+	color_gamma = (int)(gamma * 256.0f + 0.5f) / 256.0f;
+	color_flags = flags;
+}
+
+
+/**
+ *	@brief Use an on-disk cache of decoded textures
+ *	@param cache	The cache, or NULL to always decode
+ */
+void ETextureManager::set_cache(ETextureCache* cache) {
+	this->cache = cache;
+}
+
+
+/**
+ *	@brief Find image files through a virtual filesystem
+ *	@param vfs	The filesystem, or NULL to use the real one
+ */
+void ETextureManager::set_vfs(const EVFS* vfs) {
+	this->vfs = vfs;
+}
+
+
+/**
+ *	@brief Limit the memory used by textures
+ *	@param bytes	The budget, 0 for no limit
+ *
+ *	Applied by end_frame().
+ */
+void ETextureManager::set_budget(unsigned long bytes) {
+	budget = bytes;
+}
+
+
+/**
+ *	@brief Only register textures loaded from now on
+ *	@param enabled	1 to load images when drawn or prefetched, 0 to load them straight away
+ */
+void ETextureManager::set_deferred(int enabled) {
+	deferred = enabled;
+}
+
+
+/**
+ *	@brief Limit the image data uploaded per frame
+ *	@param bytes	The budget, 0 for no limit
+ */
+void ETextureManager::set_upload_budget(unsigned long bytes) {
+	upload_ring->set_frame_budget(bytes);
+}
+
+
+/**
+ *	@brief Choose how mip levels are generated for textures loaded from now on
+ *	@param filter	MIPMAP_FILTER_*
+ *	@param flags	MIPMAP_* flags
+ */
+void ETextureManager::set_mip_filter(int filter, int flags) {
+	mip_filter = filter;
+	mip_flags = flags;
+}
+
+
+/**
+ *	@brief Stop accepting decoded images.
+ *
+ *	Must be called before the worker pool is shut down so that
+ *	workers blocked on a full upload queue are released.
+ */
+void ETextureManager::cancel_pending() {
+	upload_queue->close();
 }
 
 
@@ -42,6 +263,9 @@ void ETextureManager::init() {
  *	@brief Load a texture into OpenGL
  *	@param file		Name of the image file to load.
  *	@return Returns the GL texture id if successful, or 0 if failed
+ *
+ *	The returned id is valid immediately but shows a placeholder
+ *	until the decoded image has been uploaded by process_uploads().
  */
 unsigned int ETextureManager::load(char* file) {
 	texture_t* textptr;
@@ -53,53 +277,750 @@ unsigned int ETextureManager::load(char* file) {
 		/* already cached, no need to load it again */
 		return textptr->gl_id;
 
-	/* load the image */
-	SDL_Surface* surface = IMG_Load(file);
-	if (!surface) {
-		ERROR("TextureManager: Error loading image: %s", IMG_GetError());
-		return 0;
-	}
-
+	/* placeholder until the real image arrives */
 	glEnable(GL_TEXTURE_2D);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 	glGenTextures(1, &text_id);
 	glBindTexture(GL_TEXTURE_2D, text_id);
 
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
-	gluBuild2DMipmaps(GL_TEXTURE_2D, 3, surface->w, surface->h, GL_BGR_EXT, GL_UNSIGNED_BYTE, surface->pixels);
-
-	SDL_FreeSurface(surface);
+	upload_placeholder();
 
 	/* create a link node for this texture */
 	textptr = new texture_t;
+	memset(textptr, 0, sizeof(texture_t));
 	textptr->file = strdup(file);
 	textptr->gl_id = text_id;
-	textptr->next = NULL;
+	textptr->state = TEXTURE_PENDING;
+	textptr->last_used = frame - 1;		/* not drawn yet */
+
+	/* add to the beginning since that's faster than the end */
+	textptr->next = textures;
+	textures = textptr;
+
+	/* so touch() can find it */
+	if (text_id >= by_gl_id_size) {
+		unsigned int size = (by_gl_id_size ? by_gl_id_size : 256);
+		while (size <= text_id)
+			size <<= 1;
+
+		by_gl_id = (texture_t**)realloc(by_gl_id, sizeof(texture_t*) * size);
+		memset(by_gl_id + by_gl_id_size, 0, sizeof(texture_t*) * (size - by_gl_id_size));
+		by_gl_id_size = size;
+	}
+	by_gl_id[text_id] = textptr;
 
-	/* add this texture to the list */
-	if (!textures) {
-		/* this texture is the first */
-		textures = textptr;
+	/* hand it to the decoder, or wait until it is needed */
+	if (deferred)
+		textptr->state = TEXTURE_DEFERRED;
+	else
+		submit(textptr, 0);
+
+	return text_id;
+}
+
+
+/**
+ *	@brief Queue a texture to be (re)loaded.
+ *	@param texture		The texture
+ *	@param base_level	First level of the image to upload
+ */
+void ETextureManager::submit(texture_t* texture, int base_level) {
+	texture_job_t* job = new texture_job_t;
+	job->tm = this;
+	job->texture = texture;
+	job->file = strdup(texture->file);
+	job->image = NULL;
+	job->base_level = base_level;
 
-		INFO("TextureManager: Loaded texture \"%s\" (gl %i).", file, text_id);
-		++num_loaded;
-		return text_id;
+	if (texture->state == TEXTURE_DEFERRED)
+		texture->state = TEXTURE_PENDING;
+
+	texture->loading = 1;
+	++num_pending;
+
+	if (pool && pool->get_num_threads()) {
+		pool->submit(decode_job, job);
 	} else {
-		/* add to the beginning since that's faster than the end */
-		textptr->next = textures;
-		textures = textptr;
+		/* no workers, do it all now */
+		job->image = build_image(job->file);
+		upload(job);
+	}
+}
+
+
+/**
+ *	@brief [Static] Decode an image on a worker thread.
+ *	@param arg	The texture_job_t
+ */
+void ETextureManager::decode_job(void* arg) {
+	texture_job_t* job = (texture_job_t*)arg;
+	EBoundedQueue* queue = job->tm->upload_queue;
+
+	/* the manager is going away, don't bother */
+	if (!queue->is_closed())
+		job->image = job->tm->build_image(job->file);
 
-		INFO("TextureManager: Loaded texture \"%s\" (gl %i).", file, text_id);
-		++num_loaded;
-		return text_id;
+	if (!queue->push(job)) {
+		image_destroy(job->image);
+		free(job->file);
+		delete job;
 	}
+}
 
-	WARNING("TextureManager: Failed to load texture \"%s\".", file);
-	return 0;
+
+/**
+ *	@brief Produce the final, mipmapped image for a texture file.
+ *	@param file		Name of the image file
+ *	@return The image, or NULL on failure
+ *
+ *	Comes from the texture cache if there is a valid entry,
+ *	otherwise the file is decoded and the result cached.
+ *	This is called from worker threads.
+ */
+struct image_t* ETextureManager::build_image(const char* file) {
+	unsigned long long options = cache_options();
+	struct image_t* img;
+
+	if (cache && (img = cache->lookup(file, options)))
+		return img;
+
+	img = decode(file, vfs);
+	if (!img)
+		return NULL;
+
+	if ((color_factor != 1.0f) || (color_gamma != 1.0f))
+		color_apply(img->levels[0].data, img->width * img->height, img->components, color_factor, color_gamma, color_flags, pool);
+
+	mipmap_build(img, mip_filter, mip_flags, pool);
+
+	if (compress) {
+		struct image_t* dxt = dxt_compress(img, compress_quality, pool);
+		if (dxt) {
+			image_destroy(img);
+			img = dxt;
+		}
+	}
+
+	if (cache)
+		cache->store(file, options, img);
+
+	return img;
+}
+
+
+/**
+ *	@brief Get the texture cache options matching the current settings.
+ *
+ *	bits 0-7	mip filter
+ *	bits 8-15	mip flags
+ *	bits 16-23	compression quality + 1, 0 if uncompressed
+ *	bits 24-31	colour flags
+ *	bits 32-47	colour factor, 8.8 fixed point
+ *	bits 48-63	colour gamma, 8.8 fixed point
+ */
+unsigned long long ETextureManager::cache_options() const {
+	unsigned long long options = (mip_filter | (mip_flags << 8) | (compress ? ((1 + compress_quality) << 16) : 0));
+
+	options |= (unsigned long long)(color_flags & 0xff) << 24;
+	options |= (unsigned long long)((int)(color_factor * 256.0f) & 0xffff) << 32;
+	options |= (unsigned long long)((int)(color_gamma * 256.0f) & 0xffff) << 48;
+
+	return options;
+}
+
+
+/**
+ *	@brief Find the bit shift of a colour channel mask.
+ */
+static int mask_shift(Uint32 mask) {
+	int shift = 0;
+
+	if (!mask)
+		return 0;
+
+	while (!(mask & 1)) {
+		mask >>= 1;
+		++shift;
+	}
+
+	return shift;
+}
+
+
+/**
+ *	@brief Read a whole file from disk.
+ *	@return A buffer to be freed with free(), or NULL on failure
+ */
+static byte* read_file(const char* file, long* size) {
+	FILE* fptr = fopen(file, "rb");
+	if (!fptr)
+		return NULL;
+
+	fseek(fptr, 0, SEEK_END);
+	*size = ftell(fptr);
+	fseek(fptr, 0, SEEK_SET);
+
+	byte* data = (byte*)malloc(*size > 0 ? *size : 1);
+	if (data && (fread(data, 1, *size, fptr) != (size_t)*size)) {
+		free(data);
+		data = NULL;
+	}
+
+	fclose(fptr);
+
+	return data;
+}
+
+
+/**
+ *	@brief Check the extension of a file name.
+ */
+static int has_extension(const char* file, const char* ext) {
+	int len = strlen(file), ext_len = strlen(ext);
+
+	return ((len > ext_len) && !strcasecmp(file + len - ext_len, ext));
+}
+
+
+/**
+ *	@brief [Static] Decode an image file.
+ *	@param file		Name of the image file
+ *	@param vfs		Filesystem to read it from, NULL for the real one
+ *	@return The decoded image with room for its mip chain, or NULL on failure
+ *
+ *	TGA and baseline JPEG files are decoded straight into the
+ *	image.  Anything else, progressive JPEGs included, goes through
+ *	SDL_image and is repacked from the surface.
+ *
+ *	This is called from worker threads.
+ */
+struct image_t* ETextureManager::decode(const char* file, const EVFS* vfs) {
+	SDL_Surface* surface;
+	struct image_t* img = NULL;
+	long size;
+	int x, y;
+
+	/* load the file */
+	byte* data = (vfs ? vfs->load(file, &size) : read_file(file, &size));
+	if (!data) {
+		ERROR("TextureManager: Error reading image \"%s\".", file);
+		return NULL;
+	}
+
+	/* TGA has no signature, so only trust the header of files named like one */
+	if (has_extension(file, ".tga") && tga_check(data, size))
+		img = tga_decode(data, size, 1);
+	else if (jpeg_check(data, size))
+		img = jpeg_decode(data, size, 1);
+
+	if (img) {
+		free(data);
+		return img;
+	}
+
+	surface = IMG_Load_RW(SDL_RWFromMem(data, size), 1);
+	free(data);
+
+	if (!surface) {
+		ERROR("TextureManager: Error loading image \"%s\": %s", file, IMG_GetError());
+		return NULL;
+	}
+
+	SDL_PixelFormat* fmt = surface->format;
+	int bpp = fmt->BytesPerPixel;
+	int components = (((bpp == 4) && fmt->Amask) ? 4 : 3);
+
+	if ((bpp < 1) || (bpp > 4) || ((bpp == 1) && !fmt->palette)) {
+		ERROR("TextureManager: Unsupported pixel format in \"%s\" (%i bits).", file, fmt->BitsPerPixel);
+		SDL_FreeSurface(surface);
+		return NULL;
+	}
+
+	img = image_create(surface->w, surface->h, components, 1);
+	if (!img) {
+		ERROR("TextureManager: Out of memory for image \"%s\".", file);
+		SDL_FreeSurface(surface);
+		return NULL;
+	}
+
+	int rs = mask_shift(fmt->Rmask), gs = mask_shift(fmt->Gmask);
+	int bs = mask_shift(fmt->Bmask), as = mask_shift(fmt->Amask);
+	byte* out = img->levels[0].data;
+
+	/* repack into tightly packed RGB(A) */
+	for (y = 0; y < surface->h; ++y) {
+		byte* row = (byte*)surface->pixels + (y * surface->pitch);
+
+		for (x = 0; x < surface->w; ++x, row += bpp) {
+			Uint32 p;
+
+			if (bpp == 1) {
+				SDL_Color* c = &fmt->palette->colors[*row];
+				*out++ = c->r;
+				*out++ = c->g;
+				*out++ = c->b;
+				continue;
+			}
+
+			if (bpp == 2) {
+				/* scale the narrow channels up to 8 bits */
+				p = *(Uint16*)row;
+				*out++ = (byte)(((p & fmt->Rmask) >> rs) * 255 / (fmt->Rmask >> rs));
+				*out++ = (byte)(((p & fmt->Gmask) >> gs) * 255 / (fmt->Gmask >> gs));
+				*out++ = (byte)(((p & fmt->Bmask) >> bs) * 255 / (fmt->Bmask >> bs));
+				continue;
+			}
+
+			if (bpp == 3)
+				p = (row[0] | (row[1] << 8) | (row[2] << 16));
+			else
+				p = *(Uint32*)row;
+
+			*out++ = (byte)((p & fmt->Rmask) >> rs);
+			*out++ = (byte)((p & fmt->Gmask) >> gs);
+			*out++ = (byte)((p & fmt->Bmask) >> bs);
+			if (components == 4)
+				*out++ = (byte)((p & fmt->Amask) >> as);
+		}
+	}
+
+	SDL_FreeSurface(surface);
+
+	return img;
+}
+
+
+/**
+ *	@brief Upload decoded images to OpenGL.
+ *	@param budget_usec	Stop starting new uploads after this many microseconds
+ *	@return The number of textures uploaded
+ *
+ *	Must be called from the thread that owns the GL context,
+ *	normally once per frame.  At least one image is uploaded per
+ *	call so progress is always made; more are only started while
+ *	the frame's upload budget lasts and a staging buffer is free.
+ */
+int ETextureManager::process_uploads(unsigned int budget_usec) {
+	struct timeval start_tv, now_tv;
+	texture_job_t* job;
+	int uploaded = 0;
+
+	gettimeofday(&start_tv, NULL);
+
+	while ((job = (texture_job_t*)upload_queue->try_pop())) {
+		upload(job);
+		++uploaded;
+
+		gettimeofday(&now_tv, NULL);
+		unsigned long elapsed_usec = ((now_tv.tv_sec - start_tv.tv_sec) * 1000000 +
+									  (now_tv.tv_usec - start_tv.tv_usec));
+		if (elapsed_usec >= budget_usec)
+			break;
+
+		if (!can_upload())
+			break;
+	}
+
+	return uploaded;
+}
+
+
+/**
+ *	@brief Upload an image to the bound GL_TEXTURE_2D.
+ *	@param img			The image; it can be destroyed once this returns
+ *	@param first_level	Image level that becomes GL level 0
+ *
+ *	Counts towards the frame's upload budget.
+ */
+void ETextureManager::upload_image(struct image_t* img, int first_level) {
+	upload_ring->upload(img, first_level);
+}
+
+
+/**
+ *	@brief Check if more can be uploaded this frame without stalling.
+ *	@return 1 if the upload budget is not used up and a staging buffer is free
+ */
+int ETextureManager::can_upload() {
+	return (!upload_ring->over_budget() && upload_ring->available());
+}
+
+
+/**
+ *	@brief Wait until every requested texture has been uploaded.
+ */
+void ETextureManager::finish() {
+	while (num_pending) {
+		if (!process_uploads(TEXTURE_UPLOAD_BUDGET_USEC))
+			usleep(1000);
+	}
+}
+
+
+/**
+ *	@brief Note that a texture is being drawn this frame.
+ *	@param gl_id	GL id returned by load(), ids not from this manager are ignored
+ */
+void ETextureManager::touch(unsigned int gl_id) {
+	if ((gl_id < by_gl_id_size) && by_gl_id[gl_id])
+		by_gl_id[gl_id]->last_used = frame;
+}
+
+
+/**
+ *	@brief Keep the textures within the budget.  Call once at the end of every frame.
+ *
+ *	Over budget, textures are evicted or downgraded.  Otherwise
+ *	textures drawn this frame that were evicted or downgraded are
+ *	reloaded if they fit, and if evicted ones do not, room is made
+ *	for them.
+ */
+void ETextureManager::end_frame() {
+	unsigned long limit = (budget / 100) * TEXTURE_RESTORE_PERCENT;
+	unsigned long needed;
+
+	if (budget && (resident_bytes > budget)) {
+		enforce_budget(budget);
+	} else {
+		needed = restore_textures();
+
+		if (budget && needed)
+			enforce_budget(limit > needed ? limit - needed : 0);
+	}
+
+	start_prefetches();
+
+	upload_ring->end_frame();
+	++frame;
+}
+
+
+/**
+ *	@brief Drop a texture, leaving the placeholder bound to its id.
+ */
+void ETextureManager::evict(texture_t* texture) {
+	glBindTexture(GL_TEXTURE_2D, texture->gl_id);
+	upload_placeholder();
+
+	resident_bytes -= texture->size;
+	texture->size = 0;
+	texture->base_level = texture->num_levels;
+	texture->state = TEXTURE_EVICTED;
+}
+
+
+/**
+ *	@brief Reload a texture without its largest level.
+ *
+ *	The budget is charged the smaller size straight away, the
+ *	memory is freed once the reload has been uploaded.
+ */
+void ETextureManager::downgrade(texture_t* texture) {
+	if (texture->base_level + 1 >= texture->num_levels)
+		return;
+
+	resident_bytes -= texture->size;
+
+	texture->base_level += 1;
+	texture->size = levels_size(texture, texture->base_level);
+
+	resident_bytes += texture->size;
+
+	submit(texture, texture->base_level);
+}
+
+
+/**
+ *	@brief Get the resident size down to a target.
+ *	@param target	Bytes to get down to
+ *
+ *	Textures that have not been drawn for TEXTURE_EVICT_FRAMES
+ *	are evicted first, least recently used first.  If that is not
+ *	enough, the least recently used textures lose a mip level each,
+ *	largest first among those drawn in the same frame.
+ */
+void ETextureManager::enforce_budget(unsigned long target) {
+	texture_t** list;
+	texture_t* tptr;
+	int num = 0, i;
+
+	for (tptr = textures; tptr; tptr = tptr->next)
+		++num;
+
+	list = (texture_t**)malloc(sizeof(texture_t*) * num);
+	if (!list)
+		return;
+
+	num = 0;
+	for (tptr = textures; tptr; tptr = tptr->next) {
+		if ((tptr->state == TEXTURE_READY) && !tptr->loading)
+			list[num++] = tptr;
+	}
+
+	qsort(list, num, sizeof(texture_t*), compare_texture_use);
+
+	for (i = 0; (i < num) && (resident_bytes > target); ++i) {
+		if (frame - list[i]->last_used >= TEXTURE_EVICT_FRAMES)
+			evict(list[i]);
+	}
+
+	for (i = 0; (i < num) && (resident_bytes > target); ++i) {
+		if (list[i]->state == TEXTURE_READY)
+			downgrade(list[i]);
+	}
+
+	free(list);
+}
+
+
+/**
+ *	@brief Reload textures drawn this frame that are evicted or downgraded.
+ *	@return Bytes needed to give the evicted textures that did not fit their share of the budget
+ *
+ *	Each gets the most levels that keep the textures under
+ *	TEXTURE_RESTORE_PERCENT of the budget, so they do not bounce
+ *	between being restored and evicted.
+ */
+unsigned long ETextureManager::restore_textures() {
+	unsigned long limit = (budget ? (budget / 100) * TEXTURE_RESTORE_PERCENT : (unsigned long)-1);
+	unsigned long share, needed = 0;
+	texture_t* tptr;
+	int restored = 0, drawn = 0;
+	int level;
+
+	for (tptr = textures; tptr; tptr = tptr->next) {
+		if (tptr->last_used == frame)
+			++drawn;
+	}
+
+	/* what each texture drawn this frame would get if the budget was split evenly */
+	share = (drawn ? limit / drawn : limit);
+
+	for (tptr = textures; tptr && (restored < TEXTURE_RESTORE_PER_FRAME); tptr = tptr->next) {
+		if (tptr->loading || (tptr->last_used != frame))
+			continue;
+
+		/* drawn before it was prefetched */
+		if (tptr->state == TEXTURE_DEFERRED) {
+			submit(tptr, 0);
+			continue;
+		}
+
+		if (!tptr->base_level)
+			continue;
+
+		if ((tptr->state != TEXTURE_READY) && (tptr->state != TEXTURE_EVICTED))
+			continue;
+
+		for (level = 0; level < tptr->base_level; ++level) {
+			unsigned int size = levels_size(tptr, level);
+
+			if (resident_bytes - tptr->size + size <= limit)
+				break;
+		}
+
+		if (level == tptr->base_level) {
+			if (tptr->state == TEXTURE_EVICTED) {
+				for (level = 0; (level < tptr->num_levels - 1) && (levels_size(tptr, level) > share); ++level)
+					;
+				needed += levels_size(tptr, level);
+			}
+			continue;
+		}
+
+		resident_bytes -= tptr->size;
+
+		tptr->base_level = level;
+		tptr->size = levels_size(tptr, level);
+
+		resident_bytes += tptr->size;
+
+		submit(tptr, level);
+		++restored;
+	}
+
+	return needed;
+}
+
+
+/**
+ *	@brief Forget all prefetch requests that have not been started yet.
+ */
+void ETextureManager::clear_prefetch() {
+	int i;
+
+	for (i = 0; i < num_prefetch; ++i)
+		prefetch_list[i]->prefetch_queued = 0;
+
+	num_prefetch = 0;
+}
+
+
+/**
+ *	@brief Ask for a texture to be loaded before it is drawn.
+ *	@param gl_id		GL id returned by load()
+ *	@param priority		Lower is sooner, normally the distance to what uses it
+ *
+ *	Only deferred and evicted textures are loaded.  Asking again
+ *	for a queued texture keeps the lower priority.
+ */
+void ETextureManager::prefetch(unsigned int gl_id, float priority) {
+	texture_t* tptr;
+
+	if ((gl_id >= by_gl_id_size) || !(tptr = by_gl_id[gl_id]))
+		return;
+
+	if (tptr->loading || ((tptr->state != TEXTURE_DEFERRED) && (tptr->state != TEXTURE_EVICTED)))
+		return;
+
+	if (tptr->prefetch_queued) {
+		if (priority < tptr->prefetch_priority)
+			tptr->prefetch_priority = priority;
+		return;
+	}
+
+	if (num_prefetch == max_prefetch) {
+		max_prefetch = (max_prefetch ? max_prefetch * 2 : 64);
+		prefetch_list = (texture_t**)realloc(prefetch_list, sizeof(texture_t*) * max_prefetch);
+	}
+
+	tptr->prefetch_queued = 1;
+	tptr->prefetch_priority = priority;
+	prefetch_list[num_prefetch++] = tptr;
+}
+
+
+/**
+ *	@brief Guess the size of a texture that has never been decoded.
+ *
+ *	The average size of the textures decoded so far, or
+ *	TEXTURE_SIZE_ESTIMATE before any have been.
+ */
+unsigned int ETextureManager::estimate_size() const {
+	unsigned long total = 0;
+	unsigned int num = 0;
+	texture_t* tptr;
+
+	for (tptr = textures; tptr; tptr = tptr->next) {
+		if (tptr->num_levels) {
+			total += levels_size(tptr, 0);
+			++num;
+		}
+	}
+
+	return (num ? (unsigned int)(total / num) : TEXTURE_SIZE_ESTIMATE);
+}
+
+
+/**
+ *	@brief Start loading the most urgent prefetch requests.
+ *
+ *	Keeps at most TEXTURE_PREFETCH_IN_FLIGHT loads going so that
+ *	textures actually being drawn are not stuck behind them, and
+ *	stops at the point where textures would start being restored
+ *	over budget.  A prefetched texture counts as used this frame.
+ *	Textures never decoded are charged an estimate until their
+ *	upload charges the real size.
+ */
+void ETextureManager::start_prefetches() {
+	unsigned long limit = (budget ? (budget / 100) * TEXTURE_RESTORE_PERCENT : (unsigned long)-1);
+	unsigned int estimate;
+	int i, kept = 0;
+
+	if (!num_prefetch)
+		return;
+
+	estimate = estimate_size();
+
+	qsort(prefetch_list, num_prefetch, sizeof(texture_t*), compare_prefetch_priority);
+
+	for (i = 0; i < num_prefetch; ++i) {
+		texture_t* tptr = prefetch_list[i];
+
+		/* may have been drawn and loaded already */
+		if (tptr->loading || ((tptr->state != TEXTURE_DEFERRED) && (tptr->state != TEXTURE_EVICTED))) {
+			tptr->prefetch_queued = 0;
+			continue;
+		}
+
+		unsigned int size = (tptr->num_levels ? levels_size(tptr, 0) : estimate);
+
+		if ((num_pending >= TEXTURE_PREFETCH_IN_FLIGHT) || (resident_bytes + size > limit)) {
+			prefetch_list[kept++] = tptr;
+			continue;
+		}
+
+		tptr->prefetch_queued = 0;
+		tptr->last_used = frame;
+
+		resident_bytes += size;
+		tptr->base_level = 0;
+		tptr->size = size;
+
+		submit(tptr, 0);
+	}
+
+	num_prefetch = kept;
+}
+
+
+/**
+ *	@brief Give a decoded image to OpenGL, replacing the placeholder.
+ *	@param job	The finished job, freed by this function
+ */
+void ETextureManager::upload(texture_job_t* job) {
+	texture_t* textptr = job->texture;
+	struct image_t* img = job->image;
+
+	int i, base_level;
+
+	--num_pending;
+	textptr->loading = 0;
+
+	glBindTexture(GL_TEXTURE_2D, textptr->gl_id);
+
+	/* anything resident is replaced below */
+	resident_bytes -= textptr->size;
+	textptr->size = 0;
+
+	if (!img) {
+		WARNING("TextureManager: Failed to load texture \"%s\".", job->file);
+
+		if (textptr->state != TEXTURE_PENDING)
+			upload_placeholder();
+
+		textptr->state = TEXTURE_FAILED;
+	} else {
+		/* the source may have changed since the last time it was loaded */
+		textptr->num_levels = img->num_levels;
+		for (i = 0; i < img->num_levels; ++i)
+			textptr->level_size[i] = img->levels[i].size;
+
+		base_level = job->base_level;
+		RANGE_BOUND(base_level, 0, img->num_levels - 1);
+
+		upload_ring->upload(img, base_level);
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+
+		if (textptr->state == TEXTURE_PENDING) {
+			++num_loaded;
+			INFO("TextureManager: Loaded texture \"%s\" (gl %i).", job->file, textptr->gl_id);
+		}
+
+		textptr->state = TEXTURE_READY;
+		textptr->base_level = base_level;
+		textptr->size = levels_size(textptr, base_level);
+	}
+
+	resident_bytes += textptr->size;
+
+	image_destroy(img);
+	free(job->file);
+	delete job;
 }
 
 
@@ -149,6 +1070,7 @@ unsigned int ETextureManager::try_load(char* file, char* extensions[]) {
 	FILE* fptr;
 	int i = 0;
 	int filename_len;
+	int found;
 
 	strncpy(filepath, file, 511);
 	filename_len = strlen(file);
@@ -158,10 +1080,16 @@ unsigned int ETextureManager::try_load(char* file, char* extensions[]) {
 		filepath[filename_len] = 0;
 		strcat(filepath, extensions[i]);
 
-		if ((fptr = fopen(filepath, "r")))
-			fclose(fptr);
+		if (vfs) {
+			/* answered from the index, no need to touch the disk */
+			found = vfs->exists(filepath);
+		} else {
+			if ((fptr = fopen(filepath, "r")))
+				fclose(fptr);
+			found = (fptr != NULL);
+		}
 
-		if (fptr) {
+		if (found) {
 			/* this file exists - append the extension to the file name */
 			strcat(file, extensions[i]);
 
@@ -175,53 +1103,24 @@ unsigned int ETextureManager::try_load(char* file, char* extensions[]) {
 
 
 /**
- *	@brief [Static] Change the gamma of an image
- *	@param data		Pointer to the image data
- *	@param width	Width of the image
- *	@param height	Height of the image
- *	@param bbp		Bytes per pixel
- *	@param factor	How much to modify the gamma by
- *
- *	Code taken from gametutorials.com, credited to Aftershock engine.
+ *	@brief Get the number of loaded textures
  */
-void ETextureManager::modify_gamma(byte* data, int width, int height, int bbp, float factor) {
-	int size = width * height * bbp;
-	int i = 0;
-
-	float scale, temp;
-	float r, g, b;
-
-	for (; i < size; i += 3) {
-		scale = 1.0f;
-		temp = 0.0f;
-
-		r = (float)data[i];
-		g = (float)data[i+1];
-		b = (float)data[i+2];
-
-		r = r * factor / 255.0f;
-		g = g * factor / 255.0f;
-		b = b * factor / 255.0f;
-
-		if(r > 1.0f && (temp = (1.0f/r)) < scale) scale = temp;
-		if(g > 1.0f && (temp = (1.0f/g)) < scale) scale = temp;
-		if(b > 1.0f && (temp = (1.0f/b)) < scale) scale = temp;
+int ETextureManager::get_num_loaded() const {
+	return num_loaded;
+}
 
-		scale *= 255.0f;
-		r *= scale;
-		g *= scale;
-		b *= scale;
 
-		data[i] = (byte)r;
-		data[i+1] = (byte)g;
-		data[i+2] = (byte)b;
-	}
+/**
+ *	@brief Get the bytes of texture data resident, or soon to be
+ */
+unsigned long ETextureManager::get_resident_bytes() const {
+	return resident_bytes;
 }
 
 
 /**
- *	@brief Get the number of loaded textures
+ *	@brief Get the number of textures still being decoded or waiting to be uploaded
  */
-int ETextureManager::get_num_loaded() const {
-	return num_loaded;
+int ETextureManager::get_num_pending() const {
+	return num_pending;
 }
@@ -0,0 +1,320 @@
+/**
+ *	@file tga.cpp
+ *	@brief Truevision TGA decoder.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "definitions.h"
+#include "engine/tga.h"
+
+
+/*
+ *	Image types.
+ */
+#define TGA_TYPE_MAPPED			1
+#define TGA_TYPE_TRUE			2
+#define TGA_TYPE_GREY			3
+#define TGA_TYPE_RLE			8		/* added to the above */
+
+/*
+ *	Image descriptor bits.
+ */
+#define TGA_DESC_ALPHA_BITS		0x0f
+#define TGA_DESC_RIGHT			0x10	/* first pixel of a row is the rightmost */
+#define TGA_DESC_TOP			0x20	/* first row is the top one */
+
+
+/**
+ *	@struct tga_reader_t
+ *	@brief Where a decode is up to.
+ */
+struct tga_reader_t {
+	const byte* pos;
+	const byte* end;
+
+	int type;					/* without TGA_TYPE_RLE */
+	int bytes;					/* per stored pixel */
+	int alpha;					/* 16 bit pixels carry an alpha bit */
+
+	byte palette[256 * 4];		/* colour map expanded to RGBA */
+	int palette_first;
+	int palette_len;
+};
+
+
+static TB_INLINE int read_le16(const byte* p) {
+	return (p[0] | (p[1] << 8));
+}
+
+
+/**
+ *	@brief Expand a 15 or 16 bit A1R5G5B5 pixel.
+ */
+static TB_INLINE void expand_16(int p, int alpha, byte* rgba) {
+	int r = (p >> 10) & 0x1f, g = (p >> 5) & 0x1f, b = p & 0x1f;
+
+	rgba[0] = (byte)((r << 3) | (r >> 2));
+	rgba[1] = (byte)((g << 3) | (g >> 2));
+	rgba[2] = (byte)((b << 3) | (b >> 2));
+	rgba[3] = ((!alpha || (p & 0x8000)) ? 255 : 0);
+}
+
+
+/**
+ *	@brief Convert one stored pixel to RGBA.
+ *	@return 1 on success, 0 if the data ran out or a colour index is out of range
+ */
+static TB_INLINE int read_pixel(struct tga_reader_t* r, byte* rgba) {
+	const byte* p = r->pos;
+
+	if (r->end - p < r->bytes)
+		return 0;
+	r->pos += r->bytes;
+
+	if (r->type == TGA_TYPE_MAPPED) {
+		int index = ((r->bytes == 1) ? p[0] : read_le16(p)) - r->palette_first;
+
+		if ((index < 0) || (index >= r->palette_len))
+			return 0;
+
+		memcpy(rgba, &r->palette[index * 4], 4);
+		return 1;
+	}
+
+	if (r->type == TGA_TYPE_GREY) {
+		rgba[0] = rgba[1] = rgba[2] = p[0];
+		rgba[3] = ((r->bytes == 2) ? p[1] : 255);
+		return 1;
+	}
+
+	switch (r->bytes) {
+		case 2:
+			expand_16(read_le16(p), r->alpha, rgba);
+			break;
+
+		case 3:
+			rgba[0] = p[2];
+			rgba[1] = p[1];
+			rgba[2] = p[0];
+			rgba[3] = 255;
+			break;
+
+		default:
+			rgba[0] = p[2];
+			rgba[1] = p[1];
+			rgba[2] = p[0];
+			rgba[3] = p[3];
+			break;
+	}
+
+	return 1;
+}
+
+
+/**
+ *	@brief Check that data looks like a TGA file the decoder handles.
+ *	@return 1 if it does, 0 if not
+ *
+ *	TGA files have no signature, so this only checks that the
+ *	header fields are consistent.
+ */
+int tga_check(const byte* data, long size) {
+	if (size < TGA_HEADER_SIZE)
+		return 0;
+
+	int cmap_type = data[1];
+	int type = data[2] & ~TGA_TYPE_RLE;
+	int cmap_bits = data[7];
+	int bits = data[16];
+
+	if ((data[2] & ~(TGA_TYPE_RLE | 3)) || (type < TGA_TYPE_MAPPED) || (cmap_type > 1))
+		return 0;
+
+	if (!read_le16(data + 12) || !read_le16(data + 14))
+		return 0;
+
+	switch (type) {
+		case TGA_TYPE_MAPPED:
+			return (cmap_type && ((bits == 8) || (bits == 16)) &&
+					((cmap_bits == 15) || (cmap_bits == 16) || (cmap_bits == 24) || (cmap_bits == 32)));
+
+		case TGA_TYPE_TRUE:
+			return ((bits == 15) || (bits == 16) || (bits == 24) || (bits == 32));
+
+		default:
+			return ((bits == 8) || (bits == 16));
+	}
+}
+
+
+/**
+ *	@brief Decode a TGA file.
+ *	@param data			The whole file
+ *	@param size			Bytes in data
+ *	@param mipmapped	Leave room for a mip chain after the image
+ *	@return The image, or NULL if the file is damaged or not supported
+ *
+ *	Images with alpha (32 bit, 16 bit with the alpha bit in use,
+ *	grey with alpha, or a 32 bit colour map) decode to RGBA, the
+ *	rest to RGB.
+ */
+struct image_t* tga_decode(const byte* data, long size, int mipmapped) {
+	struct tga_reader_t r;
+	int x, y;
+
+	if (!tga_check(data, size)) {
+		ERROR("TGA: Unsupported or damaged header.");
+		return NULL;
+	}
+
+	int rle = (data[2] & TGA_TYPE_RLE);
+	int cmap_bits = data[7];
+	int width = read_le16(data + 12);
+	int height = read_le16(data + 14);
+	int desc = data[17];
+
+	r.type = (data[2] & ~TGA_TYPE_RLE);
+	r.bytes = (data[16] + 7) / 8;
+	r.alpha = ((desc & TGA_DESC_ALPHA_BITS) != 0);
+	r.pos = data + TGA_HEADER_SIZE + data[0];
+	r.end = data + size;
+	r.palette_first = 0;
+	r.palette_len = 0;
+
+	int components;
+	if (r.type == TGA_TYPE_MAPPED)
+		components = (((cmap_bits == 32) || ((cmap_bits == 16) && r.alpha)) ? 4 : 3);
+	else if (r.type == TGA_TYPE_GREY)
+		components = ((r.bytes == 2) ? 4 : 3);
+	else
+		components = (((r.bytes == 4) || ((r.bytes == 2) && r.alpha)) ? 4 : 3);
+
+	/* the colour map is present whenever its type says so, even if unused */
+	if (data[1]) {
+		int first = read_le16(data + 3);
+		int len = read_le16(data + 5);
+		int entry_bytes = (cmap_bits + 7) / 8;
+
+		if ((r.end - r.pos) < (long)len * entry_bytes) {
+			ERROR("TGA: Colour map is truncated.");
+			return NULL;
+		}
+
+		if (r.type == TGA_TYPE_MAPPED) {
+			if (len > 256)
+				len = 256;
+
+			for (int i = 0; i < len; ++i) {
+				const byte* e = r.pos + i * entry_bytes;
+				byte* c = &r.palette[i * 4];
+
+				if (entry_bytes == 2) {
+					expand_16(read_le16(e), r.alpha, c);
+				} else {
+					c[0] = e[2];
+					c[1] = e[1];
+					c[2] = e[0];
+					c[3] = ((entry_bytes == 4) ? e[3] : 255);
+				}
+			}
+
+			r.palette_first = first;
+			r.palette_len = len;
+		}
+
+		r.pos += read_le16(data + 5) * entry_bytes;
+	}
+
+	struct image_t* img = image_create(width, height, components, mipmapped);
+	if (!img) {
+		ERROR("TGA: Out of memory for a %ix%i image.", width, height);
+		return NULL;
+	}
+
+	byte* out = img->levels[0].data;
+	int stride = width * components;
+	int flip_x = (desc & TGA_DESC_RIGHT);
+	int flip_y = !(desc & TGA_DESC_TOP);
+
+	/* raw true colour rows are swizzled straight across */
+	if (!rle && !flip_x && (r.type == TGA_TYPE_TRUE) && (r.bytes == components)) {
+		if ((r.end - r.pos) < (long)width * height * r.bytes) {
+			ERROR("TGA: Image data is truncated.");
+			image_destroy(img);
+			return NULL;
+		}
+
+		for (y = 0; y < height; ++y) {
+			const byte* src = r.pos + (long)y * width * r.bytes;
+			byte* dst = out + (long)(flip_y ? (height - 1 - y) : y) * stride;
+
+			if (components == 4) {
+				for (x = 0; x < width; ++x, src += 4, dst += 4) {
+					dst[0] = src[2];
+					dst[1] = src[1];
+					dst[2] = src[0];
+					dst[3] = src[3];
+				}
+			} else {
+				for (x = 0; x < width; ++x, src += 3, dst += 3) {
+					dst[0] = src[2];
+					dst[1] = src[1];
+					dst[2] = src[0];
+				}
+			}
+		}
+
+		return img;
+	}
+
+	/* everything else goes a pixel at a time; runs may cross rows */
+	byte rgba[4];
+	int run = 0, raw = 0;
+
+	for (y = 0; y < height; ++y) {
+		byte* dst = out + (long)(flip_y ? (height - 1 - y) : y) * stride;
+		int step = components;
+
+		if (flip_x) {
+			dst += (width - 1) * components;
+			step = -components;
+		}
+
+		for (x = 0; x < width; ++x, dst += step) {
+			if (rle && !run) {
+				if (r.pos >= r.end)
+					goto truncated;
+
+				int header = *r.pos++;
+				run = (header & 0x7f) + 1;
+				raw = !(header & 0x80);
+
+				/* a repeated pixel is only converted once */
+				if (!raw && !read_pixel(&r, rgba))
+					goto truncated;
+			}
+
+			if ((!rle || raw) && !read_pixel(&r, rgba))
+				goto truncated;
+
+			if (rle)
+				--run;
+
+			dst[0] = rgba[0];
+			dst[1] = rgba[1];
+			dst[2] = rgba[2];
+			if (components == 4)
+				dst[3] = rgba[3];
+		}
+	}
+
+	return img;
+
+truncated:
+	ERROR("TGA: Image data is truncated or has a bad colour index.");
+	image_destroy(img);
+	return NULL;
+}
@@ -0,0 +1,292 @@
+/**
+ *	@file thread_pool.cpp
+ *	@brief Worker thread pool.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "definitions.h"
+#include "engine/thread_pool.h"
+
+
+/**
+ *	@struct range_group_t
+ *	@brief Shared state of one parallel_for() call.
+ *
+ *	Every participant pulls chunks off next_chunk until none are
+ *	left.  The group is reference counted because helper jobs may
+ *	only start after the caller has already returned.
+ */
+struct range_group_t {
+	range_func_t func;
+	void* arg;
+
+	int count;
+	int grain;
+	int num_chunks;
+
+	volatile int next_chunk;
+	volatile int chunks_done;
+	volatile int refs;
+
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+
+/**
+ *	@brief Run chunks of a range group until none are left.
+ */
+static void range_group_work(struct range_group_t* g) {
+	int chunk, begin, end;
+
+	while ((chunk = __sync_fetch_and_add(&g->next_chunk, 1)) < g->num_chunks) {
+		begin = chunk * g->grain;
+		end = begin + g->grain;
+		if (end > g->count)
+			end = g->count;
+
+		g->func(g->arg, begin, end);
+
+		if (__sync_add_and_fetch(&g->chunks_done, 1) == g->num_chunks) {
+			pthread_mutex_lock(&g->lock);
+			pthread_cond_broadcast(&g->done);
+			pthread_mutex_unlock(&g->lock);
+		}
+	}
+}
+
+
+/**
+ *	@brief Drop a reference to a range group, freeing it on the last one.
+ */
+static void range_group_release(struct range_group_t* g) {
+	if (__sync_sub_and_fetch(&g->refs, 1))
+		return;
+
+	pthread_cond_destroy(&g->done);
+	pthread_mutex_destroy(&g->lock);
+	delete g;
+}
+
+
+EThreadPool::EThreadPool() {
+	num_threads = 0;
+	head = NULL;
+	tail = NULL;
+	running = 0;
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+
+EThreadPool::~EThreadPool() {
+	shutdown();
+
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+
+/**
+ *	@brief Start the worker threads.
+ *	@param threads	Number of workers, or 0 to use one per online CPU
+ *	@return 1 on success, 0 on failure
+ */
+int EThreadPool::init(int threads) {
+	INFO("Initializing thread pool...");
+
+	if (threads <= 0) {
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads <= 0)
+			threads = 1;
+	}
+	if (threads > THREAD_POOL_MAX_THREADS)
+		threads = THREAD_POOL_MAX_THREADS;
+
+	running = 1;
+
+	for (num_threads = 0; num_threads < threads; ++num_threads) {
+		if (pthread_create(&this->threads[num_threads], NULL, worker_main, this)) {
+			ERROR("ThreadPool: Failed to create worker thread %i.", num_threads);
+			break;
+		}
+	}
+
+	if (!num_threads) {
+		running = 0;
+		return 0;
+	}
+
+	INFO("ThreadPool: Started %i worker threads.", num_threads);
+	return 1;
+}
+
+
+/**
+ *	@brief Stop the worker threads.
+ *
+ *	Jobs that are already queued are still run before the
+ *	workers exit so that their arguments are not leaked.
+ */
+void EThreadPool::shutdown() {
+	int i;
+
+	if (!running)
+		return;
+
+	INFO("Shutting down thread pool...");
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < num_threads; ++i)
+		pthread_join(threads[i], NULL);
+
+	num_threads = 0;
+}
+
+
+/**
+ *	@brief Queue a job to be run on a worker thread.
+ *	@param func	The function to run
+ *	@param arg	Argument given to func
+ *
+ *	If the pool is not running the job is run immediately
+ *	on the calling thread.
+ */
+void EThreadPool::submit(job_func_t func, void* arg) {
+	if (!running) {
+		func(arg);
+		return;
+	}
+
+	job_t* job = new job_t;
+	job->func = func;
+	job->arg = arg;
+	job->next = NULL;
+
+	pthread_mutex_lock(&lock);
+
+	if (tail)
+		tail->next = job;
+	else
+		head = job;
+	tail = job;
+
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ *	@brief Split a range of items over the workers and wait for all of them.
+ *	@param func		Called with consecutive [begin, end) sub-ranges
+ *	@param arg		Argument given to func
+ *	@param count	Number of items
+ *	@param grain	Items per call to func
+ *
+ *	The calling thread works on the range as well, so this is safe
+ *	to use from inside a job running on one of the workers.
+ */
+void EThreadPool::parallel_for(range_func_t func, void* arg, int count, int grain) {
+	int i, helpers;
+
+	if (count <= 0)
+		return;
+	if (grain < 1)
+		grain = 1;
+
+	/* not worth the hand-off */
+	if (!running || (count <= grain)) {
+		func(arg, 0, count);
+		return;
+	}
+
+	struct range_group_t* g = new range_group_t;
+	g->func = func;
+	g->arg = arg;
+	g->count = count;
+	g->grain = grain;
+	g->num_chunks = (count + grain - 1) / grain;
+	g->next_chunk = 0;
+	g->chunks_done = 0;
+
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->done, NULL);
+
+	helpers = g->num_chunks - 1;
+	if (helpers > num_threads)
+		helpers = num_threads;
+
+	g->refs = helpers + 1;
+	for (i = 0; i < helpers; ++i)
+		submit(range_job, g);
+
+	range_group_work(g);
+
+	/* wait for chunks still running on other threads */
+	pthread_mutex_lock(&g->lock);
+	while (g->chunks_done < g->num_chunks)
+		pthread_cond_wait(&g->done, &g->lock);
+	pthread_mutex_unlock(&g->lock);
+
+	range_group_release(g);
+}
+
+
+/**
+ *	@brief [Static] Helper job queued by parallel_for().
+ */
+void EThreadPool::range_job(void* arg) {
+	struct range_group_t* g = (struct range_group_t*)arg;
+
+	range_group_work(g);
+	range_group_release(g);
+}
+
+
+/**
+ *	@brief Get the number of worker threads.
+ */
+int EThreadPool::get_num_threads() const {
+	return num_threads;
+}
+
+
+/**
+ *	@brief [Static] Worker thread entry point.
+ */
+void* EThreadPool::worker_main(void* arg) {
+	EThreadPool* pool = (EThreadPool*)arg;
+	job_t* job;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+
+		while (!pool->head && pool->running)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+
+		job = pool->head;
+		if (!job) {
+			/* not running and nothing left to do */
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+
+		pool->head = job->next;
+		if (!pool->head)
+			pool->tail = NULL;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		job->func(job->arg);
+		delete job;
+	}
+
+	return NULL;
+}
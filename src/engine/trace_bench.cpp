@@ -0,0 +1,119 @@
+/**
+ *	@file trace_bench.cpp
+ *	@brief Timing of traces through a map.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "definitions.h"
+#include "engine/bench.h"
+#include "engine/trace_bench.h"
+
+
+/**
+ *	@brief Print the time of a run of traces.
+ */
+static void bench_report(const char* shape, const char* how, int count, double ms) {
+	INFO("TraceBench: %-6s %-22s %8.1f ms  %6.2f us/trace  %6.2f M traces/s",
+		 shape, how, ms, (ms * 1000.0) / count, (ms > 0.0) ? (count / ms) / 1000.0 : 0.0);
+}
+
+
+/**
+ *	@brief Time random traces through a loaded map.
+ *	@param map		The map
+ *	@param pool		Threads for the batches
+ *	@param count	Traces of each shape
+ *	@return 1 on success, 0 if out of memory
+ *
+ *	Traces start anywhere in the map's bounds and move up to
+ *	TRACE_BENCH_MAX_MOVE in a random direction, like the moves and
+ *	sight checks of things in the game.  Each shape is run one at a
+ *	time, as a batch on this thread, and as a batch over the pool.
+ */
+int trace_bench(EQ3Map* map, EThreadPool* pool, int count) {
+	static const char* shapes[] = { "ray", "sphere", "box" };
+	float mins[3], maxs[3];
+	float* buf;
+	float *starts, *ends, *box_mins, *box_maxs, *fractions;
+	struct trace_batch_t batch;
+	struct trace_scratch_t scratch;
+	struct trace_t tr;
+	double t;
+	int type, i, k;
+	int hits;
+
+	if (count <= 0 || !map->get_bounds(mins, maxs))
+		return 0;
+
+	if (!trace_scratch_init(&scratch, map->get_num_brushes(), map->get_num_patches()))
+		return 0;
+
+	buf = (float*)malloc(sizeof(float) * count * 13);
+	if (!buf) {
+		ERROR("TraceBench: Out of memory for %i traces.", count);
+		trace_scratch_free(&scratch);
+		return 0;
+	}
+
+	starts = buf;
+	ends = starts + count * 3;
+	box_mins = ends + count * 3;
+	box_maxs = box_mins + count * 3;
+	fractions = box_maxs + count * 3;
+
+	srand(BENCH_SEED);
+	for (i = 0; i < count; ++i) {
+		for (k = 0; k < 3; ++k) {
+			starts[i * 3 + k] = mins[k] + (maxs[k] - mins[k]) * (rand() / (float)RAND_MAX);
+			ends[i * 3 + k] = starts[i * 3 + k] + TRACE_BENCH_MAX_MOVE * (rand() / (float)RAND_MAX - 0.5f);
+		}
+
+		/* the size of a player */
+		box_mins[i * 3 + 0] = box_mins[i * 3 + 1] = -15.0f;
+		box_mins[i * 3 + 2] = -24.0f;
+		box_maxs[i * 3 + 0] = box_maxs[i * 3 + 1] = 15.0f;
+		box_maxs[i * 3 + 2] = 32.0f;
+	}
+
+	INFO("TraceBench: %i traces of each shape, %i worker threads.", count, (pool ? pool->get_num_threads() : 0));
+
+	for (type = TRACE_RAY; type <= TRACE_BOX; ++type) {
+		hits = 0;
+
+		t = bench_time_ms();
+		for (i = 0; i < count; ++i) {
+			map->trace(&tr, type, &starts[i * 3], &ends[i * 3], &box_mins[i * 3], &box_maxs[i * 3],
+					   16.0f, MASK_SOLID, &scratch);
+			hits += (tr.fraction < 1.0f);
+		}
+		bench_report(shapes[type], "one at a time", count, bench_time_ms() - t);
+
+		memset(&batch, 0, sizeof(batch));
+		batch.count = count;
+		batch.type = type;
+		batch.mask = MASK_SOLID;
+		batch.radius = 16.0f;
+		batch.starts = starts;
+		batch.ends = ends;
+		batch.mins = box_mins;
+		batch.maxs = box_maxs;
+		batch.fractions = fractions;
+
+		t = bench_time_ms();
+		map->trace_batch(&batch, NULL);
+		bench_report(shapes[type], "batch", count, bench_time_ms() - t);
+
+		t = bench_time_ms();
+		map->trace_batch(&batch, pool);
+		bench_report(shapes[type], "batch on the pool", count, bench_time_ms() - t);
+
+		INFO("TraceBench: %-6s %i of %i hit something.", shapes[type], hits, count);
+	}
+
+	free(buf);
+	trace_scratch_free(&scratch);
+	return 1;
+}
@@ -0,0 +1,218 @@
+/**
+ *	@file upload_ring.cpp
+ *	@brief Asynchronous texture uploads through pixel buffer objects.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "definitions.h"
+#include "gl.h"
+#include "engine/mipmap.h"
+#include "engine/upload_ring.h"
+
+
+/**
+ *	@brief Check for buffer objects, buffer mapping and fences.
+ *	@return 1 if supported, 0 if not
+ *
+ *	All of these are core from OpenGL 3.2.
+ */
+static int ring_supported() {
+	const char* version = (const char*)glGetString(GL_VERSION);
+	const char* ext = (const char*)glGetString(GL_EXTENSIONS);
+	int major = 0, minor = 0;
+
+	if (version && (sscanf(version, "%i.%i", &major, &minor) == 2))
+		if ((major > 3) || ((major == 3) && (minor >= 2)))
+			return 1;
+
+	return (ext && strstr(ext, "GL_ARB_pixel_buffer_object") &&
+			strstr(ext, "GL_ARB_map_buffer_range") && strstr(ext, "GL_ARB_sync"));
+}
+
+
+EUploadRing::EUploadRing() {
+	buffers = NULL;
+	num_buffers = 0;
+	next = 0;
+	buffer_size = 0;
+
+	frame_budget = 0;
+	frame_bytes = 0;
+
+	num_staged = 0;
+	num_direct = 0;
+}
+
+
+EUploadRing::~EUploadRing() {
+	if (buffers) {
+		INFO("UploadRing: %i uploads staged, %i direct.", num_staged, num_direct);
+
+		for (int i = 0; i < num_buffers; ++i) {
+			if (buffers[i].fence)
+				glDeleteSync(buffers[i].fence);
+			glDeleteBuffers(1, &buffers[i].pbo);
+		}
+
+		free(buffers);
+	}
+}
+
+
+/**
+ *	@brief Create the buffers.
+ *	@param num_buffers	Uploads that may be in flight at once
+ *	@param buffer_size	Bytes in each buffer
+ *	@return 1 if uploads are staged, 0 if they fall back to direct uploads
+ *
+ *	Needs a current GL context.
+ */
+int EUploadRing::init(int num_buffers, long buffer_size) {
+	if (!ring_supported()) {
+		WARNING("UploadRing: Pixel buffer objects or fences not supported, uploading directly.");
+		return 0;
+	}
+
+	buffers = (struct upload_buffer_t*)calloc(num_buffers, sizeof(struct upload_buffer_t));
+	if (!buffers) {
+		ERROR("UploadRing: Out of memory.");
+		return 0;
+	}
+
+	this->num_buffers = num_buffers;
+	this->buffer_size = buffer_size;
+
+	for (int i = 0; i < num_buffers; ++i) {
+		glGenBuffers(1, &buffers[i].pbo);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i].pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, buffer_size, NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	INFO("UploadRing: %i buffers of %li KB.", num_buffers, buffer_size / 1024);
+
+	return 1;
+}
+
+
+/**
+ *	@brief Get the oldest buffer if OpenGL has finished with it.
+ *	@return The buffer, or NULL if it is still in use
+ */
+struct upload_buffer_t* EUploadRing::acquire() {
+	struct upload_buffer_t* b = &buffers[next];
+
+	if (b->fence) {
+		GLenum status = glClientWaitSync(b->fence, 0, 0);
+		if ((status != GL_ALREADY_SIGNALED) && (status != GL_CONDITION_SATISFIED))
+			return NULL;
+
+		glDeleteSync(b->fence);
+		b->fence = 0;
+	}
+
+	return b;
+}
+
+
+/**
+ *	@brief Upload an image to the bound GL_TEXTURE_2D.
+ *	@param img			The image; it is not needed once this returns
+ *	@param first_level	Image level that becomes GL level 0
+ *
+ *	The image is staged through the next buffer if it fits and
+ *	the buffer is free, otherwise it is uploaded directly.
+ */
+void EUploadRing::upload(struct image_t* img, int first_level) {
+	const struct image_level_t* last = &img->levels[img->num_levels - 1];
+	const byte* start = img->levels[first_level].data;
+	long bytes = (last->data + last->size) - start;
+	struct upload_buffer_t* b = NULL;
+	void* dst = NULL;
+
+	frame_bytes += bytes;
+
+	if (buffers && (bytes <= buffer_size))
+		b = acquire();
+
+	if (b) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, b->pbo);
+
+		/* the fence says OpenGL is done with the old contents, so there is nothing to wait for */
+		dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+							   GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	}
+
+	if (!dst) {
+		if (b)
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		mipmap_upload_levels(img, first_level);
+		++num_direct;
+		return;
+	}
+
+	memcpy(dst, start, bytes);
+
+	if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER)) {
+		/* the contents were lost, the buffer itself is fine */
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		mipmap_upload_levels(img, first_level);
+		++num_direct;
+		return;
+	}
+
+	mipmap_upload_unpack_buffer(img, first_level);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	b->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	next = (next + 1) % num_buffers;
+	++num_staged;
+}
+
+
+/**
+ *	@brief Check if the next upload can be staged.
+ *	@return 1 if a buffer is free or staging is off, 0 if the next upload would have to wait or go direct
+ */
+int EUploadRing::available() {
+	return (!buffers || acquire());
+}
+
+
+/**
+ *	@brief Set the bytes that may be uploaded per frame.
+ *	@param bytes	The budget, 0 for no limit
+ */
+void EUploadRing::set_frame_budget(unsigned long bytes) {
+	frame_budget = bytes;
+}
+
+
+/**
+ *	@brief Start counting towards the next frame's budget.
+ */
+void EUploadRing::end_frame() {
+	frame_bytes = 0;
+}
+
+
+/**
+ *	@brief Check if this frame's budget is used up.
+ */
+int EUploadRing::over_budget() const {
+	return (frame_budget && (frame_bytes >= frame_budget));
+}
+
+
+int EUploadRing::is_enabled() const {
+	return (buffers != NULL);
+}
+
+
+unsigned long EUploadRing::get_frame_bytes() const {
+	return frame_bytes;
+}
@@ -0,0 +1,636 @@
+/**
+ *	@file vfs.cpp
+ *	@brief Virtual filesystem over loose directories and pk3 archives.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "definitions.h"
+#include "engine/vfs.h"
+
+
+/* zip record signatures */
+#define ZIP_LOCAL_SIG			0x04034b50
+#define ZIP_CENTRAL_SIG			0x02014b50
+#define ZIP_END_SIG				0x06054b50
+
+#define ZIP_LOCAL_SIZE			30
+#define ZIP_CENTRAL_SIZE		46
+#define ZIP_END_SIZE			22
+
+/* the end record is followed by at most a 64k comment */
+#define ZIP_MAX_COMMENT			0xffff
+
+#define ZIP_STORED				0
+#define ZIP_DEFLATED			8
+
+#define VFS_LOOSE				-1
+
+
+/**
+ *	@brief Read little endian values from zip records.
+ */
+static TB_INLINE unsigned int get_u16(const byte* p) {
+	return (p[0] | (p[1] << 8));
+}
+
+static TB_INLINE unsigned int get_u32(const byte* p) {
+	return (p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+}
+
+
+/**
+ *	@brief Turn a character of a file name into its index form.
+ */
+static TB_INLINE char normalize(char c) {
+	return (c == '\\' ? '/' : (char)tolower((unsigned char)c));
+}
+
+
+/**
+ *	@brief FNV-1a of a file name in index form.
+ */
+static unsigned int hash_name(const char* name) {
+	unsigned int h = 2166136261u;
+
+	for (; *name; ++name) {
+		h ^= (byte)normalize(*name);
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+
+/**
+ *	@brief Compare file names, ignoring case and separator style.
+ */
+static int same_name(const char* a, const char* b) {
+	for (; *a && *b; ++a, ++b) {
+		if (normalize(*a) != normalize(*b))
+			return 0;
+	}
+
+	return (*a == *b);
+}
+
+
+/**
+ *	@brief Sort helper for archive names.
+ */
+static int compare_names(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+EVFS::EVFS() {
+	sources = NULL;
+	num_sources = 0;
+
+	table_size = 1024;
+	table = (struct vfs_entry_t**)calloc(table_size, sizeof(struct vfs_entry_t*));
+	num_files = 0;
+}
+
+
+EVFS::~EVFS() {
+	unsigned int i;
+
+	INFO("Shutting down virtual filesystem...");
+
+	for (i = 0; i < table_size; ++i) {
+		struct vfs_entry_t* e = table[i];
+
+		while (e) {
+			struct vfs_entry_t* next = e->next;
+
+			free(e->name);
+			free(e);
+
+			e = next;
+		}
+	}
+	free(table);
+
+	for (i = 0; i < (unsigned int)num_sources; ++i) {
+		if (sources[i].fd >= 0)
+			close(sources[i].fd);
+	}
+	free(sources);
+}
+
+
+/**
+ *	@brief Mount a directory and then every archive in it, in name order.
+ *	@param dir	The directory
+ *	@return 1 on success, 0 if the directory can not be read
+ *
+ *	Files in the archives hide loose files of the same name.
+ */
+int EVFS::add_search_path(const char* dir) {
+	char** packs = NULL;
+	int num_packs = 0, max_packs = 0;
+	char path[VFS_MAX_PATH * 2];
+	struct dirent* de;
+	int i;
+
+	if (!add_directory(dir))
+		return 0;
+
+	DIR* d = opendir(dir);
+	if (!d)
+		return 0;
+
+	while ((de = readdir(d))) {
+		int len = strlen(de->d_name);
+		int ext_len = strlen(VFS_PACK_EXT);
+
+		if ((len <= ext_len) || strcasecmp(de->d_name + len - ext_len, VFS_PACK_EXT))
+			continue;
+
+		if (num_packs == max_packs) {
+			max_packs = (max_packs ? max_packs * 2 : 16);
+			packs = (char**)realloc(packs, sizeof(char*) * max_packs);
+		}
+
+		packs[num_packs++] = strdup(de->d_name);
+	}
+
+	closedir(d);
+
+	qsort(packs, num_packs, sizeof(char*), compare_names);
+
+	for (i = 0; i < num_packs; ++i) {
+		snprintf(path, sizeof(path), "%s/%s", dir, packs[i]);
+		add_pack(path);
+		free(packs[i]);
+	}
+	free(packs);
+
+	return 1;
+}
+
+
+/**
+ *	@brief Mount the loose files of a directory and its subdirectories.
+ *	@param dir	The directory
+ *	@return 1 on success, 0 if the directory can not be read
+ *
+ *	Hidden files and directories are skipped.  Files added to the
+ *	directory after this are not seen.
+ */
+int EVFS::add_directory(const char* dir) {
+	int before = num_files;
+
+	int source = add_source(dir, -1, 0);
+	if (source < 0)
+		return 0;
+
+	if (!scan_directory(source, dir, "")) {
+		ERROR("VFS: Can not read directory \"%s\".", dir);
+		return 0;
+	}
+
+	INFO("VFS: Added directory \"%s\" (%i files).", dir, num_files - before);
+	return 1;
+}
+
+
+/**
+ *	@brief Index one level of a mounted directory.
+ *	@param source	The mounted directory
+ *	@param dir		Directory to read
+ *	@param prefix	Name of dir relative to the mounted directory, "" or ending in '/'
+ *	@return 1 on success, 0 if dir can not be read
+ */
+int EVFS::scan_directory(int source, const char* dir, const char* prefix) {
+	char path[VFS_MAX_PATH * 2];
+	char name[VFS_MAX_PATH];
+	struct dirent* de;
+	struct stat st;
+
+	DIR* d = opendir(dir);
+	if (!d)
+		return 0;
+
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if ((int)snprintf(name, sizeof(name), "%s%s", prefix, de->d_name) >= (int)sizeof(name))
+			continue;
+
+		if (stat(path, &st))
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			strcat(name, "/");
+			scan_directory(source, path, name);
+			continue;
+		}
+
+		if (!S_ISREG(st.st_mode))
+			continue;
+
+		struct vfs_entry_t* entry = (struct vfs_entry_t*)calloc(1, sizeof(struct vfs_entry_t));
+		entry->name = strdup(name);
+		entry->source = source;
+		entry->method = VFS_LOOSE;
+		entry->size = st.st_size;
+		entry->comp_size = st.st_size;
+		entry->mtime = st.st_mtime;
+
+		insert(entry);
+	}
+
+	closedir(d);
+	return 1;
+}
+
+
+/**
+ *	@brief Mount a pk3 (zip) archive.
+ *	@param file	The archive
+ *	@return 1 on success, 0 if it can not be read
+ *
+ *	Only the central directory is read.  The archive stays open
+ *	until the filesystem is destroyed.
+ */
+int EVFS::add_pack(const char* file) {
+	struct stat st;
+	byte* tail = NULL;
+	byte* cd = NULL;
+	long tail_size, i;
+	int count = 0;
+
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		ERROR("VFS: Can not open archive \"%s\".", file);
+		return 0;
+	}
+
+	if (fstat(fd, &st) || (st.st_size < ZIP_END_SIZE))
+		goto bad;
+
+	/* find the end of central directory record */
+	tail_size = (st.st_size < ZIP_END_SIZE + ZIP_MAX_COMMENT ? (long)st.st_size : ZIP_END_SIZE + ZIP_MAX_COMMENT);
+	tail = (byte*)malloc(tail_size);
+	if (!tail || (pread(fd, tail, tail_size, st.st_size - tail_size) != tail_size))
+		goto bad;
+
+	for (i = tail_size - ZIP_END_SIZE; i >= 0; --i) {
+		if (get_u32(tail + i) == ZIP_END_SIG)
+			break;
+	}
+	if (i < 0)
+		goto bad;
+
+	{
+		int num_entries = get_u16(tail + i + 10);
+		long cd_size = get_u32(tail + i + 12);
+		long cd_offset = get_u32(tail + i + 16);
+		long pos = 0;
+
+		if (cd_offset + cd_size > st.st_size)
+			goto bad;
+
+		cd = (byte*)malloc(cd_size + 1);
+		if (!cd || (pread(fd, cd, cd_size, cd_offset) != cd_size))
+			goto bad;
+
+		int source = add_source(file, fd, st.st_mtime);
+		if (source < 0)
+			goto bad;
+
+		for (; num_entries > 0; --num_entries) {
+			const byte* rec = cd + pos;
+
+			if ((pos + ZIP_CENTRAL_SIZE > cd_size) || (get_u32(rec) != ZIP_CENTRAL_SIG))
+				break;
+
+			int name_len = get_u16(rec + 28);
+			int next = ZIP_CENTRAL_SIZE + name_len + get_u16(rec + 30) + get_u16(rec + 32);
+
+			if (pos + next > cd_size)
+				break;
+			pos += next;
+
+			/* skip directories and anything we could not read */
+			int method = get_u16(rec + 10);
+			if (!name_len || (name_len >= VFS_MAX_PATH) || (rec[ZIP_CENTRAL_SIZE + name_len - 1] == '/') ||
+				((method != ZIP_STORED) && (method != ZIP_DEFLATED)))
+				continue;
+
+			struct vfs_entry_t* entry = (struct vfs_entry_t*)calloc(1, sizeof(struct vfs_entry_t));
+			entry->name = (char*)malloc(name_len + 1);
+			memcpy(entry->name, rec + ZIP_CENTRAL_SIZE, name_len);
+			entry->name[name_len] = 0;
+
+			entry->source = source;
+			entry->method = method;
+			entry->crc = get_u32(rec + 16);
+			entry->comp_size = get_u32(rec + 20);
+			entry->size = get_u32(rec + 24);
+			entry->offset = get_u32(rec + 42);
+			entry->mtime = st.st_mtime;
+
+			insert(entry);
+			++count;
+		}
+	}
+
+	free(tail);
+	free(cd);
+
+	INFO("VFS: Added archive \"%s\" (%i files).", file, count);
+	return 1;
+
+bad:
+	ERROR("VFS: \"%s\" is not a valid archive.", file);
+	free(tail);
+	free(cd);
+	close(fd);
+	return 0;
+}
+
+
+/**
+ *	@brief Remember a mounted directory or archive.
+ *	@return Index of the source, or -1 on failure
+ */
+int EVFS::add_source(const char* path, int fd, long long mtime) {
+	struct vfs_source_t* s = (struct vfs_source_t*)realloc(sources, sizeof(struct vfs_source_t) * (num_sources + 1));
+	if (!s)
+		return -1;
+
+	sources = s;
+
+	strncpy(sources[num_sources].path, path, VFS_MAX_PATH - 1);
+	sources[num_sources].path[VFS_MAX_PATH - 1] = 0;
+	sources[num_sources].fd = fd;
+	sources[num_sources].mtime = mtime;
+
+	return num_sources++;
+}
+
+
+/**
+ *	@brief Add a file to the index, replacing any file of the same name.
+ */
+void EVFS::insert(struct vfs_entry_t* entry) {
+	struct vfs_entry_t* e;
+	unsigned int i;
+
+	entry->hash = hash_name(entry->name);
+
+	for (e = table[entry->hash & (table_size - 1)]; e; e = e->next) {
+		if ((e->hash == entry->hash) && same_name(e->name, entry->name)) {
+			/* keep the chain link, take everything else */
+			struct vfs_entry_t* next = e->next;
+
+			free(e->name);
+			*e = *entry;
+			e->next = next;
+
+			free(entry);
+			return;
+		}
+	}
+
+	/* keep the chains short */
+	if (num_files >= (int)table_size) {
+		unsigned int size = table_size * 2;
+		struct vfs_entry_t** t = (struct vfs_entry_t**)calloc(size, sizeof(struct vfs_entry_t*));
+
+		if (t) {
+			for (i = 0; i < table_size; ++i) {
+				while ((e = table[i])) {
+					table[i] = e->next;
+					e->next = t[e->hash & (size - 1)];
+					t[e->hash & (size - 1)] = e;
+				}
+			}
+
+			free(table);
+			table = t;
+			table_size = size;
+		}
+	}
+
+	entry->next = table[entry->hash & (table_size - 1)];
+	table[entry->hash & (table_size - 1)] = entry;
+	++num_files;
+}
+
+
+/**
+ *	@brief Look up a file.
+ */
+const struct vfs_entry_t* EVFS::find(const char* name) const {
+	const struct vfs_entry_t* e;
+	unsigned int h;
+
+	/* allow "./textures/..." and "/textures/..." */
+	while ((name[0] == '.') && ((name[1] == '/') || (name[1] == '\\')))
+		name += 2;
+	while ((name[0] == '/') || (name[0] == '\\'))
+		++name;
+
+	h = hash_name(name);
+
+	for (e = table[h & (table_size - 1)]; e; e = e->next) {
+		if ((e->hash == h) && same_name(e->name, name))
+			return e;
+	}
+
+	return NULL;
+}
+
+
+/**
+ *	@brief Check if a file exists.
+ */
+int EVFS::exists(const char* name) const {
+	return (find(name) != NULL);
+}
+
+
+/**
+ *	@brief Get the size and version of a file.
+ *	@return 1 on success, 0 if there is no such file
+ */
+int EVFS::get_info(const char* name, struct vfs_info_t* info) const {
+	const struct vfs_entry_t* e = find(name);
+	if (!e)
+		return 0;
+
+	info->size = e->size;
+	info->mtime = e->mtime;
+	info->crc = e->crc;
+
+	return 1;
+}
+
+
+/**
+ *	@brief Read a file into a buffer.
+ *	@param name		The file
+ *	@param buf		Where to put it
+ *	@param buf_size	Size of buf, a smaller buffer gets the start of the file
+ *	@return Number of bytes read, or -1 if the file is missing or unreadable
+ */
+long EVFS::read(const char* name, void* buf, long buf_size) const {
+	const struct vfs_entry_t* e = find(name);
+	if (!e)
+		return -1;
+
+	if (e->method == VFS_LOOSE)
+		return read_loose(e, buf, buf_size);
+
+	return read_packed(e, buf, buf_size);
+}
+
+
+/**
+ *	@brief Read a whole file into a new buffer.
+ *	@param name		The file
+ *	@param size		Set to the size of the file, may be NULL
+ *	@return The contents, zero terminated, free() when done; NULL on failure
+ */
+byte* EVFS::load(const char* name, long* size) const {
+	const struct vfs_entry_t* e = find(name);
+	if (!e)
+		return NULL;
+
+	byte* buf = (byte*)malloc(e->size + 1);
+	if (!buf)
+		return NULL;
+
+	if (read(name, buf, e->size) != e->size) {
+		free(buf);
+		return NULL;
+	}
+
+	buf[e->size] = 0;
+
+	if (size)
+		*size = e->size;
+
+	return buf;
+}
+
+
+/**
+ *	@brief Read a loose file.
+ */
+long EVFS::read_loose(const struct vfs_entry_t* entry, void* buf, long buf_size) const {
+	char path[VFS_MAX_PATH * 2];
+	long want = (buf_size < entry->size ? buf_size : entry->size);
+
+	snprintf(path, sizeof(path), "%s/%s", sources[entry->source].path, entry->name);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ERROR("VFS: Can not open \"%s\".", path);
+		return -1;
+	}
+
+	long got = pread(fd, buf, want, 0);
+	close(fd);
+
+	return (got == want ? got : -1);
+}
+
+
+/**
+ *	@brief Read a file from an archive, inflating it if needed.
+ */
+long EVFS::read_packed(const struct vfs_entry_t* entry, void* buf, long buf_size) const {
+	int fd = sources[entry->source].fd;
+	long want = (buf_size < entry->size ? buf_size : entry->size);
+	byte local[ZIP_LOCAL_SIZE];
+
+	/* the local header's extra field can differ from the central one */
+	if ((pread(fd, local, ZIP_LOCAL_SIZE, entry->offset) != ZIP_LOCAL_SIZE) || (get_u32(local) != ZIP_LOCAL_SIG)) {
+		ERROR("VFS: Bad local header for \"%s\".", entry->name);
+		return -1;
+	}
+
+	long data = entry->offset + ZIP_LOCAL_SIZE + get_u16(local + 26) + get_u16(local + 28);
+
+	if (entry->method == ZIP_STORED) {
+		if (pread(fd, buf, want, data) != want)
+			return -1;
+	} else {
+		byte* in = (byte*)malloc(VFS_READ_CHUNK);
+		long consumed = 0;
+		z_stream zs;
+		int ret = Z_OK;
+
+		if (!in)
+			return -1;
+
+		memset(&zs, 0, sizeof(zs));
+		if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+			free(in);
+			return -1;
+		}
+
+		zs.next_out = (Bytef*)buf;
+		zs.avail_out = want;
+
+		while ((zs.avail_out > 0) && (ret != Z_STREAM_END)) {
+			if (!zs.avail_in) {
+				long chunk = entry->comp_size - consumed;
+				if (chunk > VFS_READ_CHUNK)
+					chunk = VFS_READ_CHUNK;
+
+				if ((chunk <= 0) || (pread(fd, in, chunk, data + consumed) != chunk))
+					break;
+
+				consumed += chunk;
+				zs.next_in = in;
+				zs.avail_in = chunk;
+			}
+
+			ret = inflate(&zs, Z_NO_FLUSH);
+			if ((ret != Z_OK) && (ret != Z_STREAM_END))
+				break;
+		}
+
+		long got = want - zs.avail_out;
+
+		inflateEnd(&zs);
+		free(in);
+
+		if (got != want) {
+			ERROR("VFS: Failed to inflate \"%s\".", entry->name);
+			return -1;
+		}
+	}
+
+	/* only a whole file can be checked */
+	if ((want == entry->size) && (crc32(crc32(0L, Z_NULL, 0), (const Bytef*)buf, want) != entry->crc)) {
+		ERROR("VFS: CRC mismatch in \"%s\".", entry->name);
+		return -1;
+	}
+
+	return want;
+}
+
+
+/**
+ *	@brief Get the number of files in the index.
+ */
+int EVFS::get_num_files() const {
+	return num_files;
+}
@@ -42,6 +42,7 @@ _wiimote_poll_fptr				wiimote_poll;
 
 
 EWiimote::EWiimote() {
+	wm = NULL;
 	roll = 0.0f;
 	pitch = 0.0f;
 	connected = 0;
@@ -49,6 +50,10 @@ EWiimote::EWiimote() {
 
 
 EWiimote::~EWiimote() {
+	/* init() unloads wiiuse itself unless a wiimote connected */
+	if (!connected)
+		return;
+
 	connected = 0;
 	wiimote_disconnect(wm[0]);
 	wiiuse_shutdown();
@@ -1,14 +1,43 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "definitions.h"
 #include "engine/engine.h"
+#include "engine/trace_bench.h"
+#include "engine/ball_bench.h"
 
 #include "math/matrix.h"
 
 int main(int argc, char** argv) {
 	printf(STARTUP_BANNER "\n\n");
 
+	/* typeball --bench-traces|--bench-balls [count], without a window or wiimote */
+	if (argc > 1) {
+		bench_func_t fn = NULL;
+		int count = 0;
+
+		if (!strcmp(argv[1], "--bench-traces")) {
+			fn = trace_bench;
+			count = TRACE_BENCH_DEFAULT_COUNT;
+		} else if (!strcmp(argv[1], "--bench-balls")) {
+			fn = ball_bench;
+			count = BALL_BENCH_DEFAULT_COUNT;
+		}
+
+		if (fn) {
+			if (argc > 2)
+				count = atoi(argv[2]);
+
+			if (!g_engine.init_headless())
+				return 1;
+
+			int ret = g_engine.bench(fn, count);
+			g_engine.shutdown(ret ? 0 : 1);
+			return (ret ? 0 : 1);
+		}
+	}
+
 	if (!g_engine.init())
 		return 0;
 
@@ -4,11 +4,14 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
+#include <math.h>
 #include "definitions.h"
 #include "gl.h"
 
 #include "math/vector.h"
 #include "engine/Q3map.h"
+#include "engine/texture_manager.h"
 
 
 /**
@@ -22,45 +25,37 @@ void EQ3Map::render(RCamera* camera) {
 	/* find the leaf and cluster the camera is at */
 	camera->get_position(&pos);
 	leaf = find_leaf(&pos);
-	cluster = leafs[leaf].cluster;
+	cluster = data->leafs[leaf].cluster;
 	//DEBUG("[Render::Q3Map] cluster = %i", cluster);
 
+	/* get what can be seen from here loading */
+	prefetch(cluster, &pos);
+
+	glBindBuffer(GL_ARRAY_BUFFER, data->vertex_buffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, data->index_buffer);
+
 	#if 0
 
 	/* render everything */
 	int face = 0;
 
-	for (; face < num_faces; ++face) {
-		if (faces[face].type == Q3_FACETYPE_POLYGON)
+	for (; face < data->num_faces; ++face) {
+		if (data->faces[face].type == Q3_FACETYPE_POLYGON)
 			render_face(face);
 	}
 
 	#else
 
-	int i = num_leafs;
-	struct q3bsp_leaf_t* t_leaf = NULL;
-
-	for (; i >= 0; --i) {
-		t_leaf = &leafs[i];
+	/* what the camera sees, mostly as it was last frame */
+	find_visible(camera, cluster);
 
-		/* check if this leaf cluster is visable from here */
-		if (!is_cluster_visable(cluster, t_leaf->cluster))
-			continue;
-
-		/* if this cluster is not in the camera frustum, skip it */
-		if (!camera->is_box_visable(t_leaf->mins[0], t_leaf->mins[1], t_leaf->mins[2],
-									t_leaf->maxs[0], t_leaf->maxs[1], t_leaf->maxs[2]))
-			continue;
-
-		/* render all the faces in this leaf */
-		int f = t_leaf->num_leaffaces;
-		for (; f >= 0; --f) {
-			int f_index = leaffaces[t_leaf->leafface + f].face;
-			render_face(f_index);
-		}
-	}
+	for (int i = 0; i < vis.num_faces; ++i)
+		render_face(vis.faces[i]);
 
 	#endif
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 
@@ -69,60 +64,159 @@ void EQ3Map::render(RCamera* camera) {
  *	@param face_index	The index of the face to render
  */
 inline void EQ3Map::render_face(int face_index) {
-	struct q3bsp_face_t* face = (faces + face_index);
+	struct q3bsp_face_t* face = (data->faces + face_index);
+
+	/* offsets into the bound buffers, or addresses in memory without them */
+	size_t stride = sizeof(struct q3bsp_vertex_t);
+	size_t vertex = (data->vertex_buffer ? 0 : (size_t)data->vertexes) + face->vertex * stride;
+	size_t index = (data->index_buffer ? 0 : (size_t)data->meshverts) + face->meshvert * sizeof(struct q3bsp_meshvert_t);
 
 	/* bind the texture */
 	glActiveTextureARB(GL_TEXTURE0_ARB);
 	glClientActiveTextureARB(GL_TEXTURE0_ARB);
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-	glTexCoordPointer(2, GL_FLOAT, sizeof(struct q3bsp_vertex_t), vertexes[face->vertex].texcoord);
+	glTexCoordPointer(2, GL_FLOAT, stride, (void*)(vertex + offsetof(struct q3bsp_vertex_t, texcoord)));
 	glClientActiveTextureARB(GL_TEXTURE0_ARB);
 	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, textures[face->texture].gl_text_id);
+	glBindTexture(GL_TEXTURE_2D, data->textures[face->texture].gl_text_id);
+	data->texture_manager->touch(data->textures[face->texture].gl_text_id);
 
 	/* bind the light map */
 	glActiveTextureARB(GL_TEXTURE1_ARB);
 	glClientActiveTextureARB(GL_TEXTURE1_ARB);
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-	glTexCoordPointer(2, GL_FLOAT, sizeof(struct q3bsp_vertex_t), vertexes[face->vertex].lightmapcoord);
+	glTexCoordPointer(2, GL_FLOAT, stride, (void*)(vertex + offsetof(struct q3bsp_vertex_t, lightmapcoord)));
 	glClientActiveTextureARB(GL_TEXTURE1_ARB);
 	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, lightmaps[face->lm_index].gl_text_id);
+	if ((face->lm_index >= 0) && (face->lm_index < data->num_lightmaps)) {
+		if (!data->lightmap_uploaded[face->lm_index])
+			data->upload_lightmap(face->lm_index);
+		glBindTexture(GL_TEXTURE_2D, data->lightmaps[face->lm_index].gl_text_id);
+	} else {
+		/* no lightmap, -1 would read before the array */
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
 
 	/* draw everything */
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glEnableClientState(GL_NORMAL_ARRAY);
 	//glEnableClientState(GL_COLOR_ARRAY);
 
-	glVertexPointer(3, GL_FLOAT, sizeof(struct q3bsp_vertex_t), vertexes[face->vertex].position);
-	glNormalPointer(GL_FLOAT, sizeof(struct q3bsp_vertex_t), vertexes[face->vertex].normal);
-	//glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(struct q3bsp_vertex_t), vertexes[face->vertex].color);
+	glVertexPointer(3, GL_FLOAT, stride, (void*)(vertex + offsetof(struct q3bsp_vertex_t, position)));
+	glNormalPointer(GL_FLOAT, stride, (void*)(vertex + offsetof(struct q3bsp_vertex_t, normal)));
+	//glColorPointer(4, GL_UNSIGNED_BYTE, stride, (void*)(vertex + offsetof(struct q3bsp_vertex_t, color)));
+
+	glDrawRangeElements(GL_TRIANGLES, 0, face->num_meshverts - 1, face->num_meshverts, GL_UNSIGNED_INT, (void*)index);
+}
+
+
+/**
+ *	@brief Request the textures and lightmaps of everything visible from a cluster.
+ *	@param cluster	The cluster the camera is in
+ *	@param pos		The camera position
+ *
+ *	The requests are rebuilt when the camera enters a new cluster,
+ *	nearest clusters first.  Textures go to the texture manager's
+ *	loader, lightmaps are uploaded a few per frame.
+ */
+void EQ3Map::prefetch(int cluster, vector3* pos) {
+	int c, i;
+
+	if (!data->cluster_lightmaps)
+		return;
+
+	if (cluster != prefetch_cluster) {
+		prefetch_cluster = cluster;
+
+		data->texture_manager->clear_prefetch();
+
+		for (i = 0; i < data->num_lightmaps; ++i)
+			lightmap_priority[i] = -1.0f;
+
+		for (c = 0; c < data->num_clusters; ++c) {
+			if (!is_cluster_visable(cluster, c))
+				continue;
+
+			const float* center = &data->cluster_centers[c * 3];
+			float dx = center[0] - pos->x;
+			float dy = center[1] - pos->y;
+			float dz = center[2] - pos->z;
+			float distance = sqrtf(dx * dx + dy * dy + dz * dz);
 
-	glDrawRangeElements(GL_TRIANGLES, 0, face->num_meshverts - 1, face->num_meshverts, GL_UNSIGNED_INT, &meshverts[face->meshvert]);
+			for (i = data->cluster_texture_start[c]; i < data->cluster_texture_start[c + 1]; ++i)
+				data->texture_manager->prefetch(data->textures[data->cluster_textures[i]].gl_text_id, distance);
+
+			for (i = data->cluster_lightmap_start[c]; i < data->cluster_lightmap_start[c + 1]; ++i) {
+				int lm = data->cluster_lightmaps[i];
+
+				if (!data->lightmap_uploaded[lm] && ((lightmap_priority[lm] < 0.0f) || (distance < lightmap_priority[lm])))
+					lightmap_priority[lm] = distance;
+			}
+		}
+	}
+
+	/* upload the nearest few waiting lightmaps, if there is room this frame */
+	for (c = 0; c < Q3_LIGHTMAP_PREFETCH_PER_FRAME; ++c) {
+		int nearest = -1;
+
+		if (!data->texture_manager->can_upload())
+			break;
+
+		for (i = 0; i < data->num_lightmaps; ++i) {
+			/* another map of the same file, or drawing it, may have uploaded it since */
+			if (data->lightmap_uploaded[i])
+				lightmap_priority[i] = -1.0f;
+
+			if ((lightmap_priority[i] >= 0.0f) && ((nearest < 0) || (lightmap_priority[i] < lightmap_priority[nearest])))
+				nearest = i;
+		}
+
+		if (nearest < 0)
+			break;
+
+		data->upload_lightmap(nearest);
+		lightmap_priority[nearest] = -1.0f;
+	}
 }
 
 
 /**
  *	@brief Find the leaf at a given position
  *	@param pos	The position of interest
- *	@return Offset of the leaf in the nodes vector
+ *	@return Offset of the leaf in the leafs vector
  */
 int EQ3Map::find_leaf(vector3* pos) {
-	int i = 0;
+	float p[3] = { pos->x, pos->y, pos->z };
+
+	return find_leaf(p);
+}
+
+
+/**
+ *	@brief Find the leaf at a given position, 3 floats
+ */
+int EQ3Map::find_leaf(const float* p) const {
+	const struct q3bsp_tree_node_t* tree = data->tree;
+	const struct q3bsp_tree_node_t* node = NULL;
 	float distance = 0.0f;
-	struct q3bsp_node_t* node = NULL;
-	struct q3bsp_plane_t* plane = NULL;
+	int i = 0;
+
+	if (!data->num_tree_nodes)
+		return 0;
 
 	while (i >= 0) {
-		node = &nodes[i];
-		plane = &planes[node->plane];
+		node = &tree[i];
 
 		/* calculate the distance Ax+By+Cz+d=0 */
-		distance = (plane->normal[0] * pos->x +
-					plane->normal[1] * pos->y +
-					plane->normal[2] * pos->z -
-					plane->dist);
+		if (node->type < Q3_PLANE_NON_AXIAL)
+			distance = node->normal[node->type] * p[node->type] - node->dist;
+		else
+			distance = (node->normal[0] * p[0] +
+						node->normal[1] * p[1] +
+						node->normal[2] * p[2] -
+						node->dist);
 
+		/* a branch lets the next node load while the distance is worked out */
 		if (distance >= 0)
 			/* go to the front node */
 			i = node->children[0];
@@ -141,12 +235,12 @@ int EQ3Map::find_leaf(vector3* pos) {
  *	@param test		The index to the cluster to be tested
  *	@return Returns 1 if the test cluster is visable from the current, 0 if not.
  */
-int EQ3Map::is_cluster_visable(int current, int test) {
+int EQ3Map::is_cluster_visable(int current, int test) const {
 	if (current < 0)
 		return 1;
 
 	/* get vector for current cluster */
-	byte vec = visdata.vecs[(current * visdata.sz_vecs) + (test / 8)];
+	byte vec = data->visdata.vecs[(current * data->visdata.sz_vecs) + (test / 8)];
 
 	return (vec & (1 << ((test) & 7)));
 }
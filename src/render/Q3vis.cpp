@@ -0,0 +1,299 @@
+/**
+ *	@file Q3vis.cpp
+ *	@brief Find what of a Quake3 BSP map the camera sees, reusing the last frame.
+ *
+ *	Most frames the camera moved a few units and turned a little, so
+ *	most leafs are as far inside or outside the frustum as they were.
+ *	Each leaf and cluster keeps the plane it was last behind and how
+ *	far it was from changing sides, and is only tested again once the
+ *	camera may have moved it that far.  Everything is tested when the
+ *	camera changes cluster, turns a lot or its projection changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "definitions.h"
+#include "math/simd.h"
+#include "engine/Q3map.h"
+
+
+/**
+ *	@brief Make room to remember what was visible.
+ *	@return 1 on success, 0 if out of memory
+ */
+int EQ3Map::init_vis() {
+	int num_clusters = (data->num_clusters + 1);
+	int num_leafs = data->cluster_leaf_start[data->num_clusters + 1];
+
+	memset(&vis, 0, sizeof(vis));
+	vis.cluster = -2;
+
+	vis.candidates = (int*)malloc(sizeof(int) * num_clusters);
+	vis.cluster_plane = (byte*)calloc(num_clusters, 1);
+	vis.cluster_slack = (float*)malloc(sizeof(float) * num_clusters);
+	vis.cluster_radius = (float*)malloc(sizeof(float) * num_clusters);
+	vis.leaf_plane = (byte*)calloc(num_leafs + 1, 1);
+	vis.leaf_slack = (float*)malloc(sizeof(float) * (num_leafs + 1));
+	vis.leaf_radius = (float*)malloc(sizeof(float) * (num_leafs + 1));
+	vis.faces = (int*)malloc(sizeof(int) * (data->num_faces + 1));
+	vis.face_marks = (int*)calloc(data->num_faces + 1, sizeof(int));
+
+	if (!vis.candidates || !vis.cluster_plane || !vis.cluster_slack || !vis.cluster_radius ||
+		!vis.leaf_plane || !vis.leaf_slack || !vis.leaf_radius || !vis.faces || !vis.face_marks) {
+		ERROR("Q3Map: Out of memory for visibility of %i leafs.", num_leafs);
+		free_vis();
+		return 0;
+	}
+
+	return 1;
+}
+
+
+void EQ3Map::free_vis() {
+	free(vis.candidates);
+	free(vis.cluster_plane);
+	free(vis.cluster_slack);
+	free(vis.cluster_radius);
+	free(vis.leaf_plane);
+	free(vis.leaf_slack);
+	free(vis.leaf_radius);
+	free(vis.faces);
+	free(vis.face_marks);
+
+	memset(&vis, 0, sizeof(vis));
+	vis.cluster = -2;
+}
+
+
+/**
+ *	@brief Distance from the origin to the furthest corner of a box.
+ */
+static inline float box_radius(const float* origin, const float* mins, const float* maxs) {
+	float r = 0.0f;
+
+	for (int i = 0; i < 3; ++i) {
+		float a = fabsf(mins[i] - origin[i]);
+		float b = fabsf(maxs[i] - origin[i]);
+		float d = ((a > b) ? a : b);
+
+		r += (d * d);
+	}
+
+	return sqrtf(r);
+}
+
+
+/**
+ *	@brief Test a box against the frustum, as RCamera::is_box_visable() does.
+ *	@param plane	Plane the box was last behind, tried first
+ *	@param slack	Set to how far the box is from changing sides
+ *	@return The plane it is behind, or Q3_VIS_INSIDE
+ */
+int EQ3Map::test_box(const float* mins, const float* maxs, const struct vec4* frustum, int plane, float* slack) const {
+	float nearest = 1e30f;
+	int i;
+
+	for (i = -1; i < 6; ++i) {
+		int k = ((i < 0) ? plane : i);
+
+		if ((k == Q3_VIS_INSIDE) || ((i >= 0) && (i == plane)))
+			continue;
+
+		const float* p = frustum[k].v;
+		float d = ((p[0] * ((p[0] > 0) ? maxs[0] : mins[0])) +
+				   (p[1] * ((p[1] > 0) ? maxs[1] : mins[1])) +
+				   (p[2] * ((p[2] > 0) ? maxs[2] : mins[2])) + p[3]);
+
+		if (d <= 0) {
+			*slack = -d;
+			return k;
+		}
+
+		if (d < nearest)
+			nearest = d;
+	}
+
+	*slack = nearest;
+	return Q3_VIS_INSIDE;
+}
+
+
+/**
+ *	@brief Work out the faces the camera sees into vis.faces.
+ *	@param camera	The camera, after its update()
+ *	@param cluster	Cluster the camera is in, -1 outside the map
+ */
+void EQ3Map::find_visible(RCamera* camera, int cluster) {
+	const struct vec4* frustum = camera->get_frustum();
+	const float* view = camera->get_view();
+	const float* projection = camera->get_projection();
+	vector3 pos;
+	float move, swing;
+	int full = 0, changed = 0;
+	int c, i, f;
+
+	camera->get_position(&pos);
+
+	/* clusters that can be seen from this one, outside the map every cluster and the leafs in none */
+	if (cluster != vis.cluster) {
+		int last = ((cluster < 0) ? data->num_clusters + 1 : data->num_clusters);
+
+		vis.cluster = cluster;
+		vis.num_candidates = 0;
+
+		for (c = 0; c < last; ++c) {
+			if ((data->cluster_leaf_start[c] != data->cluster_leaf_start[c + 1]) && is_cluster_visable(cluster, c))
+				vis.candidates[vis.num_candidates++] = c;
+		}
+
+		full = 1;
+	}
+
+	/*
+	 *	How far the camera moved, and how far it turned a point 1 unit
+	 *	away.  The rotations differ by R, and R - I is that distance
+	 *	across two axes and 0 along the third.
+	 */
+	move = sqrtf(((pos.x - vis.origin[0]) * (pos.x - vis.origin[0])) +
+				 ((pos.y - vis.origin[1]) * (pos.y - vis.origin[1])) +
+				 ((pos.z - vis.origin[2]) * (pos.z - vis.origin[2])));
+
+	swing = 0.0f;
+	for (c = 0; c < 3; ++c) {
+		for (i = 0; i < 3; ++i) {
+			float d = (view[c * 4 + i] - vis.view[c * 4 + i]);
+			swing += (d * d);
+		}
+	}
+	swing = sqrtf(swing * 0.5f);
+
+	if ((move > Q3_VIS_MAX_MOVE) || (swing > Q3_VIS_MAX_SWING) || memcmp(projection, vis.projection, sizeof(vis.projection)))
+		full = 1;
+
+	if (full) {
+		vis.origin[0] = pos.x;
+		vis.origin[1] = pos.y;
+		vis.origin[2] = pos.z;
+		memcpy(vis.view, view, sizeof(vis.view));
+		memcpy(vis.projection, projection, sizeof(vis.projection));
+
+		move = 0.0f;
+		swing = 0.0f;
+		changed = 1;
+		++vis.num_full;
+	}
+
+	for (int n = 0; n < vis.num_candidates; ++n) {
+		int first_leaf, end_leaf, was_inside;
+		float slack;
+
+		c = vis.candidates[n];
+		first_leaf = data->cluster_leaf_start[c];
+		end_leaf = data->cluster_leaf_start[c + 1];
+		was_inside = (vis.cluster_plane[c] == Q3_VIS_INSIDE);
+
+		/* still behind the same plane, and so are all its leafs */
+		if (!full && !was_inside && (((swing * vis.cluster_radius[c]) + move + Q3_VIS_EPSILON) < vis.cluster_slack[c]))
+			continue;
+
+		if (!full)
+			++vis.num_retests;
+
+		const float* mn = &data->cluster_mins[c * 3];
+		const float* mx = &data->cluster_maxs[c * 3];
+		int plane = test_box(mn, mx, frustum, (full ? Q3_VIS_INSIDE : vis.cluster_plane[c]), &slack);
+		float radius = box_radius(vis.origin, mn, mx);
+
+		vis.cluster_plane[c] = plane;
+		vis.cluster_radius[c] = radius;
+		vis.cluster_slack[c] = (slack - ((swing * radius) + move));
+
+		if (plane != Q3_VIS_INSIDE) {
+			/* the leafs are inside the cluster, so behind the plane with at least as much slack */
+			if (full || was_inside) {
+				for (i = first_leaf; i < end_leaf; ++i) {
+					if (vis.leaf_plane[i] == Q3_VIS_INSIDE)
+						changed = 1;
+
+					vis.leaf_plane[i] = plane;
+					vis.leaf_radius[i] = radius;
+					vis.leaf_slack[i] = vis.cluster_slack[c];
+				}
+			}
+
+			continue;
+		}
+
+		for (i = first_leaf; i < end_leaf; ++i) {
+			int old = vis.leaf_plane[i];
+
+			if (!full && (((swing * vis.leaf_radius[i]) + move + Q3_VIS_EPSILON) < vis.leaf_slack[i]))
+				continue;
+
+			if (!full)
+				++vis.num_retests;
+
+			mn = &data->leaf_mins[i * 3];
+			mx = &data->leaf_maxs[i * 3];
+			plane = test_box(mn, mx, frustum, (full ? Q3_VIS_INSIDE : old), &slack);
+			radius = box_radius(vis.origin, mn, mx);
+
+			vis.leaf_plane[i] = plane;
+			vis.leaf_radius[i] = radius;
+			vis.leaf_slack[i] = (slack - ((swing * radius) + move));
+
+			if ((plane == Q3_VIS_INSIDE) != (old == Q3_VIS_INSIDE))
+				changed = 1;
+		}
+	}
+
+	if (!changed)
+		return;
+
+	/* faces of the visible leafs, in the order they were always drawn */
+	++vis.rebuild;
+	vis.num_faces = 0;
+
+	for (int n = 0; n < vis.num_candidates; ++n) {
+		c = vis.candidates[n];
+		if (vis.cluster_plane[c] != Q3_VIS_INSIDE)
+			continue;
+
+		for (i = data->cluster_leaf_start[c]; i < data->cluster_leaf_start[c + 1]; ++i) {
+			if (vis.leaf_plane[i] != Q3_VIS_INSIDE)
+				continue;
+
+			int start = data->leaf_face_start[i];
+			int end = start + data->leaf_face_count[i];
+
+			for (f = start; f < end; ++f) {
+				int face = data->leaffaces[f].face;
+
+				if (vis.face_marks[face] == vis.rebuild)
+					continue;
+				vis.face_marks[face] = vis.rebuild;
+
+				vis.faces[vis.num_faces++] = face;
+			}
+		}
+	}
+}
+
+
+/**
+ *	@brief Frames everything was tested against the frustum, rather than what was near its edge.
+ */
+int EQ3Map::get_num_vis_full() const {
+	return vis.num_full;
+}
+
+
+/**
+ *	@brief Leafs and clusters tested again on frames that reused the last.
+ */
+int EQ3Map::get_num_vis_retests() const {
+	return vis.num_retests;
+}
@@ -1,9 +1,34 @@
+#include <string.h>
+#include <math.h>
+
 #include "definitions.h"
 #include "math/mat.h"
 #include "gl.h"
 #include "render/camera.h"
 
-#include "math/matrix.h"
+
+/**
+ *	@brief Make a view matrix, as gluLookAt() would.
+ *	@param m		Set to the view matrix
+ *	@param eye		Where the camera is
+ *	@param center	Point it looks at
+ *	@param up		Which way is up
+ */
+static void look_at(struct mat4* m, const vector3* eye, const vector3* center, const vector3* up) {
+	vector3 f = (*center - *eye);
+	f.normalize();
+
+	vector3 s = f.cross(up);
+	s.normalize();
+
+	vector3 u = s.cross(&f);
+
+	m->m[0] = s.x;	m->m[4] = s.y;	m->m[8] = s.z;		m->m[12] = -s.dot(eye);
+	m->m[1] = u.x;	m->m[5] = u.y;	m->m[9] = u.z;		m->m[13] = -u.dot(eye);
+	m->m[2] = -f.x;	m->m[6] = -f.y;	m->m[10] = -f.z;	m->m[14] = f.dot(eye);
+	m->m[3] = 0;	m->m[7] = 0;	m->m[11] = 0;		m->m[15] = 1.0f;
+}
+
 
 /**
  *	By default the camera is in 1st person mode.
@@ -12,6 +37,7 @@ RCamera::RCamera(float fov, float znear, float zfar) {
 	this->fov = fov;
 	this->znear = znear;
 	this->zfar = zfar;
+	aspect = R_CAMERA_DEFAULT_ASPECT;
 
 	third_person = 0;
 	third_person_radius = 10.0f;
@@ -26,6 +52,10 @@ RCamera::RCamera(float fov, float znear, float zfar) {
 
 	psi_rot = 90.0f;
 	theta_rot = 0.0f;
+
+	update_projection();
+	mat4_identity(&view);
+	update_frustum();
 }
 
 
@@ -43,6 +73,19 @@ void RCamera::set_viewable_area(float Fov, float zNear, float zFar) {
 	fov = Fov;
 	znear = zNear;
 	zfar = zFar;
+
+	update_projection();
+}
+
+
+/**
+ *	@brief Set the shape of the window being rendered to
+ *	@param aspect	Width divided by height
+ */
+void RCamera::set_aspect(float aspect) {
+	this->aspect = aspect;
+
+	update_projection();
 }
 
 
@@ -190,30 +233,73 @@ void RCamera::get_direction(vector3* vec) {
 }
 
 
+/**
+ *	@brief Get the current camera rotation
+ *	@param theta	Set to the left/right rotation in degrees
+ *	@param psi		Set to the up/down rotation in degrees
+ */
+void RCamera::get_rotation(float* theta, float* psi) {
+	*theta = theta_rot;
+	*psi = psi_rot;
+}
+
+
 /**
  *	@brief Set the camera position for the ModelView matrix.
+ *
+ *	Multiplies the current matrix by the view, as gluLookAt() did.
  */
 void RCamera::update() {
+	update_view();
+
+	glMultMatrixf(view.m);
+}
+
+
+/**
+ *	@brief Work out the view matrix and frustum, without touching GL.
+ *
+ *	After this the frustum checks can be used from any thread, or with
+ *	no GL context at all.
+ */
+void RCamera::update_view() {
+	vector3 center(0, 0, 0);
+
 	update_direction();
 
-	if (third_person) {
-		gluLookAt(pos.x, pos.y, pos.z,
-					0, 0, 0,
-					up.x, up.y, up.z
-		);
-	} else {
-		gluLookAt(pos.x, pos.y, pos.z,
-					pos.x + dir.x,
-					pos.y + dir.y,
-					pos.z + dir.z,
-					up.x, up.y, up.z
-		);
-	}
+	if (!third_person)
+		center = pos + dir;
+
+	look_at(&view, &pos, &center, &up);
 
 	update_frustum();
 }
 
 
+/**
+ *	@brief The projection matrix, column major for glLoadMatrixf().
+ */
+const float* RCamera::get_projection() const {
+	return projection.m;
+}
+
+
+/**
+ *	@brief The view matrix from the last update, column major for glLoadMatrixf().
+ */
+const float* RCamera::get_view() const {
+	return view.m;
+}
+
+
+/**
+ *	@brief The 6 frustum planes from the last update, positive inside.
+ */
+const struct vec4* RCamera::get_frustum() const {
+	return frustum;
+}
+
+
 /**
  *	@brief Move the camera along the x,y,z vector by the given factor.
  *	@param x 		X direction
@@ -268,61 +354,50 @@ void RCamera::move_right(float factor) {
 }
 
 
+/**
+ *	@brief Work out the projection matrix, as gluPerspective() would.
+ */
+void RCamera::update_projection() {
+	float f = (1.0f / tanf(RADIAN(fov) * 0.5f));
+
+	memset(projection.m, 0, sizeof(projection.m));
+	projection.m[0] = (f / aspect);
+	projection.m[5] = f;
+	projection.m[10] = ((zfar + znear) / (znear - zfar));
+	projection.m[11] = -1.0f;
+	projection.m[14] = ((2.0f * zfar * znear) / (znear - zfar));
+}
+
+
 /**
  *	@brief Update the frustum clipping planes.
+ *
+ *	Each plane is the last row of the projection plus or minus one of
+ *	the others, in the order right, left, bottom, top, far, near,
+ *	then taken from eye space to the world by the transposed view.
+ *	Going through the clip matrix instead loses the far plane to
+ *	rounding, moving it a unit or more from one frame to the next.
  */
 void RCamera::update_frustum() {
-	float pm[16];
-	float mvm[16];
-
-	/* get the projection matrix */
-	glGetFloatv(GL_PROJECTION_MATRIX, pm);
-
-	/* get the model view matrix */
-	glGetFloatv(GL_MODELVIEW_MATRIX, mvm);
-
-	matrix4 m_pm(pm);
-	matrix4 m_mvm(mvm);
-
-	matrix4 clip = m_mvm * m_pm;
-
-	clip.transpose();
-
-	frustum[0][0] = clip[3][0] - clip[0][0];
-	frustum[0][1] = clip[3][1] - clip[0][1];
-	frustum[0][2] = clip[3][2] - clip[0][2];
-	frustum[0][3] = clip[3][3] - clip[0][3];
-	normalize_plane(&frustum[0][0], &frustum[0][1], &frustum[0][2], &frustum[0][3]);
-
-	frustum[1][0] = clip[3][0] + clip[0][0];
-	frustum[1][1] = clip[3][1] + clip[0][1];
-	frustum[1][2] = clip[3][2] + clip[0][2];
-	frustum[1][3] = clip[3][3] + clip[0][3];
-	normalize_plane(&frustum[1][0], &frustum[1][1], &frustum[1][2], &frustum[1][3]);
-
-	frustum[2][0] = clip[3][0] + clip[1][0];
-	frustum[2][1] = clip[3][1] + clip[1][1];
-	frustum[2][2] = clip[3][2] + clip[1][2];
-	frustum[2][3] = clip[3][3] + clip[1][3];
-	normalize_plane(&frustum[2][0], &frustum[2][1], &frustum[2][2], &frustum[2][3]);
-
-	frustum[3][0] = clip[3][0] - clip[1][0];
-	frustum[3][1] = clip[3][1] - clip[1][1];
-	frustum[3][2] = clip[3][2] - clip[1][2];
-	frustum[3][3] = clip[3][3] - clip[1][3];
-	normalize_plane(&frustum[3][0], &frustum[3][1], &frustum[3][2], &frustum[3][3]);
-
-	frustum[4][0] = clip[3][0] - clip[2][0];
-	frustum[4][1] = clip[3][1] - clip[2][1];
-	frustum[4][2] = clip[3][2] - clip[2][2];
-	frustum[4][3] = clip[3][3] - clip[2][3];
-	normalize_plane(&frustum[4][0], &frustum[4][1], &frustum[4][2], &frustum[4][3]);
-
-	frustum[5][0] = clip[3][0] + clip[2][0];
-	frustum[5][1] = clip[3][1] + clip[2][1];
-	frustum[5][2] = clip[3][2] + clip[2][2];
-	frustum[5][3] = clip[3][3] + clip[2][3];
-	normalize_plane(&frustum[5][0], &frustum[5][1], &frustum[5][2], &frustum[5][3]);
+	struct mat4 rows;
+	struct mat4 to_world;
+	struct vec4 plane;
+
+	/* rows of the projection, one vec4 each */
+	mat4_transpose(&rows, &projection);
+	const struct vec4* row = (const struct vec4*)rows.m;
+
+	mat4_transpose(&to_world, &view);
+
+	for (int i = 0; i < 6; ++i) {
+		if ((i == 1) || (i == 2) || (i == 5))
+			vec4_add(&plane, &row[3], &row[i / 2]);
+		else
+			vec4_sub(&plane, &row[3], &row[i / 2]);
+
+		plane_normalize(&plane);
+		mat4_transform(&frustum[i], &to_world, &plane);
+	}
 }
 
 
@@ -330,11 +405,13 @@ void RCamera::update_frustum() {
  *	@brief Check if the specified point is within the viewing frustum
  *	@return Returns 1 on success, 0 on failure
  */
-int RCamera::is_point_visable(float x, float y, float z) {
+int RCamera::is_point_visable(float x, float y, float z) const {
 	int i = 0;
 
 	for(; i < 6; ++i) {
-		if ((frustum[i][0] * x) + (frustum[i][1] * y) + (frustum[i][2] * z) + frustum[i][3] <= 0)
+		const float* p = frustum[i].v;
+
+		if ((p[0] * x) + (p[1] * y) + (p[2] * z) + p[3] <= 0)
 			return 0;
 	}
 
@@ -344,23 +421,23 @@ int RCamera::is_point_visable(float x, float y, float z) {
 
 /**
  *	@brief Check if the specified box is within the viewing frustum
+ *	@param x1	Lowest corner of the box
+ *	@param x2	Highest corner
  *	@return Returns 1 on success, 0 on failure
+ *
+ *	Only the corner furthest along the normal of each plane is tried,
+ *	if that one is behind the plane so is the rest of the box.
  */
-int RCamera::is_box_visable(float x1, float y1, float z1, float x2, float y2, float z2) {
+int RCamera::is_box_visable(float x1, float y1, float z1, float x2, float y2, float z2) const {
 	int i = 0;
 
 	for(; i < 6; i++ ) {
-		if ((((frustum[i][0] * x1) + (frustum[i][1] * y1) + (frustum[i][2] * z1) + frustum[i][3]) > 0) ||
-			(((frustum[i][0] * x2) + (frustum[i][1] * y1) + (frustum[i][2] * z1) + frustum[i][3]) < 0) ||
-			(((frustum[i][0] * x1) + (frustum[i][1] * y2) + (frustum[i][2] * z1) + frustum[i][3]) > 0) ||
-			(((frustum[i][0] * x2) + (frustum[i][1] * y2) + (frustum[i][2] * z1) + frustum[i][3]) > 0) ||
-			(((frustum[i][0] * x1) + (frustum[i][1] * y1) + (frustum[i][2] * z2) + frustum[i][3]) > 0) ||
-			(((frustum[i][0] * x2) + (frustum[i][1] * y1) + (frustum[i][2] * z2) + frustum[i][3]) > 0) ||
-			(((frustum[i][0] * x1) + (frustum[i][1] * y2) + (frustum[i][2] * z2) + frustum[i][3]) > 0) ||
-			(((frustum[i][0] * x2) + (frustum[i][1] * y2) + (frustum[i][2] * z2) + frustum[i][3]) > 0))
-				continue;
-
-		return 0;
+		const float* p = frustum[i].v;
+
+		if (((p[0] * ((p[0] > 0) ? x2 : x1)) +
+			 (p[1] * ((p[1] > 0) ? y2 : y1)) +
+			 (p[2] * ((p[2] > 0) ? z2 : z1)) + p[3]) <= 0)
+			return 0;
 	}
 
 	return 1;
@@ -13,6 +13,9 @@ void test_draw();
 RRender::~RRender() {
 	INFO("Shutting down renderer...");
 
+	if (ball_list)
+		glDeleteLists(ball_list, 1);
+
 	/* shut down SDL */
 	INFO("Shutting down SDL...");
 	SDL_Quit();
@@ -37,6 +40,10 @@ int RRender::init(RCamera* cam) {
 	max_fps = DEFAULT_MAX_FPS;
 
 	map = NULL;
+	simulation = NULL;
+	ball_list = 0;
+	ball_links = NULL;
+	num_linked_balls = 0;
 
 	/* initialize SDL */
 	INFO("Initializing SDL...");
@@ -85,6 +92,25 @@ void RRender::set_map(EMap* m) {
 }
 
 
+/**
+ *	@brief Set the simulation the camera is placed by
+ *	@param sim	Pointer to a ESimulation object, can be NULL
+ */
+void RRender::set_simulation(ESimulation* sim) {
+	simulation = sim;
+}
+
+
+/**
+ *	@brief Set the links balls are culled with
+ *	@param links	Pointer to a EEntityLinks object with room for every ball, can be NULL
+ */
+void RRender::set_ball_links(EEntityLinks* links) {
+	ball_links = links;
+	num_linked_balls = 0;
+}
+
+
 /**
  *	@brief Set the maximum frames per second to render.
  *	@param max	Number of frames per second.
@@ -109,10 +135,10 @@ void RRender::resize_window(int new_width, int new_height) {
 	/* setup viewport */
 	glViewport(0, 0, width, height);
 
-	/* setup the projection matrix */
+	/* setup the projection matrix, the camera works it out itself for its frustum */
+	camera->set_aspect((float)width / (float)height);
 	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluPerspective(camera->fov, ((float)width / (float)height), camera->znear, camera->zfar);
+	glLoadMatrixf(camera->get_projection());
 
 	/* switch back and initialize the model view matrix */
 	glMatrixMode(GL_MODELVIEW);
@@ -143,6 +169,17 @@ void RRender::render() {
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 
+	/* place the camera between the last two simulation ticks */
+	const struct sim_snapshot_t* snap = NULL;
+	float alpha = 1.0f;
+
+	if (simulation) {
+		snap = simulation->get_snapshot(&alpha);
+		camera->set_position(snap->prev.position[0] + ((snap->cur.position[0] - snap->prev.position[0]) * alpha),
+							 snap->prev.position[1] + ((snap->cur.position[1] - snap->prev.position[1]) * alpha),
+							 snap->prev.position[2] + ((snap->cur.position[2] - snap->prev.position[2]) * alpha));
+	}
+
 	/* update the camera */
 	camera->update();
 
@@ -155,6 +192,9 @@ void RRender::render() {
 		}
 
 		map->render(camera);
+
+		if (snap)
+			render_balls(snap, alpha);
 	glPopMatrix();
 
 	/* swap buffers */
@@ -166,6 +206,86 @@ void RRender::render() {
 }
 
 
+/**
+ *	@brief Draw the balls between the last two ticks.
+ *	@param snap		The ticks
+ *	@param alpha	How far between them
+ *
+ *	Balls are linked into the map where they are drawn, and those in
+ *	no cluster visible from the camera are skipped.  Most stay in the
+ *	same leafs from one frame to the next and are not relinked.
+ */
+void RRender::render_balls(const struct sim_snapshot_t* snap, float alpha) {
+	float r = snap->ball_radius;
+	int cluster = -1;
+	vector3 eye;
+
+	/* balls taken out since the last frame */
+	if (ball_links) {
+		for (; num_linked_balls > snap->num_balls; --num_linked_balls)
+			ball_links->unlink(num_linked_balls - 1);
+		num_linked_balls = snap->num_balls;
+
+		camera->get_position(&eye);
+		float p[3] = { eye.x, eye.y, eye.z };
+		cluster = ball_links->find_cluster(p);
+	}
+
+	if (!snap->num_balls)
+		return;
+
+	/* one sphere, drawn at each ball */
+	if (!ball_list) {
+		GLUquadric* quad = gluNewQuadric();
+
+		ball_list = glGenLists(1);
+		glNewList(ball_list, GL_COMPILE);
+			gluSphere(quad, snap->ball_radius, R_BALL_SLICES, R_BALL_STACKS);
+		glEndList();
+
+		gluDeleteQuadric(quad);
+	}
+
+	glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+
+	/* the map leaves both texture units on */
+	glActiveTextureARB(GL_TEXTURE1_ARB);
+	glDisable(GL_TEXTURE_2D);
+	glActiveTextureARB(GL_TEXTURE0_ARB);
+	glDisable(GL_TEXTURE_2D);
+
+	glColor3f(0.9f, 0.9f, 0.9f);
+
+	for (int i = 0; i < snap->num_balls; ++i) {
+		const float* prev = &snap->prev_balls[i * 3];
+		const float* cur = &snap->cur_balls[i * 3];
+
+		float x = (prev[0] + ((cur[0] - prev[0]) * alpha));
+		float y = (prev[1] + ((cur[1] - prev[1]) * alpha));
+		float z = (prev[2] + ((cur[2] - prev[2]) * alpha));
+
+		if (ball_links) {
+			float mins[3] = { x - r, y - r, z - r };
+			float maxs[3] = { x + r, y + r, z + r };
+
+			ball_links->link(i, mins, maxs);
+			if (!ball_links->is_visible(i, cluster))
+				continue;
+		}
+
+		if (!camera->is_box_visable(x - r, y - r, z - r, x + r, y + r, z + r))
+			continue;
+
+		glPushMatrix();
+			glTranslatef(x, y, z);
+			glCallList(ball_list);
+		glPopMatrix();
+	}
+
+	glPopAttrib();
+}
+
+
 /**
  *	@brief Update the framerate based on the current time and the number of rendered frames.
  */
@@ -0,0 +1,304 @@
+/**
+ *	@file math_test.cpp
+ *	@brief Check the math layer against plain scalar formulas.
+ *
+ *	Built once with SSE and once with MATH_NO_SIMD by "make test".
+ *	The matrix4 checks are the formulas matrix.cpp had before it
+ *	went header-only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "math/simd.h"
+#include "math/matrix.h"
+
+/* tests of each kind, on random numbers */
+#define TEST_RUNS				1000
+
+/* furthest a result may be from the scalar one, scaled by its size */
+#define TEST_EPSILON			1e-5f
+
+static int failures = 0;
+
+
+static void check(int ok, const char* what) {
+	if (ok)
+		return;
+
+	printf("math_test: %s failed.\n", what);
+	++failures;
+}
+
+
+static float random_float(float range) {
+	return ((rand() / (float)RAND_MAX) * 2.0f - 1.0f) * range;
+}
+
+
+/**
+ *	@brief Whether a is within TEST_EPSILON of b, relative to the size of b.
+ */
+static int close_to(float a, float b) {
+	float scale = ((fabsf(b) > 1.0f) ? fabsf(b) : 1.0f);
+
+	return (fabsf(a - b) <= (TEST_EPSILON * scale));
+}
+
+
+/**
+ *	@brief The old matrix4 product, on m[row][col].
+ */
+static void old_mul(float r[4][4], float m[4][4], float b[4][4]) {
+	for (int i = 0; i < 4; ++i) {
+		for (int j = 0; j < 4; ++j)
+			r[i][j] = (m[i][0] * b[0][j]) + (m[i][1] * b[1][j]) + (m[i][2] * b[2][j]) + (m[i][3] * b[3][j]);
+	}
+}
+
+
+static void test_matrix4() {
+	float a[4][4], b[4][4], r[4][4];
+	int ctor = 1, mul = 1, transpose = 1;
+
+	for (int n = 0; n < TEST_RUNS; ++n) {
+		for (int i = 0; i < 4; ++i) {
+			for (int j = 0; j < 4; ++j) {
+				a[i][j] = random_float(100.0f);
+				b[i][j] = random_float(100.0f);
+			}
+		}
+
+		matrix4 ma(&a[0][0]);
+		matrix4 mb(b[0][0], b[0][1], b[0][2], b[0][3],
+				   b[1][0], b[1][1], b[1][2], b[1][3],
+				   b[2][0], b[2][1], b[2][2], b[2][3],
+				   b[3][0], b[3][1], b[3][2], b[3][3]);
+
+		/* both constructors lay the floats out as given */
+		for (int i = 0; i < 4; ++i) {
+			for (int j = 0; j < 4; ++j) {
+				if ((ma[i][j] != a[i][j]) || (mb[i][j] != b[i][j]))
+					ctor = 0;
+			}
+		}
+
+		matrix4 mr = (ma * mb);
+		old_mul(r, a, b);
+
+		for (int i = 0; i < 4; ++i) {
+			for (int j = 0; j < 4; ++j) {
+				if (!close_to(mr[i][j], r[i][j]))
+					mul = 0;
+			}
+		}
+
+		ma.transpose();
+		for (int i = 0; i < 4; ++i) {
+			for (int j = 0; j < 4; ++j) {
+				if (ma[i][j] != a[j][i])
+					transpose = 0;
+			}
+		}
+	}
+
+	check(ctor, "matrix4 constructors");
+	check(mul, "matrix4::operator*");
+	check(transpose, "matrix4::transpose");
+}
+
+
+/**
+ *	@brief A random matrix far from singular, or a camera's projection times view.
+ *
+ *	Kept well conditioned, so A * inverse(A) is the identity to
+ *	within rounding rather than to within how near singular A is.
+ */
+static void random_invertible(struct mat4* m, int camera) {
+	if (!camera) {
+		for (int i = 0; i < 16; ++i)
+			m->m[i] = random_float(1.0f);
+		for (int i = 0; i < 4; ++i)
+			m->m[i * 5] += ((m->m[i * 5] < 0.0f) ? -4.0f : 4.0f);
+		return;
+	}
+
+	struct mat4 proj, view;
+	float fov = (0.5f + (rand() / (float)RAND_MAX));
+	float f = (1.0f / tanf(fov * 0.5f));
+	float zn = 1.0f, zf = 100.0f;
+	float yaw = random_float(3.14159f);
+	float px = random_float(10.0f), py = random_float(10.0f), pz = random_float(10.0f);
+
+	memset(&proj, 0, sizeof(proj));
+	proj.m[0] = (f / 1.333f);
+	proj.m[5] = f;
+	proj.m[10] = ((zf + zn) / (zn - zf));
+	proj.m[11] = -1.0f;
+	proj.m[14] = ((2.0f * zf * zn) / (zn - zf));
+
+	mat4_identity(&view);
+	view.m[0] = cosf(yaw);
+	view.m[2] = -sinf(yaw);
+	view.m[8] = sinf(yaw);
+	view.m[10] = cosf(yaw);
+	view.m[12] = -(view.m[0] * px + view.m[8] * pz);
+	view.m[13] = -py;
+	view.m[14] = -(view.m[2] * px + view.m[10] * pz);
+
+	mat4_mul(m, &proj, &view);
+}
+
+
+static void test_inverse() {
+	struct mat4 a, inv, r, singular;
+	float worst = 0.0f;
+	int ok = 1;
+
+	for (int n = 0; n < TEST_RUNS; ++n) {
+		random_invertible(&a, (n & 1));
+
+		if (!mat4_inverse(&inv, &a)) {
+			ok = 0;
+			continue;
+		}
+
+		mat4_mul(&r, &a, &inv);
+		for (int i = 0; i < 16; ++i) {
+			float d = fabsf(r.m[i] - (((i % 5) == 0) ? 1.0f : 0.0f));
+			if (d > worst)
+				worst = d;
+		}
+	}
+
+	check(ok && (worst <= TEST_EPSILON), "mat4_inverse (A * inverse(A) = I)");
+
+	/* a column of zeros can not be inverted, and r is left alone */
+	random_invertible(&singular, 0);
+	memset(&singular.m[0], 0, sizeof(float) * 4);
+	mat4_identity(&r);
+	check(!mat4_inverse(&r, &singular) && (r.m[0] == 1.0f) && (r.m[1] == 0.0f), "mat4_inverse of a singular matrix");
+
+	printf("math_test: mat4_inverse is at most %g from the identity.\n", worst);
+}
+
+
+static void test_plane_normalize() {
+	struct vec4 p;
+	int ok = 1;
+
+	for (int n = 0; n < TEST_RUNS; ++n) {
+		float plane[4];
+		for (int i = 0; i < 4; ++i)
+			plane[i] = p.v[i] = random_float(1000.0f);
+
+		float mag = sqrtf((plane[0] * plane[0]) + (plane[1] * plane[1]) + (plane[2] * plane[2]));
+		plane_normalize(&p);
+
+		for (int i = 0; i < 4; ++i) {
+			if (!close_to(p.v[i], plane[i] / mag))
+				ok = 0;
+		}
+	}
+
+	check(ok, "plane_normalize");
+}
+
+
+/**
+ *	@brief Check the 4 or 8 wide kernels against doing each point by itself.
+ */
+static void test_soa(int lanes) {
+	float a[24], b[24], r[24];
+	float out[8];
+	struct vec4 plane;
+	int load = 1, madd = 1, dot = 1, dist = 1;
+
+	for (int n = 0; n < TEST_RUNS; ++n) {
+		float s = random_float(10.0f);
+		int behind, want = 0;
+
+		for (int i = 0; i < (lanes * 3); ++i) {
+			a[i] = random_float(1000.0f);
+			b[i] = random_float(1000.0f);
+		}
+		for (int i = 0; i < 4; ++i)
+			plane.v[i] = random_float(1.0f);
+
+		if (lanes == 4) {
+			struct vec3x4 va, vb, vr;
+
+			vec3x4_load(&va, a);
+			vec3x4_load(&vb, b);
+			vec3x4_store(&va, r);
+			load &= !memcmp(r, a, sizeof(float) * 12);
+
+			vec3x4_madd(&vr, &va, &vb, s);
+			vec3x4_store(&vr, r);
+			vec3x4_dot(&va, &vb, out);
+			for (int i = 0; i < 12; ++i)
+				madd &= close_to(r[i], a[i] + b[i] * s);
+			for (int i = 0; i < 4; ++i)
+				dot &= close_to(out[i], (a[i * 3] * b[i * 3]) + (a[i * 3 + 1] * b[i * 3 + 1]) + (a[i * 3 + 2] * b[i * 3 + 2]));
+
+			behind = vec3x4_plane(&va, &plane, out);
+		} else {
+			struct vec3x8 va, vb, vr;
+
+			vec3x8_load(&va, a);
+			vec3x8_load(&vb, b);
+			vec3x8_store(&va, r);
+			load &= !memcmp(r, a, sizeof(float) * 24);
+
+			vec3x8_madd(&vr, &va, &vb, s);
+			vec3x8_store(&vr, r);
+			vec3x8_dot(&va, &vb, out);
+			for (int i = 0; i < 24; ++i)
+				madd &= close_to(r[i], a[i] + b[i] * s);
+			for (int i = 0; i < 8; ++i)
+				dot &= close_to(out[i], (a[i * 3] * b[i * 3]) + (a[i * 3 + 1] * b[i * 3 + 1]) + (a[i * 3 + 2] * b[i * 3 + 2]));
+
+			behind = vec3x8_plane(&va, &plane, out);
+		}
+
+		for (int i = 0; i < lanes; ++i) {
+			float d = (a[i * 3] * plane.v[0]) + (a[i * 3 + 1] * plane.v[1]) + (a[i * 3 + 2] * plane.v[2]) + plane.v[3];
+
+			dist &= close_to(out[i], d);
+			if (d < 0.0f)
+				want |= (1 << i);
+		}
+
+		/* a point right on the plane may land either side of it */
+		for (int i = 0; i < lanes; ++i) {
+			if (((behind ^ want) & (1 << i)) && (fabsf(out[i]) > TEST_EPSILON))
+				dist = 0;
+		}
+	}
+
+	check(load, (lanes == 4) ? "vec3x4_load and vec3x4_store" : "vec3x8_load and vec3x8_store");
+	check(madd, (lanes == 4) ? "vec3x4_madd" : "vec3x8_madd");
+	check(dot, (lanes == 4) ? "vec3x4_dot" : "vec3x8_dot");
+	check(dist, (lanes == 4) ? "vec3x4_plane" : "vec3x8_plane");
+}
+
+
+int main(int argc, char** argv) {
+	srand(1);
+
+	test_matrix4();
+	test_inverse();
+	test_plane_normalize();
+	test_soa(4);
+	test_soa(8);
+
+#ifdef MATH_SIMD
+	printf("math_test (SSE): %s\n", (failures ? "FAILED" : "ok"));
+#else
+	printf("math_test (no SIMD): %s\n", (failures ? "FAILED" : "ok"));
+#endif
+
+	return (failures ? 1 : 0);
+}
@@ -0,0 +1,155 @@
+/**
+ *	@file simulation_test.cpp
+ *	@brief Check the simulation gives the same result for the same input.
+ *
+ *	Runs the camera and a pile of balls through data/q3dm1.bsp twice
+ *	from the same input, loading the map without OpenGL, and compares
+ *	where everything ended up bit for bit.  Run from the top directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "definitions.h"
+#include "engine/Q3map.h"
+#include "engine/thread_pool.h"
+#include "engine/simulation.h"
+
+#define TEST_MAP				"data/q3dm1.bsp"
+#define TEST_TICKS				500
+#define TEST_BALLS				64
+#define TEST_THREADS			4
+
+
+struct test_state_t {
+	unsigned int tick;
+	struct sim_camera_t camera;
+	int num_balls;
+	float balls[TEST_BALLS * 3];
+};
+
+
+/**
+ *	@brief The input of a tick, the same every run.
+ */
+static void test_input(int tick, struct sim_input_t* input) {
+	static const int keys[] = {
+		SIM_KEY_FORWARD,
+		SIM_KEY_FORWARD | SIM_KEY_LEFT,
+		SIM_KEY_BACK,
+		SIM_KEY_RIGHT,
+		0
+	};
+
+	input->keys = keys[(tick / 60) % 5];
+	input->theta = (tick * 0.7f);
+	input->psi = (sinf(tick * 0.01f) * 20.0f);
+	input->roll = (sinf(tick * 0.03f) * 15.0f);
+	input->pitch = (cosf(tick * 0.02f) * 15.0f);
+}
+
+
+/**
+ *	@brief Drop the balls above the spawn point and run the ticks.
+ *	@return 1 on success, 0 on failure
+ */
+static int test_run(EQ3Map* map, EThreadPool* pool, const vector3* spawn, struct test_state_t* state) {
+	ESimulation sim;
+	struct sim_input_t input;
+	struct trace_t tr;
+	const struct sim_snapshot_t* snap;
+	float alpha;
+	float start[3] = { spawn->x, spawn->y, spawn->z };
+
+	if (!sim.init(map, pool, TEST_BALLS))
+		return 0;
+
+	sim.set_camera(start);
+
+	for (int i = 0; i < TEST_BALLS; ++i) {
+		vector3 p(spawn->x + ((i % 4) - 1.5f) * BALL_DEFAULT_RADIUS * 2.5f,
+				  spawn->y + ((i / 16) + 1) * BALL_DEFAULT_RADIUS * 2.5f,
+				  spawn->z + (((i / 4) % 4) - 1.5f) * BALL_DEFAULT_RADIUS * 2.5f);
+
+		map->trace_sphere(&tr, &p, &p, BALL_DEFAULT_RADIUS, MASK_SOLID);
+		if (tr.start_solid)
+			continue;
+
+		float f[3] = { p.x, p.y, p.z };
+		sim.add_ball(f);
+	}
+
+	for (int t = 0; t < TEST_TICKS; ++t) {
+		test_input(t, &input);
+		sim.set_input(&input);
+		sim.step(1);
+	}
+
+	snap = sim.get_snapshot(&alpha);
+
+	memset(state, 0, sizeof(*state));
+	state->tick = snap->tick;
+	state->camera = snap->cur;
+	state->num_balls = snap->num_balls;
+	memcpy(state->balls, snap->cur_balls, sizeof(float) * 3 * snap->num_balls);
+
+	return 1;
+}
+
+
+int main(int argc, char** argv) {
+	struct test_state_t first, second;
+	EThreadPool pool;
+	EQ3Map map;
+	vector3 spawn;
+	float angle;
+	int ret = 0;
+
+	pool.init(TEST_THREADS);
+
+	map.set_headless(1);
+	if (!map.load(TEST_MAP)) {
+		printf("simulation_test: Failed to load \"%s\".\n", TEST_MAP);
+		return 1;
+	}
+	map.get_spawn_point(1, &angle, &spawn);
+
+	if (!test_run(&map, &pool, &spawn, &first) || !test_run(&map, &pool, &spawn, &second)) {
+		printf("simulation_test: Failed to set up the simulation.\n");
+		return 1;
+	}
+
+	if (first.tick != TEST_TICKS) {
+		printf("simulation_test: Ran %u ticks, expected %i.\n", first.tick, TEST_TICKS);
+		ret = 1;
+	}
+
+	if ((first.camera.position[0] == spawn.x) && (first.camera.position[1] == spawn.y) && (first.camera.position[2] == spawn.z)) {
+		printf("simulation_test: The camera never moved.\n");
+		ret = 1;
+	}
+
+	if (!first.num_balls) {
+		printf("simulation_test: No room for any balls.\n");
+		ret = 1;
+	}
+
+	if (memcmp(&first.camera, &second.camera, sizeof(first.camera))) {
+		printf("simulation_test: The camera ended up at (%f, %f, %f) and (%f, %f, %f).\n",
+			first.camera.position[0], first.camera.position[1], first.camera.position[2],
+			second.camera.position[0], second.camera.position[1], second.camera.position[2]);
+		ret = 1;
+	}
+
+	if ((first.num_balls != second.num_balls) || memcmp(first.balls, second.balls, sizeof(first.balls))) {
+		printf("simulation_test: The balls ended up in different places.\n");
+		ret = 1;
+	}
+
+	printf("simulation_test: %i ticks, %i balls: %s\n", TEST_TICKS, first.num_balls, (ret ? "FAILED" : "ok"));
+
+	pool.shutdown();
+	return ret;
+}